@@ -0,0 +1,11 @@
+//
+// Host (Linux) stand-in for libfat. Files are read straight from the
+// host filesystem, see host/source/filesystem.cpp.
+//
+
+#ifndef UNDERTALE_HOST_FAT_H
+#define UNDERTALE_HOST_FAT_H
+
+bool fatInitDefault();
+
+#endif //UNDERTALE_HOST_FAT_H
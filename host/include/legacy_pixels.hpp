@@ -0,0 +1,25 @@
+//
+// The per-pixel conversion loops the engine used before the word kernels
+// of Engine/PixelKernels.hpp, kept to compare against in the pixels
+// scenario.
+//
+
+#ifndef UNDERTALE_HOST_LEGACY_PIXELS_HPP
+#define UNDERTALE_HOST_LEGACY_PIXELS_HPP
+
+#include <nds.h>
+
+namespace Host {
+    // Background::loadBgRectEngine, a 4bpp tile into an 8bpp VRAM tile
+    void legacyExpandTile(const u8* src, u16* tileRes);
+    // OAMManager::buildFrameCache, a tile through the sprite's palette
+    // slots into a zeroed destination
+    void legacyRemapTile(const u8* src, u8* dst, const u8* paletteColors);
+    // Sprite3DManager::streamTexture, a frame of CSPR v4 tiles to a quad's
+    // linear texels
+    void legacyPackQuad(const u8* tiles, u8 tileWidth, u8 tileHeight, int frame,
+                        u8 quadX, u8 quadY, u8 quadWidth, u8 quadHeight,
+                        bool color8bit, u8* tileRamStart);
+}
+
+#endif //UNDERTALE_HOST_LEGACY_PIXELS_HPP
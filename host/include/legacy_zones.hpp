@@ -0,0 +1,41 @@
+//
+// The array-rebuilding FreeZoneManager the engine used before the
+// size-class one, kept to compare against in the zones scenario.
+//
+
+#ifndef UNDERTALE_HOST_LEGACY_ZONES_HPP
+#define UNDERTALE_HOST_LEGACY_ZONES_HPP
+
+#include <nds.h>
+
+namespace Host {
+    class LegacyFreeZoneManager {
+    public:
+        LegacyFreeZoneManager(int start, int length, const char* name) {
+            _zoneCount = 1;
+            _zones = new u16[2];
+            _zones[0] = start;
+            _zones[1] = length;
+            _name = name;
+        };
+
+        ~LegacyFreeZoneManager() {
+            delete[] _zones;
+            _zones = nullptr;
+        }
+
+        int reserve(u16 length, u16 &start, u16 alignment);
+        bool fits(u16 length, u16 alignment) const;
+
+        void free(u16 length, u16 start);
+
+        u16 getFreeZoneCount() const { return _zoneCount; }
+
+    private:
+        u16 _zoneCount;
+        u16 *_zones;
+        const char* _name;
+    };
+}
+
+#endif //UNDERTALE_HOST_LEGACY_ZONES_HPP
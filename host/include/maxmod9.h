@@ -0,0 +1,55 @@
+//
+// Host (Linux) stand-in for the maxmod streaming API.
+// mmStreamUpdate pulls one frame worth of samples from the stream
+// callback into a scratch buffer, so the audio mixer runs every frame
+// exactly like it does on hardware.
+//
+
+#ifndef UNDERTALE_HOST_MAXMOD9_H
+#define UNDERTALE_HOST_MAXMOD9_H
+
+#include <nds.h>
+
+typedef u32 mm_word;
+typedef void* mm_addr;
+typedef u8 mm_byte;
+typedef u16 mm_hword;
+
+typedef enum {
+    MM_STREAM_8BIT_MONO = 0,
+    MM_STREAM_8BIT_STEREO = 1,
+    MM_STREAM_16BIT_MONO = 2,
+    MM_STREAM_16BIT_STEREO = 3
+} mm_stream_formats;
+
+typedef enum {
+    MM_TIMER0 = 0,
+    MM_TIMER1,
+    MM_TIMER2,
+    MM_TIMER3
+} mm_stream_timer;
+
+typedef mm_word (*mm_stream_func)(mm_word length, mm_addr dest, mm_stream_formats format);
+
+typedef struct {
+    mm_word mod_count;
+    mm_word samp_count;
+    mm_word* mem_bank;
+    mm_word fifo_channel;
+} mm_ds_system;
+
+typedef struct {
+    mm_word sampling_rate;
+    mm_word buffer_length;
+    mm_stream_func callback;
+    mm_word format;
+    mm_word timer;
+    mm_byte manual;
+} mm_stream;
+
+void mmInit(mm_ds_system* system);
+void mmStreamOpen(mm_stream* stream);
+void mmStreamUpdate();
+void mmStreamClose();
+
+#endif //UNDERTALE_HOST_MAXMOD9_H
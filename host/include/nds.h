@@ -0,0 +1,368 @@
+//
+// Host (Linux) stand-in for the parts of libnds the game uses.
+// VRAM banks, palettes, OAM and IO registers are plain memory, the
+// geometry FIFO is recorded into Host::gfx so it can be inspected.
+//
+
+#ifndef UNDERTALE_HOST_NDS_H
+#define UNDERTALE_HOST_NDS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int8_t s8;
+typedef int16_t s16;
+typedef int32_t s32;
+typedef int64_t s64;
+
+typedef volatile u8 vu8;
+typedef volatile u16 vu16;
+typedef volatile u32 vu32;
+typedef volatile u64 vu64;
+typedef volatile s8 vs8;
+typedef volatile s16 vs16;
+typedef volatile s32 vs32;
+typedef volatile s64 vs64;
+
+typedef s32 int32;
+
+#define BIT(n) (1 << (n))
+
+#define SCREEN_WIDTH 256
+#define SCREEN_HEIGHT 192
+#define SPRITE_COUNT 128
+
+#define RGB15(r, g, b) ((r) | ((g) << 5) | ((b) << 10))
+
+namespace Host {
+    // Sizes of the DS memory regions we back with host memory
+    const u32 kVramASize = 128 * 1024;
+    const u32 kVramBSize = 128 * 1024;
+    const u32 kVramCSize = 128 * 1024;
+    const u32 kVramDSize = 128 * 1024;
+    const u32 kVramESize = 64 * 1024;
+    const u32 kVramFSize = 16 * 1024;
+    const u32 kVramGSize = 16 * 1024;
+    const u32 kVramHSize = 32 * 1024;
+    const u32 kVramISize = 16 * 1024;
+    const u32 kPaletteSize = 512;
+    const u32 kOamSize = 1024;
+
+    struct Memory {
+        alignas(4) u16 vramA[kVramASize / 2];
+        alignas(4) u16 vramB[kVramBSize / 2];
+        alignas(4) u16 vramC[kVramCSize / 2];
+        alignas(4) u16 vramD[kVramDSize / 2];
+        alignas(4) u16 vramE[kVramESize / 2];
+        alignas(4) u16 vramF[kVramFSize / 2];
+        alignas(4) u16 vramG[kVramGSize / 2];
+        alignas(4) u16 vramH[kVramHSize / 2];
+        alignas(4) u16 vramI[kVramISize / 2];
+        alignas(4) u16 bgPalette[kPaletteSize / 2];
+        alignas(4) u16 bgPaletteSub[kPaletteSize / 2];
+        alignas(4) u16 sprPalette[kPaletteSize / 2];
+        alignas(4) u16 sprPaletteSub[kPaletteSize / 2];
+        alignas(4) u16 oam[kOamSize / 2];
+        alignas(4) u16 oamSub[kOamSize / 2];
+    };
+
+    extern Memory mem;
+
+    // Geometry engine commands (DS GXFIFO command ids)
+    enum GfxCommand {
+        GFX_CMD_MTX_MODE = 0x10,
+        GFX_CMD_MTX_IDENTITY = 0x15,
+        GFX_CMD_MTX_MULT_4x4 = 0x18,
+        GFX_CMD_COLOR = 0x20,
+        GFX_CMD_TEXCOORD = 0x22,
+        GFX_CMD_VTX_16 = 0x23,
+        GFX_CMD_VTX_XY = 0x25,
+        GFX_CMD_POLYGON_ATTR = 0x29,
+        GFX_CMD_TEXIMAGE_PARAM = 0x2A,
+        GFX_CMD_PLTT_BASE = 0x2B,
+        GFX_CMD_BEGIN_VTXS = 0x40,
+        GFX_CMD_END_VTXS = 0x41,
+        GFX_CMD_SWAP_BUFFERS = 0x50,
+        GFX_CMD_VIEWPORT = 0x60
+    };
+
+    const u32 kGfxLogCapacity = 64 * 1024;
+
+    // Every write to a GFX_* command port lands here, one entry per
+    // parameter word. Cleared when a new frame starts.
+    struct GfxLog {
+        u32 count = 0;
+        u32 overflow = 0;
+        u8 commands[kGfxLogCapacity] = {0};
+        u32 params[kGfxLogCapacity] = {0};
+    };
+
+    struct FrameStats {
+        u32 frame = 0;
+        u32 gfxWords = 0;
+        u32 gxListWords = 0;  // Sent to GFX_FIFO by DMA, packed
+        u32 gxListCount = 0;
+        u32 dmaBytes = 0;
+        u32 dmaCount = 0;
+    };
+
+    extern GfxLog gfx;
+    extern FrameStats cFrameStats;  // frame being built
+    extern FrameStats lastFrameStats;  // last completed frame
+    extern u32 frameCount;
+
+    void gfxWrite(u8 command, u32 param);
+    void dmaAccount(u32 bytes);
+    // Unpacks a command list sent to GFX_FIFO into gfx, one entry per
+    // parameter as if every command was written to its port
+    void gxFifoWrite(const u32* words, u32 count);
+
+    // Input for the next scanKeys()
+    void setKeys(u32 held);
+    void setTouch(u16 px, u16 py);
+
+    // Debug output file (stderr when nullptr)
+    void setMessageStream(FILE* stream);
+    // Every command list sent to GFX_FIFO is dumped there as hex words,
+    // one list per line after its frame number and size. nullptr to stop.
+    void setGxListStream(FILE* stream);
+
+    struct GfxPort {
+        u8 command;
+        GfxPort& operator=(u32 param) {
+            gfxWrite(command, param);
+            return *this;
+        }
+    };
+
+    // DMA channel registers. Copies run when DMA_CR is written. GFX_FIFO
+    // transfers stay pending, like the real ones running next to the CPU,
+    // until DMA_CR is read or the frame ends, then DMA_BUSY reads as done.
+    struct DmaControl {
+        u8 channel;
+        DmaControl& operator=(u32 value);
+        operator u32() const;
+    };
+
+    struct DmaChannel {
+        uintptr_t src = 0;
+        uintptr_t dest = 0;
+        DmaControl control;
+        u32 pending = 0;  // DMA_CR of a GFX_FIFO transfer not run yet
+    };
+
+    extern DmaChannel dmaChannels[4];
+    void dmaFinish();
+}
+
+// ---------------------------------------------------------------- registers
+extern vu32 REG_DISPCNT;
+extern vu32 REG_DISPCNT_SUB;
+extern vu16 REG_BG0CNT;
+extern vu16 REG_BG1CNT;
+extern vu16 REG_BG2CNT;
+extern vu16 REG_BG3CNT;
+extern vu16 REG_BG0CNT_SUB;
+extern vu16 REG_BG1CNT_SUB;
+extern vu16 REG_BG2CNT_SUB;
+extern vu16 REG_BG3CNT_SUB;
+extern vu16 REG_BG3HOFS;
+extern vu16 REG_BG3VOFS;
+extern vs16 REG_BG3PA, REG_BG3PB, REG_BG3PC, REG_BG3PD;
+extern vs16 REG_BG3PA_SUB, REG_BG3PB_SUB, REG_BG3PC_SUB, REG_BG3PD_SUB;
+extern vs32 REG_BG3X, REG_BG3Y;
+extern vs32 REG_BG3X_SUB, REG_BG3Y_SUB;
+extern vu16 REG_VCOUNT;
+
+extern vu16 GFX_CONTROL;
+extern vu32 GFX_CLEAR_COLOR;
+extern Host::GfxPort MATRIX_CONTROL;
+extern Host::GfxPort MATRIX_IDENTITY;
+extern Host::GfxPort GFX_COLOR;
+extern Host::GfxPort GFX_TEX_COORD;
+extern Host::GfxPort GFX_VERTEX16;
+extern Host::GfxPort GFX_VERTEX_XY;
+extern Host::GfxPort GFX_POLY_FORMAT;
+extern Host::GfxPort GFX_TEX_FORMAT;
+extern Host::GfxPort GFX_PAL_FORMAT;
+extern Host::GfxPort GFX_BEGIN;
+extern Host::GfxPort GFX_END;
+extern Host::GfxPort GFX_FLUSH;
+extern Host::GfxPort GFX_VIEWPORT;
+extern vu32 GFX_FIFO;
+
+// ---------------------------------------------------------------- memory
+#define VRAM_A (Host::mem.vramA)
+#define VRAM_B (Host::mem.vramB)
+#define VRAM_C (Host::mem.vramC)
+#define VRAM_D (Host::mem.vramD)
+#define VRAM_E (Host::mem.vramE)
+#define VRAM_F (Host::mem.vramF)
+#define VRAM_G (Host::mem.vramG)
+#define VRAM_H (Host::mem.vramH)
+#define VRAM_I (Host::mem.vramI)
+
+// Engine::init maps A to main bg, C to sub bg and D to sub sprites
+#define BG_GFX (Host::mem.vramA)
+#define BG_GFX_SUB (Host::mem.vramC)
+#define SPRITE_GFX_SUB (Host::mem.vramD)
+#define BG_TILE_RAM(base) ((u16*)((u8*)BG_GFX + (base) * 0x4000))
+#define BG_MAP_RAM(base) ((u16*)((u8*)BG_GFX + (base) * 0x800))
+#define BG_TILE_RAM_SUB(base) ((u16*)((u8*)BG_GFX_SUB + (base) * 0x4000))
+#define BG_MAP_RAM_SUB(base) ((u16*)((u8*)BG_GFX_SUB + (base) * 0x800))
+
+#define BG_PALETTE (Host::mem.bgPalette)
+#define BG_PALETTE_SUB (Host::mem.bgPaletteSub)
+#define SPRITE_PALETTE (Host::mem.sprPalette)
+#define SPRITE_PALETTE_SUB (Host::mem.sprPaletteSub)
+#define OAM (Host::mem.oam)
+#define OAM_SUB (Host::mem.oamSub)
+
+// ---------------------------------------------------------------- video
+#define BG_PRIORITY(n) (n)
+#define BG_TILE_BASE(base) ((base) << 2)
+#define BG_MAP_BASE(base) ((base) << 8)
+
+#define DISPLAY_BG0_ACTIVE (1 << 8)
+#define DISPLAY_BG1_ACTIVE (1 << 9)
+#define DISPLAY_BG2_ACTIVE (1 << 10)
+#define DISPLAY_BG3_ACTIVE (1 << 11)
+#define DISPLAY_SPR_ACTIVE (1 << 12)
+#define DISPLAY_SPR_1D (1 << 4)
+
+#define MODE_0_2D 0x10000
+#define MODE_3_2D 0x10003
+#define MODE_0_3D (0x10000 | DISPLAY_BG0_ACTIVE | (1 << 3))
+#define MODE_3_3D (0x10003 | DISPLAY_BG0_ACTIVE | (1 << 3))
+
+enum VRAM_A_TYPE { VRAM_A_LCD = 0, VRAM_A_MAIN_BG_0x06000000 = 1 };
+enum VRAM_B_TYPE { VRAM_B_LCD = 0, VRAM_B_TEXTURE_SLOT0 = 3, VRAM_B_TEXTURE_SLOT1 = 3 | (1 << 3) };
+enum VRAM_C_TYPE { VRAM_C_LCD = 0, VRAM_C_SUB_BG = 4 };
+enum VRAM_D_TYPE { VRAM_D_LCD = 0, VRAM_D_SUB_SPRITE = 4, VRAM_D_TEXTURE_SLOT1 = 3 | (1 << 3) };
+enum VRAM_E_TYPE { VRAM_E_LCD = 0, VRAM_E_TEX_PALETTE = 3 };
+enum VRAM_F_TYPE { VRAM_F_LCD = 0 };
+enum VRAM_G_TYPE { VRAM_G_LCD = 0 };
+enum VRAM_H_TYPE { VRAM_H_LCD = 0, VRAM_H_SUB_BG = 1 };
+enum VRAM_I_TYPE { VRAM_I_LCD = 0 };
+
+void vramSetBankA(VRAM_A_TYPE a);
+void vramSetBankB(VRAM_B_TYPE b);
+void vramSetBankC(VRAM_C_TYPE c);
+void vramSetBankD(VRAM_D_TYPE d);
+void vramSetBankE(VRAM_E_TYPE e);
+void vramSetBankF(VRAM_F_TYPE f);
+void vramSetBankG(VRAM_G_TYPE g);
+void vramSetBankH(VRAM_H_TYPE h);
+void vramSetBankI(VRAM_I_TYPE i);
+
+void videoSetMode(u32 mode);
+void videoSetModeSub(u32 mode);
+void lcdMainOnTop();
+void lcdMainOnBottom();
+void setBrightness(int screen, int level);
+
+// ---------------------------------------------------------------- 3D
+#define GL_MAX_DEPTH 0x7FFF
+#define POLY_ALPHA(n) ((n) << 16)
+#define POLY_CULL_NONE (3 << 6)
+
+enum GL_GLBEGIN_ENUM { GL_TRIANGLES = 0, GL_QUADS = 1, GL_TRIANGLE_STRIP = 2, GL_QUAD_STRIP = 3 };
+enum GL_MATRIX_MODE_ENUM { GL_PROJECTION = 0, GL_POSITION = 1, GL_MODELVIEW = 2, GL_TEXTURE = 3 };
+
+void glFlush(u32 mode);
+void glColor(u16 color);
+void glPolyFmt(u32 params);
+void glClearDepth(u16 depth);
+void glViewport(u8 x1, u8 y1, u8 x2, u8 y2);
+void glMatrixMode(int mode);
+void glLoadIdentity();
+void glOrthof32(int32 left, int32 right, int32 bottom, int32 top, int32 zNear, int32 zFar);
+
+// ---------------------------------------------------------------- dma / bios
+void dmaCopy(const void* source, void* dest, u32 size);
+void dmaCopyWords(u8 channel, const void* src, void* dest, u32 size);
+void dmaCopyHalfWords(u8 channel, const void* src, void* dest, u32 size);
+void dmaCopyWordsAsynch(u8 channel, const void* src, void* dest, u32 size);
+void dmaCopyHalfWordsAsynch(u8 channel, const void* src, void* dest, u32 size);
+void dmaFillWords(u32 value, void* dest, u32 size);
+void dmaFillHalfWords(u16 value, void* dest, u32 size);
+
+#define DMA_SRC(n) (Host::dmaChannels[n].src)
+#define DMA_DEST(n) (Host::dmaChannels[n].dest)
+#define DMA_CR(n) (Host::dmaChannels[n].control)
+
+#define DMA_ENABLE BIT(31)
+#define DMA_BUSY BIT(31)
+#define DMA_32_BIT BIT(26)
+#define DMA_START_FIFO (7 << 27)
+#define DMA_DST_FIX (2 << 21)
+#define DMA_FIFO (DMA_ENABLE | DMA_32_BIT | DMA_DST_FIX | DMA_START_FIFO)
+
+// No data cache on the host
+inline void DC_FlushRange(const void*, u32) {}
+inline void DC_FlushAll() {}
+
+void swiWaitForVBlank();
+void swiDelay(u32 duration);
+// BIOS LZ77 (type 0x10) and RLE (type 0x30) decompression to main RAM,
+// the size in the stream header's upper 24 bits
+void swiDecompressLZSSWram(void* source, void* destination);
+void swiDecompressRLEWram(void* source, void* destination);
+
+// ---------------------------------------------------------------- timers
+#define BUS_CLOCK (33513982)
+
+// Backed by std::chrono, returns bus clock ticks since cpuStartTiming
+void cpuStartTiming(int timer);
+u32 cpuGetTiming();
+u32 cpuEndTiming();
+
+// ---------------------------------------------------------------- system
+#define POWER_ALL 0x820F
+
+enum FifoChannels { FIFO_PM = 0, FIFO_SOUND = 1, FIFO_SYSTEM = 2, FIFO_MAXMOD = 3 };
+
+void powerOn(int bits);
+void nocashMessage(const char* message);
+
+// ---------------------------------------------------------------- input
+enum KEYPAD_BITS {
+    KEY_A = BIT(0),
+    KEY_B = BIT(1),
+    KEY_SELECT = BIT(2),
+    KEY_START = BIT(3),
+    KEY_RIGHT = BIT(4),
+    KEY_LEFT = BIT(5),
+    KEY_UP = BIT(6),
+    KEY_DOWN = BIT(7),
+    KEY_R = BIT(8),
+    KEY_L = BIT(9),
+    KEY_X = BIT(10),
+    KEY_Y = BIT(11),
+    KEY_TOUCH = BIT(12),
+    KEY_LID = BIT(13)
+};
+
+struct touchPosition {
+    u16 rawx;
+    u16 rawy;
+    u16 px;
+    u16 py;
+    u16 z1;
+    u16 z2;
+};
+
+void scanKeys();
+u32 keysDown();
+u32 keysHeld();
+u32 keysUp();
+void touchRead(touchPosition* data);
+
+#endif //UNDERTALE_HOST_NDS_H
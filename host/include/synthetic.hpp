@@ -0,0 +1,51 @@
+//
+// Procedurally generated assets for host scenarios, the real nitrofs
+// data isn't redistributable so benchmarks can't rely on it.
+//
+
+#ifndef UNDERTALE_HOST_SYNTHETIC_HPP
+#define UNDERTALE_HOST_SYNTHETIC_HPP
+
+#include <nds.h>
+#include "Engine/Background.hpp"
+#include "Engine/Texture.hpp"
+
+namespace Host {
+    // Builds a CSPR in memory and loads it into texture. Pixels cycle
+    // through colors with some transparent holes, frames differ from each
+    // other and a "gfx" animation steps through all of them every tick.
+    // Version 4 stores 8x8 tiles, version 5 pre-swizzled 3D sub-textures.
+    // framesPerAnimation splits the frames over several animations.
+    // ellipse keeps pixels inside an ellipse shrinking every frame, so
+    // some sub-textures end up fully transparent.
+    int loadSyntheticTexture(Engine::Texture& texture, u16 width, u16 height,
+                             u8 frameCount, const u16* colors, u8 colorCount,
+                             u32 version = 4, u8 framesPerAnimation = 0, bool ellipse = false);
+    // Same texture written as a .cspr file, for scenarios going through
+    // Texture::loadPath (point NITRO_ROOT at the directory)
+    bool writeSyntheticTexture(const char* path, u16 width, u16 height,
+                               u8 frameCount, const u16* colors, u8 colorCount,
+                               u32 version = 4);
+
+    // Palette index (0 transparent) of a pixel of those textures
+    u8 syntheticPixel(u16 width, u16 height, u8 frameCount, u8 colorCount,
+                      int px, int py, int frame, bool ellipse = false);
+
+    // Builds a CBGF in memory and loads it into bg: a room of a few floor
+    // and wall tiles repeating, with decorations (the other tiles) here
+    // and there
+    int loadSyntheticBackground(Engine::Background& bg, u16 width, u16 height,
+                                u16 tileCount, bool color8bit);
+    // Same background as a .cbgf file. Version 2 is cut in regions of
+    // regionSize cells, streamed by Background::loadPath.
+    bool writeSyntheticBackground(const char* path, u16 width, u16 height, u16 tileCount,
+                                  bool color8bit, u32 version = 1, u8 regionSize = 16);
+    // Tile at a cell of those backgrounds, and palette index of its pixels
+    u16 syntheticBgTile(u16 tileCount, int x, int y);
+    u8 syntheticBgPixel(u16 tile, int px, int py, bool color8bit);
+
+    // Deterministic color in [0, 0x7FFF], distinct for idx < 32768
+    u16 syntheticColor(u32 idx);
+}
+
+#endif //UNDERTALE_HOST_SYNTHETIC_HPP
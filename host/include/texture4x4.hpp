@@ -0,0 +1,21 @@
+//
+// Reference decoder for DS 4x4 compressed textures (GFX_TEX_FORMAT format
+// 5), so what tools/cspr4x4.py encodes can be checked against what ends up
+// in VRAM.
+//
+
+#ifndef UNDERTALE_HOST_TEXTURE_4X4_HPP
+#define UNDERTALE_HOST_TEXTURE_4X4_HPP
+
+#include <nds.h>
+
+namespace Host {
+    // texels: the texture's block words in slot 0, indices: the index words
+    // (at half the texels' offset in slot 1), palette: at the texture's
+    // palette base. out gets width x height RGB555 colors, bit 15 set for
+    // opaque texels.
+    void decode4x4(const u8* texels, const u8* indices, const u16* palette,
+                   u16 width, u16 height, u16* out);
+}
+
+#endif //UNDERTALE_HOST_TEXTURE_4X4_HPP
@@ -0,0 +1,53 @@
+//
+// Host (Linux) replacement for card.cpp. The save EEPROM is plain memory.
+//
+
+#include "card.hpp"
+
+namespace Host {
+    const u32 kEepromSize = 8000;
+    u8 eeprom[kEepromSize] = {0};
+}
+
+u8 cardCommand(u8, bool) {
+    return 0;
+}
+
+u8 cardTransfer(u8) {
+    return 0;
+}
+
+void cardWaitInProgress() {}
+
+void cardReadBytes(u8* dst, u32 addr, u16 size) {
+    for (u16 i = 0; i < size; i++) {
+        dst[i] = addr + i < Host::kEepromSize ? Host::eeprom[addr + i] : 0xff;
+    }
+}
+
+void cardWriteBytes(u8* src, u32 addr, u16 size) {
+    for (u16 i = 0; i < size && addr + i < Host::kEepromSize; i++) {
+        Host::eeprom[addr + i] = src[i];
+    }
+}
+
+void CardBuffer::read(void *data, size_t size) {
+    cardReadBytes((u8*)data, _pos, size);
+    _pos += size;
+}
+
+void CardBuffer::write(void *src, size_t size) {
+    cardWriteBytes((u8*)src, _pos, size);
+    _pos += size;
+}
+
+void CardBuffer::seek(s32 offset, u8 mode) {
+    if (mode == SEEK_SET)
+        _pos = offset;
+    else if (mode == SEEK_CUR)
+        _pos += offset;
+    else if (mode == SEEK_END)
+        _pos = 7999 + offset;
+}
+
+CardBuffer fCard;
@@ -0,0 +1,42 @@
+//
+// Host (Linux) replacement for nitrofs.c. nitro:/ paths are mapped onto
+// a directory on the host filesystem (NITRO_ROOT, "nitrofs" by default).
+// The game opens files with plain fopen, so the linker wraps it
+// (-Wl,--wrap=fopen) and the prefix is rewritten here.
+//
+
+#include <nds.h>
+#include <fat.h>
+#include "filesystem.h"
+
+extern "C" FILE* __real_fopen(const char* path, const char* mode);
+
+namespace Host {
+    char nitroRoot[256] = "nitrofs";
+    u32 nitroOpenCount = 0;
+}
+
+bool nitroFSInit(char **base_path) {
+    const char* root = getenv("NITRO_ROOT");
+    if (root != nullptr && root[0] != 0) {
+        strncpy(Host::nitroRoot, root, sizeof(Host::nitroRoot) - 1);
+        Host::nitroRoot[sizeof(Host::nitroRoot) - 1] = 0;
+    }
+    if (base_path != nullptr)
+        *base_path = Host::nitroRoot;
+    return true;
+}
+
+bool fatInitDefault() {
+    return true;
+}
+
+extern "C" FILE* __wrap_fopen(const char* path, const char* mode) {
+    const char prefix[] = "nitro:/";
+    if (strncmp(path, prefix, sizeof(prefix) - 1) != 0)
+        return __real_fopen(path, mode);
+    char hostPath[512];
+    snprintf(hostPath, sizeof(hostPath), "%s/%s", Host::nitroRoot, path + sizeof(prefix) - 1);
+    Host::nitroOpenCount++;
+    return __real_fopen(hostPath, mode);
+}
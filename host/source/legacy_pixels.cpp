@@ -0,0 +1,48 @@
+//
+// Engine pixel conversion loops as of before Engine/PixelKernels.hpp.
+//
+
+#include "legacy_pixels.hpp"
+
+namespace Host {
+    void legacyExpandTile(const u8* src, u16* tileRes) {
+        for (int i = 0; i < 64; i++) {
+            bool highBits = i & 1;
+            tileRes[i / 2] &= ~(0xFF << (8 * highBits));
+            tileRes[i / 2] |= (src[i / 2] >> (4 * highBits) & 0xF) << (8 * highBits);
+        }
+    }
+
+    void legacyRemapTile(const u8* src, u8* dst, const u8* paletteColors) {
+        for (int pixel = 0; pixel < 64; pixel++) {
+            if (src[pixel] != 0)
+                dst[pixel] = paletteColors[src[pixel] - 1];
+        }
+    }
+
+    void legacyPackQuad(const u8* tiles, u8 tileWidth, u8 tileHeight, int frame,
+                        u8 quadX, u8 quadY, u8 quadWidth, u8 quadHeight,
+                        bool color8bit, u8* tileRamStart) {
+        for (int y = quadY * 8, y2 = 0; y < (quadY + quadHeight) * 8; y++, y2++) {
+            for (int x = quadX * 8, x2 = 0; x < (quadX + quadWidth) * 8; x++, x2++) {
+                int tileX = x / 8;
+                int tileY = y / 8;
+
+                u32 framePos = frame * tileWidth * tileHeight;
+                u32 tileOffset = framePos + tileY * tileWidth + tileX;
+                tileOffset *= 64;
+                if (color8bit) {
+                    tileOffset += (y % 8) * 8 + (x % 8);
+                    u16* dst = (u16*)(tileRamStart + ((y2 * quadWidth * 8 + x2) & ~1));
+                    *dst &= ~(0xFF << (8 * (x2 & 1)));
+                    *dst |= (tiles[tileOffset] & 0xFF) << (8 * (x2 & 1));
+                } else {
+                    tileOffset += (y % 8) * 8 + (x % 8);
+                    u16* dst = (u16*)(tileRamStart + (((y2 * quadWidth * 8 + x2) / 2) & ~1));
+                    *dst &= ~(0xF << (4 * (x2 & 3)));
+                    *dst |= (tiles[tileOffset] & 0xFF) << (4 * (x2 & 3));
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,2355 @@
+//
+// Host (Linux) driver. Steps the game deterministically so the engine can
+// be run under perf/valgrind or timed without a DS.
+//
+// usage: undertale_host [scenario] [args...]
+//   room <roomId> <frames>   walk the player around a room (default)
+//   palette <rounds>         load/free batches of sub screen sprites
+//   frames <switches> <w> <h>  sub screen animation frame switches
+//   hud <frames> <sprites>   static sub screen sprites, OAM traffic per frame
+//   cull <frames>            sub screen sprites moving on and off screen
+//   scale <frames> <sprites> sub screen sprites scaled together
+//   tex3d <loads> <w> <h>    3D texture uploads, CSPR v4 tiles vs v5 sub-textures
+//   atlas <toolsDir> <frames> 3D VRAM and texture state per room part, with and
+//                            without atlas pages
+//   draw3d <toolsDir> <frames> <parts>  geometry commands per frame in the
+//                            busiest room parts, unpacked and as command lists
+//   battle <rounds> <w> <h>  3D texture uploads entering and leaving battles
+//                            and rooms, VRAM cache on and off, w x h enemy
+//   stream <frames>          big 3D sprite sheets streamed in chunks, v-blank
+//                            cost and frames until they show
+//   geometry <frames> <sprites>  more 3D quads than the geometry engine takes,
+//                            decorations behind bullets, with and without
+//                            the empty quad skip and the quad budget
+//   tex4x4 <cspr> [<rgba>]   4x4 compressed texture from tools/cspr4x4.py,
+//                            decoded from VRAM as drawn and compared with
+//                            its reference pixels
+//   budget <toolsDir>        3D VRAM allocator peak, largest free zone and
+//                            failures per room part
+//   bgscroll <frames>        room background scrolled a tile at a time, VRAM
+//                            writes with and without the tile cache
+//   pixels <rounds>          pixel conversion kernels against the loops they
+//                            replaced, results and throughput
+//   pan <frames>             fast diagonal camera pans, background edges
+//                            loaded after tile crossings or prefetched
+//   bigroom <frames> <speed> 4096x4096 background streamed by regions from
+//                            a version 2 CBGF, RAM and reads per frame
+//   bgwrite <dir>            version 1 backgrounds, intro pictures and rooms
+//   bgload <raw> <packed> <rounds>  the same after tools/cbgfCompress.py:
+//                            bytes read, load time and VRAM compared
+//
+// UNDERTALE_LOG=<file> sends nocashMessage output (and the profiler dump
+// when built with DEFINES=-DDEBUG_PROFILER) to a file instead of stderr.
+// UNDERTALE_GXLIST=<file> dumps every command list DMA'd to GFX_FIFO, one
+// line each: frame, word count, then the words in hex.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <cmath>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+#include <nds.h>
+#include "Engine/Engine.hpp"
+#include "Engine/math.hpp"
+#include "Engine/Sprite3DManager.hpp"
+#include "Engine/OAMManager.hpp"
+#include "Engine/Profiler.hpp"
+#include "Engine/VBlankQueue.hpp"
+#include "Save.hpp"
+#include "Room/Room.hpp"
+#include "Room/Player.hpp"
+#include "Room/Camera.hpp"
+#include "Room/InGameMenu.hpp"
+#include "Cutscene/Cutscene.hpp"
+#include "filesystem.h"
+#include "synthetic.hpp"
+#include "texture4x4.hpp"
+#include "legacy_zones.hpp"
+#include "legacy_pixels.hpp"
+
+namespace {
+    typedef int (*ScenarioFunc)(int argc, char** argv);
+
+    struct Scenario {
+        const char* name;
+        ScenarioFunc run;
+    };
+
+    int argInt(int argc, char** argv, int idx, int defaultValue) {
+        if (idx >= argc)
+            return defaultValue;
+        return atoi(argv[idx]);
+    }
+
+    // Holds each direction for a while so the camera scrolls both ways
+    u32 scriptedKeys(u32 frame) {
+        const u32 pattern[] = {KEY_RIGHT, KEY_DOWN, KEY_LEFT, KEY_UP,
+                               KEY_RIGHT | KEY_DOWN, KEY_LEFT | KEY_UP};
+        const u32 holdFrames = 90;
+        return pattern[(frame / holdFrames) % (sizeof(pattern) / sizeof(pattern[0]))];
+    }
+
+    void roomFrame() {
+        Engine::tick();
+        if (globalCutscene != nullptr) {
+            globalCutscene->update();
+            if (globalCutscene->runCommands(ROOM)) {
+                delete globalCutscene;
+                globalCutscene = nullptr;
+                globalInGameMenu.show(false);
+                globalPlayer->setPlayerControl(true);
+                globalCamera._manual = false;
+            }
+        }
+        globalPlayer->update();
+        globalRoom->update();
+        globalCamera.updatePosition(false);
+        globalPlayer->draw();
+        globalRoom->draw();
+    }
+
+    int runRoom(int argc, char** argv) {
+        int roomId = argInt(argc, argv, 0, 1);
+        int frames = argInt(argc, argv, 1, 600);
+
+        globalPlayer = new Player();
+        globalRoom = new Room(roomId);
+        globalPlayer->_playerSpr._wx = globalRoom->_spawnX << 8;
+        globalPlayer->_playerSpr._wy = globalRoom->_spawnY << 8;
+        globalPlayer->_playerSpr.setShown(true);
+        globalCamera.updatePosition(true);
+        globalPlayer->draw();
+        globalRoom->draw();
+
+        u64 gfxWords = 0, dmaBytes = 0;
+        u32 maxGfxWords = 0, maxDmaBytes = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (int frame = 0; frame < frames; frame++) {
+            Host::setKeys(scriptedKeys(frame));
+            roomFrame();
+            gfxWords += Host::lastFrameStats.gfxWords;
+            dmaBytes += Host::lastFrameStats.dmaBytes;
+            if (Host::lastFrameStats.gfxWords > maxGfxWords)
+                maxGfxWords = Host::lastFrameStats.gfxWords;
+            if (Host::lastFrameStats.dmaBytes > maxDmaBytes)
+                maxDmaBytes = Host::lastFrameStats.dmaBytes;
+        }
+        auto end = std::chrono::steady_clock::now();
+        double ms = std::chrono::duration<double, std::milli>(end - start).count();
+
+        printf("room %d, %d frames in %.2f ms (%.3f ms/frame)\n",
+               roomId, frames, ms, frames > 0 ? ms / frames : 0.0);
+        printf("gfx words/frame avg %.1f max %u\n",
+               frames > 0 ? (double) gfxWords / frames : 0.0, maxGfxWords);
+        printf("dma bytes/frame avg %.1f max %u\n",
+               frames > 0 ? (double) dmaBytes / frames : 0.0, maxDmaBytes);
+        Engine::vblankQueue.dumpStats();
+        Engine::main3dSpr.dumpZoneStats();
+        Engine::OAMManagerSub.dumpZoneStats();
+#ifdef DEBUG_PROFILER
+        Engine::profiler.dump();
+#endif
+
+        globalRoom->free_();
+        delete globalRoom;
+        globalRoom = nullptr;
+        return 0;
+    }
+
+    // OAMManager::loadSprite/freeSprite with many textures sharing part of
+    // a 200 color pool, like dialogue, menu and battle UI loading together
+    int runPalette(int argc, char** argv) {
+        int rounds = argInt(argc, argv, 0, 2000);
+        const int textureCount = 256;
+        const int batch = 8;
+        const u32 colorPool = 200;
+
+        auto* textures = new Engine::Texture[textureCount];
+        u16 colors[48];
+        for (int i = 0; i < textureCount; i++) {
+            u8 colorCount = 16 + i % 33;
+            for (int j = 0; j < colorCount; j++)
+                colors[j] = Host::syntheticColor((i * 13 + j * 7) % colorPool);
+            Host::loadSyntheticTexture(textures[i], 16, 16, 1, colors, colorCount);
+        }
+
+        Engine::Sprite* sprites[batch];
+        for (auto& sprite : sprites)
+            sprite = new Engine::Sprite(Engine::AllocatedOAM);
+
+        u32 colorLoads = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (int round = 0; round < rounds; round++) {
+            for (int i = 0; i < batch; i++) {
+                Engine::Texture& texture = textures[(round * batch + i) % textureCount];
+                sprites[i]->loadTexture(texture);
+                sprites[i]->setShown(true);
+                colorLoads += 16 + ((round * batch + i) % textureCount) % 33;
+            }
+            for (auto& sprite : sprites)
+                sprite->setShown(false);
+        }
+        auto end = std::chrono::steady_clock::now();
+        double ns = std::chrono::duration<double, std::nano>(end - start).count();
+        u32 loads = rounds * batch;
+
+        printf("palette %u sprite loads/frees, %u colors, %.1f ms\n",
+               loads, colorLoads, ns / 1e6);
+        printf("%.1f ns per load+free, %.2f ns per color\n",
+               loads > 0 ? ns / loads : 0.0, colorLoads > 0 ? ns / colorLoads : 0.0);
+
+        for (auto& sprite : sprites)
+            delete sprite;
+        delete[] textures;
+        return 0;
+    }
+
+    // OAMManager::loadSpriteFrame on a speaker sized sprite (dialogue
+    // portraits such as speaker/toriel animate every few frames)
+    int runFrames(int argc, char** argv) {
+        int switches = argInt(argc, argv, 0, 20000);
+        int width = argInt(argc, argv, 1, 64);
+        int height = argInt(argc, argv, 2, 64);
+        const u8 frameCount = 4;
+
+        u16 colors[64];
+        for (int i = 0; i < 64; i++)
+            colors[i] = Host::syntheticColor(i);
+        Engine::Texture texture;
+        Host::loadSyntheticTexture(texture, width, height, frameCount, colors, 64);
+        Engine::Sprite sprite(Engine::AllocatedOAM);
+        sprite.loadTexture(texture);
+        sprite.setShown(true);
+        Engine::OAMManagerSub.draw();
+        Engine::OAMManagerSub.flush();
+
+        Host::cFrameStats = Host::FrameStats();
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < switches; i++) {
+            Engine::OAMManagerSub.draw();  // gfx animation advances every tick
+            Engine::OAMManagerSub.flush();
+        }
+        auto end = std::chrono::steady_clock::now();
+        double ns = std::chrono::duration<double, std::nano>(end - start).count();
+
+        printf("frames %dx%d, %d switches, %.1f ms\n", width, height, switches, ns / 1e6);
+        printf("%.1f ns per frame switch, %.1f dma/switch, %.1f dma bytes/switch\n",
+               switches > 0 ? ns / switches : 0.0,
+               switches > 0 ? (double) Host::cFrameStats.dmaCount / switches : 0.0,
+               switches > 0 ? (double) Host::cFrameStats.dmaBytes / switches : 0.0);
+        sprite.setShown(false);
+        return 0;
+    }
+
+    // Sub screen sprites that never move or animate, like menu and battle
+    // HUD, should cost no OAM writes once they are on screen
+    int runHud(int argc, char** argv) {
+        int frames = argInt(argc, argv, 0, 600);
+        int spriteCount = argInt(argc, argv, 1, 16);
+
+        u16 colors[8];
+        for (int i = 0; i < 8; i++)
+            colors[i] = Host::syntheticColor(i);
+        Engine::Texture texture;
+        Host::loadSyntheticTexture(texture, 32, 16, 1, colors, 8);
+        auto** sprites = new Engine::Sprite*[spriteCount];
+        for (int i = 0; i < spriteCount; i++) {
+            sprites[i] = new Engine::Sprite(Engine::AllocatedOAM);
+            sprites[i]->loadTexture(texture);
+            sprites[i]->_wx = ((i % 8) * 32) << 8;
+            sprites[i]->_wy = ((i / 8) * 16) << 8;
+            sprites[i]->setShown(true);
+        }
+
+        u64 dmaBytes = 0;
+        u32 firstFrameBytes = 0;
+        for (int frame = 0; frame < frames; frame++) {
+            Host::cFrameStats = Host::FrameStats();
+            Engine::OAMManagerSub.draw();
+            Engine::OAMManagerSub.flush();
+            if (frame == 0)
+                firstFrameBytes = Host::cFrameStats.dmaBytes;
+            else
+                dmaBytes += Host::cFrameStats.dmaBytes;
+        }
+        printf("hud %d sprites, %d frames, first frame %u dma bytes, then %.1f dma bytes/frame\n",
+               spriteCount, frames, firstFrameBytes,
+               frames > 1 ? (double) dmaBytes / (frames - 1) : 0.0);
+
+        for (int i = 0; i < spriteCount; i++)
+            delete sprites[i];
+        delete[] sprites;
+        return 0;
+    }
+
+    // Sub screen sprites sweeping across and past the screen edges
+    int runCull(int argc, char** argv) {
+        int frames = argInt(argc, argv, 0, 2000);
+        const int spriteCount = 12;
+
+        u16 colors[16];
+        for (int i = 0; i < 16; i++)
+            colors[i] = Host::syntheticColor(i);
+        Engine::Texture texture;
+        Host::loadSyntheticTexture(texture, 72, 32, 1, colors, 16);  // 2 OAM entries
+        Engine::Sprite* sprites[spriteCount];
+        for (int i = 0; i < spriteCount; i++) {
+            sprites[i] = new Engine::Sprite(Engine::AllocatedOAM);
+            sprites[i]->loadTexture(texture);
+            sprites[i]->setShown(true);
+        }
+
+        u64 culled = 0, dmaBytes = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (int frame = 0; frame < frames; frame++) {
+            for (int i = 0; i < spriteCount; i++) {
+                // Each sprite crosses a 768x576 area centered on the screen
+                sprites[i]->_wx = ((frame * (i + 1) + i * 97) % 768 - 256) << 8;
+                sprites[i]->_wy = ((frame * (i % 3 + 1) + i * 53) % 576 - 192) << 8;
+                sprites[i]->_w_scale_x = i % 3 == 0 ? 384 : 256;
+                sprites[i]->_w_scale_y = i % 3 == 0 ? 384 : 256;
+            }
+            Host::cFrameStats = Host::FrameStats();
+            Engine::OAMManagerSub.draw();
+            Engine::OAMManagerSub.flush();
+            culled += Engine::OAMManagerSub.getCulledCount();
+            dmaBytes += Host::cFrameStats.dmaBytes;
+        }
+        auto end = std::chrono::steady_clock::now();
+        double ns = std::chrono::duration<double, std::nano>(end - start).count();
+
+        printf("cull %d sprites (%d oam entries), %d frames, %.1f ns/frame\n",
+               spriteCount, spriteCount * 2, frames, frames > 0 ? ns / frames : 0.0);
+        printf("%.1f entries culled/frame, %.1f dma bytes/frame\n",
+               frames > 0 ? (double) culled / frames : 0.0,
+               frames > 0 ? (double) dmaBytes / frames : 0.0);
+
+        for (auto& sprite : sprites)
+            delete sprite;
+        return 0;
+    }
+
+    // Many sub screen sprites zooming together, like a cutscene running
+    // CMD_SCALE_IN_FRAMES on a group of sprites
+    int runScale(int argc, char** argv) {
+        int frames = argInt(argc, argv, 0, 2000);
+        int spriteCount = argInt(argc, argv, 1, 40);
+
+        u16 colors[4];
+        for (int i = 0; i < 4; i++)
+            colors[i] = Host::syntheticColor(i);
+        Engine::Texture texture;
+        Host::loadSyntheticTexture(texture, 16, 16, 1, colors, 4);
+        auto** sprites = new Engine::Sprite*[spriteCount];
+        for (int i = 0; i < spriteCount; i++) {
+            sprites[i] = new Engine::Sprite(Engine::AllocatedOAM);
+            sprites[i]->loadTexture(texture);
+            sprites[i]->_wx = ((i % 8) * 30) << 8;
+            sprites[i]->_wy = ((i / 8) * 30) << 8;
+            sprites[i]->setShown(true);
+        }
+
+        int maxMatrices = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (int frame = 0; frame < frames; frame++) {
+            // Ramp up to 2x over 60 frames, hold for 60, repeat
+            s32 scale = 256 + 256 * std::min(frame % 120, 60) / 60;
+            for (int i = 0; i < spriteCount; i++) {
+                sprites[i]->_w_scale_x = scale;
+                sprites[i]->_w_scale_y = scale;
+            }
+            Engine::OAMManagerSub.draw();
+            Engine::OAMManagerSub.flush();
+            maxMatrices = std::max(maxMatrices, Engine::OAMManagerSub.getScaleEntriesUsed());
+        }
+        auto end = std::chrono::steady_clock::now();
+        double ns = std::chrono::duration<double, std::nano>(end - start).count();
+
+        printf("scale %d sprites, %d frames, %.1f ns/frame, %d affine matrices max\n",
+               spriteCount, frames, frames > 0 ? ns / frames : 0.0, maxMatrices);
+
+        for (int i = 0; i < spriteCount; i++)
+            delete sprites[i];
+        delete[] sprites;
+        return 0;
+    }
+
+    // Sprite3DManager::loadSpriteTexture for a battle/room sized 3D sprite,
+    // once from 8x8 tiles (CSPR v4) and once from pre-swizzled data (v5)
+    double timeTexture3D(Engine::Texture& texture, int loads, u32& dmaCount) {
+        Engine::Sprite sprite(Engine::Allocated3D);
+        sprite.loadTexture(texture);
+        Host::cFrameStats = Host::FrameStats();
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < loads; i++) {
+            sprite.setShown(true);
+            Engine::main3dSpr.updateTextures();
+            Engine::vblankQueue.flush();
+            sprite.setShown(false);
+        }
+        auto end = std::chrono::steady_clock::now();
+        dmaCount = Host::cFrameStats.dmaCount;
+        return std::chrono::duration<double, std::nano>(end - start).count();
+    }
+
+    int runTexture3D(int argc, char** argv) {
+        int loads = argInt(argc, argv, 0, 200);
+        int width = argInt(argc, argv, 1, 96);
+        int height = argInt(argc, argv, 2, 80);
+        const u8 frameCount = 4;
+
+        u16 colors[64];
+        for (int i = 0; i < 64; i++)
+            colors[i] = Host::syntheticColor(i);
+
+        // 8bpp and 4bpp textures take different paths
+        const u8 colorCounts[] = {64, 12};
+        int mismatches = 0;
+        // Every load has to be a real upload
+        Engine::main3dSpr.setTextureCacheEnabled(false);
+        for (u8 colorCount : colorCounts) {
+            Engine::Texture tiles, swizzled;
+            Host::loadSyntheticTexture(tiles, width, height, frameCount, colors, colorCount, 4);
+            if (Host::loadSyntheticTexture(swizzled, width, height, frameCount,
+                                           colors, colorCount, 5) != 0) {
+                fprintf(stderr, "tex3d: v5 texture failed to load\n");
+                return 1;
+            }
+
+            u32 dmaTiles, dmaSwizzled;
+            memset(VRAM_B, 0, sizeof(Host::mem.vramB));
+            double nsTiles = timeTexture3D(tiles, loads, dmaTiles);
+            auto* reference = new u16[sizeof(Host::mem.vramB) / 2];
+            memcpy(reference, VRAM_B, sizeof(Host::mem.vramB));
+            memset(VRAM_B, 0, sizeof(Host::mem.vramB));
+            double nsSwizzled = timeTexture3D(swizzled, loads, dmaSwizzled);
+            bool same = memcmp(reference, VRAM_B, sizeof(Host::mem.vramB)) == 0;
+            delete[] reference;
+            if (!same)
+                mismatches++;
+
+            printf("tex3d %dx%d %d colors, %d loads\n", width, height, colorCount, loads);
+            printf("  v4 %.1f us/load %.1f dma/load, v5 %.1f us/load %.1f dma/load, vram %s\n",
+                   loads > 0 ? nsTiles / loads / 1e3 : 0.0,
+                   loads > 0 ? (double) dmaTiles / loads : 0.0,
+                   loads > 0 ? nsSwizzled / loads / 1e3 : 0.0,
+                   loads > 0 ? (double) dmaSwizzled / loads : 0.0,
+                   same ? "identical" : "DIFFERENT");
+        }
+        Engine::main3dSpr.setTextureCacheEnabled(true);
+        return mismatches == 0 ? 0 : 1;
+    }
+
+    char* readText(const char* path) {
+        FILE* f = fopen(path, "rb");
+        if (f == nullptr)
+            return nullptr;
+        fseek(f, 0, SEEK_END);
+        long size = ftell(f);
+        fseek(f, 0, SEEK_SET);
+        auto* text = new char[size + 1];
+        text[fread(text, 1, size, f)] = 0;
+        fclose(f);
+        return text;
+    }
+
+    // Integers after "key": in text, skipping brackets and commas. Just
+    // enough for the flat fields of tools/spr and tools/rooms
+    int jsonInts(const char* text, const char* key, int* out, int count) {
+        char pattern[64];
+        snprintf(pattern, sizeof(pattern), "\"%s\"", key);
+        const char* pos = strstr(text, pattern);
+        if (pos == nullptr)
+            return 0;
+        pos += strlen(pattern);
+        int found = 0;
+        while (found < count && *pos != 0) {
+            if ((*pos >= '0' && *pos <= '9') || *pos == '-') {
+                out[found++] = strtol(pos, (char**) &pos, 10);
+                continue;
+            }
+            if (*pos == ']' || *pos == '}')
+                break;
+            pos++;
+        }
+        return found;
+    }
+
+    struct RoomTexture {
+        int width = 16, height = 16, frameCount = 1;
+        u8 colorCount = 0;
+        u16 colors[32] = {0};
+    };
+
+    // Texture list and sprites of one part of a tools/rooms/*.json room
+    struct RoomPart {
+        char label[16] = {0};
+        RoomTexture textures[32];
+        int textureCount = 0;
+        int spriteTextures[64] = {0};
+        int spriteCount = 0;
+    };
+
+    // Room sprite textures as listed in tools/rooms/*.json, sized from
+    // tools/spr. Pixels and palettes are synthetic (the PNGs aren't in the
+    // tree), palettes of neighbouring textures overlap a bit.
+    int loadRoomParts(const char* toolsDir, RoomPart* parts, int maxParts) {
+        char path[256];
+        int partCount = 0;
+        for (int roomId = 0;; roomId++) {
+            snprintf(path, sizeof(path), "%s/rooms/room%d.json", toolsDir, roomId);
+            char* room = readText(path);
+            if (room == nullptr)
+                break;
+
+            const char* part = room;
+            for (int partIdx = 0; partCount < maxParts &&
+                    (part = strstr(part, "\"textures\"")) != nullptr; partIdx++) {
+                RoomPart& roomPart = parts[partCount++];
+                snprintf(roomPart.label, sizeof(roomPart.label), "%d.%d", roomId, partIdx % 100);
+                const char* nextPart = strstr(part + 1, "\"textures\"");
+                const char* listEnd = strchr(part, ']');
+
+                const char* name = strchr(part + 10, '"');
+                while (name != nullptr && name < listEnd && roomPart.textureCount < 32) {
+                    const char* nameEnd = strchr(name + 1, '"');
+                    snprintf(path, sizeof(path), "%s/spr/%.*s.json", toolsDir,
+                             (int) (nameEnd - name - 1), name + 1);
+                    int textureIdx = roomPart.textureCount++;
+                    RoomTexture& texture = roomPart.textures[textureIdx];
+                    char* spr = readText(path);
+                    if (spr != nullptr) {
+                        int size[2] = {16, 16};
+                        if (jsonInts(spr, "size", size, 2) == 2) {
+                            texture.width = size[0];
+                            texture.height = size[1];
+                        }
+                        jsonInts(spr, "frameCount", &texture.frameCount, 1);
+                        delete[] spr;
+                    }
+                    texture.colorCount = 6 + (textureIdx * 7 + roomId * 3) % 20;
+                    for (int c = 0; c < texture.colorCount; c++)
+                        texture.colors[c] = Host::syntheticColor(textureIdx * 4 + c);
+                    name = strchr(nameEnd + 1, '"');
+                }
+
+                const char* sprite = listEnd;
+                while ((sprite = strstr(sprite, "\"texture_id\"")) != nullptr && roomPart.spriteCount < 64 &&
+                       (nextPart == nullptr || sprite < nextPart)) {
+                    int textureId = 0;
+                    jsonInts(sprite, "texture_id", &textureId, 1);
+                    if (textureId >= 0 && textureId < roomPart.textureCount)
+                        roomPart.spriteTextures[roomPart.spriteCount++] = textureId;
+                    sprite++;
+                }
+                part = listEnd;
+            }
+            delete[] room;
+        }
+        return partCount;
+    }
+
+    struct RoomPartStats {
+        u32 vramBytes = 0;
+        u32 stateWrites = 0;  // GFX_TEX_FORMAT + GFX_PAL_FORMAT
+        u32 gfxCommands = 0;
+        u32 gfxWords = 0;
+        u32 listWords = 0;  // Packed, what the DMA sends to GFX_FIFO
+        double drawNs = 0;
+        Engine::ZoneStats tiles, palette;  // Once everything is loaded
+    };
+
+    // Loads the part's textures and sprites (all on screen, the worst case)
+    // and runs Sprite3DManager::draw for a number of frames
+    RoomPartStats measureRoomPart(const RoomPart& part, int frames) {
+        auto** textures = new Engine::Texture*[part.textureCount];
+        for (int i = 0; i < part.textureCount; i++) {
+            const RoomTexture& spec = part.textures[i];
+            textures[i] = new Engine::Texture;
+            Host::loadSyntheticTexture(*textures[i], spec.width, spec.height,
+                                       spec.frameCount, spec.colors, spec.colorCount, 5);
+        }
+        Engine::main3dSpr.packAtlas(textures, part.textureCount);
+
+        auto** sprites = new Engine::Sprite*[part.spriteCount];
+        for (int i = 0; i < part.spriteCount; i++) {
+            sprites[i] = new Engine::Sprite(Engine::Allocated3D);
+            sprites[i]->loadTexture(*textures[part.spriteTextures[i]]);
+            sprites[i]->setSpriteAnim(0);
+            sprites[i]->_wx = ((i % 6) * 40) << 8;
+            sprites[i]->_wy = (((i / 6) * 24) % 160) << 8;
+            sprites[i]->setShown(true);
+        }
+        Engine::main3dSpr.updateTextures();
+        Engine::vblankQueue.flush();
+
+        RoomPartStats stats;
+        stats.vramBytes = Engine::main3dSpr.getTileBytesUsed() +
+                          Engine::main3dSpr.getPaletteBytesUsed();
+        stats.tiles = Engine::main3dSpr.getTileZoneStats();
+        stats.palette = Engine::main3dSpr.getPaletteZoneStats();
+        u8 lastCommand = 0;
+        for (int frame = 0; frame < frames; frame++) {
+            Host::gfx.count = 0;
+            auto start = std::chrono::steady_clock::now();
+            Engine::main3dSpr.draw();
+            auto end = std::chrono::steady_clock::now();
+            stats.drawNs += std::chrono::duration<double, std::nano>(end - start).count();
+            Engine::main3dSpr.waitDraw();  // The DMA, not the CPU, unpacks the list
+            stats.gfxWords += Host::gfx.count;
+            stats.listWords += Engine::main3dSpr.getCommandList().getWordCount();
+            for (u32 i = 0; i < Host::gfx.count; i++) {
+                // One log entry per parameter word, VERTEX16 takes two
+                u8 command = Host::gfx.commands[i];
+                if (command != Host::GFX_CMD_VTX_16 || lastCommand != Host::GFX_CMD_VTX_16)
+                    stats.gfxCommands++;
+                else
+                    command = 0;
+                lastCommand = command;
+                if (command == Host::GFX_CMD_TEXIMAGE_PARAM || command == Host::GFX_CMD_PLTT_BASE)
+                    stats.stateWrites++;
+            }
+        }
+
+        for (int i = 0; i < part.spriteCount; i++)
+            delete sprites[i];
+        delete[] sprites;
+        for (int i = 0; i < part.textureCount; i++)
+            delete textures[i];
+        delete[] textures;
+        return stats;
+    }
+
+    const int kMaxRoomParts = 64;
+
+    int runAtlas(int argc, char** argv) {
+        const char* toolsDir = argc > 0 ? argv[0] : "tools";
+        int frames = argInt(argc, argv, 1, 60);
+
+        auto* parts = new RoomPart[kMaxRoomParts];
+        int partCount = loadRoomParts(toolsDir, parts, kMaxRoomParts);
+        if (partCount == 0) {
+            fprintf(stderr, "atlas: no rooms in %s/rooms\n", toolsDir);
+            delete[] parts;
+            return 1;
+        }
+
+        printf("%-6s %4s %4s  %8s %8s  %11s %11s\n", "room", "tex", "spr",
+               "vram", "atlas", "state/frame", "atlas");
+        u32 totalVram[2] = {0, 0}, totalState[2] = {0, 0};
+        for (int i = 0; i < partCount; i++) {
+            RoomPartStats stats[2];
+            for (int atlas = 0; atlas < 2; atlas++) {
+                Engine::main3dSpr.setAtlasEnabled(atlas == 1);
+                stats[atlas] = measureRoomPart(parts[i], frames);
+                totalVram[atlas] += stats[atlas].vramBytes;
+                totalState[atlas] += stats[atlas].stateWrites;
+            }
+            printf("%-6s %4d %4d  %8u %8u  %11.1f %11.1f\n", parts[i].label,
+                   parts[i].textureCount, parts[i].spriteCount,
+                   stats[0].vramBytes, stats[1].vramBytes,
+                   frames > 0 ? (double) stats[0].stateWrites / frames : 0.0,
+                   frames > 0 ? (double) stats[1].stateWrites / frames : 0.0);
+        }
+        printf("%-6s %4s %4s  %8u %8u  %11.1f %11.1f\n", "total", "", "",
+               totalVram[0], totalVram[1],
+               frames > 0 ? (double) totalState[0] / frames : 0.0,
+               frames > 0 ? (double) totalState[1] / frames : 0.0);
+        Engine::main3dSpr.setAtlasEnabled(true);
+        delete[] parts;
+        return 0;
+    }
+
+    // 3D allocator stats of every room part loaded on its own, with what
+    // was left from the last one flushed
+    int runBudget(int argc, char** argv) {
+        const char* toolsDir = argc > 0 ? argv[0] : "tools";
+
+        auto* parts = new RoomPart[kMaxRoomParts];
+        int partCount = loadRoomParts(toolsDir, parts, kMaxRoomParts);
+        if (partCount == 0) {
+            fprintf(stderr, "budget: no rooms in %s/rooms\n", toolsDir);
+            delete[] parts;
+            return 1;
+        }
+
+        printf("%-6s %4s  %8s %8s %8s %5s %5s %5s  %6s %6s\n", "room", "tex",
+               "tiles", "peak", "largest", "frag", "zones", "fails", "pal", "peak");
+        u32 peakTiles = 0, peakPalette = 0, failures = 0;
+        for (int i = 0; i < partCount; i++) {
+            Engine::main3dSpr.flushTextureCache();
+            Engine::main3dSpr.resetZoneStats();
+            RoomPartStats stats = measureRoomPart(parts[i], 1);
+            const Engine::ZoneStats& tiles = stats.tiles;
+            printf("%-6s %4d  %8u %8u %8u %4d%% %5d %5u  %6u %6u\n", parts[i].label,
+                   parts[i].textureCount, tiles.used, tiles.peakUsed, tiles.largestFree,
+                   tiles.fragmentation, tiles.freeZones, tiles.failures + stats.palette.failures,
+                   stats.palette.used, stats.palette.peakUsed);
+            peakTiles = tiles.peakUsed > peakTiles ? tiles.peakUsed : peakTiles;
+            peakPalette = stats.palette.peakUsed > peakPalette ? stats.palette.peakUsed : peakPalette;
+            failures += tiles.failures + stats.palette.failures;
+        }
+        printf("%-6s %4s  %8s %8u %8s %5s %5s %5u  %6s %6u\n", "max", "", "",
+               peakTiles, "", "", "", failures, "", peakPalette);
+        delete[] parts;
+        return 0;
+    }
+
+    struct BgScrollStats {
+        u32 steps = 0;  // Tile rows and columns scrolled in
+        Engine::BgTileStats tiles;
+        u32 maxFrameCells = 0;
+        u32 maxFrameRead = 0;  // Bytes of a streamed background read in a frame
+        u32 maxFrameCost = 0;
+        u32 checked = 0;
+        u32 wrong = 0;  // Visible cells whose VRAM pixels aren't the map's tile
+    };
+
+    // Compares the pixels every cell on screen at x, y shows with the map
+    void checkBgWindow(int x, int y, u16 tileCount, bool color8bit, BgScrollStats& stats) {
+        const int mapSize = 64;
+        auto* mapRam = (const u16*) BG_MAP_RAM(0);
+        auto* tileRam = (const u8*) BG_TILE_RAM(1);
+        for (int row = y / 8; row <= (y + 191) / 8; row++) {
+            for (int col = x / 8; col <= (x + 255) / 8; col++) {
+                u16 slot = mapRam[mod(row, mapSize) * mapSize + mod(col, mapSize)];
+                u16 tile = Host::syntheticBgTile(tileCount, col, row);
+                bool same = true;
+                for (int p = 0; p < 64 && same; p++)
+                    same = tileRam[slot * 64 + p] == Host::syntheticBgPixel(tile, p % 8, p / 8, color8bit);
+                stats.checked++;
+                stats.wrong += !same;
+            }
+        }
+    }
+
+    // Camera before scrollWindowMain: both edge strips of every tile
+    // crossed, in the frame after the crossing
+    void legacyScrollEdges(Engine::Background& bg, int prevX, int prevY, int x, int y) {
+        int xTilePrev = prevX / 8, yTilePrev = prevY / 8;
+        int xTilePost = x / 8, yTilePost = y / 8;
+        int incrementX = xTilePost > xTilePrev ? 1 : -1;
+        int incrementY = yTilePost > yTilePrev ? 1 : -1;
+        for (int xTile = xTilePrev; xTile != xTilePost; xTile += incrementX) {
+            bg.queueBgRectMain(xTile + incrementX + 32, yTilePost - 1, 1, 26);
+            bg.queueBgRectMain(xTile + incrementX - 1, yTilePost - 1, 1, 26);
+        }
+        for (int yTile = yTilePrev; yTile != yTilePost; yTile += incrementY) {
+            bg.queueBgRectMain(xTilePost - 1, yTile + incrementY + 24, 34, 1);
+            bg.queueBgRectMain(xTilePost - 1, yTile + incrementY - 1, 34, 1);
+        }
+    }
+
+    // Moves the camera to x, y and loads what it needs, the way Camera does
+    // or did, then runs v-blank and checks the screen
+    void scrollBgFrame(Engine::Background& bg, bool prefetch, int& camX, int& camY, int x, int y,
+                       u16 tileCount, bool color8bit, BgScrollStats& stats) {
+        u32 cells = bg.getTileStats().cells;
+        u32 bytesRead = bg.getRegionStats().bytesRead;
+        stats.steps += abs(x / 8 - camX / 8) + abs(y / 8 - camY / 8);
+        if (prefetch)
+            bg.scrollWindowMain(x, y, (x - camX) << 8, (y - camY) << 8);
+        else
+            legacyScrollEdges(bg, camX, camY, x, y);
+        camX = x, camY = y;
+        Engine::vblankQueue.drain();
+        stats.maxFrameCells = std::max(stats.maxFrameCells, bg.getTileStats().cells - cells);
+        stats.maxFrameRead = std::max(stats.maxFrameRead, bg.getRegionStats().bytesRead - bytesRead);
+        if (Engine::vblankQueue.getStats().depth == 0)
+            checkBgWindow(camX, camY, tileCount, color8bit, stats);
+    }
+
+    void startBgScroll(Engine::Background& bg, bool tileCache, int camX, int camY) {
+        bg.setTileCacheEnabled(tileCache);
+        bg.loadBgExtendedMain(512 / 8);
+        bg.loadWindowMain(camX, camY);
+        bg.resetTileStats();
+        bg.resetRegionStats();
+        Engine::vblankQueue.resetStats();
+    }
+
+    void finishBgScroll(Engine::Background& bg, BgScrollStats& stats) {
+        Engine::vblankQueue.flush();
+        stats.tiles = bg.getTileStats();
+        stats.maxFrameCost = Engine::vblankQueue.getStats().maxFrameCost;
+    }
+
+    // Walks a camera around a room background, edges loaded as it goes
+    BgScrollStats runBgScrollPass(int frames, bool tileCache, bool color8bit) {
+        const u16 width = 160, height = 120, tileCount = 96;
+        const int speed = 2;
+        BgScrollStats stats;
+        Engine::Background bg;
+        int camX = (width * 8 - 256) / 2, camY = (height * 8 - 192) / 2;
+        Host::loadSyntheticBackground(bg, width, height, tileCount, color8bit);
+        startBgScroll(bg, tileCache, camX, camY);
+        for (int frame = 0; frame < frames; frame++) {
+            u32 keys = scriptedKeys(frame);
+            int x = camX + ((keys & KEY_RIGHT) ? speed : 0) - ((keys & KEY_LEFT) ? speed : 0);
+            int y = camY + ((keys & KEY_DOWN) ? speed : 0) - ((keys & KEY_UP) ? speed : 0);
+            x = std::max(0, std::min(x, width * 8 - 256));
+            y = std::max(0, std::min(y, height * 8 - 192));
+            scrollBgFrame(bg, true, camX, camY, x, y, tileCount, color8bit, stats);
+        }
+        finishBgScroll(bg, stats);
+        return stats;
+    }
+
+    int runBgScroll(int argc, char** argv) {
+        int frames = argInt(argc, argv, 0, 2000);
+
+        printf("%-5s %5s  %6s %10s %10s %10s %10s %8s %8s  %6s\n", "cache", "bpp", "steps",
+               "cells/step", "tiles/step", "bytes/step", "hit rate", "max cost", "checked", "wrong");
+        int wrong = 0;
+        for (int color8bit = 1; color8bit >= 0; color8bit--) {
+            for (int cache = 0; cache < 2; cache++) {
+                BgScrollStats stats = runBgScrollPass(frames, cache == 1, color8bit == 1);
+                double steps = stats.steps > 0 ? stats.steps : 1;
+                u32 bytes = stats.tiles.cells * 2 + stats.tiles.uploads * 64;
+                printf("%-5s %5d  %6u %10.1f %10.1f %10.1f %9.1f%% %8u %8u  %6u\n",
+                       cache ? "on" : "off", color8bit ? 8 : 4, stats.steps,
+                       stats.tiles.cells / steps, stats.tiles.uploads / steps, bytes / steps,
+                       stats.tiles.cells > 0 ? 100.0 * stats.tiles.hits / stats.tiles.cells : 0.0,
+                       stats.maxFrameCost, stats.checked, stats.wrong);
+                wrong += stats.wrong;
+            }
+        }
+        return wrong != 0;
+    }
+
+    // Camera panning corner to corner across a background at speed
+    // pixels a frame, bouncing off its edges
+    void panBg(Engine::Background& bg, int frames, int speed, bool prefetch, bool tileCache,
+               u16 tileCount, bool color8bit, BgScrollStats& stats) {
+        u16 width, height;
+        bg.getSize(width, height);
+        const int maxX = width * 8 - 256, maxY = height * 8 - 192;
+        int camX = 3, camY = 5;
+        startBgScroll(bg, tileCache, camX, camY);
+        int dirX = 1, dirY = 1;
+        int x = camX, y = camY;
+        for (int frame = 0; frame < frames; frame++) {
+            // Steeper one way than the other so rows and columns drift apart
+            x += dirX * speed;
+            y += dirY * (speed * 3 / 4 + 1);
+            if (x < 0 || x > maxX)
+                dirX = -dirX, x = std::max(0, std::min(x, maxX));
+            if (y < 0 || y > maxY)
+                dirY = -dirY, y = std::max(0, std::min(y, maxY));
+            scrollBgFrame(bg, prefetch, camX, camY, x, y, tileCount, color8bit, stats);
+        }
+        finishBgScroll(bg, stats);
+    }
+
+    // Cutscene camera pans across a room background, edges loaded after
+    // each crossing or ahead of it
+    BgScrollStats runPanPass(int frames, int speed, bool prefetch) {
+        const u16 width = 160, height = 120, tileCount = 96;
+        BgScrollStats stats;
+        Engine::Background bg;
+        Host::loadSyntheticBackground(bg, width, height, tileCount, true);
+        panBg(bg, frames, speed, prefetch, false, tileCount, true, stats);
+        return stats;
+    }
+
+    int runPan(int argc, char** argv) {
+        int frames = argInt(argc, argv, 0, 2000);
+        const int speeds[] = {1, 2, 4, 6, 8};
+
+        printf("%-8s %5s  %6s %10s %10s %10s %8s %8s  %6s\n", "loads", "speed", "steps",
+               "cells/step", "max cells", "urgent", "max cost", "checked", "wrong");
+        int wrong = 0;
+        for (int speed : speeds) {
+            for (int prefetch = 0; prefetch < 2; prefetch++) {
+                BgScrollStats stats = runPanPass(frames, speed, prefetch == 1);
+                double steps = stats.steps > 0 ? stats.steps : 1;
+                printf("%-8s %5d  %6u %10.1f %10u %10u %8u %8u  %6u\n",
+                       prefetch ? "prefetch" : "edges", speed, stats.steps,
+                       stats.tiles.cells / steps, stats.maxFrameCells, stats.tiles.urgent,
+                       stats.maxFrameCost, stats.checked, stats.wrong);
+                wrong += stats.wrong;
+            }
+        }
+        return wrong != 0;
+    }
+
+    // A 4096x4096 pixel room in a version 2 CBGF, streamed by regions as
+    // the camera pans over all of it
+    int runBigRoom(int argc, char** argv) {
+        int frames = argInt(argc, argv, 0, 3000);
+        int speed = argInt(argc, argv, 1, 6);
+        const u16 width = 512, height = 512, tileCount = 96;
+
+        char root[] = "/tmp/undertale_hostXXXXXX";
+        if (mkdtemp(root) == nullptr) {
+            fprintf(stderr, "bigroom: can't create a temporary directory\n");
+            return 1;
+        }
+        char path[512];
+        snprintf(path, sizeof(path), "%s/bg", root);
+        mkdir(path, 0755);
+        snprintf(path, sizeof(path), "%s/bg/big.cbgf", root);
+        setenv("NITRO_ROOT", root, 1);
+        nitroFSInit(nullptr);
+
+        printf("%-5s %5s %5s %9s %9s %9s %8s %10s %9s %8s  %6s\n", "cache", "bpp", "speed", "file",
+               "in RAM", "streamed", "regions", "read/frame", "max read", "checked", "wrong");
+        int wrong = 0;
+        for (int pass = 0; pass < 4; pass++) {
+            bool color8bit = pass < 2, cache = pass % 2 == 1;
+            Host::writeSyntheticBackground(path, width, height, tileCount, color8bit, 2);
+            struct stat fileStat;
+            stat(path, &fileStat);
+
+            BgScrollStats stats;
+            Engine::Background bg;
+            if (!bg.loadPath("big") || !bg.getStreamed()) {
+                fprintf(stderr, "bigroom: can't stream %s\n", path);
+                return 1;
+            }
+            panBg(bg, frames, speed, true, cache, tileCount, color8bit, stats);
+            // What version 1 would keep in RAM: the whole map and tile set
+            u32 wholeBytes = width * height * 2 + tileCount * (color8bit ? 64 : 32);
+            const Engine::BgRegionStats& regions = bg.getRegionStats();
+            printf("%-5s %5d %5d %9ld %9u %9u %8u %10.1f %9u %8u  %6u\n", cache ? "on" : "off",
+                   color8bit ? 8 : 4, speed,
+                   (long) fileStat.st_size, wholeBytes, regions.peakBytes, regions.loads,
+                   (double) regions.bytesRead / frames, stats.maxFrameRead, stats.checked, stats.wrong);
+            wrong += stats.wrong;
+            if (regions.starved != 0) {
+                fprintf(stderr, "bigroom: %u region loads found the cache all pinned\n", regions.starved);
+                wrong += regions.starved;
+            }
+        }
+        unlink(path);
+        snprintf(path, sizeof(path), "%s/bg", root);
+        rmdir(path);
+        rmdir(root);
+        return wrong != 0;
+    }
+
+    struct BgFileSpec {
+        const char* name;
+        u16 width, height;  // In tiles
+        u16 tileCount;
+        bool color8bit;
+    };
+
+    // Stand-ins for the intro pictures runTitleScreen loads one after the
+    // other (the last one taller, it scrolls) and a few rooms
+    const BgFileSpec kBgFiles[] = {
+        {"intro0", 32, 24, 400, true}, {"intro1", 32, 24, 360, true},
+        {"intro2", 32, 24, 320, true}, {"intro3", 32, 24, 300, true},
+        {"intro4", 32, 24, 280, true}, {"intro5", 32, 24, 260, true},
+        {"intro6", 32, 24, 240, true}, {"intro7", 32, 24, 220, true},
+        {"intro8", 32, 24, 200, true}, {"intro9", 32, 24, 180, false},
+        {"intro10", 32, 44, 500, true},
+        {"room_ruins", 80, 60, 96, true}, {"room_hall", 120, 30, 64, true},
+        {"room_small", 40, 30, 48, false},
+    };
+
+    // Version 1 backgrounds for tools/cbgfCompress.py to compress
+    int runBgWrite(int argc, char** argv) {
+        const char* dir = argc > 0 ? argv[0] : "bgraw";
+        mkdir(dir, 0755);
+        char path[512];
+        for (const BgFileSpec& spec : kBgFiles) {
+            snprintf(path, sizeof(path), "%s/%s.cbgf", dir, spec.name);
+            if (!Host::writeSyntheticBackground(path, spec.width, spec.height, spec.tileCount,
+                                                spec.color8bit)) {
+                fprintf(stderr, "bgwrite: can't write %s\n", path);
+                return 1;
+            }
+        }
+        printf("%d backgrounds in %s\n", (int) (sizeof(kBgFiles) / sizeof(kBgFiles[0])), dir);
+        return 0;
+    }
+
+    // Loads a background file rounds times, then shows a window of it and
+    // copies what ends up in VRAM to vram
+    bool loadBgFile(const char* path, int rounds, double& microseconds, long& bytes,
+                    std::vector<u8>& vram) {
+        Engine::Background bg;
+        auto start = std::chrono::steady_clock::now();
+        for (int round = 0; round < rounds; round++) {
+            FILE* f = fopen(path, "rb");
+            if (f == nullptr || bg.loadCBGF(f) != 0) {
+                if (f != nullptr)
+                    fclose(f);
+                return false;
+            }
+            if (round == 0) {
+                fseek(f, 0, SEEK_END);
+                bytes = ftell(f);
+            }
+            fclose(f);
+        }
+        auto end = std::chrono::steady_clock::now();
+        microseconds = std::chrono::duration<double, std::micro>(end - start).count() / rounds;
+
+        bg.loadBgExtendedMain(512 / 8);
+        bg.loadWindowMain(0, 0);
+        auto* tileRam = (const u8*) BG_TILE_RAM(1);
+        auto* mapRam = (const u8*) BG_MAP_RAM(0);
+        vram.assign(tileRam, tileRam + Engine::kBgWindowCells * 64);
+        vram.insert(vram.end(), mapRam, mapRam + 64 * 64 * 2);
+        return true;
+    }
+
+    // Each background of bgwrite, as written and as compressed by
+    // cbgfCompress.py: bytes read, load time, and the same VRAM after
+    int runBgLoad(int argc, char** argv) {
+        const char* rawDir = argc > 0 ? argv[0] : "bgraw";
+        const char* packedDir = argc > 1 ? argv[1] : "bgpacked";
+        int rounds = argInt(argc, argv, 2, 50);
+
+        printf("%-12s %9s %9s %7s %10s %10s  %s\n", "background", "raw", "packed", "ratio",
+               "raw us", "packed us", "vram");
+        long rawTotal = 0, packedTotal = 0;
+        double rawTime = 0, packedTime = 0;
+        int failed = 0;
+        char rawPath[512], packedPath[512];
+        for (const BgFileSpec& spec : kBgFiles) {
+            snprintf(rawPath, sizeof(rawPath), "%s/%s.cbgf", rawDir, spec.name);
+            snprintf(packedPath, sizeof(packedPath), "%s/%s.cbgf", packedDir, spec.name);
+            double rawUs = 0, packedUs = 0;
+            long rawBytes = 0, packedBytes = 0;
+            std::vector<u8> rawVram, packedVram;
+            if (!loadBgFile(rawPath, rounds, rawUs, rawBytes, rawVram) ||
+                    !loadBgFile(packedPath, rounds, packedUs, packedBytes, packedVram)) {
+                printf("%-12s can't load %s or %s\n", spec.name, rawPath, packedPath);
+                failed++;
+                continue;
+            }
+            bool same = rawVram == packedVram;
+            printf("%-12s %9ld %9ld %6.1f%% %10.1f %10.1f  %s\n", spec.name, rawBytes, packedBytes,
+                   100.0 * packedBytes / rawBytes, rawUs, packedUs, same ? "same" : "DIFFERENT");
+            failed += !same;
+            rawTotal += rawBytes, packedTotal += packedBytes;
+            rawTime += rawUs, packedTime += packedUs;
+        }
+        printf("%-12s %9ld %9ld %6.1f%% %10.1f %10.1f\n", "total", rawTotal, packedTotal,
+               rawTotal > 0 ? 100.0 * packedTotal / rawTotal : 0.0, rawTime, packedTime);
+        return failed != 0;
+    }
+
+    // Geometry commands sent by Sprite3DManager::draw in the room parts
+    // with the most sprites
+    int runDraw3D(int argc, char** argv) {
+        const char* toolsDir = argc > 0 ? argv[0] : "tools";
+        int frames = argInt(argc, argv, 1, 600);
+        int shown = argInt(argc, argv, 2, 4);
+
+        auto* parts = new RoomPart[kMaxRoomParts];
+        int partCount = loadRoomParts(toolsDir, parts, kMaxRoomParts);
+        if (partCount == 0) {
+            fprintf(stderr, "draw3d: no rooms in %s/rooms\n", toolsDir);
+            delete[] parts;
+            return 1;
+        }
+
+        printf("%-6s %4s  %5s %12s %10s %10s %11s %10s\n", "room", "spr", "atlas",
+               "commands/fr", "words/fr", "list/fr", "state/fr", "ns/draw");
+        bool* done = new bool[partCount]();
+        for (int n = 0; n < shown && n < partCount; n++) {
+            int busiest = -1;
+            for (int i = 0; i < partCount; i++) {
+                if (!done[i] && (busiest < 0 || parts[i].spriteCount > parts[busiest].spriteCount))
+                    busiest = i;
+            }
+            done[busiest] = true;
+            for (int atlas = 0; atlas < 2; atlas++) {
+                Engine::main3dSpr.setAtlasEnabled(atlas == 1);
+                RoomPartStats stats = measureRoomPart(parts[busiest], frames);
+                printf("%-6s %4d  %5s %12.1f %10.1f %10.1f %11.1f %10.0f\n", parts[busiest].label,
+                       parts[busiest].spriteCount, atlas ? "on" : "off",
+                       frames > 0 ? (double) stats.gfxCommands / frames : 0.0,
+                       frames > 0 ? (double) stats.gfxWords / frames : 0.0,
+                       frames > 0 ? (double) stats.listWords / frames : 0.0,
+                       frames > 0 ? (double) stats.stateWrites / frames : 0.0,
+                       frames > 0 ? stats.drawNs / frames : 0.0);
+            }
+        }
+        Engine::main3dSpr.setAtlasEnabled(true);
+        delete[] done;
+        delete[] parts;
+        return 0;
+    }
+
+    struct CachedTextureSpec {
+        const char* name;
+        u16 width, height;
+        u8 frameCount;
+        u8 colorCount;
+    };
+
+    const CachedTextureSpec kPlayerTexture = {"mainchara", 24, 32, 16, 12};
+    const CachedTextureSpec kRoomATextures[] = {
+        {"toriel", 32, 56, 8, 20}, {"wall_a", 64, 64, 1, 24},
+        {"panel", 32, 32, 4, 8}, {"flowey", 24, 32, 8, 14},
+    };
+    const CachedTextureSpec kRoomBTextures[] = {
+        {"toriel", 32, 56, 8, 20}, {"wall_b", 64, 64, 1, 24}, {"panel", 32, 32, 4, 8},
+    };
+    const CachedTextureSpec kBattleTextures[] = {
+        {"enemy", 64, 80, 4, 40}, {"bullet", 16, 16, 4, 4},
+        {"soul", 16, 16, 2, 3}, {"box", 64, 64, 1, 18},
+    };
+
+    // Textures and sprites of one room or battle, loaded through
+    // Texture::loadPath like Room does
+    struct CachedTextureSet {
+        int count = 0;
+        Engine::Texture* textures[8] = {nullptr};
+        Engine::Sprite* sprites[8] = {nullptr};
+
+        void load(const CachedTextureSpec* specs, int specCount) {
+            count = specCount;
+            for (int i = 0; i < count; i++) {
+                textures[i] = new Engine::Texture;
+                textures[i]->loadPath(specs[i].name);
+                sprites[i] = new Engine::Sprite(Engine::Allocated3D);
+                sprites[i]->loadTexture(*textures[i]);
+                sprites[i]->setShown(true);
+            }
+        }
+
+        void show(bool shown) {
+            for (int i = 0; i < count; i++)
+                sprites[i]->setShown(shown);
+        }
+
+        void free_() {
+            for (int i = 0; i < count; i++) {
+                delete sprites[i];
+                delete textures[i];
+            }
+            count = 0;
+        }
+    };
+
+    void uploadTextures() {
+        Engine::main3dSpr.updateTextures();
+        Engine::vblankQueue.flush();
+    }
+
+    // Rooms with a battle in each, then on to the next room, the way
+    // Room::push/pop and loadNewRoom free and show sprites
+    int runBattle(int argc, char** argv) {
+        int rounds = argInt(argc, argv, 0, 20);
+        // A bigger enemy leaves less room for what the battle pushed away
+        CachedTextureSpec battleSpecs[4];
+        memcpy(battleSpecs, kBattleTextures, sizeof(battleSpecs));
+        battleSpecs[0].width = argInt(argc, argv, 1, battleSpecs[0].width);
+        battleSpecs[0].height = argInt(argc, argv, 2, battleSpecs[0].height);
+
+        char root[] = "/tmp/undertale_hostXXXXXX";
+        if (mkdtemp(root) == nullptr) {
+            fprintf(stderr, "battle: can't create a temporary directory\n");
+            return 1;
+        }
+        char path[512];
+        snprintf(path, sizeof(path), "%s/spr", root);
+        mkdir(path, 0755);
+
+        u16 colors[64];
+        for (int i = 0; i < 64; i++)
+            colors[i] = Host::syntheticColor(i);
+        const CachedTextureSpec* allSpecs[] = {&kPlayerTexture, kRoomATextures, kRoomBTextures, battleSpecs};
+        const int allCounts[] = {1, 4, 3, 4};
+        for (int set = 0; set < 4; set++) {
+            for (int i = 0; i < allCounts[set]; i++) {
+                const CachedTextureSpec& spec = allSpecs[set][i];
+                snprintf(path, sizeof(path), "%s/spr/%s.cspr", root, spec.name);
+                Host::writeSyntheticTexture(path, spec.width, spec.height, spec.frameCount,
+                                            colors, spec.colorCount, 5);
+            }
+        }
+        setenv("NITRO_ROOT", root, 1);
+        nitroFSInit(nullptr);
+
+        printf("%-6s %8s %8s %10s %12s %10s\n", "cache", "uploads", "hits", "evictions",
+               "dma bytes", "saved");
+        for (int cache = 0; cache < 2; cache++) {
+            Engine::main3dSpr.setTextureCacheEnabled(cache == 1);
+            Engine::main3dSpr.resetCacheStats();
+            u32 dmaStart = Host::cFrameStats.dmaBytes;
+
+            CachedTextureSet player, room, battle;
+            player.load(&kPlayerTexture, 1);
+            for (int round = 0; round < rounds; round++) {
+                if (round % 2 == 0)
+                    room.load(kRoomATextures, 4);
+                else
+                    room.load(kRoomBTextures, 3);
+                uploadTextures();
+
+                player.show(false);
+                room.show(false);
+                battle.load(battleSpecs, 4);
+                uploadTextures();
+                battle.free_();
+                player.show(true);
+                room.show(true);
+                uploadTextures();
+
+                room.free_();
+            }
+            player.free_();
+
+            const Engine::TextureCacheStats& stats = Engine::main3dSpr.getCacheStats();
+            printf("%-6s %8u %8u %10u %12u %10u\n", cache ? "on" : "off",
+                   stats.misses, stats.hits, stats.evictions,
+                   Host::cFrameStats.dmaBytes - dmaStart, stats.savedBytes);
+            Engine::main3dSpr.flushTextureCache();
+        }
+
+        for (int set = 0; set < 4; set++) {
+            for (int i = 0; i < allCounts[set]; i++) {
+                snprintf(path, sizeof(path), "%s/spr/%s.cspr", root, allSpecs[set][i].name);
+                remove(path);
+            }
+        }
+        snprintf(path, sizeof(path), "%s/spr", root);
+        rmdir(path);
+        rmdir(root);
+        return 0;
+    }
+
+    // Toriel's room sprite sheets, by size and frame count
+    struct StreamedTextureSpec {
+        u16 width, height;
+        u8 frameCount;
+        u8 framesPerAnimation;
+    };
+    const StreamedTextureSpec kStreamedTextures[] = {{25, 52, 15, 3}, {44, 53, 14, 4}};
+    const int kStreamedTextureCount = 2;
+
+    // Big sprite sheets shown at once, texture uploads streamed in chunks
+    // of different sizes (0 uploads whole textures)
+    int runStream(int argc, char** argv) {
+        int frames = argInt(argc, argv, 0, 60);
+        u16 colors[64];
+        for (int i = 0; i < 64; i++)
+            colors[i] = Host::syntheticColor(i);
+
+        Engine::main3dSpr.setTextureCacheEnabled(false);
+        printf("%-7s %6s %8s %8s %8s %10s %9s\n", "chunk", "jobs", "first", "all", "resident",
+               "max cost", "overruns");
+        const u32 chunks[] = {0, 8 * 1024, Engine::kTextureStreamChunk, 2 * 1024};
+        for (u32 chunk : chunks) {
+            Engine::main3dSpr.setStreamChunk(chunk == 0 ? 0xFFFFFFFF : chunk);
+            Engine::main3dSpr.resetCacheStats();
+            Engine::vblankQueue.resetStats();
+
+            Engine::Texture textures[kStreamedTextureCount];
+            Engine::Sprite* sprites[kStreamedTextureCount];
+            u32 quadCount = 0;
+            for (int i = 0; i < kStreamedTextureCount; i++) {
+                const StreamedTextureSpec& spec = kStreamedTextures[i];
+                Host::loadSyntheticTexture(textures[i], spec.width, spec.height, spec.frameCount,
+                                           colors, 20, 5, spec.framesPerAnimation);
+                sprites[i] = new Engine::Sprite(Engine::Allocated3D);
+                sprites[i]->loadTexture(textures[i]);
+                sprites[i]->_wx = (32 + i * 96) << 8;
+                sprites[i]->_wy = 64 << 8;
+                sprites[i]->setShown(true);
+                u8 tileWidth, tileHeight;
+                textures[i].getSizeTiles(tileWidth, tileHeight);
+                quadCount += __builtin_popcount(tileWidth) * __builtin_popcount(tileHeight);
+            }
+
+            // Frame the first sprite shows, all of them and the last upload
+            int first = -1, all = -1, resident = -1;
+            for (int frame = 0; frame < frames; frame++) {
+                Host::gfx.count = 0;
+                Engine::main3dSpr.draw();
+                Engine::main3dSpr.waitDraw();
+                u32 quads = 0;
+                for (u32 i = 0; i < Host::gfx.count; i++)
+                    quads += Host::gfx.commands[i] == Host::GFX_CMD_VTX_16;
+                quads /= 2;  // Two parameter words
+                if (quads > 0 && first < 0)
+                    first = frame;
+                if (quads == quadCount && all < 0)
+                    all = frame;
+
+                Engine::main3dSpr.updateTextures();
+                Engine::vblankQueue.drain();
+                if (resident < 0 && Engine::vblankQueue.getStats().depth == 0 && frame > 0)
+                    resident = frame;
+            }
+
+            const Engine::VBlankQueueStats& stats = Engine::vblankQueue.getStats();
+            char label[16];
+            if (chunk == 0)
+                snprintf(label, sizeof(label), "whole");
+            else
+                snprintf(label, sizeof(label), "%uK", chunk / 1024);
+            printf("%-7s %6u %8d %8d %8d %10u %9u\n", label, Engine::main3dSpr.getCacheStats().streamChunks,
+                   first, all, resident, stats.maxFrameCost, stats.overruns);
+
+            for (auto* sprite : sprites)
+                delete sprite;
+        }
+        Engine::main3dSpr.setStreamChunk(Engine::kTextureStreamChunk);
+        Engine::main3dSpr.setTextureCacheEnabled(true);
+        return 0;
+    }
+
+    // Decorations (low priority, partly transparent) then a bullet hell, so
+    // a frame has more quads than polygon/vertex RAM holds
+    int runGeometry(int argc, char** argv) {
+        int frames = argInt(argc, argv, 0, 300);
+        const int decoCount = 60;
+        // Sprite3DManager counts active sprites in a u8
+        int bulletCount = std::min(argInt(argc, argv, 1, 195), 255 - decoCount);
+        u16 colors[32];
+        for (int i = 0; i < 32; i++)
+            colors[i] = Host::syntheticColor(i);
+
+        Engine::Texture decoTexture, bulletTexture;
+        Host::loadSyntheticTexture(decoTexture, 56, 56, 2, colors, 20, 5, 0, true);
+        Host::loadSyntheticTexture(bulletTexture, 56, 24, 4, colors, 12, 5);
+        auto** sprites = new Engine::Sprite*[decoCount + bulletCount];
+        for (int i = 0; i < decoCount + bulletCount; i++) {
+            sprites[i] = new Engine::Sprite(Engine::Allocated3D);
+            sprites[i]->loadTexture(i < decoCount ? decoTexture : bulletTexture);
+            if (i < decoCount)
+                sprites[i]->_drawPriority = -1;
+            sprites[i]->_wx = ((i * 37) % 200) << 8;
+            sprites[i]->_wy = ((i * 53) % 136) << 8;
+            sprites[i]->setShown(true);
+        }
+        uploadTextures();
+
+        printf("%-7s %8s %6s %8s %8s %8s %8s %8s %8s\n", "policy", "quads/fr", "peak", "over/fr",
+               "empty/fr", "drop/fr", "spr/fr", "warnings", "ns/draw");
+        const char* policies[] = {"none", "skip", "budget"};
+        for (int policy = 0; policy < 3; policy++) {
+            Engine::main3dSpr.setSkipEmptyQuads(policy >= 1);
+            Engine::main3dSpr.setQuadBudget(policy == 2 ? Engine::kMaxQuads : 0xFFFF);
+            Engine::main3dSpr.resetGeometryStats();
+
+            u64 quads = 0, over = 0;
+            auto start = std::chrono::steady_clock::now();
+            for (int frame = 0; frame < frames; frame++) {
+                for (int i = decoCount; i < decoCount + bulletCount; i++)
+                    sprites[i]->_wy = (((i * 53) + frame * (1 + i % 3)) % 136) << 8;
+                Engine::main3dSpr.draw();
+                Engine::main3dSpr.waitDraw();
+                // Past the limit the geometry engine drops polygons silently
+                u16 sent = Engine::main3dSpr.getGeometryStats().quads;
+                quads += sent;
+                if (sent > Engine::kMaxQuads)
+                    over += sent - Engine::kMaxQuads;
+            }
+            auto end = std::chrono::steady_clock::now();
+            double ns = std::chrono::duration<double, std::nano>(end - start).count() / frames;
+
+            const Engine::GeometryStats& stats = Engine::main3dSpr.getGeometryStats();
+            printf("%-7s %8.1f %6u %8.1f %8.1f %8.1f %8.1f %8u %8.0f\n", policies[policy],
+                   (double) quads / frames, stats.maxQuads, (double) over / frames,
+                   (double) stats.emptySkipped / frames, (double) stats.dropped / frames,
+                   (double) stats.droppedSprites / frames, stats.warnings, ns);
+        }
+        Engine::main3dSpr.setSkipEmptyQuads(true);
+        Engine::main3dSpr.setQuadBudget(Engine::kMaxQuads);
+
+        for (int i = 0; i < decoCount + bulletCount; i++)
+            delete sprites[i];
+        delete[] sprites;
+        return 0;
+    }
+
+    u8 expand5(u16 color, int shift) {
+        u8 c = (color >> shift) & 0x1F;
+        return (c << 3) | (c >> 2);
+    }
+
+    // Textured quads drawn since the log was cleared, decoded the way the
+    // geometry engine reads them, at their place relative to the first one
+    int decodeDrawn4x4(u16* image, u16 width, u16 height) {
+        u32 texFormat = 0, palBase = 0;
+        int quads = 0;
+        s16 originX = 0, originY = 0;
+        for (u32 i = 0; i < Host::gfx.count; i++) {
+            u8 command = Host::gfx.commands[i];
+            if (command == Host::GFX_CMD_TEXIMAGE_PARAM)
+                texFormat = Host::gfx.params[i];
+            else if (command == Host::GFX_CMD_PLTT_BASE)
+                palBase = Host::gfx.params[i];
+            if (command != Host::GFX_CMD_VTX_16 || Host::gfx.commands[i - 1] == Host::GFX_CMD_VTX_16)
+                continue;
+            if (((texFormat >> 26) & 7) != 5)
+                continue;
+            // Top left corner first, drawn at scale 1
+            s16 x = Host::gfx.params[i] & 0xFFFF, y = Host::gfx.params[i] >> 16;
+            if (quads++ == 0) {
+                originX = x;
+                originY = y;
+            }
+            u16 quadWidth = 8 << ((texFormat >> 20) & 7), quadHeight = 8 << ((texFormat >> 23) & 7);
+            u32 texAddr = (texFormat & 0xFFFF) * 8;
+            auto* decoded = new u16[quadWidth * quadHeight];
+            Host::decode4x4((u8*) VRAM_B + texAddr, (u8*) VRAM_D + texAddr / 2,
+                            &VRAM_E[palBase * 8], quadWidth, quadHeight, decoded);
+            for (int qy = 0; qy < quadHeight; qy++) {
+                for (int qx = 0; qx < quadWidth; qx++) {
+                    int px = x - originX + qx, py = y - originY + qy;
+                    if (px < width && py < height)
+                        image[py * width + px] = decoded[qy * quadWidth + qx];
+                }
+            }
+            delete[] decoded;
+        }
+        return quads;
+    }
+
+    // 4x4 compressed sprite sheet through the runtime path, checked
+    // against the encoder's reference pixels
+    int runTexture4x4(int argc, char** argv) {
+        if (argc < 1) {
+            fprintf(stderr, "tex4x4: usage tex4x4 <cspr> [<rgba>], see tools/cspr4x4.py\n");
+            return 1;
+        }
+        char rgbaPath[512];
+        if (argc > 1)
+            snprintf(rgbaPath, sizeof(rgbaPath), "%s", argv[1]);
+        else {
+            snprintf(rgbaPath, sizeof(rgbaPath), "%s", argv[0]);
+            char* ext = strrchr(rgbaPath, '.');
+            if (ext != nullptr)
+                *ext = 0;
+            strncat(rgbaPath, ".rgba", sizeof(rgbaPath) - strlen(rgbaPath) - 1);
+        }
+
+        Engine::Texture texture;
+        FILE* f = fopen(argv[0], "rb");
+        if (f == nullptr || texture.loadCSPR(f) != 0) {
+            fprintf(stderr, "tex4x4: can't load %s\n", argv[0]);
+            if (f != nullptr)
+                fclose(f);
+            return 1;
+        }
+        fclose(f);
+        u16 width, height;
+        texture.getSize(width, height);
+        u8 tileWidth, tileHeight;
+        texture.getSizeTiles(tileWidth, tileHeight);
+
+        // Every frame, stacked
+        u32 frameTexels = width * height;
+        f = fopen(rgbaPath, "rb");
+        if (f == nullptr) {
+            fprintf(stderr, "tex4x4: can't open %s\n", rgbaPath);
+            return 1;
+        }
+        fseek(f, 0, SEEK_END);
+        int frameCount = ftell(f) / (frameTexels * 4);
+        fseek(f, 0, SEEK_SET);
+        auto* reference = new u8[frameTexels * 4 * frameCount];
+        fread(reference, frameTexels * 4, frameCount, f);
+        fclose(f);
+
+        Engine::main3dSpr.setTextureCacheEnabled(false);
+        Engine::Sprite sprite(Engine::Allocated3D);
+        sprite.loadTexture(texture);
+        sprite._wx = 16 << 8;
+        sprite._wy = 16 << 8;
+        sprite._cAnimation = -1;  // Frames picked below
+        sprite.setShown(true);
+
+        // Slot 1 unmapped: the sprite waits
+        uploadTextures();
+        Host::gfx.count = 0;
+        Engine::main3dSpr.draw();
+        Engine::main3dSpr.waitDraw();
+        int quadsOff = 0;
+        for (u32 i = 0; i < Host::gfx.count; i++)
+            quadsOff += Host::gfx.commands[i] == Host::GFX_CMD_VTX_16;
+
+        if (!Engine::main3dSpr.setCompressedTextures(true)) {
+            fprintf(stderr, "tex4x4: can't take VRAM_D for slot 1\n");
+            return 1;
+        }
+        uploadTextures();
+        u32 slot0Bytes = Engine::main3dSpr.getTileBytesUsed();
+        u32 paletteBytes = Engine::main3dSpr.getPaletteBytesUsed();
+
+        // Error over the opaque reference pixels, 8 bit channels
+        auto* image = new u16[frameTexels];
+        u64 squaredError = 0, samples = 0;
+        u32 alphaErrors = 0, quadsDrawn = 0;
+        for (int frame = 0; frame < frameCount; frame++) {
+            sprite._cFrame = frame;
+            memset(image, 0, frameTexels * 2);
+            Host::gfx.count = 0;
+            Engine::main3dSpr.draw();
+            Engine::main3dSpr.waitDraw();
+            quadsDrawn += decodeDrawn4x4(image, width, height);
+
+            const u8* ref = reference + frame * frameTexels * 4;
+            for (u32 i = 0; i < frameTexels; i++) {
+                bool opaque = image[i] & 0x8000;
+                if (opaque != (ref[i * 4 + 3] != 0)) {
+                    alphaErrors++;
+                    continue;
+                }
+                if (!opaque)
+                    continue;
+                for (int channel = 0; channel < 3; channel++) {
+                    int diff = expand5(image[i], channel * 5) - ref[i * 4 + channel];
+                    squaredError += diff * diff;
+                    samples++;
+                }
+            }
+        }
+
+        u32 directBytes = tileWidth * tileHeight * 128 * frameCount;
+        printf("%-9s %6s %8s %8s %8s %8s %9s %6s %6s %8s\n", "size", "frames", "slot 0", "slot 1",
+               "palette", "direct", "psnr", "alpha", "quads", "slot off");
+        char size[16], psnr[16];
+        snprintf(size, sizeof(size), "%ux%u", width, height);
+        if (squaredError == 0)
+            snprintf(psnr, sizeof(psnr), "lossless");
+        else
+            snprintf(psnr, sizeof(psnr), "%.2f dB", 10 * log10(255.0 * 255.0 * samples / squaredError));
+        printf("%-9s %6u %8u %8u %8u %8u %9s %6u %6u %8d\n", size, frameCount, slot0Bytes,
+               slot0Bytes / 2, paletteBytes, directBytes, psnr, alphaErrors, quadsDrawn, quadsOff);
+
+        sprite.setShown(false);
+        Engine::main3dSpr.setCompressedTextures(false);
+        Engine::main3dSpr.setTextureCacheEnabled(true);
+        delete[] image;
+        delete[] reference;
+        return 0;
+    }
+
+    // Small deterministic generator, so both allocators see the same ops
+    struct XorShift {
+        u32 state;
+        u32 next() {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            return state;
+        }
+    };
+
+    struct ZoneAllocation {
+        u32 start, length;
+        u32 alignment = 1;
+    };
+
+    struct ZoneFuzzStats {
+        u32 reserves = 0, failed = 0, errors = 0;
+        u32 maxFreeZones = 0;
+    };
+
+    const u16 kAlignments[] = {1, 2, 8, 16, 32};
+
+    // Whether some aligned run of length free units exists, the answer
+    // fits() must give
+    bool shadowFits(const u8* used, int rangeStart, int rangeLength, u16 length, u16 alignment) {
+        int run = 0;
+        for (int unit = rangeStart; unit < rangeStart + rangeLength; unit++) {
+            run = used[unit] ? 0 : run + 1;
+            int start = unit + 1 - length;
+            if (run >= length && start % alignment == 0)
+                return true;
+        }
+        return false;
+    }
+
+    // Random reserves and frees checked against a map of the reserved
+    // units: in range, aligned, no overlap, fits() exact, and a single
+    // zone again once everything is freed. Zones are unit times the
+    // range, lengths and alignments given.
+    template <class Zones, class Offset>
+    ZoneFuzzStats fuzzZones(Zones& zones, int rangeStart, int rangeLength, u32 unit, u32 ops, u32 seed) {
+        ZoneFuzzStats stats;
+        auto* used = new u8[rangeStart + rangeLength]();
+        std::vector<ZoneAllocation> live;
+        XorShift rng = {seed};
+        for (u32 op = 0; op < ops; op++) {
+            u32 roll = rng.next();
+            if (!live.empty() && (roll % 8 < 3 || live.size() >= 20)) {
+                u32 idx = rng.next() % live.size();
+                ZoneAllocation allocation = live[idx];
+                live[idx] = live.back();
+                live.pop_back();
+                zones.free(allocation.length * unit, allocation.start * unit);
+                memset(used + allocation.start, 0, allocation.length);
+                continue;
+            }
+
+            // Mostly small, sometimes a whole sheet
+            u16 length = (roll >> 8) % 16 == 0 ? 1 + rng.next() % 512 : 1 + rng.next() % 48;
+            u16 alignment = kAlignments[rng.next() % 5];
+            stats.reserves++;
+            bool fits = zones.fits(length * unit, alignment * unit);
+            if (fits != shadowFits(used, rangeStart, rangeLength, length, alignment))
+                stats.errors++;
+            if (!fits) {
+                stats.failed++;
+                continue;
+            }
+            Offset start;
+            if (zones.reserve(length * unit, start, alignment * unit) != 0 || start % unit != 0) {
+                stats.errors++;
+                continue;
+            }
+            int first = start / unit;
+            bool inRange = first >= rangeStart && first + length <= rangeStart + rangeLength;
+            if (!inRange || first % alignment != 0) {
+                stats.errors++;
+                continue;
+            }
+            for (int i = first; i < first + length; i++) {
+                stats.errors += used[i];
+                used[i] = 1;
+            }
+            live.push_back({(u32) first, length});
+            stats.maxFreeZones = std::max<u32>(stats.maxFreeZones, zones.getFreeZoneCount());
+        }
+
+        for (const ZoneAllocation& allocation : live)
+            zones.free(allocation.length * unit, allocation.start * unit);
+        Offset start;
+        if (zones.getFreeZoneCount() != 1 || zones.reserve(rangeLength * unit, start, 1) != 0 ||
+                start != rangeStart * unit)
+            stats.errors++;
+        else
+            zones.free(rangeLength * unit, start);
+        delete[] used;
+        return stats;
+    }
+
+    struct CompactFuzz {
+        u8* used;
+        std::vector<ZoneAllocation>* live;
+        u32 moves = 0, errors = 0;
+    };
+
+    // Moves the allocation in the map, checking it goes down, aligned,
+    // into units nothing uses
+    bool fuzzRelocate(void* context, u32 start, u32 newStart, u32 length) {
+        auto* fuzz = (CompactFuzz*) context;
+        for (ZoneAllocation& allocation : *fuzz->live) {
+            if (allocation.start != start)
+                continue;
+            if (allocation.length != length || newStart >= start || newStart % allocation.alignment != 0)
+                fuzz->errors++;
+            memset(fuzz->used + start, 0, length);
+            for (u32 i = newStart; i < newStart + length; i++) {
+                fuzz->errors += fuzz->used[i];
+                fuzz->used[i] = 1;
+            }
+            allocation.start = newStart;
+            fuzz->moves++;
+            return true;
+        }
+        fuzz->errors++;
+        return false;
+    }
+
+    // Same traffic, compacting a bit after every op and all the way when
+    // a reservation fails with enough free units. Counts the failures
+    // compaction saved as reserves that didn't fail.
+    ZoneFuzzStats fuzzCompaction(Engine::FreeZoneManager& zones, int rangeStart, int rangeLength, u32 ops,
+                                 u32 seed, u32& moves) {
+        ZoneFuzzStats stats;
+        auto* used = new u8[rangeStart + rangeLength]();
+        std::vector<ZoneAllocation> live;
+        CompactFuzz fuzz = {used, &live};
+        zones.setRelocator(fuzzRelocate, &fuzz);
+        XorShift rng = {seed};
+        for (u32 op = 0; op < ops; op++) {
+            u32 roll = rng.next();
+            if (zones.getFragmentation() >= Engine::kCompactFragmentationPercent)
+                zones.compact(16);
+            if (!live.empty() && (roll % 8 < 3 || live.size() >= 20)) {
+                u32 idx = rng.next() % live.size();
+                ZoneAllocation allocation = live[idx];
+                live[idx] = live.back();
+                live.pop_back();
+                zones.free(allocation.length, allocation.start);
+                memset(used + allocation.start, 0, allocation.length);
+                continue;
+            }
+
+            u16 length = (roll >> 8) % 16 == 0 ? 1 + rng.next() % 512 : 1 + rng.next() % 48;
+            u16 alignment = kAlignments[rng.next() % 5];
+            stats.reserves++;
+            if (!zones.fits(length, alignment) && zones.getFreeLength() >= u32(length) + alignment - 1)
+                zones.compact(rangeLength);
+            bool fits = zones.fits(length, alignment);
+            if (fits != shadowFits(used, rangeStart, rangeLength, length, alignment))
+                stats.errors++;
+            u32 start;
+            if (!fits || zones.reserve(length, start, alignment) != 0) {
+                stats.failed++;
+                continue;
+            }
+            bool inRange = (int) start >= rangeStart && (int) (start + length) <= rangeStart + rangeLength;
+            if (!inRange || start % alignment != 0) {
+                stats.errors++;
+                continue;
+            }
+            for (u32 i = start; i < start + length; i++) {
+                stats.errors += used[i];
+                used[i] = 1;
+            }
+            live.push_back({start, length, alignment});
+            stats.maxFreeZones = std::max<u32>(stats.maxFreeZones, zones.getFreeZoneCount());
+        }
+
+        // Compacted all the way, what's free is one zone at the end
+        zones.compact(rangeLength);
+        u32 usedLength = 0;
+        for (const ZoneAllocation& allocation : live)
+            usedLength += allocation.length;
+        if (zones.getFreeLength() != (u32) rangeLength - usedLength)
+            stats.errors++;
+        for (const ZoneAllocation& allocation : live)
+            zones.free(allocation.length, allocation.start);
+        if (zones.getFreeZoneCount() != 1 || zones.getLargestFree() != (u32) rangeLength)
+            stats.errors++;
+        zones.setRelocator(nullptr, nullptr);
+        stats.errors += fuzz.errors;
+        moves = fuzz.moves;
+        delete[] used;
+        return stats;
+    }
+
+    // Sprite3DManager's traffic: texture sheets of 8 byte aligned quads
+    // coming and going in the 3D tile range, evicting until they fit
+    template <class Zones, class Offset>
+    double benchZones(Zones& zones, u32 ops, u32 seed, u32& failed) {
+        std::vector<ZoneAllocation> live;
+        XorShift rng = {seed};
+        failed = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (u32 op = 0; op < ops; op++) {
+            u16 length = 64 << (rng.next() % 6);
+            Offset tileStart;
+            while (!zones.fits(length, 8) && !live.empty()) {
+                u32 idx = rng.next() % live.size();
+                zones.free(live[idx].length, live[idx].start);
+                live[idx] = live.back();
+                live.pop_back();
+            }
+            if (zones.reserve(length, tileStart, 8) != 0) {
+                failed++;
+                continue;
+            }
+            live.push_back({tileStart, length});
+            if (rng.next() % 4 == 0) {
+                u32 idx = rng.next() % live.size();
+                zones.free(live[idx].length, live[idx].start);
+                live[idx] = live.back();
+                live.pop_back();
+            }
+        }
+        auto end = std::chrono::steady_clock::now();
+        for (const ZoneAllocation& allocation : live)
+            zones.free(allocation.length, allocation.start);
+        return std::chrono::duration<double, std::nano>(end - start).count() / ops;
+    }
+
+    int runZones(int argc, char** argv) {
+        u32 ops = argInt(argc, argv, 0, 200000);
+        u32 seed = argInt(argc, argv, 1, 1);
+        if (seed == 0)
+            seed = 1;
+
+        // OAM tiles' range, starting past tile 0
+        const int fuzzStart = 1, fuzzLength = 1023;
+        Engine::FreeZoneManager zones(fuzzStart, fuzzLength, "FUZZ");
+        Host::LegacyFreeZoneManager legacyZones(fuzzStart, fuzzLength, "FUZZ_LEGACY");
+        ZoneFuzzStats stats = fuzzZones<Engine::FreeZoneManager, u32>(zones, fuzzStart, fuzzLength, 1, ops, seed);
+        ZoneFuzzStats legacyStats = fuzzZones<Host::LegacyFreeZoneManager, u16>(legacyZones, fuzzStart, fuzzLength,
+                                                                                1, ops, seed);
+        // Texture slots 0 and 1 in 256 byte units, past what u16 offsets reach
+        Engine::FreeZoneManager wideZones(fuzzStart * 256, fuzzLength * 256, "FUZZ_WIDE");
+        ZoneFuzzStats wideStats = fuzzZones<Engine::FreeZoneManager, u32>(wideZones, fuzzStart, fuzzLength, 256,
+                                                                          ops, seed);
+
+        Engine::FreeZoneManager compactZones(fuzzStart, fuzzLength, "FUZZ_COMPACT");
+        u32 moves;
+        ZoneFuzzStats compactStats = fuzzCompaction(compactZones, fuzzStart, fuzzLength, ops, seed, moves);
+
+        printf("%-8s %8s %8s %8s %10s %7s %8s\n", "fuzz", "ops", "reserves", "failed", "max zones", "errors",
+               "moves");
+        printf("%-8s %8u %8u %8u %10u %7u\n", "size cls", ops, stats.reserves, stats.failed,
+               stats.maxFreeZones, stats.errors);
+        printf("%-8s %8u %8u %8u %10u %7u\n", "legacy", ops, legacyStats.reserves, legacyStats.failed,
+               legacyStats.maxFreeZones, legacyStats.errors);
+        printf("%-8s %8u %8u %8u %10u %7u\n", "x256", ops, wideStats.reserves, wideStats.failed,
+               wideStats.maxFreeZones, wideStats.errors);
+        printf("%-8s %8u %8u %8u %10u %7u %8u\n", "compact", ops, compactStats.reserves, compactStats.failed,
+               compactStats.maxFreeZones, compactStats.errors, moves);
+
+        Engine::FreeZoneManager tileZones(0, 65536 - 8, "BENCH", 1024);
+        Host::LegacyFreeZoneManager legacyTileZones(0, 65536 - 8, "BENCH_LEGACY");
+        u32 failed, legacyFailed;
+        double ns = benchZones<Engine::FreeZoneManager, u32>(tileZones, ops, seed, failed);
+        double legacyNs = benchZones<Host::LegacyFreeZoneManager, u16>(legacyTileZones, ops, seed, legacyFailed);
+        printf("\n%-8s %8s %8s %8s\n", "bench", "ops", "ns/op", "failed");
+        printf("%-8s %8u %8.1f %8u\n", "size cls", ops, ns, failed);
+        printf("%-8s %8u %8.1f %8u\n", "legacy", ops, legacyNs, legacyFailed);
+
+        return stats.errors + legacyStats.errors + wideStats.errors + compactStats.errors != 0;
+    }
+
+    const u8* hostTextureVram(u32 texAddr) {
+        if (texAddr < Engine::kTextureSlotBytes)
+            return (const u8*) VRAM_B + texAddr;
+        return (const u8*) VRAM_D + texAddr - Engine::kTextureSlotBytes;
+    }
+
+    const int kMaxDrawnSheets = 48;
+
+    struct DrawnSheet {
+        u16 width, height;
+        u8 frameCount, colorCount;
+        s16 top, bottom;  // Screen rows its quads start in
+        s16 left = 0, right = 256;  // And columns
+        u8 shown = 0;  // Frame
+        u32 quads = 0, checked = 0, mismatches = 0;
+        bool slot1 = false;
+    };
+
+    // Compares the paletted quads drawn for each sheet with the pixels the
+    // synthetic generator wrote, texel by texel from VRAM
+    void checkDrawnSheets(DrawnSheet* sheets, int sheetCount) {
+        u32 texFormat = 0;
+        s16 originX[kMaxDrawnSheets], originY[kMaxDrawnSheets];
+        for (int sheet = 0; sheet < sheetCount; sheet++) {
+            originX[sheet] = 0x7FFF;
+            originY[sheet] = 0x7FFF;
+        }
+        for (int pass = 0; pass < 2; pass++) {
+            for (u32 i = 0; i < Host::gfx.count; i++) {
+                u8 command = Host::gfx.commands[i];
+                if (command == Host::GFX_CMD_TEXIMAGE_PARAM)
+                    texFormat = Host::gfx.params[i];
+                if (command != Host::GFX_CMD_VTX_16 || Host::gfx.commands[i - 1] == Host::GFX_CMD_VTX_16)
+                    continue;
+                s16 x = Host::gfx.params[i] & 0xFFFF, y = Host::gfx.params[i] >> 16;
+                int sheetIdx = 0;
+                while (sheetIdx < sheetCount && (y < sheets[sheetIdx].top || y >= sheets[sheetIdx].bottom ||
+                                                  x < sheets[sheetIdx].left || x >= sheets[sheetIdx].right))
+                    sheetIdx++;
+                if (sheetIdx == sheetCount)
+                    continue;
+                if (pass == 0) {
+                    // Top left quad first
+                    originX[sheetIdx] = std::min(originX[sheetIdx], x);
+                    originY[sheetIdx] = std::min(originY[sheetIdx], y);
+                    continue;
+                }
+
+                DrawnSheet& sheet = sheets[sheetIdx];
+                sheet.quads++;
+                u16 quadWidth = 8 << ((texFormat >> 20) & 7), quadHeight = 8 << ((texFormat >> 23) & 7);
+                u32 texAddr = (texFormat & 0xFFFF) * 8;
+                bool color8bit = ((texFormat >> 26) & 7) == 4;
+                sheet.slot1 |= texAddr >= Engine::kTextureSlotBytes;
+                const u8* texels = hostTextureVram(texAddr);
+                for (int qy = 0; qy < quadHeight; qy++) {
+                    for (int qx = 0; qx < quadWidth; qx++) {
+                        u32 texel = qy * quadWidth + qx;
+                        u8 pixel = color8bit ? texels[texel] : (texels[texel / 2] >> (4 * (texel & 1))) & 0xF;
+                        int px = x - originX[sheetIdx] + qx, py = y - originY[sheetIdx] + qy;
+                        u8 expected = Host::syntheticPixel(sheet.width, sheet.height, sheet.frameCount,
+                                                           sheet.colorCount, px, py, sheet.shown);
+                        sheet.checked++;
+                        sheet.mismatches += pixel != expected;
+                    }
+                }
+            }
+        }
+    }
+
+    // Sheets past 64KB of VRAM: one filling texture slot 0, one that only
+    // fits in slot 1 next to the 4x4 index words, then slot 1 given back
+    int runBigSheet(int argc, char** argv) {
+        int uploads = argInt(argc, argv, 0, 64);
+        u16 colors[64];
+        for (int i = 0; i < 64; i++)
+            colors[i] = Host::syntheticColor(i);
+
+        Engine::main3dSpr.setTextureCacheEnabled(false);
+        if (!Engine::main3dSpr.setCompressedTextures(true)) {
+            fprintf(stderr, "bigsheet: can't take VRAM_D for slot 1\n");
+            return 1;
+        }
+        // 256x128 8bpp x4 is all of slot 0, tile by tile (v4)
+        DrawnSheet sheets[2] = {{256, 128, 4, 32, 0, 128}, {64, 64, 12, 20, 128, 192}};
+        Engine::Texture textures[2];
+        Engine::Sprite* sprites[2];
+        for (int i = 0; i < 2; i++) {
+            Host::loadSyntheticTexture(textures[i], sheets[i].width, sheets[i].height, sheets[i].frameCount,
+                                       colors, sheets[i].colorCount, i == 0 ? 4 : 5);
+            sprites[i] = new Engine::Sprite(Engine::Allocated3D);
+            sprites[i]->loadTexture(textures[i]);
+            sprites[i]->_wx = 0;
+            sprites[i]->_wy = sheets[i].top << 8;
+            sprites[i]->_cAnimation = -1;  // Frames picked below
+            sprites[i]->setShown(true);
+        }
+
+        printf("%-6s %10s %8s %6s %6s %8s %6s\n", "sheet", "size", "bytes", "slot 1", "quads", "texels",
+               "wrong");
+        auto check = [&](const char* step, int sheetCount) {
+            for (int i = 0; i < uploads; i++)
+                uploadTextures();
+            for (int i = 0; i < sheetCount; i++) {
+                sheets[i].quads = sheets[i].checked = sheets[i].mismatches = 0;
+                sheets[i].slot1 = false;
+            }
+            for (int frame = 0; frame < 12; frame++) {
+                for (int i = 0; i < sheetCount; i++) {
+                    sheets[i].shown = frame % sheets[i].frameCount;
+                    sprites[i]->_cFrame = sheets[i].shown;
+                }
+                Host::gfx.count = 0;
+                Engine::main3dSpr.draw();
+                Engine::main3dSpr.waitDraw();
+                checkDrawnSheets(sheets, sheetCount);
+            }
+
+            u32 mismatches = 0;
+            for (int i = 0; i < sheetCount; i++) {
+                char label[16], size[16];
+                snprintf(label, sizeof(label), "%s %d", step, i);
+                snprintf(size, sizeof(size), "%ux%ux%u", sheets[i].width, sheets[i].height,
+                         sheets[i].frameCount);
+                u32 bytes = sheets[i].width * sheets[i].height * sheets[i].frameCount;
+                if (sheets[i].colorCount < 16)
+                    bytes /= 2;
+                printf("%-6s %10s %8u %6s %6u %8u %6u\n", label, size, bytes, sheets[i].slot1 ? "yes" : "no",
+                       sheets[i].quads, sheets[i].checked, sheets[i].mismatches);
+                mismatches += sheets[i].mismatches + (sheets[i].checked == 0);
+            }
+            return mismatches;
+        };
+
+        u32 mismatches = check("on", 2);
+        // Slot 1 back to the sub screen: the second sheet moves to slot 0
+        sprites[0]->setShown(false);
+        Engine::main3dSpr.setCompressedTextures(false);
+        std::swap(sheets[0], sheets[1]);
+        std::swap(sprites[0], sprites[1]);
+        mismatches += check("off", 1);
+
+        for (auto* sprite : sprites)
+            delete sprite;
+        Engine::main3dSpr.setTextureCacheEnabled(true);
+        return mismatches != 0;
+    }
+
+    struct DefragStats {
+        u32 late3D = 0, late2D = 0;  // Sprite frames shown but not drawn
+        u32 stuck3D = 0, stuck2D = 0;  // Still not drawn at the end of a round
+        u8 maxFragmentation3D = 0, maxFragmentation2D = 0;
+        u32 checked3D = 0, wrong3D = 0, checked2D = 0, wrong2D = 0;
+        u32 moved3D = 0;
+    };
+
+    // OAM entry sizes in tiles by shape and size
+    const u8 kOamEntryTiles[3][4][2] = {
+        {{1, 1}, {2, 2}, {4, 4}, {8, 8}},
+        {{2, 1}, {4, 1}, {4, 2}, {8, 4}},
+        {{1, 2}, {1, 4}, {2, 4}, {4, 8}},
+    };
+
+    // Compares the sub screen sprites the hardware shows with the pixels
+    // the synthetic generator wrote, through OAM, tiles and palette.
+    // Sprites sit far enough apart that entry positions tell them apart.
+    // Returns the sprites with an entry on screen.
+    u32 checkShownOam(Engine::Sprite** sprites, const DrawnSheet* specs, int spriteCount, const u16* colors,
+                      u32& checked, u32& wrong) {
+        u32 shown = 0;
+        for (int oamId = 0; oamId < SPRITE_COUNT; oamId++) {
+            const u16* attrs = &OAM_SUB[oamId * 4];
+            // Tile 0 is never handed out, entries never used point there
+            if ((attrs[0] & (1 << 9)) || (attrs[2] & 0x3FF) == 0)
+                continue;
+            int entryX = attrs[1] & 0x1FF, entryY = attrs[0] & 0xFF;
+            const u8* size = kOamEntryTiles[attrs[0] >> 14][attrs[1] >> 14];
+            const u8* tiles = (const u8*) SPRITE_GFX_SUB + (attrs[2] & 0x3FF) * 64;
+            for (int i = 0; i < spriteCount; i++) {
+                if (sprites[i] == nullptr)
+                    continue;
+                int offsetX = entryX - (sprites[i]->_wx >> 8), offsetY = entryY - (sprites[i]->_wy >> 8);
+                if (offsetX < 0 || offsetY < 0 || offsetX % 64 != 0 || offsetY % 64 != 0 ||
+                        offsetX >= specs[i].width || offsetY >= specs[i].height)
+                    continue;
+                shown |= 1 << i;
+                for (int py = 0; py < size[1] * 8; py++) {
+                    for (int px = 0; px < size[0] * 8; px++) {
+                        u8 slot = tiles[((py / 8) * size[0] + px / 8) * 64 + (py % 8) * 8 + px % 8];
+                        int x = offsetX + px, y = offsetY + py;
+                        u8 expected = 0;
+                        if (x < specs[i].width && y < specs[i].height)
+                            expected = Host::syntheticPixel(specs[i].width, specs[i].height, specs[i].frameCount,
+                                                            specs[i].colorCount, x, y, specs[i].shown);
+                        checked++;
+                        if (expected == 0)
+                            wrong += slot != 0;
+                        else
+                            wrong += slot == 0 || SPRITE_PALETTE_SUB[slot] != colors[expected - 1];
+                    }
+                }
+                break;
+            }
+        }
+        return shown;
+    }
+
+    const int kDefragCells = 48, kDefragSubSprites = 14, kDefragFrames = 8;
+
+    // Sprites of random sizes coming and going in a grid of 32x32 cells on
+    // the main screen and a fan of sub screen sprites, so free VRAM ends up
+    // in pieces. Shown sprites that aren't drawn wait for space, or for
+    // their frames to stream in.
+    DefragStats runDefragPass(int rounds, bool compaction, const u16* colors) {
+        DefragStats stats;
+        Engine::main3dSpr.setCompactionEnabled(compaction);
+        Engine::OAMManagerSub.setCompactionEnabled(compaction);
+        Engine::main3dSpr.resetCacheStats();
+        Engine::main3dSpr.resetZoneStats();
+        Engine::OAMManagerSub.resetZoneStats();
+        XorShift rng = {12345};
+
+        const int cells = kDefragCells, subSprites = kDefragSubSprites;
+        DrawnSheet specs3D[cells], specs2D[subSprites];
+        Engine::Texture* textures[cells + subSprites] = {nullptr};
+        Engine::Sprite* sprites[cells + subSprites] = {nullptr};
+        Engine::Sprite** sprites2D = sprites + cells;
+        auto replace = [&](int i) {
+            delete sprites[i];
+            delete textures[i];
+            bool sub = i >= cells;
+            DrawnSheet& spec = sub ? specs2D[i - cells] : specs3D[i];
+            if (sub) {
+                const u16 sizes[] = {16, 32, 64, 128};
+                spec = {sizes[rng.next() % 4], sizes[rng.next() % 4], 2, 16, 0, 0};
+            } else {
+                const u16 sizes[] = {16, 32};
+                const u8 frameCounts[] = {2, 4, 8, 8};
+                spec = {sizes[rng.next() % 2], sizes[rng.next() % 2], frameCounts[rng.next() % 4],
+                        (u8) (rng.next() % 2 ? 40 : 8), 0, 0};
+                spec.left = (i % 8) * 32;
+                spec.top = (i / 8) * 32;
+                spec.right = spec.left + 32;
+                spec.bottom = spec.top + 32;
+            }
+            textures[i] = new Engine::Texture;
+            Host::loadSyntheticTexture(*textures[i], spec.width, spec.height, spec.frameCount, colors,
+                                       spec.colorCount, sub ? 4 : 5);
+            sprites[i] = new Engine::Sprite(sub ? Engine::AllocatedOAM : Engine::Allocated3D);
+            sprites[i]->loadTexture(*textures[i]);
+            sprites[i]->_wx = (sub ? (i - cells) * 4 : spec.left) << 8;
+            sprites[i]->_wy = (sub ? (i - cells) * 3 : spec.top) << 8;
+            sprites[i]->setShown(true);
+        };
+        for (int i = 0; i < cells + subSprites; i++)
+            replace(i);
+
+        for (int round = 0; round < rounds; round++) {
+            for (int i = 0; i < 6; i++)
+                replace(rng.next() % cells);
+            for (int i = 0; i < 3; i++)
+                replace(cells + rng.next() % subSprites);
+            for (int frame = 0; frame < kDefragFrames; frame++) {
+                for (int i = 0; i < cells + subSprites; i++) {
+                    DrawnSheet& spec = i < cells ? specs3D[i] : specs2D[i - cells];
+                    spec.shown = round % spec.frameCount;
+                    sprites[i]->_cAnimation = -1;
+                    sprites[i]->_cFrame = spec.shown;
+                }
+                Host::gfx.count = 0;
+                Engine::main3dSpr.draw();
+                Engine::main3dSpr.waitDraw();
+                Engine::OAMManagerSub.draw();
+                // V-blank, then the frame rendered from what's in VRAM
+                Engine::OAMManagerSub.flush();
+                Engine::main3dSpr.updateTextures();
+                Engine::vblankQueue.drain();
+
+                for (auto& spec : specs3D)
+                    spec.quads = spec.checked = spec.mismatches = 0;
+                checkDrawnSheets(specs3D, cells);
+                bool last = frame == kDefragFrames - 1;
+                for (const auto& spec : specs3D) {
+                    stats.late3D += spec.quads == 0;
+                    stats.stuck3D += last && spec.quads == 0;
+                    stats.checked3D += spec.checked;
+                    stats.wrong3D += spec.mismatches;
+                }
+                u32 shown = checkShownOam(sprites2D, specs2D, subSprites, colors, stats.checked2D, stats.wrong2D);
+                stats.late2D += subSprites - __builtin_popcount(shown);
+                stats.stuck2D += last ? subSprites - __builtin_popcount(shown) : 0;
+            }
+            stats.maxFragmentation3D = std::max(stats.maxFragmentation3D,
+                                                Engine::main3dSpr.getTileFragmentation());
+            stats.maxFragmentation2D = std::max(stats.maxFragmentation2D,
+                                                Engine::OAMManagerSub.getTileFragmentation());
+        }
+        stats.moved3D = Engine::main3dSpr.getCacheStats().compactedBytes;
+        Engine::main3dSpr.dumpZoneStats();
+        Engine::OAMManagerSub.dumpZoneStats();
+
+        for (int i = 0; i < cells + subSprites; i++) {
+            delete sprites[i];
+            delete textures[i];
+        }
+        Engine::vblankQueue.flush();
+        return stats;
+    }
+
+    int runDefrag(int argc, char** argv) {
+        int rounds = argInt(argc, argv, 0, 200);
+        u16 colors[64];
+        for (int i = 0; i < 64; i++)
+            colors[i] = Host::syntheticColor(i);
+        // Parked textures would hide fragmentation behind evictions
+        Engine::main3dSpr.setTextureCacheEnabled(false);
+        Engine::main3dSpr.setSkipEmptyQuads(false);
+
+        printf("%-8s %6s %8s %6s %8s %8s %8s %10s %6s\n", "compact", "screen", "sprites", "late", "stuck",
+               "max frag", "moved", "texels", "wrong");
+        u32 wrong = 0;
+        for (int compaction = 0; compaction < 2; compaction++) {
+            DefragStats stats = runDefragPass(rounds, compaction == 1, colors);
+            const char* label = compaction ? "on" : "off";
+            printf("%-8s %6s %8u %6u %8u %7u%% %8u %10u %6u\n", label, "main",
+                   rounds * kDefragFrames * kDefragCells, stats.late3D, stats.stuck3D, stats.maxFragmentation3D,
+                   stats.moved3D, stats.checked3D, stats.wrong3D);
+            printf("%-8s %6s %8u %6u %8u %7u%% %8s %10u %6u\n", label, "sub",
+                   rounds * kDefragFrames * kDefragSubSprites, stats.late2D, stats.stuck2D,
+                   stats.maxFragmentation2D, "-", stats.checked2D, stats.wrong2D);
+            wrong += stats.wrong3D + stats.wrong2D;
+        }
+
+        Engine::main3dSpr.setSkipEmptyQuads(true);
+        Engine::main3dSpr.setTextureCacheEnabled(true);
+        return wrong != 0;
+    }
+
+    // Sprite3DManager::packQuadFrames for a frame, into plain memory
+    template <Engine::PixelFormat Format>
+    void kernelPackQuad(const u8* tiles, u8 tileWidth, u8 tileHeight, int frame,
+                        u8 quadX, u8 quadY, u8 quadWidth, u8 quadHeight, u8* tileRamStart) {
+        const u32 tileRowWords = Format == Engine::PIXELS_8BPP ? 2 : 1;
+        auto* dst = (u32*) tileRamStart;
+        const u8* frameTiles = tiles + frame * tileWidth * tileHeight * 64;
+        for (int y = 0; y < quadHeight * 8; y++) {
+            const u8* src = frameTiles + ((quadY + y / 8) * tileWidth + quadX) * 64 + (y % 8) * 8;
+            for (int tileX = 0; tileX < quadWidth; tileX++, src += 64, dst += tileRowWords)
+                Engine::packPixels<Format>(src, dst, 8);
+        }
+    }
+
+    // Conversion kernels against the per-pixel loops they replaced, on
+    // random pixels, then v4 sheets drawn and read back from VRAM
+    int runPixels(int argc, char** argv) {
+        int rounds = argInt(argc, argv, 0, 2000);
+        const int checks = 64;
+        // 64x64 sheet of 4 frames as CSPR tiles, a byte per pixel
+        const u8 tileWidth = 8, tileHeight = 8, frames = 4;
+        const u32 tilePixels = tileWidth * tileHeight * 64 * frames;
+        XorShift rng = {2463534242u};
+
+        auto* tiles = new u8[tilePixels];
+        auto* packed = new u8[tilePixels / 2];  // 4bpp background tiles
+        u8 paletteColors[255];
+        auto* legacyOut = new u32[tilePixels / 4];
+        auto* kernelOut = new u32[tilePixels / 4];
+        u8 remap[256] = {0};
+
+        auto fill = [&](u8 maxIndex) {
+            for (u32 i = 0; i < tilePixels; i++)
+                tiles[i] = rng.next() % (maxIndex + 1);
+            for (u32 i = 0; i < tilePixels / 2; i++)
+                packed[i] = rng.next();
+            for (int i = 0; i < 255; i++) {
+                paletteColors[i] = rng.next();
+                remap[i + 1] = paletteColors[i];
+            }
+            // Whatever was in VRAM before, the same for both
+            for (u32 i = 0; i < tilePixels / 4; i++)
+                legacyOut[i] = kernelOut[i] = rng.next();
+        };
+        auto differing = [&](u32 bytes) {
+            return (u32) (memcmp(legacyOut, kernelOut, bytes) != 0);
+        };
+
+        struct Kernel {
+            const char* name;
+            u8 maxIndex;
+            u32 bytes;  // Written per run
+            bool zeroed;  // Destination cleared first, as buildFrameCache does
+            std::function<void()> legacy, kernel;
+        };
+        u32 tileCount = tilePixels / 64;
+        Kernel kernels[] = {
+            {"bg 4->8bpp", 255, tilePixels, false,
+             [&] { for (u32 t = 0; t < tileCount; t++)
+                       Host::legacyExpandTile(packed + t * 32, (u16*) legacyOut + t * 32); },
+             [&] { for (u32 t = 0; t < tileCount; t++)
+                       Engine::unpackPixels<Engine::PIXELS_4BPP>(packed + t * 32, kernelOut + t * 16, 64); }},
+            {"oam remap", 255, tilePixels, true,
+             [&] { for (u32 t = 0; t < tileCount; t++)
+                       Host::legacyRemapTile(tiles + t * 64, (u8*) legacyOut + t * 64, paletteColors); },
+             [&] { for (u32 t = 0; t < tileCount; t++)
+                       Engine::remapPixels(tiles + t * 64, kernelOut + t * 16, remap, 64); }},
+            {"3d 8bpp", 255, tilePixels, false,
+             [&] { for (int f = 0; f < frames; f++)
+                       Host::legacyPackQuad(tiles, tileWidth, tileHeight, f, 0, 0, tileWidth, tileHeight, true,
+                                            (u8*) legacyOut + f * 4096); },
+             [&] { for (int f = 0; f < frames; f++)
+                       kernelPackQuad<Engine::PIXELS_8BPP>(tiles, tileWidth, tileHeight, f, 0, 0, tileWidth,
+                                                           tileHeight, (u8*) kernelOut + f * 4096); }},
+            {"3d 4bpp", 15, tilePixels / 2, false,
+             [&] { for (int f = 0; f < frames; f++)
+                       Host::legacyPackQuad(tiles, tileWidth, tileHeight, f, 0, 0, tileWidth, tileHeight, false,
+                                            (u8*) legacyOut + f * 2048); },
+             [&] { for (int f = 0; f < frames; f++)
+                       kernelPackQuad<Engine::PIXELS_4BPP>(tiles, tileWidth, tileHeight, f, 0, 0, tileWidth,
+                                                           tileHeight, (u8*) kernelOut + f * 2048); }},
+        };
+
+        printf("%-12s %8s %14s %14s %8s %6s\n", "kernel", "pixels", "legacy ns/kpx", "kernel ns/kpx",
+               "speedup", "wrong");
+        u32 wrong = 0;
+        for (auto& k : kernels) {
+            u32 kernelWrong = 0;
+            for (int i = 0; i < checks; i++) {
+                fill(k.maxIndex);
+                if (k.zeroed) {
+                    memset(legacyOut, 0, k.bytes);
+                    memset(kernelOut, 0, k.bytes);
+                }
+                k.legacy();
+                k.kernel();
+                kernelWrong += differing(k.bytes);
+            }
+            double ns[2];
+            for (int pass = 0; pass < 2; pass++) {
+                auto start = std::chrono::steady_clock::now();
+                for (int i = 0; i < rounds; i++)
+                    (pass == 0 ? k.legacy : k.kernel)();
+                auto end = std::chrono::steady_clock::now();
+                ns[pass] = std::chrono::duration<double, std::nano>(end - start).count();
+            }
+            double kpx = (double) rounds * tilePixels / 1000;
+            printf("%-12s %8u %14.1f %14.1f %7.1fx %6u\n", k.name, tilePixels, ns[0] / kpx, ns[1] / kpx,
+                   ns[1] > 0 ? ns[0] / ns[1] : 0.0, kernelWrong);
+            wrong += kernelWrong;
+        }
+        delete[] tiles;
+        delete[] packed;
+        delete[] legacyOut;
+        delete[] kernelOut;
+
+        // CSPR v4 sheets go through Sprite3DManager::packQuadFrames
+        u16 colors[64];
+        for (int i = 0; i < 64; i++)
+            colors[i] = Host::syntheticColor(i);
+        Engine::main3dSpr.setTextureCacheEnabled(false);
+        DrawnSheet sheets[2] = {{64, 64, 4, 8, 0, 64}, {64, 64, 4, 40, 96, 160}};
+        Engine::Texture textures[2];
+        Engine::Sprite* sprites[2];
+        for (int i = 0; i < 2; i++) {
+            Host::loadSyntheticTexture(textures[i], sheets[i].width, sheets[i].height, sheets[i].frameCount,
+                                       colors, sheets[i].colorCount, 4);
+            sprites[i] = new Engine::Sprite(Engine::Allocated3D);
+            sprites[i]->loadTexture(textures[i]);
+            sprites[i]->_wx = 0;
+            sprites[i]->_wy = sheets[i].top << 8;
+            sprites[i]->_cAnimation = -1;
+            sprites[i]->setShown(true);
+        }
+        for (int i = 0; i < 16; i++)
+            uploadTextures();
+        for (int frame = 0; frame < 4; frame++) {
+            for (int i = 0; i < 2; i++) {
+                sheets[i].shown = frame;
+                sprites[i]->_cFrame = frame;
+            }
+            Host::gfx.count = 0;
+            Engine::main3dSpr.draw();
+            Engine::main3dSpr.waitDraw();
+            checkDrawnSheets(sheets, 2);
+        }
+        for (int i = 0; i < 2; i++) {
+            printf("%-12s %8u %14s %14s %8s %6u\n", i == 0 ? "sheet 4bpp" : "sheet 8bpp",
+                   sheets[i].checked, "-", "-", "-", sheets[i].mismatches);
+            wrong += sheets[i].mismatches + (sheets[i].checked == 0);
+            delete sprites[i];
+        }
+        Engine::vblankQueue.flush();
+        Engine::main3dSpr.setTextureCacheEnabled(true);
+        return wrong != 0;
+    }
+
+    const Scenario kScenarios[] = {
+        {"room", runRoom},
+        {"palette", runPalette},
+        {"frames", runFrames},
+        {"hud", runHud},
+        {"cull", runCull},
+        {"scale", runScale},
+        {"tex3d", runTexture3D},
+        {"atlas", runAtlas},
+        {"draw3d", runDraw3D},
+        {"battle", runBattle},
+        {"stream", runStream},
+        {"geometry", runGeometry},
+        {"tex4x4", runTexture4x4},
+        {"zones", runZones},
+        {"bigsheet", runBigSheet},
+        {"defrag", runDefrag},
+        {"budget", runBudget},
+        {"bgscroll", runBgScroll},
+        {"pixels", runPixels},
+        {"pan", runPan},
+        {"bigroom", runBigRoom},
+        {"bgwrite", runBgWrite},
+        {"bgload", runBgLoad},
+    };
+}
+
+int main(int argc, char** argv) {
+    const char* logPath = getenv("UNDERTALE_LOG");
+    if (logPath != nullptr && logPath[0] != 0)
+        Host::setMessageStream(fopen(logPath, "w"));
+    const char* gxListPath = getenv("UNDERTALE_GXLIST");
+    if (gxListPath != nullptr && gxListPath[0] != 0)
+        Host::setGxListStream(fopen(gxListPath, "w"));
+
+    if (Engine::init() != 0)
+        return 1;
+    srand(0);  // Engine::init seeds from the clock, keep runs reproducible
+    globalSave.clear(INTERNAL_RESET);
+
+    const char* scenarioName = argc > 1 ? argv[1] : "room";
+    for (const Scenario& scenario : kScenarios) {
+        if (strcmp(scenario.name, scenarioName) == 0)
+            return scenario.run(argc > 2 ? argc - 2 : 0, argc > 2 ? argv + 2 : nullptr);
+    }
+
+    fprintf(stderr, "Unknown scenario %s, available:", scenarioName);
+    for (const Scenario& scenario : kScenarios)
+        fprintf(stderr, " %s", scenario.name);
+    fprintf(stderr, "\n");
+    return 1;
+}
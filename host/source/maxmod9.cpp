@@ -0,0 +1,41 @@
+//
+// Host (Linux) implementation of the maxmod shim.
+//
+
+#include <maxmod9.h>
+
+namespace Host {
+    // One frame of 44100Hz stereo 16 bit audio fits comfortably
+    const u32 kStreamFrameSamples = 1024;
+
+    mm_stream stream;
+    bool streamOpen = false;
+    u32 streamRemainder = 0;
+    alignas(4) u16 streamBuffer[kStreamFrameSamples * 2];
+}
+
+void mmInit(mm_ds_system*) {}
+
+void mmStreamOpen(mm_stream* stream) {
+    Host::stream = *stream;
+    Host::streamOpen = true;
+    Host::streamRemainder = 0;
+}
+
+void mmStreamUpdate() {
+    if (!Host::streamOpen || Host::stream.callback == nullptr)
+        return;
+    // Request exactly one 60Hz frame of samples, carrying the remainder
+    // so the stream stays deterministic over many frames
+    u32 samples = Host::stream.sampling_rate + Host::streamRemainder;
+    Host::streamRemainder = samples % 60;
+    samples /= 60;
+    if (samples > Host::kStreamFrameSamples)
+        samples = Host::kStreamFrameSamples;
+    Host::stream.callback(samples, Host::streamBuffer,
+                          (mm_stream_formats) Host::stream.format);
+}
+
+void mmStreamClose() {
+    Host::streamOpen = false;
+}
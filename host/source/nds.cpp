@@ -0,0 +1,371 @@
+//
+// Host (Linux) implementation of the libnds shim.
+//
+
+#include <chrono>
+#include <nds.h>
+
+namespace Host {
+    Memory mem;
+    GfxLog gfx;
+    FrameStats cFrameStats;
+    FrameStats lastFrameStats;
+    u32 frameCount = 0;
+
+    u32 vramBankModes[9] = {0};
+    u16 brightness[2] = {0};
+    bool mainOnTop = true;
+
+    u32 keysHeldNext = 0, keysHeldCurrent = 0, keysHeldPrev = 0;
+    touchPosition touchNext = {0, 0, 0, 0, 0, 0};
+    touchPosition touchCurrent = {0, 0, 0, 0, 0, 0};
+
+    FILE* messageStream = nullptr;
+    FILE* gxListStream = nullptr;
+
+    DmaChannel dmaChannels[4] = {{0, 0, {0}}, {0, 0, {1}}, {0, 0, {2}}, {0, 0, {3}}};
+
+    std::chrono::steady_clock::time_point timingStart;
+
+    void gfxWrite(u8 command, u32 param) {
+        cFrameStats.gfxWords++;
+        if (gfx.count >= kGfxLogCapacity) {
+            gfx.overflow++;
+            return;
+        }
+        gfx.commands[gfx.count] = command;
+        gfx.params[gfx.count] = param;
+        gfx.count++;
+    }
+
+    void dmaAccount(u32 bytes) {
+        cFrameStats.dmaBytes += bytes;
+        cFrameStats.dmaCount++;
+    }
+
+    // Parameter words of each geometry command id, 0 for unused ids
+    static u8 gxParamCount(u8 command) {
+        switch (command) {
+            case 0x10: case 0x12: case 0x13: case 0x14: return 1;
+            case 0x16: case 0x18: return 16;
+            case 0x17: case 0x19: return 12;
+            case 0x1A: return 9;
+            case 0x1B: case 0x1C: return 3;
+            case 0x23: case 0x71: return 2;
+            case 0x34: return 32;
+            case 0x70: return 3;
+            case 0x20: case 0x21: case 0x22: case 0x24: case 0x25: case 0x26: case 0x27:
+            case 0x28: case 0x29: case 0x2A: case 0x2B: case 0x30: case 0x31: case 0x32:
+            case 0x33: case 0x40: case 0x50: case 0x60: case 0x72: return 1;
+            default: return 0;
+        }
+    }
+
+    void gxFifoWrite(const u32* words, u32 count) {
+        cFrameStats.gxListWords += count;
+        cFrameStats.gxListCount++;
+        if (gxListStream != nullptr) {
+            fprintf(gxListStream, "%u %u", frameCount, count);
+            for (u32 i = 0; i < count; i++)
+                fprintf(gxListStream, " %08x", words[i]);
+            fprintf(gxListStream, "\n");
+        }
+
+        u32 pos = 0;
+        while (pos < count) {
+            u32 header = words[pos++];
+            for (int slot = 0; slot < 4; slot++) {
+                u8 command = (header >> (8 * slot)) & 0xFF;
+                if (command == 0)
+                    continue;
+                u8 params = gxParamCount(command);
+                if (params == 0) {
+                    // Same log entry as the dummy word a port write takes
+                    gfxWrite(command, 0);
+                    continue;
+                }
+                for (u8 i = 0; i < params && pos < count; i++)
+                    gfxWrite(command, words[pos++]);
+            }
+        }
+    }
+
+    static void dmaRun(DmaChannel& dma, u32 value) {
+        u32 count = value & 0x1FFFFF;
+        if ((value & DMA_START_FIFO) == DMA_START_FIFO && dma.dest == (uintptr_t) &GFX_FIFO) {
+            gxFifoWrite((const u32*) dma.src, count);
+        } else {
+            u32 bytes = count * (value & DMA_32_BIT ? 4 : 2);
+            dmaAccount(bytes);
+            memcpy((void*) dma.dest, (const void*) dma.src, bytes);
+        }
+    }
+
+    DmaControl& DmaControl::operator=(u32 value) {
+        DmaChannel& dma = dmaChannels[channel];
+        if (dma.pending != 0) {
+            dmaRun(dma, dma.pending);
+            dma.pending = 0;
+        }
+        if (!(value & DMA_ENABLE))
+            return *this;
+        if ((value & DMA_START_FIFO) == DMA_START_FIFO)
+            dma.pending = value;
+        else
+            dmaRun(dma, value);
+        return *this;
+    }
+
+    DmaControl::operator u32() const {
+        DmaChannel& dma = dmaChannels[channel];
+        if (dma.pending != 0) {
+            dmaRun(dma, dma.pending);
+            dma.pending = 0;
+        }
+        return 0;
+    }
+
+    void dmaFinish() {
+        for (DmaChannel& dma : dmaChannels)
+            (void) (u32) dma.control;
+    }
+
+    void setKeys(u32 held) {
+        keysHeldNext = held;
+    }
+
+    void setTouch(u16 px, u16 py) {
+        touchNext.px = px;
+        touchNext.py = py;
+    }
+
+    void setMessageStream(FILE* stream) {
+        messageStream = stream;
+    }
+
+    void setGxListStream(FILE* stream) {
+        gxListStream = stream;
+    }
+}
+
+// ---------------------------------------------------------------- registers
+vu32 REG_DISPCNT = 0;
+vu32 REG_DISPCNT_SUB = 0;
+vu16 REG_BG0CNT = 0;
+vu16 REG_BG1CNT = 0;
+vu16 REG_BG2CNT = 0;
+vu16 REG_BG3CNT = 0;
+vu16 REG_BG0CNT_SUB = 0;
+vu16 REG_BG1CNT_SUB = 0;
+vu16 REG_BG2CNT_SUB = 0;
+vu16 REG_BG3CNT_SUB = 0;
+vu16 REG_BG3HOFS = 0;
+vu16 REG_BG3VOFS = 0;
+vs16 REG_BG3PA = 1 << 8, REG_BG3PB = 0, REG_BG3PC = 0, REG_BG3PD = 1 << 8;
+vs16 REG_BG3PA_SUB = 1 << 8, REG_BG3PB_SUB = 0, REG_BG3PC_SUB = 0, REG_BG3PD_SUB = 1 << 8;
+vs32 REG_BG3X = 0, REG_BG3Y = 0;
+vs32 REG_BG3X_SUB = 0, REG_BG3Y_SUB = 0;
+vu16 REG_VCOUNT = 0;
+
+vu16 GFX_CONTROL = 0;
+vu32 GFX_CLEAR_COLOR = 0;
+Host::GfxPort MATRIX_CONTROL = {Host::GFX_CMD_MTX_MODE};
+Host::GfxPort MATRIX_IDENTITY = {Host::GFX_CMD_MTX_IDENTITY};
+Host::GfxPort GFX_COLOR = {Host::GFX_CMD_COLOR};
+Host::GfxPort GFX_TEX_COORD = {Host::GFX_CMD_TEXCOORD};
+Host::GfxPort GFX_VERTEX16 = {Host::GFX_CMD_VTX_16};
+Host::GfxPort GFX_VERTEX_XY = {Host::GFX_CMD_VTX_XY};
+Host::GfxPort GFX_POLY_FORMAT = {Host::GFX_CMD_POLYGON_ATTR};
+Host::GfxPort GFX_TEX_FORMAT = {Host::GFX_CMD_TEXIMAGE_PARAM};
+Host::GfxPort GFX_PAL_FORMAT = {Host::GFX_CMD_PLTT_BASE};
+Host::GfxPort GFX_BEGIN = {Host::GFX_CMD_BEGIN_VTXS};
+Host::GfxPort GFX_END = {Host::GFX_CMD_END_VTXS};
+Host::GfxPort GFX_FLUSH = {Host::GFX_CMD_SWAP_BUFFERS};
+Host::GfxPort GFX_VIEWPORT = {Host::GFX_CMD_VIEWPORT};
+vu32 GFX_FIFO = 0;
+
+// ---------------------------------------------------------------- video
+void vramSetBankA(VRAM_A_TYPE a) { Host::vramBankModes[0] = a; }
+void vramSetBankB(VRAM_B_TYPE b) { Host::vramBankModes[1] = b; }
+void vramSetBankC(VRAM_C_TYPE c) { Host::vramBankModes[2] = c; }
+void vramSetBankD(VRAM_D_TYPE d) { Host::vramBankModes[3] = d; }
+void vramSetBankE(VRAM_E_TYPE e) { Host::vramBankModes[4] = e; }
+void vramSetBankF(VRAM_F_TYPE f) { Host::vramBankModes[5] = f; }
+void vramSetBankG(VRAM_G_TYPE g) { Host::vramBankModes[6] = g; }
+void vramSetBankH(VRAM_H_TYPE h) { Host::vramBankModes[7] = h; }
+void vramSetBankI(VRAM_I_TYPE i) { Host::vramBankModes[8] = i; }
+
+void videoSetMode(u32 mode) { REG_DISPCNT = mode; }
+void videoSetModeSub(u32 mode) { REG_DISPCNT_SUB = mode; }
+void lcdMainOnTop() { Host::mainOnTop = true; }
+void lcdMainOnBottom() { Host::mainOnTop = false; }
+
+void setBrightness(int screen, int level) {
+    if (screen & 1)
+        Host::brightness[0] = level;
+    if (screen & 2)
+        Host::brightness[1] = level;
+}
+
+// ---------------------------------------------------------------- 3D
+void glFlush(u32 mode) { GFX_FLUSH = mode; }
+void glColor(u16 color) { GFX_COLOR = color; }
+void glPolyFmt(u32 params) { GFX_POLY_FORMAT = params; }
+void glClearDepth(u16) {}
+void glViewport(u8 x1, u8 y1, u8 x2, u8 y2) { GFX_VIEWPORT = x1 + (y1 << 8) + (x2 << 16) + (y2 << 24); }
+void glMatrixMode(int mode) { MATRIX_CONTROL = mode; }
+void glLoadIdentity() { MATRIX_IDENTITY = 0; }
+
+void glOrthof32(int32 left, int32 right, int32 bottom, int32 top, int32 zNear, int32 zFar) {
+    // 4x4 multiply, 16 parameter words
+    Host::gfxWrite(Host::GFX_CMD_MTX_MULT_4x4, left);
+    Host::gfxWrite(Host::GFX_CMD_MTX_MULT_4x4, right);
+    Host::gfxWrite(Host::GFX_CMD_MTX_MULT_4x4, bottom);
+    Host::gfxWrite(Host::GFX_CMD_MTX_MULT_4x4, top);
+    Host::gfxWrite(Host::GFX_CMD_MTX_MULT_4x4, zNear);
+    Host::gfxWrite(Host::GFX_CMD_MTX_MULT_4x4, zFar);
+    for (int i = 0; i < 10; i++)
+        Host::gfxWrite(Host::GFX_CMD_MTX_MULT_4x4, 0);
+}
+
+// ---------------------------------------------------------------- dma / bios
+void dmaCopy(const void* source, void* dest, u32 size) {
+    Host::dmaAccount(size);
+    memcpy(dest, source, size);
+}
+
+void dmaCopyWords(u8, const void* src, void* dest, u32 size) {
+    Host::dmaAccount(size);
+    memcpy(dest, src, size);
+}
+
+void dmaCopyHalfWords(u8, const void* src, void* dest, u32 size) {
+    Host::dmaAccount(size);
+    memcpy(dest, src, size);
+}
+
+void dmaCopyWordsAsynch(u8, const void* src, void* dest, u32 size) {
+    Host::dmaAccount(size);
+    memcpy(dest, src, size);
+}
+
+void dmaCopyHalfWordsAsynch(u8, const void* src, void* dest, u32 size) {
+    Host::dmaAccount(size);
+    memcpy(dest, src, size);
+}
+
+void dmaFillWords(u32 value, void* dest, u32 size) {
+    Host::dmaAccount(size);
+    auto* dst = (u32*) dest;
+    for (u32 i = 0; i < size / 4; i++)
+        dst[i] = value;
+}
+
+void dmaFillHalfWords(u16 value, void* dest, u32 size) {
+    Host::dmaAccount(size);
+    auto* dst = (u16*) dest;
+    for (u32 i = 0; i < size / 2; i++)
+        dst[i] = value;
+}
+
+void swiWaitForVBlank() {
+    Host::dmaFinish();
+    Host::cFrameStats.frame = Host::frameCount;
+    Host::lastFrameStats = Host::cFrameStats;
+    Host::cFrameStats = Host::FrameStats();
+    Host::gfx.count = 0;
+    Host::gfx.overflow = 0;
+    Host::frameCount++;
+}
+
+void swiDelay(u32) {}
+
+void swiDecompressLZSSWram(void* source, void* destination) {
+    auto* src = (const u8*) source;
+    auto* dst = (u8*) destination;
+    u32 size = (src[1] | (src[2] << 8) | (src[3] << 16));
+    src += 4;
+    u32 written = 0;
+    while (written < size) {
+        u8 flags = *src++;
+        for (int bit = 0; bit < 8 && written < size; bit++) {
+            if (flags & (0x80 >> bit)) {
+                u32 length = (src[0] >> 4) + 3;
+                u32 distance = (((src[0] & 0xF) << 8) | src[1]) + 1;
+                src += 2;
+                // Byte by byte, a reference may overlap what it writes
+                for (u32 i = 0; i < length && written < size; i++, written++)
+                    dst[written] = dst[written - distance];
+            } else {
+                dst[written++] = *src++;
+            }
+        }
+    }
+}
+
+void swiDecompressRLEWram(void* source, void* destination) {
+    auto* src = (const u8*) source;
+    auto* dst = (u8*) destination;
+    u32 size = (src[1] | (src[2] << 8) | (src[3] << 16));
+    src += 4;
+    u32 written = 0;
+    while (written < size) {
+        u8 flag = *src++;
+        if (flag & 0x80) {
+            u32 length = (flag & 0x7F) + 3;
+            u8 value = *src++;
+            for (u32 i = 0; i < length && written < size; i++)
+                dst[written++] = value;
+        } else {
+            u32 length = (flag & 0x7F) + 1;
+            for (u32 i = 0; i < length && written < size; i++)
+                dst[written++] = *src++;
+        }
+    }
+}
+
+// ---------------------------------------------------------------- timers
+void cpuStartTiming(int) {
+    Host::timingStart = std::chrono::steady_clock::now();
+}
+
+u32 cpuGetTiming() {
+    auto elapsed = std::chrono::steady_clock::now() - Host::timingStart;
+    u64 ns = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+    return (u32)((ns * BUS_CLOCK) / 1000000000ull);
+}
+
+u32 cpuEndTiming() {
+    return cpuGetTiming();
+}
+
+// ---------------------------------------------------------------- system
+void powerOn(int) {}
+
+void nocashMessage(const char* message) {
+    FILE* stream = Host::messageStream != nullptr ? Host::messageStream : stderr;
+    fprintf(stream, "%s\n", message);
+}
+
+// ---------------------------------------------------------------- input
+void scanKeys() {
+    Host::keysHeldPrev = Host::keysHeldCurrent;
+    Host::keysHeldCurrent = Host::keysHeldNext;
+    Host::touchCurrent = Host::touchNext;
+}
+
+u32 keysDown() {
+    return Host::keysHeldCurrent & ~Host::keysHeldPrev;
+}
+
+u32 keysHeld() {
+    return Host::keysHeldCurrent;
+}
+
+u32 keysUp() {
+    return Host::keysHeldPrev & ~Host::keysHeldCurrent;
+}
+
+void touchRead(touchPosition* data) {
+    *data = Host::touchCurrent;
+}
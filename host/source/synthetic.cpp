@@ -0,0 +1,296 @@
+//
+// Procedurally generated assets for host scenarios.
+//
+
+#include <algorithm>
+#include <vector>
+#include "synthetic.hpp"
+
+namespace {
+    void put8(std::vector<u8>& out, u8 value) {
+        out.push_back(value);
+    }
+
+    void put16(std::vector<u8>& out, u16 value) {
+        out.push_back(value & 0xFF);
+        out.push_back(value >> 8);
+    }
+
+    void put32(std::vector<u8>& out, u32 value) {
+        put16(out, value & 0xFFFF);
+        put16(out, value >> 16);
+    }
+
+    void putMagic(std::vector<u8>& out, const char magic[4]) {
+        for (int i = 0; i < 4; i++)
+            put8(out, magic[i]);
+    }
+
+    std::vector<u8> buildSyntheticTexture(u16 width, u16 height, u8 frameCount,
+                                          const u16* colors, u8 colorCount, u32 version,
+                                          u8 framesPerAnimation, bool ellipse) {
+        u16 tileWidth = (width + 7) / 8, tileHeight = (height + 7) / 8;
+
+        std::vector<u8> data;
+        putMagic(data, "CSPR");
+        put32(data, 0);  // file size, patched below
+        put32(data, version);
+        put16(data, width);
+        put16(data, height);
+        put16(data, height);
+        put8(data, colorCount);
+        for (int i = 0; i < colorCount; i++)
+            put16(data, colors[i]);
+
+        auto pixelAt = [&](int px, int py, int frame) -> u8 {
+            return Host::syntheticPixel(width, height, frameCount, colorCount, px, py, frame, ellipse);
+        };
+
+        put8(data, frameCount);
+        if (version == 4) {
+            for (int frame = 0; frame < frameCount; frame++) {
+                for (int tileY = 0; tileY < tileHeight; tileY++) {
+                    for (int tileX = 0; tileX < tileWidth; tileX++) {
+                        for (int y = 0; y < 8; y++) {
+                            for (int x = 0; x < 8; x++)
+                                put8(data, pixelAt(tileX * 8 + x, tileY * 8 + y, frame));
+                        }
+                    }
+                }
+            }
+        } else {
+            // Same layout as jsonToCspr.py: power of two sub-textures, each
+            // holding every frame as a linear 4bpp or 8bpp texture
+            bool color8bit = colorCount >= 16;
+            put8(data, color8bit ? 1 : 0);
+            put32(data, tileWidth * tileHeight * frameCount * (color8bit ? 64 : 32));
+            for (int posY = 0, leftY = tileHeight; leftY > 0;) {
+                int subHeight = 1;
+                while (subHeight << 1 <= leftY)
+                    subHeight <<= 1;
+                for (int posX = 0, leftX = tileWidth; leftX > 0;) {
+                    int subWidth = 1;
+                    while (subWidth << 1 <= leftX)
+                        subWidth <<= 1;
+                    for (int frame = 0; frame < frameCount; frame++) {
+                        for (int y = 0; y < subHeight * 8; y++) {
+                            for (int x = 0; x < subWidth * 8; x += color8bit ? 1 : 2) {
+                                int px = posX * 8 + x, py = posY * 8 + y;
+                                if (color8bit)
+                                    put8(data, pixelAt(px, py, frame));
+                                else
+                                    put8(data, pixelAt(px, py, frame) |
+                                               (pixelAt(px + 1, py, frame) << 4));
+                            }
+                        }
+                    }
+                    posX += subWidth;
+                    leftX -= subWidth;
+                }
+                posY += subHeight;
+                leftY -= subHeight;
+            }
+        }
+
+        if (framesPerAnimation == 0 || framesPerAnimation > frameCount)
+            framesPerAnimation = frameCount;
+        u8 animationCount = (frameCount + framesPerAnimation - 1) / framesPerAnimation;
+        put8(data, animationCount);
+        for (int anim = 0; anim < animationCount; anim++) {
+            // "gfx" plays by default, the others are "anim1", "anim2"...
+            char name[8] = "gfx";
+            if (anim > 0)
+                snprintf(name, sizeof(name), "anim%d", anim);
+            data.insert(data.end(), name, name + strlen(name) + 1);
+            u8 first = anim * framesPerAnimation;
+            u8 count = frameCount - first < framesPerAnimation ? frameCount - first : framesPerAnimation;
+            put8(data, count);
+            for (int frame = first; frame < first + count; frame++) {
+                put8(data, frame);
+                put16(data, 1);
+                put8(data, 0);
+                put8(data, 0);
+            }
+        }
+
+        u32 size = data.size();
+        memcpy(&data[4], &size, 4);
+        return data;
+    }
+
+    void putBgTile(std::vector<u8>& data, u16 tile, bool color8bit) {
+        for (int py = 0; py < 8; py++) {
+            for (int px = 0; px < 8; px += color8bit ? 1 : 2) {
+                u8 pixel = Host::syntheticBgPixel(tile, px, py, color8bit);
+                if (!color8bit)
+                    pixel |= Host::syntheticBgPixel(tile, px + 1, py, color8bit) << 4;
+                put8(data, pixel);
+            }
+        }
+    }
+
+    // Version 2, the map cut in regionSize square regions listing the
+    // tiles they use
+    void putBgRegions(std::vector<u8>& data, u16 width, u16 height, u16 tileCount,
+                      bool color8bit, u8 regionSize) {
+        put16(data, width);
+        put16(data, height);
+        put8(data, regionSize);
+        int regionsW = (width + regionSize - 1) / regionSize;
+        int regionsH = (height + regionSize - 1) / regionSize;
+        u32 table = data.size();
+        data.resize(table + regionsW * regionsH * 4);
+
+        std::vector<u16> local(tileCount);
+        for (int ry = 0; ry < regionsH; ry++) {
+            for (int rx = 0; rx < regionsW; rx++) {
+                u32 offset = data.size();
+                memcpy(&data[table + (ry * regionsW + rx) * 4], &offset, 4);
+                std::vector<u16> ids;
+                std::vector<u16> map(regionSize * regionSize, 0);
+                std::fill(local.begin(), local.end(), 0xFFFF);
+                for (int y = 0; y < regionSize && ry * regionSize + y < height; y++) {
+                    for (int x = 0; x < regionSize && rx * regionSize + x < width; x++) {
+                        u16 tile = Host::syntheticBgTile(tileCount, rx * regionSize + x, ry * regionSize + y);
+                        if (local[tile] == 0xFFFF) {
+                            local[tile] = ids.size();
+                            ids.push_back(tile);
+                        }
+                        map[y * regionSize + x] = local[tile];
+                    }
+                }
+                put16(data, ids.size());
+                for (u16 tile : ids)
+                    put16(data, tile);
+                for (u16 tile : ids)
+                    putBgTile(data, tile, color8bit);
+                for (u16 entry : map)
+                    put16(data, entry);
+            }
+        }
+    }
+
+    std::vector<u8> buildSyntheticBackground(u16 width, u16 height, u16 tileCount, bool color8bit,
+                                             u32 version = 1, u8 regionSize = 16) {
+        std::vector<u8> data;
+        putMagic(data, "CBGF");
+        put32(data, 0);  // file size, patched below
+        put32(data, version);
+        put8(data, color8bit ? 1 : 0);
+        u8 colorCount = color8bit ? 64 : 15;
+        put8(data, colorCount);
+        for (int i = 0; i < colorCount; i++)
+            put16(data, Host::syntheticColor(i));
+
+        put16(data, tileCount);
+        if (version == 2) {
+            putBgRegions(data, width, height, tileCount, color8bit, regionSize);
+        } else {
+            for (int tile = 0; tile < tileCount; tile++)
+                putBgTile(data, tile, color8bit);
+
+            put16(data, width);
+            put16(data, height);
+            for (int y = 0; y < height; y++) {
+                for (int x = 0; x < width; x++)
+                    put16(data, Host::syntheticBgTile(tileCount, x, y));
+            }
+        }
+
+        u32 size = data.size();
+        memcpy(&data[4], &size, 4);
+        return data;
+    }
+
+    int loadFromMemory(Engine::Texture& texture, std::vector<u8>& data) {
+        FILE* f = fmemopen(data.data(), data.size(), "rb");
+        if (f == nullptr)
+            return -1;
+        int res = texture.loadCSPR(f);
+        fclose(f);
+        return res;
+    }
+}
+
+namespace Host {
+    u8 syntheticPixel(u16 width, u16 height, u8 frameCount, u8 colorCount,
+                      int px, int py, int frame, bool ellipse) {
+        if (px >= width || py >= height || colorCount == 0 ||
+                (px * 3 + py * 5 + frame) % 11 == 0)
+            return 0;
+        if (ellipse) {
+            // Centered, shrinking frame after frame
+            float scale = (float) (frameCount - frame) / frameCount;
+            float dx = (px + 0.5f - width / 2.0f) / (width / 2.0f * scale);
+            float dy = (py + 0.5f - height / 2.0f) / (height / 2.0f * scale);
+            if (dx * dx + dy * dy > 1)
+                return 0;
+        }
+        return 1 + (px + py * 7 + frame * 3) % colorCount;
+    }
+
+    int loadSyntheticBackground(Engine::Background& bg, u16 width, u16 height,
+                                u16 tileCount, bool color8bit) {
+        std::vector<u8> data = buildSyntheticBackground(width, height, tileCount, color8bit);
+        FILE* f = fmemopen(data.data(), data.size(), "rb");
+        if (f == nullptr)
+            return -1;
+        int res = bg.loadCBGF(f);
+        fclose(f);
+        return res;
+    }
+
+    bool writeSyntheticBackground(const char* path, u16 width, u16 height, u16 tileCount,
+                                  bool color8bit, u32 version, u8 regionSize) {
+        std::vector<u8> data = buildSyntheticBackground(width, height, tileCount, color8bit,
+                                                        version, regionSize);
+        FILE* f = fopen(path, "wb");
+        if (f == nullptr)
+            return false;
+        bool written = fwrite(data.data(), 1, data.size(), f) == data.size();
+        fclose(f);
+        return written;
+    }
+
+    u16 syntheticBgTile(u16 tileCount, int x, int y) {
+        // 4 floor tiles, then 8 wall tiles in a band every 20 rows
+        const u16 kFloorTiles = 4, kWallTiles = 8;
+        u32 hash = (u32) (x * 73856093) ^ (u32) (y * 19349663);
+        if (tileCount > kFloorTiles + kWallTiles && hash % 23 == 0)
+            return kFloorTiles + kWallTiles + (hash / 23) % (tileCount - kFloorTiles - kWallTiles);
+        if (y % 20 < 4 && tileCount >= kFloorTiles + kWallTiles)
+            return kFloorTiles + (y % 20) * 2 + x % 2;
+        return (y % 2) * 2 + x % 2;
+    }
+
+    u8 syntheticBgPixel(u16 tile, int px, int py, bool color8bit) {
+        u8 colorCount = color8bit ? 64 : 15;
+        return 1 + (tile * 7 + px + py * 3 + (tile * px) / 5) % colorCount;
+    }
+
+    u16 syntheticColor(u32 idx) {
+        // Multiplying by an odd constant is a bijection mod 2^15
+        return (idx * 0x2A5B + 0x1234) & 0x7FFF;
+    }
+
+    int loadSyntheticTexture(Engine::Texture& texture, u16 width, u16 height,
+                             u8 frameCount, const u16* colors, u8 colorCount,
+                             u32 version, u8 framesPerAnimation, bool ellipse) {
+        std::vector<u8> data = buildSyntheticTexture(width, height, frameCount, colors, colorCount,
+                                                     version, framesPerAnimation, ellipse);
+        return loadFromMemory(texture, data);
+    }
+
+    bool writeSyntheticTexture(const char* path, u16 width, u16 height,
+                               u8 frameCount, const u16* colors, u8 colorCount,
+                               u32 version) {
+        std::vector<u8> data = buildSyntheticTexture(width, height, frameCount, colors, colorCount,
+                                                     version, 0, false);
+        FILE* f = fopen(path, "wb");
+        if (f == nullptr)
+            return false;
+        bool written = fwrite(data.data(), 1, data.size(), f) == data.size();
+        fclose(f);
+        return written;
+    }
+}
@@ -0,0 +1,54 @@
+//
+// Reference 4x4 compressed texture decoder, same as tools/cspr4x4.py.
+//
+
+#include "texture4x4.hpp"
+
+namespace {
+    u16 blend(u16 c0, u16 c1, int w0, int w1) {
+        u16 res = 0;
+        for (int shift = 0; shift < 15; shift += 5) {
+            int a = (c0 >> shift) & 0x1F, b = (c1 >> shift) & 0x1F;
+            res |= ((a * w0 + b * w1) / (w0 + w1)) << shift;
+        }
+        return res;
+    }
+}
+
+namespace Host {
+    void decode4x4(const u8* texels, const u8* indices, const u16* palette,
+                   u16 width, u16 height, u16* out) {
+        u32 block = 0;
+        for (int blockY = 0; blockY < height; blockY += 4) {
+            for (int blockX = 0; blockX < width; blockX += 4, block++) {
+                u32 word = texels[block * 4] | (texels[block * 4 + 1] << 8) |
+                           (texels[block * 4 + 2] << 16) | ((u32) texels[block * 4 + 3] << 24);
+                u16 index = indices[block * 2] | (indices[block * 2 + 1] << 8);
+                const u16* pal = palette + (index & 0x3FFF) * 2;
+                u16 colors[4];
+                colors[0] = pal[0] | 0x8000;
+                colors[1] = pal[1] | 0x8000;
+                switch (index >> 14) {
+                    case 0:
+                        colors[2] = pal[2] | 0x8000;
+                        colors[3] = 0;
+                        break;
+                    case 1:
+                        colors[2] = blend(pal[0], pal[1], 1, 1) | 0x8000;
+                        colors[3] = 0;
+                        break;
+                    case 2:
+                        colors[2] = pal[2] | 0x8000;
+                        colors[3] = pal[3] | 0x8000;
+                        break;
+                    default:
+                        colors[2] = blend(pal[0], pal[1], 5, 3) | 0x8000;
+                        colors[3] = blend(pal[0], pal[1], 3, 5) | 0x8000;
+                        break;
+                }
+                for (int i = 0; i < 16; i++)
+                    out[(blockY + i / 4) * width + blockX + i % 4] = colors[(word >> (2 * i)) & 3];
+            }
+        }
+    }
+}
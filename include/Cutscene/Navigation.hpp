@@ -60,6 +60,8 @@ public:
                          u16 frames, CutsceneLocation callingLocation);
     void update();
     void clearAllTasks();
+    // Pixels << 8 a frame position tasks move target by, false if none do
+    bool getVelocity(const Engine::Sprite* target, s32& vx, s32& vy) const;
     static Engine::Sprite* getTarget(u8 targetType, s8 targetId,
                                      CutsceneLocation callingLocation);
 private:
@@ -11,5 +11,7 @@
 // #define DEBUG_AUDIO
 // #define DEBUG_ZONES
 // #define DEBUG_ZONES_DUMP
+// #define DEBUG_ZONE_STATS  // VRAM allocator stats logged as each room is freed
+// #define DEBUG_PROFILER  // Engine::tick phase timings, see Engine/Profiler.hpp
 
 #endif //UNDERTALE_DEBUG_FLAGS_HPP
@@ -12,10 +12,54 @@
 #include <nds.h>
 
 namespace Engine {
+    // Cells of a scrolling background kept in VRAM, the screen with 3 cells
+    // of margin across. Each takes a tile slot at most.
+    const int kBgWindowWidth = 36, kBgWindowHeight = 28;
+    const int kBgWindowCells = kBgWindowWidth * kBgWindowHeight;
+    // Cells scrollWindowMain queues a frame ahead of the camera, more if it
+    // scrolls in more a frame. Cells about to show are loaded past it.
+    const int kBgPrefetchCells = 40;
+
+    // Smallest region a version 2 file may use, the cache is sized for it
+    const int kBgMinRegionSize = 16;
+    // Most regions a span of cells can touch
+    constexpr int bgRegionsSpanned(int cells) {
+        return (cells + 2 * kBgMinRegionSize - 2) / kBgMinRegionSize;
+    }
+    // Regions of a streamed background held in RAM. Queued rects pin theirs
+    // until they're copied. Before a strip would leave none to evict,
+    // scrollWindowMain cancels them and reloads the whole window, so the
+    // queue can lag the window by about a region first.
+    const int kBgRegionCacheSize = 20;
+    static_assert(kBgRegionCacheSize >= bgRegionsSpanned(kBgWindowWidth) * bgRegionsSpanned(kBgWindowHeight) +
+                                        bgRegionsSpanned(kBgWindowWidth),
+                  "a reloaded window and the strip after it must fit the region cache");
+
+    struct BgTileStats {
+        u32 cells = 0;  // Map entries written
+        u32 uploads = 0;  // Tiles copied to VRAM
+        u32 hits = 0;  // Cells showing a tile already in VRAM
+        u32 urgent = 0;  // Cells scrollWindowMain loaded past its budget
+    };
+
+    struct BgRegionStats {
+        u32 loads = 0;  // Regions read from the file
+        u32 bytesRead = 0;
+        u32 bytes = 0;  // Region data in RAM right now
+        u32 peakBytes = 0;
+        u32 reloads = 0;  // Windows reloaded whole as queued rects pinned too many
+        u32 starved = 0;  // Loads that found every region pinned, cells left blank
+    };
+
     class Background {
     public:
         bool loadPath(const char* path);
+        // Version 1 is read whole. Version 2 stores the map and tiles by
+        // regions of cells, the file stays open and they're read as the
+        // window moves over them, so the background can be of any size.
+        // Version 3 is version 1 with the tiles and map compressed.
         int loadCBGF(FILE* f);
+        bool getStreamed() const { return _stream != nullptr; }
         bool getLoaded() const { return _loaded; }
         void getSize(u16& width, u16& height) const {
             width = _width;
@@ -32,6 +76,24 @@ namespace Engine {
 
         int loadBgRectMain(int x, int y, int w, int h);
         int loadBgRectSub(int x, int y, int w, int h);
+        // Same as loadBgRectMain, but written in v-blank by vblankQueue
+        void queueBgRectMain(int x, int y, int w, int h);
+        // Window around a camera at x, y pixels, loaded right away
+        void loadWindowMain(int x, int y);
+        // Moves the window along with a camera going vx, vy pixels << 8 a
+        // frame. The window keeps most of its margin ahead of the camera and
+        // moves a row or column at a time, queued in slices of up to
+        // prefetchCells a frame, so strips load before they come into view.
+        void scrollWindowMain(int x, int y, s32 vx, s32 vy);
+        void setPrefetchCells(u16 cells) { _prefetchCells = cells; }
+        // Cells showing the same tile share its VRAM slot, so a tile is
+        // only copied when it comes into view. Off, every cell has a slot
+        // of its own. Applies from the next loadBgExtended.
+        void setTileCacheEnabled(bool enabled) { _tileCacheEnabled = enabled; }
+        const BgTileStats& getTileStats() const { return _tileStats; }
+        void resetTileStats() { _tileStats = BgTileStats(); }
+        const BgRegionStats& getRegionStats() const { return _regionStats; }
+        void resetRegionStats();
     private:
         bool _loaded = false;
         bool _color8bit = false;
@@ -42,12 +104,80 @@ namespace Engine {
         u16 _width = 0, _height = 0;
         u16* _map = nullptr;
 
+        struct Region {
+            s16 x = -1, y = -1;
+            u16 pins = 0;  // Queued rects still to read from it
+            u32 lastUse = 0;
+            u16* map = nullptr;  // Local tile of each cell
+            u16* ids = nullptr;  // Background tile of each local tile
+            u8* tiles = nullptr;
+            u32 size = 0;
+            u8* data = nullptr;
+            u32 capacity = 0;
+        };
+        FILE* _stream = nullptr;
+        u32 _regionTable = 0;  // File offset of the region offsets
+        u8 _regionSize = 0;
+        u16 _regionsW = 0;
+        Region* _regions = nullptr;
+        Region* _lastRegion = nullptr;
+        u32 _regionClock = 0;
+        BgRegionStats _regionStats;
+
+        static const u16 kNoTile = 0xFFFF;
+        // Past the window's slots, cells of a region that failed to load
+        // show kBlankTile from it and the cache never hands it out
+        static const u16 kBlankSlot = kBgWindowCells;
+        bool _tileCacheEnabled = true;
+        bool _tileCache = false;  // Enabled when the window was last reset
+        u16* _tileSlot = nullptr;  // Per source tile, kNoTile when not in VRAM
+        u16* _slotRefs = nullptr;  // Window cells showing each slot
+        u16* _freeSlots = nullptr;
+        u16 _freeSlotCount = 0;
+        u16* _cellTile = nullptr;  // Source tile each window cell shows
+        BgTileStats _tileStats;
+
+        // Tile the window starts at
+        int _windowX = 0, _windowY = 0;
+        // Row or column step being loaded, both 0 when none
+        s8 _stepX = 0, _stepY = 0;
+        u8 _stepDone = 0;  // Cells of the step strip queued
+        u16 _prefetchCells = kBgPrefetchCells;
+
         int loadBgTextEngine(vu16* bg3Reg, u16* paletteRam, u16* tileRam, u16* mapRam);
         int loadBgExtendedEngine(vu16* bg3Reg, u16* paletteRam, u16* tileRam, u16* mapRam,
                                  vs16* reg3A, vs16* reg3B, vs16* reg3C, vs16* reg3D,
                                  int forceSize);
         int loadBgRectEngine(const vu16* bg3Reg, u16* tileRam, u16* mapRam,
                              int x, int y, int w, int h);
+        static void loadBgRectMainJob(void* target, const s32* args);
+        // Unpacks a version 3 section, a BIOS LZ77 or RLE stream, into
+        // size bytes at dst
+        static bool readPacked(FILE* f, void* dst, u32 size);
+        // Background tile at a cell, wrapping around, and its pixels.
+        // kNoTile and kBlankTile when its region failed to load.
+        u16 tileAt(int col, int row, const u8*& pixels);
+        // Region in RAM, read from the file unless it's there already
+        Region* loadRegion(int regionX, int regionY);
+        // Adds delta to the pins of the regions under a rect, loading them
+        void pinRect(int x, int y, int w, int h, int delta);
+        // Drops the rects still queued, the whole window is about to load
+        void cancelRects();
+        // Queues the whole window at a cell, dropping the rects queued before
+        void reloadWindow(int windowX, int windowY);
+        // Too few regions unpinned for another strip
+        bool regionsLow() const;
+        // First cell of a window of size cells over first to last, margin
+        // on the side it goes towards
+        static int windowOrigin(int first, int last, s32 velocity, int size);
+        // Forgets what the window shows, every slot free
+        void resetTileCache();
+        // Slot showing that tile, copied there unless some cell shows it already
+        u16 acquireTile(u16* tileRam, u16 tile, const u8* pixels);
+        void releaseTile(u16 tile);
+        void copyTile(u16* tileRam, u16 slot, const u8* pixels) const;
+        // Bytes loadBgRectEngine would write right now
+        u32 rectCost(int x, int y, int w, int h);
     };
 
     void clearMain();
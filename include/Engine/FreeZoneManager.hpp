@@ -11,33 +11,136 @@
 #include "DEBUG_FLAGS.hpp"
 
 namespace Engine {
+    // Zone records a manager can hold, free and reserved ones together
+    const u16 kZoneCapacity = 512;
+
+    // Moves what was reserved at start down to newStart, both length
+    // long. They overlap when the zone slides into free space right in
+    // front of it. Returns false to leave that zone where it is.
+    typedef bool (*ZoneRelocator)(void* context, u32 start, u32 newStart, u32 length);
+    // Free space outside the largest free zone past which compacting is worth it
+    const u8 kCompactFragmentationPercent = 50;
+    // Failed reservations by power of two of their length, the last one
+    // takes everything longer
+    const int kZoneFailBuckets = 18;
+
+    // Lengths in the manager's own unit (bytes, or 2D tiles)
+    struct ZoneStats {
+        u32 used = 0;
+        u32 peakUsed = 0;  // Since the last reset
+        u32 largestFree = 0;
+        u8 fragmentation = 0;  // See getFragmentation
+        u16 freeZones = 0;
+        u32 reserves = 0;
+        u32 frees = 0;
+        u32 failures = 0;
+        u32 fragmentedFailures = 0;  // With enough free length in total
+        u32 failedBySize[kZoneFailBuckets] = {0};
+        // Bus clock ticks, only counted with DEBUG_PROFILER, which runs
+        // the timers
+        u32 reserveTicks = 0;
+        u32 maxReserveTicks = 0;
+        u32 freeTicks = 0;
+        u32 maxFreeTicks = 0;
+    };
+
+    // Free zones sit in lists by size class (TLSF style: 4 classes per
+    // power of two) with bitmaps of the classes that have any, reserved
+    // zones in a hash by start. Zones know their neighbours to merge with
+    // on free. Records come from a pool allocated once, so reserve and
+    // free don't touch the heap or walk the zones.
     class FreeZoneManager {
     public:
-        FreeZoneManager(int start, int length, const char* name) {
-            _zoneCount = 1;
-            _zones = new u16[2];
-            _zones[0] = start;
-            _zones[1] = length;
-            _name = name;
-        };
+        FreeZoneManager(int start, int length, const char* name, u16 capacity = kZoneCapacity);
+        ~FreeZoneManager();
 
-        ~FreeZoneManager() {
-            delete[] _zones;
-            _zones = nullptr;
-        }
+        int reserve(u32 length, u32 &start, u32 alignment);
+        // Whether reserve would succeed, without reporting the failure
+        bool fits(u32 length, u32 alignment) const;
 
-        int reserve(u16 length, u16 &start, u16 alignment);
+        void free(u32 length, u32 start);
 
-        void free(u16 length, u16 start);
+        u16 getFreeZoneCount() const { return _freeZoneCount; }
+        u32 getFreeLength() const { return _freeLength; }
+        u32 getLargestFree() const;
+        // Percent of the free length outside the largest free zone
+        u8 getFragmentation() const;
+        // Counters with the free space as it is now
+        ZoneStats getStats() const;
+        // Starts counting again, the peak from what is used now
+        void resetStats();
+        void dumpStats() const;
+
+        // Called by compact for every zone it moves, the owner copies the
+        // data and updates its start
+        void setRelocator(ZoneRelocator relocator, void* context) {
+            _relocator = relocator;
+            _relocatorContext = context;
+        }
+        // Moves reserved zones, lowest first, down into the lowest free
+        // zone that takes them or else right against the zone in front,
+        // keeping their alignment. Stops after about budget moved, returns
+        // the length moved.
+        u32 compact(u32 budget);
 
 #ifdef DEBUG_ZONES_DUMP
         void dump();
 #endif
 
     private:
-        u16 _zoneCount;
-        u16 *_zones;
+        static const u16 kNoZone = 0xFFFF;
+        // A power of two per first level bit, split in 4 classes
+        static const int kClassSplit = 4;
+        static const int kSizeClasses = 32 * kClassSplit;
+
+        struct Zone {
+            u32 start = 0;
+            u32 length = 0;
+            u32 alignment = 1;  // Reserved with, compact keeps it
+            u16 prev = kNoZone, next = kNoZone;  // By address
+            u16 prevFree = kNoZone, nextFree = kNoZone;  // In its size class, next unused in the pool
+            bool free = false;
+        };
+
+        static int sizeClass(u32 length);
+        static u32 classMinLength(int sizeClass);
+        // First class from there on with free zones, or kSizeClasses
+        int nextClass(int sizeClass) const;
+        u16 findFree(u32 length, u32 alignment) const;
+        // Reserves from that free zone, false when out of records
+        bool carve(u16 zone, u32 length, u32 alignment, u32& start);
+        // Frees a reserved zone no longer in the hash
+        void release(u16 zone);
+        void linkFree(u16 zone);
+        void unlinkFree(u16 zone);
+        u16 newZone();
+        void deleteZone(u16 zone);
+        u16 hashSlot(u32 start) const {
+            return (start * 2654435761u) >> (32 - _hashBits);
+        }
+        void hashInsert(u16 zone);
+        // Slot of the reserved zone starting there, or -1
+        int hashFind(u32 start) const;
+        void hashRemove(int slot);
+        void recordFailure(u32 length);
+
+        Zone* _zones;
+        u16 _capacity;
+        u16 _unused = kNoZone;  // Pool records not in use, through nextFree
+        u16 _unusedCount = 0;
+        u16 _first = 0;  // Lowest address
+        u16 _freeZoneCount = 0;
+        u32 _freeLength = 0;
+        u32 _totalLength;
+        ZoneStats _stats;
+        u16 _classHeads[kSizeClasses];
+        u32 _powerBits = 0;  // Powers of two with a class holding zones
+        u8 _classBits[32] = {0};  // Classes holding zones, per power of two
+        u16* _hash;
+        u8 _hashBits;
         const char* _name;
+        ZoneRelocator _relocator = nullptr;
+        void* _relocatorContext = nullptr;
     };
 }
 
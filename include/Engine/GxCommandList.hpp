@@ -0,0 +1,90 @@
+#ifndef UNDERTALE_GX_COMMAND_LIST_HPP
+#define UNDERTALE_GX_COMMAND_LIST_HPP
+
+#define ARM9
+#include <nds.h>
+
+namespace Engine {
+    // Geometry engine command ids, as packed in a GXFIFO command word
+    enum GxCommand : u8 {
+        GX_NOP = 0x00,
+        GX_MTX_MODE = 0x10,
+        GX_MTX_IDENTITY = 0x15,
+        GX_COLOR = 0x20,
+        GX_TEXCOORD = 0x22,
+        GX_VTX_16 = 0x23,
+        GX_VTX_XY = 0x25,
+        GX_POLYGON_ATTR = 0x29,
+        GX_TEXIMAGE_PARAM = 0x2A,
+        GX_PLTT_BASE = 0x2B,
+        GX_BEGIN_VTXS = 0x40,
+        GX_END_VTXS = 0x41
+    };
+
+    // glCallList uses channel 0 too, texture and map copies use 3
+    const u8 kGxDmaChannel = 0;
+
+    // Geometry commands packed in RAM and sent to GXFIFO by DMA, so the
+    // CPU can go on with the frame while the geometry engine reads them.
+    // Every group of up to 4 commands is one word of command ids (first
+    // in the low byte) followed by all their parameters, the layout the
+    // FIFO accepts when written to GFX_FIFO directly.
+    class GxCommandList {
+    public:
+        ~GxCommandList();
+
+        // Drop the previous frame's commands, waits if they are still
+        // being sent
+        void reset();
+        // Commands without parameters still take a 0 parameter word when
+        // written to their port, packed they take none
+        void command(u8 cmd) {
+            nextCommand(cmd);
+        }
+        void command(u8 cmd, u32 param) {
+            nextCommand(cmd);
+            *reserve(1) = param;
+        }
+        void command(u8 cmd, u32 param0, u32 param1) {
+            nextCommand(cmd);
+            u32* params = reserve(2);
+            params[0] = param0;
+            params[1] = param1;
+        }
+        // Starts the DMA and returns right away
+        void submit();
+        // Blocks until the geometry engine took every word
+        void wait() const;
+
+        const u32* getData() const { return _data; }
+        u32 getWordCount() const { return _count; }
+        u32 getCapacity() const { return _capacity; }
+    private:
+        u32* reserve(u32 words) {
+            if (_count + words > _capacity)
+                grow(_count + words);
+            u32* res = &_data[_count];
+            _count += words;
+            return res;
+        }
+        void nextCommand(u8 cmd) {
+            if (_headerSlots == 4) {
+                _header = _count;
+                *reserve(1) = 0;  // Unused slots stay GX_NOP
+                _headerSlots = 0;
+            }
+            _data[_header] |= cmd << (8 * _headerSlots);
+            _headerSlots++;
+        }
+        void grow(u32 words);
+
+        u32* _data = nullptr;
+        u32 _count = 0;
+        u32 _capacity = 0;
+        u32 _header = 0;  // Index of the command word being filled
+        u8 _headerSlots = 4;  // Commands already in it
+        bool _submitted = false;
+    };
+}
+
+#endif //UNDERTALE_GX_COMMAND_LIST_HPP
@@ -12,12 +12,25 @@
 #include "DEBUG_FLAGS.hpp"
 
 namespace Engine {
+    const int kOamPaletteSlots = 255;  // Color 0 is transparent
+    const int kPaletteHashSize = 512;  // Power of two, at most half full
+    const u8 kPaletteNone = 0xFF;
+    // Sprite tiles compaction moves per frame, copied from the frame caches
+    const u32 kOamCompactTiles = 64;
+
     struct OAMEntry {
         bool free_ = true;
+        bool culled = false;  // Off screen, disabled until it comes back
         u16 tileStart = 0;
         u8 tileWidth = 0, tileHeight = 0;
     };
 
+    // Affine matrix shared by every sprite drawn at the same scale
+    struct OAMScaleEntry {
+        u8 refCount = 0;
+        s32 scaleX = 0, scaleY = 0;  // 0 until first used, sprites never scale by 0
+    };
+
     class OAMManager {
     public:
         OAMManager(u16* paletteRam,
@@ -28,25 +41,59 @@ namespace Engine {
                 _tileRam(tileRam),
                 _tileZones(1, 1023, "2D_TILES"){
             *paletteRam = 31 << 5;  // full green for bg
+            resetPaletteAllocator();
+            _tileZones.setRelocator(relocateTilesCallback, this);
         };
 
 #ifdef DEBUG_2D
         void dumpOamState();
 #endif
 
+        // Update sprites into the shadow OAM, can run any time
         void draw();
+        // Copy dirty shadow OAM entries and pending frame tiles, in v-blank
+        void flush();
+        u16 getCulledCount() const { return _culledCount; }  // Entries off screen last draw
+        u8 getActiveCount() const { return _activeSprCount; }
+        // The tile VRAM is taken by something else (texture slot 1 for the
+        // sub screen), sprites refuse to load until it's given back
+        void setTilesLent(bool lent) { _tilesLent = lent; }
+        int getScaleEntriesUsed() const;
+        u8 getTileFragmentation() const { return _tileZones.getFragmentation(); }
+        // Lengths in tiles
+        ZoneStats getTileZoneStats() const { return _tileZones.getStats(); }
+        void resetZoneStats() { _tileZones.resetStats(); }
+        void dumpZoneStats() const { _tileZones.dumpStats(); }
+        // Entries move their tiles down when free tiles are fragmented or
+        // a sprite only fits once they're merged
+        void setCompactionEnabled(bool enabled) { _compactionEnabled = enabled; }
     private:
         friend class Sprite;
 
         int loadSprite(Sprite& res);
         void freeSprite(Sprite& spr);
 
+        void resetPaletteAllocator();
+        int reservePaletteColor(u16 color);
+        void releasePaletteColors(Sprite& spr, int colorCount);
+        int findPaletteColor(u16 color) const;
+        void insertPaletteColor(u16 color, u8 slot);
+        void removePaletteColor(u16 color);
+        void unlinkFreePaletteSlot(u8 slot);
+
         int reserveOAMEntry(u8 tileW, u8 tileH);
         void freeOAMEntry(int oamId);
+        static bool relocateTilesCallback(void* context, u32 start, u32 newStart, u32 length);
+        bool relocateTiles(u32 start, u32 newStart);
 
         void setSpritePosAndScale(Sprite& spr);
+        void cullOAMEntry(int oamId);
         int loadSpriteFrame(Sprite& spr, int frame);
+        void buildFrameCache(Sprite& spr, int frame);
+        void freeFrameCache(Sprite& spr);
         void setOAMState(Sprite& spr);
+        u16* shadowEntry(int oamId) { return &_oamShadow[oamId * 4]; }
+        void markOamDirty(int oamId) { _oamDirty[oamId >> 5] |= 1 << (oamId & 31); }
         void allocateOamScaleEntry(Sprite& spr);
         void freeOamScaleEntry(Sprite& spr);
 
@@ -55,13 +102,33 @@ namespace Engine {
         u16* _tileRam;
 
         FreeZoneManager _tileZones;
+        bool _compactionEnabled = true;
+        bool _compactStalled = false;  // Last pass moved nothing, until something is freed
 
         u8 _activeSprCount = 0;
         Sprite** _activeSpr = nullptr;
+        u16 _culledCount = 0;
+        bool _tilesLent = false;
 
-        u8 _paletteRefCounts[255] = {0};
+        u8 _paletteRefCounts[kOamPaletteSlots] = {0};
+        // Color -> slot, linear probing. Slots whose refcount dropped to 0
+        // stay in it until they are handed out again, so a color that comes
+        // back soon after being freed needs no palette write.
+        u16 _paletteHashColors[kPaletteHashSize];
+        u8 _paletteHashSlots[kPaletteHashSize];
+        // Unreferenced slots, oldest released first
+        u8 _paletteFreeNext[kOamPaletteSlots];
+        u8 _paletteFreePrev[kOamPaletteSlots];
+        u8 _paletteFreeHead = kPaletteNone;
+        u8 _paletteFreeTail = kPaletteNone;
         OAMEntry _oamEntries[SPRITE_COUNT];
-        bool _oamScaleEntryUsed[32] = {false};
+        // Same layout as OAM, affine parameters are the 4th halfword of
+        // each entry (matrix i spans entries 4i to 4i+3)
+        alignas(4) u16 _oamShadow[SPRITE_COUNT * 4] = {0};
+        u32 _oamDirty[SPRITE_COUNT / 32] = {0};
+        // Frame tiles to copy on the next flush, from the sprite frame cache
+        const u8* _pendingTiles[SPRITE_COUNT] = {nullptr};
+        OAMScaleEntry _oamScaleEntries[32];
     };
 
     extern OAMManager OAMManagerSub;
@@ -0,0 +1,85 @@
+#ifndef UNDERTALE_PIXEL_KERNELS_HPP
+#define UNDERTALE_PIXEL_KERNELS_HPP
+
+#define ARM9
+#include <nds.h>
+
+namespace Engine {
+    // Pixel format conversions for VRAM uploads. VRAM takes no 8-bit
+    // writes, so kernels read and write whole 32-bit words, 8 pixels at a
+    // time. Sources and destinations are word aligned.
+    enum PixelFormat {
+        PIXELS_4BPP,  // Two pixels a byte, the first in the low nibble
+        PIXELS_8BPP
+    };
+
+    // Byte of two 4bpp pixels to their two 8bpp bytes
+    struct NibbleExpandTable {
+        u16 values[256];
+        constexpr NibbleExpandTable() : values() {
+            for (int i = 0; i < 256; i++)
+                values[i] = (i & 0xF) | ((i >> 4) << 8);
+        }
+    };
+    inline constexpr NibbleExpandTable kNibbleExpand;
+
+    // Pixels of a byte each (CSPR tiles, 8bpp) to Format
+    template <PixelFormat Format>
+    void packPixels(const u8* src, u32* dst, u32 pixels);
+
+    template <>
+    inline void packPixels<PIXELS_8BPP>(const u8* src, u32* dst, u32 pixels) {
+        auto* words = (const u32*) src;
+        for (u32 i = 0; i < pixels / 4; i++)
+            dst[i] = words[i];
+    }
+
+    template <>
+    inline void packPixels<PIXELS_4BPP>(const u8* src, u32* dst, u32 pixels) {
+        auto* words = (const u32*) src;
+        for (u32 i = 0; i < pixels / 8; i++) {
+            // Low nibbles of 4 bytes folded into the low 16 bits
+            u32 low = words[2 * i] & 0x0F0F0F0F;
+            u32 high = words[2 * i + 1] & 0x0F0F0F0F;
+            low = (low | (low >> 4)) & 0x00FF00FF;
+            high = (high | (high >> 4)) & 0x00FF00FF;
+            low = (low | (low >> 8)) & 0xFFFF;
+            high = (high | (high >> 8)) & 0xFFFF;
+            dst[i] = low | (high << 16);
+        }
+    }
+
+    // Format to a byte per pixel
+    template <PixelFormat Format>
+    void unpackPixels(const u8* src, u32* dst, u32 pixels);
+
+    template <>
+    inline void unpackPixels<PIXELS_8BPP>(const u8* src, u32* dst, u32 pixels) {
+        packPixels<PIXELS_8BPP>(src, dst, pixels);
+    }
+
+    template <>
+    inline void unpackPixels<PIXELS_4BPP>(const u8* src, u32* dst, u32 pixels) {
+        auto* words = (const u32*) src;
+        for (u32 i = 0; i < pixels / 8; i++) {
+            u32 word = words[i];
+            dst[2 * i] = kNibbleExpand.values[word & 0xFF] |
+                         (kNibbleExpand.values[(word >> 8) & 0xFF] << 16);
+            dst[2 * i + 1] = kNibbleExpand.values[(word >> 16) & 0xFF] |
+                             (kNibbleExpand.values[word >> 24] << 16);
+        }
+    }
+
+    // 8bpp pixels through a palette index table, lut[0] keeps transparent
+    // pixels transparent
+    inline void remapPixels(const u8* src, u32* dst, const u8* lut, u32 pixels) {
+        auto* words = (const u32*) src;
+        for (u32 i = 0; i < pixels / 4; i++) {
+            u32 word = words[i];
+            dst[i] = lut[word & 0xFF] | (lut[(word >> 8) & 0xFF] << 8) |
+                     (lut[(word >> 16) & 0xFF] << 16) | (lut[word >> 24] << 24);
+        }
+    }
+}
+
+#endif //UNDERTALE_PIXEL_KERNELS_HPP
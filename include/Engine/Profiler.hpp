@@ -0,0 +1,84 @@
+#ifndef UNDERTALE_PROFILER_HPP
+#define UNDERTALE_PROFILER_HPP
+
+#define ARM9
+#include <nds.h>
+#include "DEBUG_FLAGS.hpp"
+
+// Per-phase frame profiler for Engine::tick. Everything compiles away
+// unless DEBUG_PROFILER is defined.
+#ifdef DEBUG_PROFILER
+#define PROFILE_INIT() Engine::profiler.start()
+#define PROFILE_SCOPE(phase) Engine::ProfilerScope profilerScope_(Engine::phase)
+#define PROFILE_VBLANK_START() Engine::profiler.vblankStart()
+#define PROFILE_FRAME_END() Engine::profiler.endFrame()
+// Logs the summary each time the ring buffer wraps, every ~2 seconds
+#define PROFILE_DUMP() do { if (Engine::profiler.wrapped()) Engine::profiler.dump(); } while (0)
+#else
+#define PROFILE_INIT()
+#define PROFILE_SCOPE(phase)
+#define PROFILE_VBLANK_START()
+#define PROFILE_FRAME_END()
+#define PROFILE_DUMP()
+#endif
+
+#ifdef DEBUG_PROFILER
+namespace Engine {
+    enum ProfilerPhase {
+        PROFILE_GAME = 0,  // Time spent outside of Engine::tick
+        PROFILE_3D_DRAW,
+        PROFILE_GL_FLUSH,
+        PROFILE_AUDIO,
+        PROFILE_VBLANK_WAIT,
+        PROFILE_OAM,
+        PROFILE_OAM_FLUSH,
+        PROFILE_TEXTURES,
+        PROFILE_VBLANK_JOBS,
+        PROFILE_INPUT,
+        PROFILE_PHASE_COUNT
+    };
+
+    const int kProfilerFrames = 128;  // Ring buffer length
+    // 71 lines of 355 dots, 6 bus cycles each
+    const s32 kVBlankTicks = 71 * 355 * 6;
+
+    struct ProfilerFrame {
+        u32 phaseTicks[PROFILE_PHASE_COUNT] = {0};
+        s32 vblankLeft = 0;  // Negative if the v-blank work overran
+    };
+
+    class Profiler {
+    public:
+        // Cascaded timers 2 and 3, timer 0 belongs to the audio stream
+        void start() { cpuStartTiming(2); _frameEnd = now(); }
+        static u32 now() { return cpuGetTiming(); }
+
+        void record(ProfilerPhase phase, u32 ticks) { _current.phaseTicks[phase] += ticks; }
+        void vblankStart() { _vblankStart = now(); }
+        void endFrame();
+        void dump();
+        bool wrapped() const { return _frameIdx == 0 && _frameCount == kProfilerFrames; }
+    private:
+        friend class ProfilerScope;
+        u32 _vblankStart = 0;
+        u32 _frameEnd = 0;
+        ProfilerFrame _current;
+        ProfilerFrame _frames[kProfilerFrames];
+        u16 _frameIdx = 0;
+        u16 _frameCount = 0;
+    };
+
+    extern Profiler profiler;
+
+    class ProfilerScope {
+    public:
+        explicit ProfilerScope(ProfilerPhase phase) : _phase(phase), _start(Profiler::now()) {}
+        ~ProfilerScope() { profiler.record(_phase, Profiler::now() - _start); }
+    private:
+        ProfilerPhase _phase;
+        u32 _start;
+    };
+}
+#endif
+
+#endif //UNDERTALE_PROFILER_HPP
@@ -30,9 +30,15 @@ namespace Engine {
         u8 oamScaleIdx = 0xff;  // all oam entries can share scale
         u8 * oamEntries = nullptr;
         u8 *paletteColors = nullptr;
+        // Palette remapped frames laid out like the OAM entries' tiles,
+        // built on first use, dropped with the palette slots
+        u8 *oamFrameCache = nullptr;
+        bool *oamFrameCached = nullptr;
+        u32 oamFrameBytes = 0;
 
         int loadedFrame = -1;
         bool loadedIntoMemory = false;
+        bool uploadQueued = false;  // 3D texture upload waiting in vblankQueue
     };
 
     class Sprite {
@@ -55,6 +61,9 @@ namespace Engine {
         s32 _cam_x = 0, _cam_y = 0;
         s32 _cam_scale_x = 1 << 8, _cam_scale_y = 1 << 8;
         s32 _layer = 0;
+        // 3D only: frames with more quads than the geometry engine takes
+        // leave out the lowest priority sprites first
+        s8 _drawPriority = 0;
         int _cFrame = 0;
         int _cAnimation = -1;
 
@@ -7,31 +7,276 @@
 
 #include "Sprite.hpp"
 #include "Engine/FreeZoneManager.hpp"
+#include "Engine/GxCommandList.hpp"
+#include "Engine/PixelKernels.hpp"
+#include "Engine/Texture.hpp"
 #define ARM9
 #include <nds.h>
 
 namespace Engine {
+    // Textures up to this size (and texels over all frames) can be packed
+    // in an atlas page, bigger ones are better off on their own
+    const u16 kAtlasMaxTextureSize = 64;
+    const u32 kAtlasMaxTextureTexels = 4096;
+    const u16 kAtlasPageWidth = 256;
+    // 256x128 at 8bpp, a quarter of slot 0
+    const u32 kAtlasPageMaxBytes = 32 * 1024;
+
+    // 3D textures use all of slot 0 (VRAM_B). While compressed textures
+    // are on VRAM_D is slot 1, its first half holds the 4x4 index words of
+    // slot 0 and the second half takes other textures. Texture addresses
+    // count from the start of slot 0.
+    const u32 kTextureSlotBytes = 128 * 1024;
+    const u32 kTextureSlot1Start = kTextureSlotBytes + kTextureSlotBytes / 2;
+    const int kAtlasMaxPages = 4;
+
+    // Several small textures sharing one VRAM texture and one palette, so
+    // their sprites draw without changing GFX_TEX_FORMAT/GFX_PAL_FORMAT
+    struct AtlasPage {
+        bool used = false;
+        bool uploaded = false;
+        u8 textureCount = 0;
+        bool color8bit = false;
+        u8 widthFmt = 0, heightFmt = 0;  // log2(size / 8)
+        u32 tileStart = 0;
+        u16 paletteIdx = 0;
+        u8 paletteLength = 0;  // In 16 color slots
+        u16 colorCount = 0;
+        u16 colors[255] = {0};
+        u8* texels = nullptr;  // Waiting for upload
+        u32 texelBytes = 0;
+    };
+
+    // Textures no sprite shows any more stay in VRAM until the space is
+    // needed, so leaving a battle or coming back to a room rebinds them
+    // instead of uploading them again
+    const int kResidentTextureSlots = 32;
+
+    struct ResidentTexture {
+        bool used = false;
+        Texture* owner = nullptr;  // nullptr once the texture itself was freed
+        u32 pathHash = 0;  // Lets a texture loaded again from the file adopt it
+        u16 width = 0, height = 0;
+        u8 frameCount = 0;
+        u8 colorCount = 0;
+        Texture3DQuad* quads = nullptr;
+        u8 quadCount = 0;
+        u16 paletteIdx = 0;
+        u16 paletteLength = 0;  // 16 color slots
+        bool color8bit = false;
+        u8* residentFrames = nullptr;  // Parked before it finished streaming
+        u8 residentCount = 0;
+        u32 lastUsed = 0;
+    };
+
+    struct TextureCacheStats {
+        u32 hits = 0;  // Rebound with no copy
+        u32 misses = 0;  // Uploaded
+        u32 evictions = 0;
+        u32 savedBytes = 0;  // Not copied thanks to hits
+        u16 resident = 0;  // Parked right now
+        u32 streamChunks = 0;  // Frame ranges uploaded
+        u32 compactedBytes = 0;  // Moved down to merge free space
+    };
+
+    // Textures upload a range of frames of every sub-texture at a time,
+    // about this many bytes, so a sprite sheet spreads over several
+    // v-blanks. Sprites show once their animation's frames are in.
+    const u32 kTextureStreamChunk = 4 * 1024;
+    // Bytes of texture compaction moves per v-blank, and moves
+    const u32 kTextureCompactChunk = 8 * 1024;
+    const int kTextureCompactMoves = 16;
+
+    // Distinct texture states grouped per frame, past that quads only
+    // cost extra state changes
+    const int kDrawGroupSlots = 128;
+    const u16 kDrawListEnd = 0xFFFF;
+
+    // One textured quad of the frame's draw list
+    struct DrawQuad {
+        u32 texFormat;
+        u32 palFormat;
+        s16 x, y, x2, y2;
+        s32 z;
+        u16 u, v, w, h;  // Texels
+        u16 sprite;  // In _activeSpr, kDrawListEnd once dropped
+        s8 priority;
+    };
+
+    // Polygon and vertex RAM of the geometry engine, what doesn't fit in a
+    // frame isn't drawn. Quads take 4 vertices each, so vertices run out
+    // first. Leave room when something else draws 3D too.
+    const u16 kMaxPolygons = 2048;
+    const u16 kMaxVertices = 6144;
+    const u16 kMaxQuads = kMaxVertices / 4;
+    // A frame past this share of the budget logs a warning
+    const u16 kGeometryWarnPercent = 90;
+
+    struct GeometryStats {
+        u16 quads = 0;  // Sent last frame, a polygon and 4 vertices each
+        u16 maxQuads = 0;  // Most sent in a frame
+        u32 emptySkipped = 0;  // Sub-textures with no opaque texel in the frame shown
+        u32 dropped = 0;  // Over budget, lowest priority sprites first
+        u32 droppedSprites = 0;
+        u32 warnings = 0;
+    };
+
     class Sprite3DManager {
     public:
         Sprite3DManager() :
-            tileFreeZones(0, 65536 - 8, "3D_TILES"),
-            paletteFreeZones(0, 1024, "3D_PALETTE") {}
+            tileFreeZones(0, kTextureSlotBytes, "3D_TILES", 1024),
+            slot1FreeZones(kTextureSlot1Start, kTextureSlot1Start - kTextureSlotBytes, "3D_TILES_SLOT1"),
+            paletteFreeZones(0, 1024, "3D_PALETTE") {
+            tileFreeZones.setRelocator(relocateTilesCallback, this);
+            slot1FreeZones.setRelocator(relocateTilesCallback, this);
+        }
 
+        // Builds the frame's geometry commands and starts sending them
         void draw();
+        void waitDraw() const { _gxList.wait(); }
+        const GxCommandList& getCommandList() const { return _gxList; }
         void updateTextures();
+        // Packs the small textures of a room into shared pages. Textures
+        // leave their page when freed, the page goes with the last one.
+        void packAtlas(Texture** textures, int textureCount);
+        void setAtlasEnabled(bool enabled) { _atlasEnabled = enabled; }
+        u32 getTileBytesUsed() const { return _tileBytesUsed; }
+        u32 getPaletteBytesUsed() const { return _paletteBytesUsed; }
+        u8 getTileFragmentation() const { return tileFreeZones.getFragmentation(); }
+        ZoneStats getTileZoneStats() const { return tileFreeZones.getStats(); }
+        ZoneStats getSlot1ZoneStats() const { return slot1FreeZones.getStats(); }
+        ZoneStats getPaletteZoneStats() const { return paletteFreeZones.getStats(); }
+        void resetZoneStats();
+        // Logs the allocator stats, slot 1 only while compressed textures are on
+        void dumpZoneStats() const;
+        // Frees every parked texture
+        void flushTextureCache();
+        void setTextureCacheEnabled(bool enabled);
+        void setStreamChunk(u32 bytes) { _streamChunk = bytes; }
+        // Textures move down in v-blank when free space is fragmented or
+        // a texture only fits once it's merged
+        void setCompactionEnabled(bool enabled) { _compactionEnabled = enabled; }
+        // 4x4 compressed textures keep their index words in texture slot 1,
+        // which takes VRAM_D from the sub screen sprites while enabled.
+        // Fails while OAMManagerSub has sprites, which then refuses new ones
+        // until it's disabled. Compressed sprites don't load until then,
+        // other textures can use the rest of slot 1. Disable with no
+        // compressed sprite shown, the ones in slot 1 load again in slot 0
+        // and parked ones are freed.
+        bool setCompressedTextures(bool enabled);
+        bool getCompressedTextures() const { return _compressedTextures; }
+        // Quads a frame may send, sprites past it are left out lowest
+        // Sprite::_drawPriority first, then the last ones in draw order
+        void setQuadBudget(u16 quads) { _quadBudget = quads; }
+        void setSkipEmptyQuads(bool skip) { _skipEmptyQuads = skip; }
+        const GeometryStats& getGeometryStats() const { return _geometryStats; }
+        void resetGeometryStats();
+        const TextureCacheStats& getCacheStats() const { return _cacheStats; }
+        void resetCacheStats();
     private:
         friend class Sprite;
+        friend class Texture;
 
         int loadSprite(Sprite& res);
         void freeSprite(Sprite& spr);
 
         void loadSpriteTexture(Sprite& spr);
+        static void loadSpriteTextureJob(void* target, const s32* args);
         void freeSpriteTexture(Sprite& spr);
 
+        int findResident(const Texture& texture) const;
+        bool rebindTexture(Texture& texture);
+        void parkTexture(Texture& texture);
+        void orphanTexture(Texture& texture);
+        // Least recently parked first, false when nothing is parked
+        bool evictTexture();
+        void evictResident(int idx);
+        void freeTextureVram(Texture3DQuad* quads, u8 quadCount, u8 frameCount,
+                             u16 paletteIdx, u16 paletteLength, u8* residentFrames);
+        static u16 texturePaletteLength(const Texture& texture);
+        static u32 textureFrameBytes(const Texture& texture);
+        bool nextStreamRange(const Texture& texture, u8& start, u8& end) const;
+        void queueStream(Texture& texture);
+        void cancelStream(Texture& texture);
+        static void streamTextureJob(void* target, const s32* args);
+        void streamTexture(Texture& texture, u8 start, u8 end);
+        // Frames of a CSPR v4 texture's tiles to the quad's linear texels
+        template <PixelFormat Format>
+        static void packQuadFrames(const Texture& texture, const Texture3DQuad& quad, u8 start, u8 end);
+        bool spriteReady(Sprite& spr);
+        // Evict parked textures until the reservation fits, in slot 1 too
+        // unless slot0 is set (4x4 texels, atlas pages)
+        int reserveTiles(u32 length, u32& start, u32 alignment, bool slot0);
+        void freeTiles(u32 length, u32 start);
+        bool compactionWanted() const;
+        void queueCompaction();
+        static void compactTilesJob(void* target, const s32* args);
+        static bool relocateTilesCallback(void* context, u32 start, u32 newStart, u32 length);
+        bool relocateTiles(u32 start, u32 newStart, u32 length);
+        int reservePalette(u16 length, u16& start, u16 alignment);
+        // Where a texture address is while its bank is mapped to LCD
+        static u8* textureVram(u32 tileStart) {
+            if (tileStart < kTextureSlotBytes)
+                return (u8*) VRAM_B + tileStart;
+            return (u8*) VRAM_D + tileStart - kTextureSlotBytes;
+        }
+        static bool textureInSlot1(const Texture& texture);
+
+        int packAtlasPage(Texture** textures, int textureCount, bool* packed);
+        static u32 shelfPack(Texture** textures, const int* order, int orderCount, u16 width, u16 maxHeight,
+                             u16* colors, u16& colorCount, u8** coords, bool* placed,
+                             u16& usedWidth, u16& usedHeight);
+        static void loadAtlasPageJob(void* target, const s32* args);
+        void releaseAtlas(Texture& texture);
+        DrawQuad* newDrawQuad();
+        void addQuad(Sprite& spr, u16 sprIdx, const Texture3DQuad& texQuad);
+        void addAtlasQuad(Sprite& spr, u16 sprIdx);
+        void applyQuadBudget();
+        void setTexState(u32 texFormat, u32 palFormat);
+
         FreeZoneManager tileFreeZones;
+        FreeZoneManager slot1FreeZones;  // Used while compressed textures are on
         FreeZoneManager paletteFreeZones;
+        u32 _tileBytesUsed = 0;
+        u32 _paletteBytesUsed = 0;
+
+        ResidentTexture _resident[kResidentTextureSlots];
+        u32 _residentClock = 0;
+        bool _textureCacheEnabled = true;
+        u32 _streamChunk = kTextureStreamChunk;
+        TextureCacheStats _cacheStats;
+        bool _compressedTextures = false;
+
+        bool _compactionEnabled = true;
+        bool _compactQueued = false;
+        bool _compactStalled = false;  // Last pass moved nothing, until something is freed
+        // Moved from this v-blank, the old copies are drawn until the next
+        // one. Nothing loads until then either.
+        u32 _vacatedStart[kTextureCompactMoves];
+        u32 _vacatedLength[kTextureCompactMoves];
+        u8 _vacatedCount = 0;
+        u32 _compactTarget = 0;  // Largest free block a failed reservation needs
+
+        bool _atlasEnabled = true;
+        AtlasPage _atlasPages[kAtlasMaxPages];
+
+        // Rebuilt every frame, sorted by texture
+        DrawQuad* _drawList = nullptr;
+        u16* _drawNext = nullptr;  // Next quad of the same texture state
+        int _drawCount = 0;
+        int _drawCapacity = 0;
+
+        GxCommandList _gxList;
+
+        u16 _quadBudget = kMaxQuads;
+        bool _skipEmptyQuads = true;
+        bool _geometryWarned = false;  // Logged once until a frame is under the threshold again
+        GeometryStats _geometryStats;
 
-        bool _paletteUsed[96] = {false};
+        // Last texture state sent to the geometry engine this frame
+        u32 _texFormat = 0;
+        u32 _palFormat = 0;
+        bool _texStateSet = false;
 
         u8 _activeSprCount = 0;
         Sprite** _activeSpr = nullptr;
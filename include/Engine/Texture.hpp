@@ -7,6 +7,15 @@
 #include "Formats/CSPR.hpp"
 
 namespace Engine {
+    // Power of two piece of a 3D texture, every frame back to back in VRAM
+    struct Texture3DQuad {
+        u8 x = 0, y = 0;  // Tiles from the sprite's top left
+        u8 width = 0, height = 0;  // Tiles
+        u32 texFormat = 0;  // GFX_TEX_FORMAT without the address
+        u32 tileStart = 0;  // Texture address, past slot 0 in VRAM_D
+        u32 frameBytes = 0;
+    };
+
     class Texture {
     public:
         bool loadPath(const char* path);
@@ -38,15 +47,45 @@ namespace Engine {
         u16 _width = 0, _height = 0;
         u8 _frameCount = 0;
         u8 _animationCount = 0;
+        u32 _pathHash = 0;  // Of the nitro:/ path, 0 when not loaded from one
         u16 _topDownOffset = 0;
         CSPRAnimation* _animations = nullptr;
-        u8* _tiles = nullptr;
+        u8* _tiles = nullptr;  // 8x8 tiles, 1 byte per pixel. Built on demand for version 5
+        // Version 5: 3D sub-textures, ready to copy to VRAM (see CSPR.hpp)
+        u8* _texData = nullptr;
+        u32 _texDataSize = 0;
+        // 4x4 compressed: _texData holds texel then index words, _colors
+        // the block palette
+        bool _compressed = false;
+        u16 _blockColorCount = 0;
+
+        void unpackTiles();
+        // Once the tiles are unpacked, the 3D path can pack from them too
+        void dropTexData();
+        // Bit per sub-texture and frame with no opaque texel, in upload order
+        u8* _emptyQuads = nullptr;
+        void findEmptyQuads();
+        bool quadEmpty(u8 quad, u8 frame) const {
+            u32 bit = quad * _frameCount + frame;
+            return _emptyQuads != nullptr && (_emptyQuads[bit / 8] & (1 << (bit % 8)));
+        }
 
         // 3D
         u8 _loaded3DCount = 0;
-        u16 * _tileStart = nullptr;
+        Texture3DQuad* _quads = nullptr;  // Power of two pieces, built on upload
+        u8 _quadCount = 0;
         u16 _paletteIdx = 0;
         bool _color8bit = false;
+        // Frames stream in after the VRAM is reserved, a bit per frame
+        u8* _residentFrames = nullptr;
+        u8 _residentCount = 0;
+        s8 _streamAnim = -1;  // Its frames go first
+        bool _streamQueued = false;
+        bool frameResident(u8 frame) const {
+            return _residentFrames[frame / 8] & (1 << (frame % 8));
+        }
+        s8 _atlasPage = -1;
+        u8* _atlasCoords = nullptr;  // x, y of every frame in the atlas page
 
         friend class Sprite3DManager;
     };
@@ -0,0 +1,73 @@
+#ifndef UNDERTALE_VBLANK_QUEUE_HPP
+#define UNDERTALE_VBLANK_QUEUE_HPP
+
+#define ARM9
+#include <nds.h>
+
+namespace Engine {
+    // Deferred VRAM/OAM/palette writes. Jobs are queued whenever the game
+    // wants them and Engine::tick runs them in v-blank, oldest first, until
+    // the frame budget is spent. Whatever doesn't fit carries over.
+    typedef void (*VBlankJobFunc)(void* target, const s32* args);
+
+    const int kVBlankQueueCapacity = 64;
+    const int kVBlankJobArgs = 4;
+    // Bytes written to VRAM per v-blank. Cost estimates are in bytes too.
+    const u32 kVBlankDefaultBudget = 16 * 1024;
+
+    struct VBlankJob {
+        VBlankJobFunc func = nullptr;
+        void* target = nullptr;
+        s32 args[kVBlankJobArgs] = {0};
+        u32 cost = 0;
+        u32 queuedFrame = 0;
+    };
+
+    struct VBlankQueueStats {
+        u16 depth = 0;  // Jobs waiting right now
+        u16 maxDepth = 0;
+        u32 queued = 0;
+        u32 run = 0;
+        u32 deferred = 0;  // Times a job was left waiting at the end of a v-blank
+        u32 overruns = 0;  // V-blanks whose work went over the budget
+        u32 overflows = 0;  // Jobs run immediately because the queue was full
+        u32 lastFrameCost = 0;
+        u32 maxFrameCost = 0;
+    };
+
+    class VBlankQueue {
+    public:
+        // Returns 0 if queued, 1 if the queue was full and the job ran right away
+        int push(VBlankJobFunc func, void* target, u32 cost,
+                 s32 arg0 = 0, s32 arg1 = 0, s32 arg2 = 0, s32 arg3 = 0);
+        // Drop every queued job writing for target (it is being freed)
+        void cancel(const void* target);
+        // Account for v-blank work that can't be deferred (OAM, etc.)
+        void charge(u32 cost) { _frameCost += cost; }
+        // Run jobs until the budget is spent, call in v-blank
+        void drain();
+        // Run everything now, for loads behind a fade or a blank screen
+        void flush();
+
+        void setBudget(u32 budget) { _budget = budget; }
+        u32 getBudget() const { return _budget; }
+        const VBlankQueueStats& getStats() const { return _stats; }
+        void resetStats();
+        void dumpStats() const;
+    private:
+        void runJob(VBlankJob& job);
+        void popFront();
+
+        VBlankJob _jobs[kVBlankQueueCapacity];
+        u16 _head = 0;
+        u16 _count = 0;
+        u32 _budget = kVBlankDefaultBudget;
+        u32 _frameCost = 0;
+        u32 _frame = 0;
+        VBlankQueueStats _stats;
+    };
+
+    extern VBlankQueue vblankQueue;
+}
+
+#endif //UNDERTALE_VBLANK_QUEUE_HPP
@@ -22,7 +22,18 @@ struct CSPRColors {
 
 struct CSPRTiles {
     u8 frameCount = 0;
+    // Version 4: 8x8 tiles, 1 byte per pixel, frame by frame
+    // Version 5: the sprite split in power of two sub-textures (largest
+    // first, row by row), each one holding every frame as a linear texture.
+    // 8bpp if colorCount >= 16, else 4bpp with the low nibble first.
+    // 4x4 compressed: the texel words of every sub-texture and frame, then
+    // their index words in the same order, then the block palette. The
+    // sprite has no paletted colors then and is 3D only.
+    u8 texFormat = 0;  // Version 5 only, bit 0 set for 8bpp, bit 1 for 4x4 compressed
+    u32 tileDataSize = 0;  // Version 5 only
     u8* tileData = nullptr;
+    u16 blockColorCount = 0;  // 4x4 compressed only
+    u16* blockColors = nullptr;
 };
 
 struct CSPRAnimFrame {
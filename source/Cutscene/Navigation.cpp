@@ -320,6 +320,23 @@ void Navigation::clearAllTasks() {
     }
 }
 
+bool Navigation::getVelocity(const Engine::Sprite* target, s32& vx, s32& vy) const {
+    bool moving = false;
+    for (int i = 0; i < _taskCount; i++) {
+        NavigationTask* navTask = _tasks[i];
+        if (navTask == nullptr || navTask->target != target || navTask->taskType != POSITION)
+            continue;
+        if (navTask->cFrames >= navTask->frames)
+            continue;
+        if (!moving)
+            vx = 0, vy = 0;
+        vx += (navTask->destX - navTask->startingX) / navTask->frames;
+        vy += (navTask->destY - navTask->startingY) / navTask->frames;
+        moving = true;
+    }
+    return moving;
+}
+
 Engine::Sprite* Navigation::getTarget(u8 targetType, s8 targetId,
                                       CutsceneLocation callingLocation) {
     if (callingLocation == ROOM || callingLocation == LOAD_ROOM) {
@@ -3,11 +3,18 @@
 //
 #include "Engine/Background.hpp"
 #include "Engine/math.hpp"
+#include "Engine/PixelKernels.hpp"
+#include "Engine/VBlankQueue.hpp"
 
 namespace Engine {
     s32 bg3ScrollX = 0, bg3ScrollY = 0;
     s16 bg3Pa = 0, bg3Pb = 0, bg3Pc = 0, bg3Pd = 0;
 
+    // Shown where a streamed region couldn't be read
+    const u32 kBlankTile[16] = {0};
+    // Version 3 section types, the low byte of their BIOS stream header
+    const u8 kStreamStored = 0x00, kStreamLZ77 = 0x10, kStreamRLE = 0x30;
+
     bool Background::loadPath(const char *path) {
         char pathFull[100];
         char buffer[100];
@@ -23,7 +30,9 @@ namespace Engine {
 
         int loadRes = loadCBGF(f);
 
-        fclose(f);
+        // Streamed, the background closes it when freed
+        if (_stream != f)
+            fclose(f);
 
         if (loadRes != 0) {
             sprintf(buffer, "Error loading bg %s: %d", path, loadRes);
@@ -58,7 +67,7 @@ namespace Engine {
         }
 
         fread(&version, 4, 1, f);
-        if (version != 1) {
+        if (version < 1 || version > 3) {
             return 3;
         }
 
@@ -75,33 +84,112 @@ namespace Engine {
 
         fread(&_tileCount, 2, 1, f);
 
+        if (version == 2) {
+            bool headerRead = fread(&_width, 2, 1, f) == 1 &&
+                              fread(&_height, 2, 1, f) == 1 &&
+                              fread(&_regionSize, 1, 1, f) == 1;
+            // tileAt and pinRect wrap cells around the size
+            if (!headerRead || _width == 0 || _height == 0 || _regionSize < kBgMinRegionSize) {
+                delete[] _colors;
+                _colors = nullptr;
+                return 5;
+            }
+            _regionsW = (_width + _regionSize - 1) / _regionSize;
+            _regionTable = ftell(f);
+            _regions = new Region[kBgRegionCacheSize];
+            _stream = f;
+            _loaded = true;
+            return 0;
+        }
+
         u32 tileDataSize = 32;
         if (_color8bit)
             tileDataSize = 64;
 
+        // Version 3 compresses the tiles and the map
+        bool sectionsRead = true;
         _tiles = new u8[_tileCount * tileDataSize];
-        fread(_tiles, tileDataSize, _tileCount, f);
+        if (version == 3)
+            sectionsRead &= readPacked(f, _tiles, _tileCount * tileDataSize);
+        else
+            fread(_tiles, tileDataSize, _tileCount, f);
 
         fread(&_width, 2, 1, f);
         fread(&_height, 2, 1, f);
 
         _map = new u16[_width * _height];
-        fread(_map, 2, _width * _height, f);
+        if (version == 3)
+            sectionsRead &= readPacked(f, _map, _width * _height * 2);
+        else
+            fread(_map, 2, _width * _height, f);
 
         _loaded = true;
+        if (!sectionsRead) {
+            free_();
+            return 6;
+        }
         return 0;
     }
 
+    bool Background::readPacked(FILE* f, void* dst, u32 size) {
+        u32 streamSize = 0;
+        fread(&streamSize, 4, 1, f);
+        if (streamSize < 4)
+            return false;
+        // The BIOS reads its source a word at a time
+        auto* stream = new u32[(streamSize + 3) / 4];
+        bool read = fread(stream, streamSize, 1, f) == 1 && (stream[0] >> 8) == size;
+        if (read) {
+            switch (stream[0] & 0xFF) {
+                case kStreamLZ77:
+                    swiDecompressLZSSWram(stream, dst);
+                    break;
+                case kStreamRLE:
+                    swiDecompressRLEWram(stream, dst);
+                    break;
+                case kStreamStored:
+                    read = streamSize - 4 >= size;
+                    if (read)
+                        memcpy(dst, stream + 1, size);
+                    break;
+                default:
+                    read = false;
+            }
+        }
+        delete[] stream;
+        return read;
+    }
+
     void Background::free_() {
         if (!_loaded)
             return;
         _loaded = false;
+        vblankQueue.cancel(this);
         delete[] _colors;
         _colors = nullptr;
         delete[] _tiles;
         _tiles = nullptr;
         delete[] _map;
         _map = nullptr;
+        if (_stream != nullptr) {
+            fclose(_stream);
+            _stream = nullptr;
+            for (int i = 0; i < kBgRegionCacheSize; i++)
+                delete[] (u32*) _regions[i].data;
+            delete[] _regions;
+            _regions = nullptr;
+            _lastRegion = nullptr;
+            _regionStats.bytes = 0;
+        }
+        delete[] _tileSlot;
+        _tileSlot = nullptr;
+        delete[] _slotRefs;
+        _slotRefs = nullptr;
+        delete[] _freeSlots;
+        _freeSlots = nullptr;
+        delete[] _cellTile;
+        _cellTile = nullptr;
+        _tileCache = false;
     }
 
     int Background::loadBgTextMain() {
@@ -120,6 +208,9 @@ namespace Engine {
     int Background::loadBgTextEngine(vu16* bg3Reg, u16* paletteRam, u16* tileRam, u16* mapRam) {
         if (!_loaded)
             return 1;
+        // Only the extended modes show a window of a streamed background
+        if (_stream != nullptr)
+            return 3;
 
         // Set control for 8-bit color depth
         *bg3Reg = (*bg3Reg & (~0x2080)) + (_color8bit << 7);
@@ -203,7 +294,7 @@ namespace Engine {
 
         u16 sizeFlag = 0;
         u16 mapRamUsage = 0x200;
-        u8 mapW = _width, mapH = _height;
+        u16 mapW = _width, mapH = _height;
         if (forceSize != 0) {
             mapW = forceSize;
             mapH = forceSize;
@@ -223,6 +314,7 @@ namespace Engine {
         *reg3C = 0;
         *reg3D = (1 << 8);
         memset(mapRam, 0, mapRamUsage);
+        resetTileCache();
 
         // loadBgRectEngine(bg3Reg, tileRam, mapRam, -1, -1, 34, 26);
         // An extended engine will need a load bg rect afterwards
@@ -251,6 +343,135 @@ namespace Engine {
         return loadBgRectEngine(&REG_BG3CNT, BG_TILE_RAM(1), BG_MAP_RAM(0), x, y, w, h);
     }
 
+    void Background::queueBgRectMain(int x, int y, int w, int h) {
+        // Read now, the job can't wait on the file in v-blank
+        if (_stream != nullptr)
+            pinRect(x, y, w, h, 1);
+        vblankQueue.push(loadBgRectMainJob, this, rectCost(x, y, w, h), x, y, w, h);
+    }
+
+    void Background::loadBgRectMainJob(void* target, const s32* args) {
+        auto* bg = (Background*) target;
+        bg->loadBgRectMain(args[0], args[1], args[2], args[3]);
+        if (bg->_stream != nullptr)
+            bg->pinRect(args[0], args[1], args[2], args[3], -1);
+    }
+
+    void Background::reloadWindow(int windowX, int windowY) {
+        _windowX = windowX, _windowY = windowY;
+        _stepX = 0, _stepY = 0;
+        cancelRects();
+        queueBgRectMain(_windowX, _windowY, kBgWindowWidth, kBgWindowHeight);
+        _tileStats.urgent += kBgWindowCells;
+    }
+
+    bool Background::regionsLow() const {
+        if (_stream == nullptr)
+            return false;
+        int pinned = 0;
+        for (int i = 0; i < kBgRegionCacheSize; i++)
+            pinned += _regions[i].pins != 0;
+        return pinned > kBgRegionCacheSize - bgRegionsSpanned(kBgWindowWidth);
+    }
+
+    int Background::windowOrigin(int first, int last, s32 velocity, int size) {
+        // A cell behind, the rest ahead
+        if (velocity > 0)
+            return first - 1;
+        if (velocity < 0)
+            return last + 2 - size;
+        int margin = size - (last - first + 1);
+        return first - margin / 2;
+    }
+
+    void Background::loadWindowMain(int x, int y) {
+        _windowX = windowOrigin(x >> 3, (x + 255) >> 3, 0, kBgWindowWidth);
+        _windowY = windowOrigin(y >> 3, (y + 191) >> 3, 0, kBgWindowHeight);
+        _stepX = 0, _stepY = 0;
+        cancelRects();
+        loadBgRectMain(_windowX, _windowY, kBgWindowWidth, kBgWindowHeight);
+    }
+
+    void Background::scrollWindowMain(int x, int y, s32 vx, s32 vy) {
+        int firstX = x >> 3, lastX = (x + 255) >> 3;
+        int firstY = y >> 3, lastY = (y + 191) >> 3;
+        int targetX = windowOrigin(firstX, lastX, vx, kBgWindowWidth);
+        int targetY = windowOrigin(firstY, lastY, vy, kBgWindowHeight);
+        if (abs(targetX - _windowX) >= kBgWindowWidth || abs(targetY - _windowY) >= kBgWindowHeight) {
+            // Jumped, nothing to keep
+            reloadWindow(targetX, targetY);
+            return;
+        }
+
+        // Camera turned back, the strip being replaced is in view again
+        if (_stepX != 0) {
+            int col = _stepX > 0 ? _windowX : _windowX + kBgWindowWidth - 1;
+            if (col >= firstX && col <= lastX) {
+                if (_stepDone != 0)
+                    queueBgRectMain(col, _windowY, 1, _stepDone);
+                _tileStats.urgent += _stepDone;
+                _stepX = 0;
+            }
+        } else if (_stepY != 0) {
+            int row = _stepY > 0 ? _windowY : _windowY + kBgWindowHeight - 1;
+            if (row >= firstY && row <= lastY) {
+                if (_stepDone != 0)
+                    queueBgRectMain(_windowX, row, _stepDone, 1);
+                _tileStats.urgent += _stepDone;
+                _stepY = 0;
+            }
+        }
+
+        // Faster than the budget keeps up with, the cells it scrolls in a frame
+        int budget = (abs(vx) * kBgWindowHeight + abs(vy) * kBgWindowWidth + (8 << 8) - 1) / (8 << 8);
+        if (budget < _prefetchCells)
+            budget = _prefetchCells;
+        while (true) {
+            if (_stepX == 0 && _stepY == 0) {
+                if (_windowX != targetX)
+                    _stepX = targetX > _windowX ? 1 : -1;
+                else if (_windowY != targetY)
+                    _stepY = targetY > _windowY ? 1 : -1;
+                else
+                    break;
+                _stepDone = 0;
+            }
+            bool inView = firstX >= _windowX && lastX < _windowX + kBgWindowWidth &&
+                          firstY >= _windowY && lastY < _windowY + kBgWindowHeight;
+            if (inView && budget == 0)
+                break;
+
+            int length = _stepX != 0 ? kBgWindowHeight : kBgWindowWidth;
+            int cells = length - _stepDone;
+            if (inView && cells > budget)
+                cells = budget;
+            if (cells > budget) {
+                _tileStats.urgent += cells - budget;
+                budget = 0;
+            } else {
+                budget -= cells;
+            }
+            if (regionsLow()) {
+                // The queue fell behind, its rects pin most of the regions
+                _regionStats.reloads++;
+                reloadWindow(targetX, targetY);
+                return;
+            }
+            if (_stepX != 0) {
+                int col = _stepX > 0 ? _windowX + kBgWindowWidth : _windowX - 1;
+                queueBgRectMain(col, _windowY + _stepDone, 1, cells);
+            } else {
+                int row = _stepY > 0 ? _windowY + kBgWindowHeight : _windowY - 1;
+                queueBgRectMain(_windowX + _stepDone, row, cells, 1);
+            }
+            _stepDone += cells;
+            if (_stepDone == length) {
+                _windowX += _stepX, _windowY += _stepY;
+                _stepX = 0, _stepY = 0;
+            }
+        }
+    }
+
     int Background::loadBgRectSub(int x, int y, int w, int h) {
         return loadBgRectEngine(&REG_BG3CNT_SUB, BG_TILE_RAM_SUB(1),
                                 BG_MAP_RAM_SUB(0), x, y, w, h);
@@ -264,30 +485,250 @@ namespace Engine {
         int mapSize = 16 << ((*bg3Reg >> 14) & 3);
         for (int row = y; row < y + h; row++) {
             for (int col = x; col < x + w; col++) {
-                int srcRow = mod(row, _height);
-                int srcCol = mod(col, _width);
                 int dstRow = mod(row, mapSize);
                 int dstCol = mod(col, mapSize);
                 auto* mapRes = (u16*)((u8*)mapRam + (dstRow * mapSize + dstCol) * 2);
-                int tileDst = mod(row, 26) * 34 + mod(col, 34);
-                *mapRes = tileDst;
-                auto* tileRes = (u16*)((u8*)tileRam + tileDst * 64);
-                auto* mapSrc = (u16*)((u8 *) _map + (srcRow * _width + srcCol) * 2);
-
-                if (_color8bit) {
-                    u8 *src = (u8 *) _tiles + (*mapSrc) * 64;
-                    dmaCopyHalfWords(3, src, tileRes, 64);
+                int cell = mod(row, kBgWindowHeight) * kBgWindowWidth + mod(col, kBgWindowWidth);
+                const u8* pixels;
+                u16 tile = tileAt(col, row, pixels);
+                _tileStats.cells++;
+
+                if (!_tileCache) {
+                    *mapRes = cell;
+                    copyTile(tileRam, cell, pixels);
+                    _tileStats.uploads++;
+                    continue;
+                }
+                if (tile == kNoTile) {
+                    // Kept out of the cache, id 0 would alias a real tile
+                    if (_cellTile[cell] != kNoTile)
+                        releaseTile(_cellTile[cell]);
+                    _cellTile[cell] = kNoTile;
+                    copyTile(tileRam, kBlankSlot, pixels);
+                    *mapRes = kBlankSlot;
+                    continue;
                 }
-                else {
-                    u8 *src = (u8 *) _tiles + (*mapSrc) * 32;
-                    for (int i = 0; i < 64; i++) {
-                        bool highBits = i & 1;
-                        tileRes[i / 2] &= ~(0xFF << (8 * highBits));
-                        tileRes[i / 2] |= (src[i / 2] >> (4 * highBits) & 0xF) << (8 * highBits);
-                    }
+                if (_cellTile[cell] == tile) {
+                    _tileStats.hits++;
+                } else {
+                    // Released first, the slot may take the new tile
+                    if (_cellTile[cell] != kNoTile)
+                        releaseTile(_cellTile[cell]);
+                    acquireTile(tileRam, tile, pixels);
+                    _cellTile[cell] = tile;
                 }
+                *mapRes = _tileSlot[tile];
             }
         }
         return 0;
     }
-}
\ No newline at end of file
+
+    u32 Background::rectCost(int x, int y, int w, int h) {
+        // 1 map entry and 1 8-bit tile per cell
+        if (!_loaded || !_tileCache)
+            return w * h * (2 + 64);
+        // A tile new to VRAM counts for every cell showing it, close enough
+        u32 cost = 0;
+        for (int row = y; row < y + h; row++) {
+            for (int col = x; col < x + w; col++) {
+                int cell = mod(row, kBgWindowHeight) * kBgWindowWidth + mod(col, kBgWindowWidth);
+                const u8* pixels;
+                u16 tile = tileAt(col, row, pixels);
+                cost += 2;
+                if (tile == kNoTile || (_cellTile[cell] != tile && _tileSlot[tile] == kNoTile))
+                    cost += 64;
+            }
+        }
+        return cost;
+    }
+
+    void Background::resetTileCache() {
+        _tileCache = _tileCacheEnabled;
+        if (!_tileCache)
+            return;
+        if (_tileSlot == nullptr) {
+            _tileSlot = new u16[_tileCount];
+            _slotRefs = new u16[kBgWindowCells];
+            _freeSlots = new u16[kBgWindowCells];
+            _cellTile = new u16[kBgWindowCells];
+        }
+        for (int i = 0; i < _tileCount; i++)
+            _tileSlot[i] = kNoTile;
+        for (int i = 0; i < kBgWindowCells; i++) {
+            _slotRefs[i] = 0;
+            _freeSlots[i] = kBgWindowCells - 1 - i;
+            _cellTile[i] = kNoTile;
+        }
+        _freeSlotCount = kBgWindowCells;
+    }
+
+    u16 Background::acquireTile(u16* tileRam, u16 tile, const u8* pixels) {
+        u16 slot = _tileSlot[tile];
+        if (slot != kNoTile) {
+            _slotRefs[slot]++;
+            _tileStats.hits++;
+            return slot;
+        }
+        // Never runs out, there are as many slots as window cells
+        slot = _freeSlots[--_freeSlotCount];
+        _tileSlot[tile] = slot;
+        _slotRefs[slot] = 1;
+        copyTile(tileRam, slot, pixels);
+        _tileStats.uploads++;
+        return slot;
+    }
+
+    void Background::releaseTile(u16 tile) {
+        u16 slot = _tileSlot[tile];
+        if (--_slotRefs[slot] != 0)
+            return;
+        _tileSlot[tile] = kNoTile;
+        _freeSlots[_freeSlotCount++] = slot;
+    }
+
+    void Background::copyTile(u16* tileRam, u16 slot, const u8* pixels) const {
+        auto* tileRes = (u16*)((u8*)tileRam + slot * 64);
+        if (_color8bit)
+            dmaCopyHalfWords(3, pixels, tileRes, 64);
+        else
+            unpackPixels<PIXELS_4BPP>(pixels, (u32*) tileRes, 64);
+    }
+
+    u16 Background::tileAt(int col, int row, const u8*& pixels) {
+        int srcRow = mod(row, _height);
+        int srcCol = mod(col, _width);
+        u32 tileDataSize = _color8bit ? 64 : 32;
+        if (_stream == nullptr) {
+            u16 tile = _map[srcRow * _width + srcCol];
+            pixels = _tiles + tile * tileDataSize;
+            return tile;
+        }
+
+        Region* region = _lastRegion;
+        if (region == nullptr || region->x != srcCol / _regionSize || region->y != srcRow / _regionSize)
+            region = loadRegion(srcCol / _regionSize, srcRow / _regionSize);
+        if (region == nullptr) {
+            pixels = (const u8*) kBlankTile;
+            return kNoTile;
+        }
+        u16 local = region->map[(srcRow % _regionSize) * _regionSize + srcCol % _regionSize];
+        pixels = region->tiles + local * tileDataSize;
+        return region->ids[local];
+    }
+
+    Background::Region* Background::loadRegion(int regionX, int regionY) {
+        Region* victim = nullptr;
+        for (int i = 0; i < kBgRegionCacheSize; i++) {
+            Region& region = _regions[i];
+            if (region.x == regionX && region.y == regionY) {
+                region.lastUse = ++_regionClock;
+                _lastRegion = &region;
+                return &region;
+            }
+            if (region.pins == 0 && (victim == nullptr || region.lastUse < victim->lastUse))
+                victim = &region;
+        }
+        if (victim == nullptr) {
+            // Queued rects lag the window further than kBgRegionCacheSize allows
+            _regionStats.starved++;
+            nocashMessage("Error: background regions all pinned");
+            return nullptr;
+        }
+
+        // Map, ids, then tiles word aligned
+        u32 tileDataSize = _color8bit ? 64 : 32;
+        u32 cells = _regionSize * _regionSize;
+        u32 mapSize = cells * 2;
+        u32 offset;
+        u16 tileCount;
+        bool read = fseek(_stream, _regionTable + (regionY * _regionsW + regionX) * 4, SEEK_SET) == 0 &&
+                    fread(&offset, 4, 1, _stream) == 1 &&
+                    fseek(_stream, offset, SEEK_SET) == 0 &&
+                    fread(&tileCount, 2, 1, _stream) == 1 &&
+                    tileCount <= cells;
+        if (!read) {
+            nocashMessage("Error: background region header unreadable");
+            return nullptr;
+        }
+
+        u32 idsSize = (tileCount * 2 + 3) & ~3;
+        u32 size = mapSize + idsSize + tileCount * tileDataSize;
+        // The victim's old contents go either way
+        victim->x = -1;
+        victim->y = -1;
+        if (_lastRegion == victim)
+            _lastRegion = nullptr;
+        if (size > victim->capacity) {
+            delete[] (u32*) victim->data;
+            victim->data = (u8*) new u32[(size + 3) / 4];
+            victim->capacity = size;
+        }
+        victim->map = (u16*) victim->data;
+        victim->ids = (u16*) (victim->data + mapSize);
+        victim->tiles = victim->data + mapSize + idsSize;
+        read = fread(victim->ids, 2, tileCount, _stream) == tileCount &&
+               fread(victim->tiles, tileDataSize, tileCount, _stream) == tileCount &&
+               fread(victim->map, 2, cells, _stream) == cells;
+        for (u32 i = 0; i < tileCount && read; i++)
+            read = victim->ids[i] < _tileCount;
+        for (u32 i = 0; i < cells && read; i++)
+            read = victim->map[i] < tileCount;
+        if (!read) {
+            nocashMessage("Error: background region corrupt");
+            return nullptr;
+        }
+
+        _regionStats.bytes += size - victim->size;
+        if (_regionStats.bytes > _regionStats.peakBytes)
+            _regionStats.peakBytes = _regionStats.bytes;
+        victim->size = size;
+        victim->x = regionX;
+        victim->y = regionY;
+        victim->lastUse = ++_regionClock;
+        _lastRegion = victim;
+        _regionStats.loads++;
+        _regionStats.bytesRead += 4 + 2 + tileCount * (2 + tileDataSize) + mapSize;
+        return victim;
+    }
+
+    void Background::pinRect(int x, int y, int w, int h, int delta) {
+        for (int row = y; row < y + h;) {
+            int srcRow = mod(row, _height);
+            // Up to the end of the region, the background or the rect
+            int rows = _regionSize - srcRow % _regionSize;
+            if (rows > _height - srcRow)
+                rows = _height - srcRow;
+            if (rows > y + h - row)
+                rows = y + h - row;
+            for (int col = x; col < x + w;) {
+                int srcCol = mod(col, _width);
+                int cols = _regionSize - srcCol % _regionSize;
+                if (cols > _width - srcCol)
+                    cols = _width - srcCol;
+                if (cols > x + w - col)
+                    cols = x + w - col;
+                Region* region = loadRegion(srcCol / _regionSize, srcRow / _regionSize);
+                // Unpinning one that failed to load when pinned
+                if (region != nullptr && (delta > 0 || region->pins > 0))
+                    region->pins += delta;
+                col += cols;
+            }
+            row += rows;
+        }
+    }
+
+    void Background::cancelRects() {
+        vblankQueue.cancel(this);
+        if (_stream != nullptr) {
+            for (int i = 0; i < kBgRegionCacheSize; i++)
+                _regions[i].pins = 0;
+        }
+    }
+
+    void Background::resetRegionStats() {
+        u32 bytes = _regionStats.bytes;
+        _regionStats = BgRegionStats();
+        _regionStats.bytes = bytes;
+        _regionStats.peakBytes = bytes;
+    }
+}
@@ -3,6 +3,8 @@
 #include "Engine/Font.hpp"
 #include "Engine/Sprite3DManager.hpp"
 #include "Engine/OAMManager.hpp"
+#include "Engine/Profiler.hpp"
+#include "Engine/VBlankQueue.hpp"
 #include "filesystem.h"
 
 namespace Engine {
@@ -60,14 +62,34 @@ namespace Engine {
         glMatrixMode( GL_PROJECTION );     // set matrix mode to projection
         glLoadIdentity();				 // reset
         glOrthof32( 0, SCREEN_WIDTH, SCREEN_HEIGHT, 0, -1 << 12, 1 << 12 );  // downscale projection matrix
+
+        PROFILE_INIT();
         return 0;
     }
 
     void tick() {
-        main3dSpr.draw();
-        glFlush(0);
-        mmStreamUpdate();
-        swiWaitForVBlank();
+        {
+            PROFILE_SCOPE(PROFILE_3D_DRAW);
+            main3dSpr.draw();
+        }
+        {
+            PROFILE_SCOPE(PROFILE_OAM);
+            OAMManagerSub.draw();  // Written to shadow OAM, copied in v-blank
+        }
+        {
+            PROFILE_SCOPE(PROFILE_GL_FLUSH);
+            main3dSpr.waitDraw();  // Sprite commands go in before the swap
+            glFlush(0);
+        }
+        {
+            PROFILE_SCOPE(PROFILE_AUDIO);
+            mmStreamUpdate();
+        }
+        {
+            PROFILE_SCOPE(PROFILE_VBLANK_WAIT);
+            swiWaitForVBlank();
+        }
+        PROFILE_VBLANK_START();
         // TODO: Scroll and bg3 negative? Sub screen?
         REG_BG3X = bg3ScrollX;
         REG_BG3Y = bg3ScrollY;
@@ -76,10 +98,23 @@ namespace Engine {
         REG_BG3PC = bg3Pc;
         REG_BG3PD = bg3Pd;
         // Render post v-blank
-        REG_DISPCNT_SUB |= (1 << 7);
-        OAMManagerSub.draw();  // Update oam in v-blank
-        REG_DISPCNT_SUB &= ~(1 << 7);
-        main3dSpr.updateTextures();  // Update textures in v-blank
-        scanKeys();
+        {
+            PROFILE_SCOPE(PROFILE_OAM_FLUSH);
+            OAMManagerSub.flush();  // Update oam in v-blank
+        }
+        {
+            PROFILE_SCOPE(PROFILE_TEXTURES);
+            main3dSpr.updateTextures();  // Queue texture uploads
+        }
+        {
+            PROFILE_SCOPE(PROFILE_VBLANK_JOBS);
+            vblankQueue.drain();  // Deferred VRAM writes, within budget
+        }
+        {
+            PROFILE_SCOPE(PROFILE_INPUT);
+            scanKeys();
+        }
+        PROFILE_FRAME_END();
+        PROFILE_DUMP();
     }
 }
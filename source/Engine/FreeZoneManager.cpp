@@ -5,81 +5,355 @@
 #include "FreeZoneManager.hpp"
 
 namespace Engine {
-    int FreeZoneManager::reserve(u16 length, u16 &start, u16 alignment) {
-        char buffer[100];
+    FreeZoneManager::FreeZoneManager(int start, int length, const char* name, u16 capacity) {
+        _name = name;
+        _totalLength = length;
+        _capacity = capacity;
+        _zones = new Zone[capacity];
+        for (u16 i = capacity; i > 0; i--)
+            deleteZone(i - 1);
+        for (auto& head : _classHeads)
+            head = kNoZone;
+
+        // Keep the hash at most half full even with every record reserved
+        _hashBits = 1;
+        while ((1 << _hashBits) < 2 * capacity)
+            _hashBits++;
+        _hash = new u16[1 << _hashBits];
+        for (int i = 0; i < (1 << _hashBits); i++)
+            _hash[i] = kNoZone;
+
+        _first = newZone();
+        _zones[_first].start = start;
+        _zones[_first].length = length;
+        linkFree(_first);
+    }
+
+    FreeZoneManager::~FreeZoneManager() {
+        delete[] _zones;
+        _zones = nullptr;
+        delete[] _hash;
+        _hash = nullptr;
+    }
+
+    int FreeZoneManager::sizeClass(u32 length) {
+        if (length < 4)
+            return length;
+        int topBit = 31 - __builtin_clz(length);
+        return (topBit - 1) * kClassSplit + ((length >> (topBit - 2)) & 3);
+    }
+
+    u32 FreeZoneManager::classMinLength(int sizeClass) {
+        if (sizeClass < 4)
+            return sizeClass;
+        if (sizeClass >= kSizeClasses)
+            return 0xFFFFFFFF;
+        return (u32) (4 + (sizeClass & 3)) << (sizeClass / kClassSplit - 1);
+    }
+
+    int FreeZoneManager::nextClass(int sizeClass) const {
+        if (sizeClass >= kSizeClasses)
+            return kSizeClasses;
+        int power = sizeClass / kClassSplit;
+        u32 classes = _classBits[power] & (0xF << (sizeClass % kClassSplit)) & 0xF;
+        if (classes != 0)
+            return power * kClassSplit + __builtin_ctz(classes);
+        if (power == 31)
+            return kSizeClasses;
+        u32 powers = _powerBits & (0xFFFFFFFF << (power + 1));
+        if (powers == 0)
+            return kSizeClasses;
+        power = __builtin_ctz(powers);
+        return power * kClassSplit + __builtin_ctz(_classBits[power]);
+    }
+
+    u16 FreeZoneManager::findFree(u32 length, u32 alignment) const {
+        // Any zone this long fits, wherever it starts. The first class
+        // whose lengths are all at least that is two bitmap lookups.
+        u64 needed = (u64) length + alignment - 1;
+        int fitClass = needed > 0xFFFFFFFF ? kSizeClasses : sizeClass(needed);
+        if (classMinLength(fitClass) < needed)
+            fitClass++;
+        int cls = nextClass(fitClass);
+        if (cls < kSizeClasses)
+            return _classHeads[cls];
 
-        int freeZoneIdx = 0;
-        u16 length_ = 0, alignOffset = 0;
-        for (; freeZoneIdx < _zoneCount; freeZoneIdx++) {
-            start = _zones[freeZoneIdx * 2];
-            length_ = _zones[freeZoneIdx * 2 + 1];
-            alignOffset = (alignment - (start % alignment)) % alignment;
-            if (length_ >= alignOffset + length)
-                break;
+        // Shorter zones may still fit depending on their start, check them
+        // so fits() stays exact
+        for (cls = nextClass(sizeClass(length)); cls < fitClass; cls = nextClass(cls + 1)) {
+            for (u16 zone = _classHeads[cls]; zone != kNoZone; zone = _zones[zone].nextFree) {
+                u32 start = _zones[zone].start;
+                u32 alignOffset = (alignment - (start % alignment)) % alignment;
+                if (_zones[zone].length >= alignOffset + length)
+                    return zone;
+            }
         }
+        return kNoZone;
+    }
+
+    bool FreeZoneManager::fits(u32 length, u32 alignment) const {
+        return findFree(length, alignment) != kNoZone;
+    }
+
+    int FreeZoneManager::reserve(u32 length, u32 &start, u32 alignment) {
+        char buffer[100];
+#ifdef DEBUG_PROFILER
+        u32 startTicks = cpuGetTiming();
+#endif
 
-        if (freeZoneIdx >= _zoneCount) {
-            sprintf(buffer, "FZM %s error reserve %d length %d (needed %d) alignment %d",
-                    _name, start, length_, length, alignment);
+        u16 zone = findFree(length, alignment);
+        if (zone == kNoZone) {
+            recordFailure(length);
+            sprintf(buffer, "FZM %s error reserve length %lu alignment %lu",
+                    _name, (unsigned long) length, (unsigned long) alignment);
             nocashMessage(buffer);
 #ifdef DEBUG_ZONES_DUMP
             dump();
 #endif
             return 1;
         }
+        if (!carve(zone, length, alignment, start)) {
+            recordFailure(length);
+            return 1;
+        }
 
-        if (alignOffset == 0) {
-            if (length_ == length) {
-                // Remove free zone
-                auto newFreeZone = new u16[--_zoneCount * 2];
+        _stats.reserves++;
+        u32 used = _totalLength - _freeLength;
+        if (used > _stats.peakUsed)
+            _stats.peakUsed = used;
+#ifdef DEBUG_PROFILER
+        u32 ticks = cpuGetTiming() - startTicks;
+        _stats.reserveTicks += ticks;
+        if (ticks > _stats.maxReserveTicks)
+            _stats.maxReserveTicks = ticks;
+#endif
 
-                memcpy(newFreeZone, _zones, freeZoneIdx * 2 * sizeof(u16));
+#ifdef DEBUG_ZONES
+        sprintf(buffer, "FZM %s reserve %lu (align %lu) -> start %lu", _name,
+                (unsigned long) length, (unsigned long) alignment, (unsigned long) start);
+        nocashMessage(buffer);
+#endif
 
-                memcpy(&newFreeZone[freeZoneIdx * 2], &_zones[freeZoneIdx * 2 + 2],
-                       (_zoneCount - freeZoneIdx) * 2 * sizeof(u16));
+#ifdef DEBUG_ZONES_DUMP
+        dump();
+#endif
 
-                delete[] _zones;
-                _zones = newFreeZone;
-            } else {
-                _zones[freeZoneIdx * 2] += length;
-                _zones[freeZoneIdx * 2 + 1] -= length;
+        return 0;
+    }
+
+    bool FreeZoneManager::carve(u16 zone, u32 length, u32 alignment, u32& start) {
+        Zone& found = _zones[zone];
+        u32 alignOffset = (alignment - (found.start % alignment)) % alignment;
+        u32 tailLength = found.length - alignOffset - length;
+        if (_unusedCount < (alignOffset != 0) + (tailLength != 0)) {
+            char buffer[100];
+            sprintf(buffer, "FZM %s error reserve length %lu: out of zones (%d)",
+                    _name, (unsigned long) length, _capacity);
+            nocashMessage(buffer);
+            return false;
+        }
+
+        unlinkFree(zone);
+        start = found.start + alignOffset;
+
+        u16 reserved = zone;
+        if (alignOffset != 0) {
+            // The padding stays free in front
+            reserved = newZone();
+            Zone& used = _zones[reserved];
+            used.start = start;
+            used.prev = zone;
+            used.next = found.next;
+            if (found.next != kNoZone)
+                _zones[found.next].prev = reserved;
+            found.next = reserved;
+            found.length = alignOffset;
+            linkFree(zone);
+        }
+        Zone& used = _zones[reserved];
+        used.length = length;
+        used.alignment = alignment;
+        used.free = false;
+
+        if (tailLength != 0) {
+            u16 tail = newZone();
+            _zones[tail].start = start + length;
+            _zones[tail].length = tailLength;
+            _zones[tail].prev = reserved;
+            _zones[tail].next = used.next;
+            if (used.next != kNoZone)
+                _zones[used.next].prev = tail;
+            used.next = tail;
+            linkFree(tail);
+        }
+        hashInsert(reserved);
+        return true;
+    }
+
+    u32 FreeZoneManager::compact(u32 budget) {
+        if (_relocator == nullptr)
+            return 0;
+        u32 moved = 0;
+        for (u16 zone = _first, after; zone != kNoZone && moved < budget; zone = after) {
+            Zone& used = _zones[zone];
+            // Next reserved zone, moving this one leaves that one alone
+            after = used.next;
+            if (after != kNoZone && _zones[after].free)
+                after = _zones[after].next;
+            if (used.free || used.length > budget - moved || _unusedCount < 2)
+                continue;
+
+            // Lowest free zone in front of it that takes it whole, or else
+            // slide down into the free zone right in front
+            u16 hole = _first;
+            u32 alignOffset = 0;
+            for (; hole != zone; hole = _zones[hole].next) {
+                if (!_zones[hole].free)
+                    continue;
+                alignOffset = (used.alignment - (_zones[hole].start % used.alignment)) % used.alignment;
+                if (_zones[hole].length >= alignOffset + used.length)
+                    break;
             }
-        } else {
-            _zones[freeZoneIdx * 2 + 1] = alignOffset;
-            start += alignOffset;
-            length_ -= alignOffset;
-            // if the length_ == length then we don't have to do anything
-            // as just trimming the length of the zone is enough
-            // otherwise we must create another free zone after this one
-            if (length != length_) {
-                // Create free zone
-                auto newFreeZone = new u16[++_zoneCount * 2];
-
-                // copy all tiles including the freeZoneIdx
-                memcpy(newFreeZone, _zones, (freeZoneIdx + 1) * 2 * sizeof(u16));
-
-                // copy all tiles after the freeZoneIdx leaving a gap
-                memcpy(&newFreeZone[(freeZoneIdx + 2) * 2], &_zones[(freeZoneIdx + 1) * 2],
-                       (_zoneCount - freeZoneIdx - 2) * 2 * sizeof(u16));
-
-                newFreeZone[(freeZoneIdx + 1) * 2] = start + length;
-                newFreeZone[(freeZoneIdx + 1) * 2 + 1] = length_ - length;
-
-                delete[] _zones;
-                _zones = newFreeZone;
+            bool slide = hole == zone;
+            if (slide) {
+                hole = used.prev;
+                if (hole == kNoZone || !_zones[hole].free)
+                    continue;
+                alignOffset = (used.alignment - (_zones[hole].start % used.alignment)) % used.alignment;
+                if (alignOffset >= _zones[hole].length)
+                    continue;
             }
-        }
+            u32 start = used.start, newStart = _zones[hole].start + alignOffset;
+            if (!_relocator(_relocatorContext, start, newStart, used.length))
+                continue;
 
 #ifdef DEBUG_ZONES
-        sprintf(buffer, "FZM %s reserve %d (align %d) -> start %d", _name, length, alignment, start);
-        nocashMessage(buffer);
+            char buffer[100];
+            sprintf(buffer, "FZM %s move %lu -> %lu (%lu)", _name, (unsigned long) start,
+                    (unsigned long) newStart, (unsigned long) used.length);
+            nocashMessage(buffer);
 #endif
+            moved += used.length;
+            hashRemove(hashFind(start));
+            if (!slide) {
+                carve(hole, used.length, used.alignment, newStart);
+                release(zone);
+                continue;
+            }
+
+            // The free zone in front keeps the padding, what the zone
+            // leaves behind goes to the free zone after it
+            unlinkFree(hole);
+            used.start = newStart;
+            hashInsert(zone);
+            if (alignOffset != 0) {
+                _zones[hole].length = alignOffset;
+                linkFree(hole);
+            } else {
+                used.prev = _zones[hole].prev;
+                if (used.prev != kNoZone)
+                    _zones[used.prev].next = zone;
+                else
+                    _first = zone;
+                deleteZone(hole);
+            }
+            u32 shift = start - newStart;
+            u16 next = used.next;
+            if (next != kNoZone && _zones[next].free) {
+                unlinkFree(next);
+                _zones[next].start -= shift;
+                _zones[next].length += shift;
+                linkFree(next);
+            } else {
+                u16 gap = newZone();
+                _zones[gap].start = newStart + used.length;
+                _zones[gap].length = shift;
+                _zones[gap].prev = zone;
+                _zones[gap].next = next;
+                if (next != kNoZone)
+                    _zones[next].prev = gap;
+                used.next = gap;
+                linkFree(gap);
+            }
+        }
 
 #ifdef DEBUG_ZONES_DUMP
-        dump();
+        if (moved != 0)
+            dump();
 #endif
+        return moved;
+    }
 
-        return 0;
+    u32 FreeZoneManager::getLargestFree() const {
+        if (_powerBits == 0)
+            return 0;
+        int power = 31 - __builtin_clz(_powerBits);
+        int cls = power * kClassSplit + 31 - __builtin_clz(_classBits[power]);
+        u32 largest = 0;
+        for (u16 zone = _classHeads[cls]; zone != kNoZone; zone = _zones[zone].nextFree)
+            largest = _zones[zone].length > largest ? _zones[zone].length : largest;
+        return largest;
+    }
+
+    u8 FreeZoneManager::getFragmentation() const {
+        if (_freeLength == 0)
+            return 0;
+        return (u64) (_freeLength - getLargestFree()) * 100 / _freeLength;
+    }
+
+    void FreeZoneManager::recordFailure(u32 length) {
+        _stats.failures++;
+        if (_freeLength >= length)
+            _stats.fragmentedFailures++;
+        int bucket = length == 0 ? 0 : 31 - __builtin_clz(length);
+        _stats.failedBySize[bucket < kZoneFailBuckets ? bucket : kZoneFailBuckets - 1]++;
+    }
+
+    ZoneStats FreeZoneManager::getStats() const {
+        ZoneStats stats = _stats;
+        stats.used = _totalLength - _freeLength;
+        stats.largestFree = getLargestFree();
+        stats.fragmentation = getFragmentation();
+        stats.freeZones = _freeZoneCount;
+        return stats;
+    }
+
+    void FreeZoneManager::resetStats() {
+        _stats = ZoneStats();
+        _stats.peakUsed = _totalLength - _freeLength;
+    }
+
+    void FreeZoneManager::dumpStats() const {
+        char buffer[120];
+        ZoneStats stats = getStats();
+        sprintf(buffer, "FZM %s used %lu/%lu peak %lu largest free %lu frag %d%% free zones %d",
+                _name, (unsigned long) stats.used, (unsigned long) _totalLength,
+                (unsigned long) stats.peakUsed, (unsigned long) stats.largestFree,
+                stats.fragmentation, stats.freeZones);
+        nocashMessage(buffer);
+        sprintf(buffer, "FZM %s reserves %lu frees %lu failures %lu (%lu fragmented)",
+                _name, (unsigned long) stats.reserves, (unsigned long) stats.frees,
+                (unsigned long) stats.failures, (unsigned long) stats.fragmentedFailures);
+        nocashMessage(buffer);
+        if (stats.failures != 0) {
+            int length = sprintf(buffer, "FZM %s failed by size", _name);
+            for (int bucket = 0; bucket < kZoneFailBuckets; bucket++) {
+                if (stats.failedBySize[bucket] != 0)
+                    length += sprintf(buffer + length, " %lu:%lu",
+                                      1ul << bucket, (unsigned long) stats.failedBySize[bucket]);
+                if (length > 100)
+                    break;
+            }
+            nocashMessage(buffer);
+        }
+#ifdef DEBUG_PROFILER
+        sprintf(buffer, "FZM %s ticks reserve avg %lu max %lu free avg %lu max %lu", _name,
+                (unsigned long) (stats.reserves != 0 ? stats.reserveTicks / stats.reserves : 0),
+                (unsigned long) stats.maxReserveTicks,
+                (unsigned long) (stats.frees != 0 ? stats.freeTicks / stats.frees : 0),
+                (unsigned long) stats.maxFreeTicks);
+        nocashMessage(buffer);
+#endif
     }
 
 #ifdef DEBUG_ZONES_DUMP
@@ -87,83 +361,156 @@ namespace Engine {
         char buffer[100];
         sprintf(buffer, "FZM %s DUMP", _name);
         nocashMessage(buffer);
-        for (int i = 0; i < _zoneCount; i++) {
-            sprintf(buffer, "ZONE %d (%d)", _zones[i * 2], _zones[i * 2 + 1]);
+        for (u16 zone = _first; zone != kNoZone; zone = _zones[zone].next) {
+            if (!_zones[zone].free)
+                continue;
+            sprintf(buffer, "ZONE %lu (%lu)", (unsigned long) _zones[zone].start,
+                    (unsigned long) _zones[zone].length);
             nocashMessage(buffer);
         }
         nocashMessage("----------------------------------");
     }
 #endif
 
-    void FreeZoneManager::free(u16 length, u16 start) {
-#ifdef DEBUG_ZONES
+    void FreeZoneManager::free(u32 length, u32 start) {
         char buffer[100];
-        sprintf(buffer, "FZM %s free %d (%d)", _name, start, length);
+#ifdef DEBUG_PROFILER
+        u32 startTicks = cpuGetTiming();
+#endif
+#ifdef DEBUG_ZONES
+        sprintf(buffer, "FZM %s free %lu (%lu)", _name, (unsigned long) start, (unsigned long) length);
         nocashMessage(buffer);
 #endif
 
-        int freeAfterIdx = 0;
-        for (; freeAfterIdx < _zoneCount; freeAfterIdx++) {
-            if (_zones[freeAfterIdx * 2] > start)
-                break;
+        int slot = hashFind(start);
+        if (slot < 0 || _zones[_hash[slot]].length != length) {
+            sprintf(buffer, "FZM %s error free %lu (%lu) not reserved", _name,
+                    (unsigned long) start, (unsigned long) length);
+            nocashMessage(buffer);
+            return;
         }
+        u16 zone = _hash[slot];
+        hashRemove(slot);
+        release(zone);
 
-        bool mergePrev = false, mergePost = false;
-
-        // merge prev if start2 + length2 = start
-        if (freeAfterIdx > 0)
-            mergePrev = (_zones[freeAfterIdx * 2 - 2] + _zones[freeAfterIdx * 2 - 1]) == start;
+        _stats.frees++;
+#ifdef DEBUG_PROFILER
+        u32 ticks = cpuGetTiming() - startTicks;
+        _stats.freeTicks += ticks;
+        if (ticks > _stats.maxFreeTicks)
+            _stats.maxFreeTicks = ticks;
+#endif
 
-        // merge post if start + length = start2
-        if (freeAfterIdx <= _zoneCount - 1)
-            mergePost = (start + length) == _zones[freeAfterIdx * 2];
+#ifdef DEBUG_ZONES_DUMP
+        dump();
+#endif
+    }
 
-        if (mergePost && mergePrev)
-        {
-            auto* newFreeZones = new u16[--_zoneCount * 2];
+    void FreeZoneManager::release(u16 zone) {
+        Zone& freed = _zones[zone];
+        freed.free = true;
 
-            // copy all zones before the free one
-            memcpy(newFreeZones, _zones, freeAfterIdx * 2 * sizeof(u16));
+        u16 next = freed.next;
+        if (next != kNoZone && _zones[next].free) {
+            unlinkFree(next);
+            freed.length += _zones[next].length;
+            freed.next = _zones[next].next;
+            if (freed.next != kNoZone)
+                _zones[freed.next].prev = zone;
+            deleteZone(next);
+        }
 
-            // add the length of the one we are freeing and the post
-            newFreeZones[freeAfterIdx * 2 - 1] += length + _zones[freeAfterIdx * 2 + 1];
+        u16 prev = freed.prev;
+        if (prev != kNoZone && _zones[prev].free) {
+            unlinkFree(prev);
+            _zones[prev].length += freed.length;
+            _zones[prev].next = freed.next;
+            if (freed.next != kNoZone)
+                _zones[freed.next].prev = prev;
+            deleteZone(zone);
+            zone = prev;
+        }
+        linkFree(zone);
+    }
 
-            // copy all remaining zones
-            memcpy(&newFreeZones[freeAfterIdx * 2], &_zones[(freeAfterIdx + 1) * 2],
-                   (_zoneCount - freeAfterIdx) * 2 * sizeof(u16));
+    void FreeZoneManager::linkFree(u16 zone) {
+        int cls = sizeClass(_zones[zone].length);
+        _zones[zone].free = true;
+        _zones[zone].prevFree = kNoZone;
+        _zones[zone].nextFree = _classHeads[cls];
+        if (_classHeads[cls] != kNoZone)
+            _zones[_classHeads[cls]].prevFree = zone;
+        _classHeads[cls] = zone;
+        _classBits[cls / kClassSplit] |= 1 << (cls % kClassSplit);
+        _powerBits |= 1 << (cls / kClassSplit);
+        _freeZoneCount++;
+        _freeLength += _zones[zone].length;
+    }
 
-            delete[] _zones;
-            _zones = newFreeZones;
-        }
-        else if (mergePrev)
-        {
-            // add length to the previous one
-            _zones[freeAfterIdx * 2 - 1] += length;
-        }
-        else if (mergePost)
-        {
-            // add length to the start and length of the post
-            _zones[freeAfterIdx * 2] -= length;
-            _zones[freeAfterIdx * 2 + 1] += length;
-        }
+    void FreeZoneManager::unlinkFree(u16 zone) {
+        Zone& unlinked = _zones[zone];
+        int cls = sizeClass(unlinked.length);
+        if (unlinked.prevFree != kNoZone)
+            _zones[unlinked.prevFree].nextFree = unlinked.nextFree;
         else
-        {
-            auto* newFreeZones = new u16[2 * ++_zoneCount];
+            _classHeads[cls] = unlinked.nextFree;
+        if (unlinked.nextFree != kNoZone)
+            _zones[unlinked.nextFree].prevFree = unlinked.prevFree;
+        if (_classHeads[cls] == kNoZone) {
+            _classBits[cls / kClassSplit] &= ~(1 << (cls % kClassSplit));
+            if (_classBits[cls / kClassSplit] == 0)
+                _powerBits &= ~(1 << (cls / kClassSplit));
+        }
+        _freeZoneCount--;
+        _freeLength -= unlinked.length;
+    }
 
-            memcpy(newFreeZones, _zones, freeAfterIdx * 2 * sizeof(u16));
+    u16 FreeZoneManager::newZone() {
+        u16 zone = _unused;
+        _unused = _zones[zone].nextFree;
+        _unusedCount--;
+        _zones[zone] = Zone();
+        return zone;
+    }
 
-            newFreeZones[freeAfterIdx * 2] = start;
-            newFreeZones[freeAfterIdx * 2 + 1] = length;
+    void FreeZoneManager::deleteZone(u16 zone) {
+        _zones[zone].nextFree = _unused;
+        _unused = zone;
+        _unusedCount++;
+    }
 
-            memcpy(&newFreeZones[(freeAfterIdx + 1) * 2], &_zones[freeAfterIdx * 2],
-                   (_zoneCount - (freeAfterIdx + 1)) * 2 * sizeof(u16));
+    void FreeZoneManager::hashInsert(u16 zone) {
+        u16 mask = (1 << _hashBits) - 1;
+        u16 slot = hashSlot(_zones[zone].start);
+        while (_hash[slot] != kNoZone)
+            slot = (slot + 1) & mask;
+        _hash[slot] = zone;
+    }
 
-            delete[] _zones;
-            _zones = newFreeZones;
+    int FreeZoneManager::hashFind(u32 start) const {
+        u16 mask = (1 << _hashBits) - 1;
+        for (u16 slot = hashSlot(start); _hash[slot] != kNoZone; slot = (slot + 1) & mask) {
+            if (_zones[_hash[slot]].start == start)
+                return slot;
         }
+        return -1;
+    }
 
-#ifdef DEBUG_ZONES_DUMP
-        dump();
-#endif
+    void FreeZoneManager::hashRemove(int slot) {
+        // Move later entries of the probe run back into the hole, so
+        // lookups never stop early at it
+        u16 mask = (1 << _hashBits) - 1;
+        u16 hole = slot;
+        _hash[hole] = kNoZone;
+        for (u16 next = (hole + 1) & mask; _hash[next] != kNoZone; next = (next + 1) & mask) {
+            u16 home = hashSlot(_zones[_hash[next]].start);
+            bool stays = hole <= next ? (hole < home && home <= next)
+                                      : (hole < home || home <= next);
+            if (stays)
+                continue;
+            _hash[hole] = _hash[next];
+            _hash[next] = kNoZone;
+            hole = next;
+        }
     }
 }
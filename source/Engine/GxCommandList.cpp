@@ -0,0 +1,44 @@
+#include "Engine/GxCommandList.hpp"
+#include <cstring>
+
+namespace Engine {
+    GxCommandList::~GxCommandList() {
+        wait();
+        delete[] _data;
+    }
+
+    void GxCommandList::reset() {
+        wait();
+        _submitted = false;
+        _count = 0;
+        _headerSlots = 4;
+    }
+
+    void GxCommandList::grow(u32 words) {
+        u32 capacityNew = _capacity == 0 ? 256 : _capacity * 2;
+        while (capacityNew < words)
+            capacityNew *= 2;
+        auto* dataNew = new u32[capacityNew];
+        memcpy(dataNew, _data, _count * 4);
+        delete[] _data;
+        _data = dataNew;
+        _capacity = capacityNew;
+    }
+
+    void GxCommandList::submit() {
+        if (_count == 0)
+            return;
+        // The DMA reads main RAM, not the cache
+        DC_FlushRange(_data, _count * 4);
+        DMA_SRC(kGxDmaChannel) = (uintptr_t) _data;
+        DMA_DEST(kGxDmaChannel) = (uintptr_t) &GFX_FIFO;
+        DMA_CR(kGxDmaChannel) = DMA_FIFO | _count;
+        _submitted = true;
+    }
+
+    void GxCommandList::wait() const {
+        if (!_submitted)
+            return;
+        while (DMA_CR(kGxDmaChannel) & DMA_BUSY);
+    }
+}
@@ -1,5 +1,7 @@
 #include "Engine/OAMManager.hpp"
+#include "Engine/PixelKernels.hpp"
 #include "Engine/Texture.hpp"
+#include "Engine/VBlankQueue.hpp"
 #include "DEBUG_FLAGS.hpp"
 
 namespace Engine {
@@ -8,31 +10,29 @@ namespace Engine {
             return -1;
         if (res._memory.allocated != NoAlloc)
             return -2;
+        if (res._texture->_compressed) {
+            nocashMessage("4x4 compressed sprites are 3D only");
+            return -5;
+        }
+        if (_tilesLent) {
+            nocashMessage("Error: sprite tile VRAM is lent to 3D textures");
+            return -6;
+        }
 
+        res._texture->unpackTiles();
+        // OAM keeps the tiles, holding both would double a version 5 sheet
+        res._texture->dropTexData();
         res._memory.paletteColors = new u8[res._texture->_colorCount];
         u16* colors = res._texture->_colors;
 
         for (int i = 0; i < res._texture->_colorCount; i++) {
-            int result = -1;
-            bool foundColor = false;
-
-            for (int paletteIdx = 0; paletteIdx < 255; paletteIdx++) {
-                if (_paletteRam[1 + paletteIdx] == colors[i]) {
-                    foundColor = true;
-                    result = paletteIdx;
-                    break;
-                }
-                if (_paletteRefCounts[paletteIdx] == 0 and result == -1) {
-                    result = paletteIdx;
-                }
+            int result = reservePaletteColor(colors[i]);
+            if (result < 0) {
+                nocashMessage("Palette full");
+                releasePaletteColors(res, i);
+                return -4;
             }
-
             res._memory.paletteColors[i] = result + 1;
-            _paletteRefCounts[result]++;
-
-            if (!foundColor) {
-                _paletteRam[1 + result] = colors[i];
-            }
         }
 
         // Reserve oam tiles
@@ -69,10 +69,11 @@ namespace Engine {
                 int oamId = reserveOAMEntry(reserveX, reserveY);
                 if (oamId < 0)
                 {
-                    delete res._memory.oamEntries;
+                    for (int i = 0; i < oamY * oamW + oamX; i++)
+                        freeOAMEntry(res._memory.oamEntries[i]);
+                    delete[] res._memory.oamEntries;
                     res._memory.oamEntries = nullptr;
-                    delete res._memory.paletteColors;
-                    res._memory.paletteColors = nullptr;
+                    releasePaletteColors(res, res._texture->_colorCount);
                     return oamId - 2;
                 }
                 res._memory.oamEntries[oamY * oamW + oamX] = oamId;
@@ -93,27 +94,174 @@ namespace Engine {
         return 0;
     }
 
+    void OAMManager::resetPaletteAllocator() {
+        for (auto& color : _paletteHashColors)
+            color = 0xFFFF;
+        // Every slot starts free, handed out in order
+        for (int slot = 0; slot < kOamPaletteSlots; slot++) {
+            _paletteRefCounts[slot] = 0;
+            _paletteFreePrev[slot] = slot == 0 ? kPaletteNone : slot - 1;
+            _paletteFreeNext[slot] = slot == kOamPaletteSlots - 1 ? kPaletteNone : slot + 1;
+        }
+        _paletteFreeHead = 0;
+        _paletteFreeTail = kOamPaletteSlots - 1;
+    }
+
+    int OAMManager::reservePaletteColor(u16 color) {
+        int slot = findPaletteColor(color);
+        if (slot >= 0) {
+            if (_paletteRefCounts[slot] == 0)
+                unlinkFreePaletteSlot(slot);
+            _paletteRefCounts[slot]++;
+            return slot;
+        }
+
+        slot = _paletteFreeHead;
+        if (slot == kPaletteNone)
+            return -1;
+        unlinkFreePaletteSlot(slot);
+        // Slot may still hold a released color, forget it
+        u16 oldColor = _paletteRam[1 + slot] & 0x7FFF;
+        if (findPaletteColor(oldColor) == slot)
+            removePaletteColor(oldColor);
+
+        _paletteRam[1 + slot] = color;
+        insertPaletteColor(color, slot);
+        _paletteRefCounts[slot]++;
+        return slot;
+    }
+
+    void OAMManager::releasePaletteColors(Sprite& spr, int colorCount) {
+        for (int colorIdx = 0; colorIdx < colorCount; colorIdx++) {
+            u8 slot = spr._memory.paletteColors[colorIdx] - 1;
+            _paletteRefCounts[slot]--;
+            if (_paletteRefCounts[slot] != 0)
+                continue;
+            // Append to the free list, reused last so its color lingers
+            _paletteFreeNext[slot] = kPaletteNone;
+            _paletteFreePrev[slot] = _paletteFreeTail;
+            if (_paletteFreeTail != kPaletteNone)
+                _paletteFreeNext[_paletteFreeTail] = slot;
+            else
+                _paletteFreeHead = slot;
+            _paletteFreeTail = slot;
+        }
+        delete[] spr._memory.paletteColors;
+        spr._memory.paletteColors = nullptr;
+    }
+
+    void OAMManager::unlinkFreePaletteSlot(u8 slot) {
+        u8 prev = _paletteFreePrev[slot];
+        u8 next = _paletteFreeNext[slot];
+        if (prev != kPaletteNone)
+            _paletteFreeNext[prev] = next;
+        else
+            _paletteFreeHead = next;
+        if (next != kPaletteNone)
+            _paletteFreePrev[next] = prev;
+        else
+            _paletteFreeTail = prev;
+    }
+
+    static inline u16 paletteHash(u16 color) {
+        return (u16)(color * 0x9E37) >> 7;  // Top 9 bits
+    }
+
+    int OAMManager::findPaletteColor(u16 color) const {
+        color &= 0x7FFF;
+        for (u16 idx = paletteHash(color);; idx = (idx + 1) & (kPaletteHashSize - 1)) {
+            if (_paletteHashColors[idx] == color)
+                return _paletteHashSlots[idx];
+            if (_paletteHashColors[idx] == 0xFFFF)
+                return -1;
+        }
+    }
+
+    void OAMManager::insertPaletteColor(u16 color, u8 slot) {
+        color &= 0x7FFF;
+        u16 idx = paletteHash(color);
+        while (_paletteHashColors[idx] != 0xFFFF)
+            idx = (idx + 1) & (kPaletteHashSize - 1);
+        _paletteHashColors[idx] = color;
+        _paletteHashSlots[idx] = slot;
+    }
+
+    void OAMManager::removePaletteColor(u16 color) {
+        color &= 0x7FFF;
+        u16 idx = paletteHash(color);
+        while (_paletteHashColors[idx] != color)
+            idx = (idx + 1) & (kPaletteHashSize - 1);
+        // Backward shift deletion, keeps probe chains intact without tombstones
+        u16 hole = idx;
+        for (u16 next = (hole + 1) & (kPaletteHashSize - 1);
+             _paletteHashColors[next] != 0xFFFF;
+             next = (next + 1) & (kPaletteHashSize - 1)) {
+            u16 home = paletteHash(_paletteHashColors[next]);
+            // Move next into the hole unless its home lies in (hole, next]
+            if (((next - home) & (kPaletteHashSize - 1)) >= ((next - hole) & (kPaletteHashSize - 1))) {
+                _paletteHashColors[hole] = _paletteHashColors[next];
+                _paletteHashSlots[hole] = _paletteHashSlots[next];
+                hole = next;
+            }
+        }
+        _paletteHashColors[hole] = 0xFFFF;
+    }
+
     int OAMManager::loadSpriteFrame(Engine::Sprite &spr, int frame) {
         if (spr._memory.loadedFrame == frame)
             return -1;
         if (frame >= spr._texture->_frameCount || frame < 0)
             return -2;
         spr._memory.loadedFrame = frame;
+
+        if (spr._memory.oamFrameCache == nullptr) {
+            u32 frameBytes = 0;
+            for (int i = 0; i < spr._memory.oamEntryCount; i++) {
+                OAMEntry* oamEntry = &_oamEntries[spr._memory.oamEntries[i]];
+                frameBytes += oamEntry->tileWidth * oamEntry->tileHeight * 64;
+            }
+            spr._memory.oamFrameBytes = frameBytes;
+            spr._memory.oamFrameCache = new u8[frameBytes * spr._texture->_frameCount];
+            spr._memory.oamFrameCached = new bool[spr._texture->_frameCount];
+            memset(spr._memory.oamFrameCached, 0, spr._texture->_frameCount);
+        }
+        if (!spr._memory.oamFrameCached[frame]) {
+            buildFrameCache(spr, frame);
+            spr._memory.oamFrameCached[frame] = true;
+        }
+
+        // One copy per OAM entry on the next flush, tiles are already in OAM layout
+        u8* src = spr._memory.oamFrameCache + frame * spr._memory.oamFrameBytes;
+        for (int i = 0; i < spr._memory.oamEntryCount; i++) {
+            int oamId = spr._memory.oamEntries[i];
+            OAMEntry* oamEntry = &_oamEntries[oamId];
+            _pendingTiles[oamId] = src;
+            src += oamEntry->tileWidth * oamEntry->tileHeight * 64;
+        }
+        return 0;
+    }
+
+    void OAMManager::buildFrameCache(Engine::Sprite &spr, int frame) {
         u8 tileWidth, tileHeight;
         spr._texture->getSizeTiles(tileWidth, tileHeight);
         u8 oamW = (tileWidth + 7) / 8;
         u8 oamH = (tileHeight + 7) / 8;
         u16 framePos = frame * tileWidth * tileHeight;
 
-        // Copy tile into memory (replacing colors)
+        u8* frameStart = spr._memory.oamFrameCache + frame * spr._memory.oamFrameBytes;
+        memset(frameStart, 0, spr._memory.oamFrameBytes);
+
+        // Texture color to the palette slot it got, 0 stays transparent
+        u8 remap[256] = {0};
+        for (int i = 0; i < spr._texture->_colorCount; i++)
+            remap[i + 1] = spr._memory.paletteColors[i];
+
+        // Replace colors, tiles stay in the order the OAM entries expect
+        u8* entryStart = frameStart;
         for (int oamY = 0; oamY < oamH; oamY++) {
             for (int oamX = 0; oamX < oamW; oamX++) {
                 int oamId = spr._memory.oamEntries[oamY * oamW + oamX];
                 OAMEntry* oamEntry = &_oamEntries[oamId];
-                u16* tileRamStart = (u16*)((u8*) _tileRam + oamEntry->tileStart * 64);
-                u8 neededTiles = oamEntry->tileWidth * oamEntry->tileHeight;
-
-                memset(tileRamStart, 0, neededTiles * 64);
 
                 u8 tilesX = 8, tilesY = 8;
                 if (oamX == oamW - 1)
@@ -125,24 +273,24 @@ namespace Engine {
                     for (int tileX = 0; tileX < tilesX; tileX++) {
                         u16 tileXPos = oamX * 8 + tileX;
                         u16 tileYPos = oamY * 8 + tileY;
-                        u32 tileOffset = framePos + tileYPos * tileWidth + tileXPos;
-                        tileOffset *= 64;
-                        for (int pixelY = 0; pixelY < 8; pixelY++) {
-                            for (int pixelX = 0; pixelX < 8; pixelX++) {
-                                u32 resultOffset = (tileY * oamEntry->tileWidth + tileX) * 8 * 8 + pixelY * 8 + pixelX;
-                                u32 tilesOffset = tileOffset + pixelY * 8 + pixelX;
-                                u8 pixel = spr._texture->_tiles[tilesOffset];
-                                if (pixel == 0) {
-                                    continue;
-                                }
-                                tileRamStart[resultOffset / 2] += spr._memory.paletteColors[pixel - 1] << (8 * (resultOffset & 1));
-                            }
-                        }
+                        u32 tileOffset = (framePos + tileYPos * tileWidth + tileXPos) * 64;
+                        u8* src = &spr._texture->_tiles[tileOffset];
+                        u8* dst = entryStart + (tileY * oamEntry->tileWidth + tileX) * 64;
+                        remapPixels(src, (u32*) dst, remap, 64);
                     }
                 }
+                entryStart += oamEntry->tileWidth * oamEntry->tileHeight * 64;
             }
         }
-        return 0;
+        DC_FlushRange(frameStart, spr._memory.oamFrameBytes);
+    }
+
+    void OAMManager::freeFrameCache(Engine::Sprite &spr) {
+        delete[] spr._memory.oamFrameCache;
+        spr._memory.oamFrameCache = nullptr;
+        delete[] spr._memory.oamFrameCached;
+        spr._memory.oamFrameCached = nullptr;
+        spr._memory.oamFrameBytes = 0;
     }
 
     int OAMManager::reserveOAMEntry(u8 tileW, u8 tileH) {
@@ -160,12 +308,24 @@ namespace Engine {
             return -1;
         }
         oamEntry->free_ = false;
+        oamEntry->culled = false;
         oamEntry->tileWidth = tileW;
         oamEntry->tileHeight = tileH;
 
         // load tiles in groups of animations
         u16 neededTiles = oamEntry->tileWidth * oamEntry->tileHeight;
-        _tileZones.reserve(neededTiles, oamEntry->tileStart, 1);
+        u32 tileStart;
+        if (_compactionEnabled && !_tileZones.fits(neededTiles, 1) &&
+                _tileZones.getFreeLength() >= neededTiles) {
+            // All the way, tiles move on the next flush with the entries
+            // pointing at them
+            _tileZones.compact(1024);
+        }
+        if (_tileZones.reserve(neededTiles, tileStart, 1) != 0) {
+            oamEntry->free_ = true;
+            return -1;
+        }
+        oamEntry->tileStart = tileStart;
 #ifdef DEBUG_2D
         dumpOamState();
 #endif
@@ -180,29 +340,72 @@ namespace Engine {
 
         OAMEntry* oamEntry = &_oamEntries[oamId];
 
-        auto* oamStart = (u16*) ((u8*) _oamRam + oamId * 8);
+        u16* oamStart = shadowEntry(oamId);
         oamStart[0] = 1 << 9; // Not displayed
         oamStart[1] = 0;
         oamStart[2] = 0;
+        markOamDirty(oamId);
+        _pendingTiles[oamId] = nullptr;
 
         u16 length = oamEntry->tileWidth * oamEntry->tileHeight;
         _tileZones.free(length, oamEntry->tileStart);
+        _compactStalled = false;
 
 #ifdef DEBUG_2D
         dumpOamState();
 #endif
     }
 
+    bool OAMManager::relocateTilesCallback(void* context, u32 start, u32 newStart, u32) {
+        return ((OAMManager*) context)->relocateTiles(start, newStart);
+    }
+
+    bool OAMManager::relocateTiles(u32 start, u32 newStart) {
+        int oamId = -1;
+        for (int i = 0; i < SPRITE_COUNT && oamId < 0; i++) {
+            if (!_oamEntries[i].free_ && _oamEntries[i].tileStart == start)
+                oamId = i;
+        }
+        if (oamId < 0)
+            return false;
+        _oamEntries[oamId].tileStart = newStart;
+        u16* oamStart = shadowEntry(oamId);
+        oamStart[2] = (oamStart[2] & ~0x3FF) | newStart;
+        markOamDirty(oamId);
+
+        // The shown frame goes to the new tiles from its cache on the next
+        // flush, same v-blank as the entry, the old tiles stay until then
+        for (int i = 0; i < _activeSprCount; i++) {
+            Sprite& spr = *_activeSpr[i];
+            u8* src = spr._memory.oamFrameCache;
+            if (src == nullptr || spr._memory.loadedFrame < 0)
+                continue;
+            src += spr._memory.loadedFrame * spr._memory.oamFrameBytes;
+            for (int entry = 0; entry < spr._memory.oamEntryCount; entry++) {
+                const OAMEntry& oamEntry = _oamEntries[spr._memory.oamEntries[entry]];
+                if (spr._memory.oamEntries[entry] == oamId) {
+                    _pendingTiles[oamId] = src;
+                    return true;
+                }
+                src += oamEntry.tileWidth * oamEntry.tileHeight * 64;
+            }
+        }
+        return true;
+    }
+
 #ifdef DEBUG_2D
     void OAMManager::dumpOamState() {
         char buffer[100];
         for (int i = 0; i < 128; i++) {
-            if (oamEntries[i].free_)
+            if (_oamEntries[i].free_)
                 continue;
-            sprintf(buffer, "OAM %d start %d w %d h %d", i,
-                    oamEntries[i].tileStart, oamEntries[i].tileWidth, oamEntries[i].tileHeight);
+            sprintf(buffer, "OAM %d start %d w %d h %d%s", i,
+                    _oamEntries[i].tileStart, _oamEntries[i].tileWidth, _oamEntries[i].tileHeight,
+                    _oamEntries[i].culled ? " culled" : "");
             nocashMessage(buffer);
         }
+        sprintf(buffer, "OAM culled %d", _culledCount);
+        nocashMessage(buffer);
     }
 #endif
 
@@ -221,12 +424,8 @@ namespace Engine {
         if (sprIdx == -1)
             return;
 
-        for (int colorIdx = 0; colorIdx < spr._texture->_colorCount; colorIdx++) {
-            u8 paletteColor = spr._memory.paletteColors[colorIdx];
-            _paletteRefCounts[paletteColor - 1]--;
-        }
-        delete[] spr._memory.paletteColors;
-        spr._memory.paletteColors = nullptr;
+        releasePaletteColors(spr, spr._texture->_colorCount);
+        freeFrameCache(spr);  // Remapped with the slots just released
 
         if (spr._memory.oamScaleIdx != 0xff) {
             freeOamScaleEntry(spr);
@@ -252,6 +451,7 @@ namespace Engine {
     }
 
     void OAMManager::draw() {
+        _culledCount = 0;
         if (_activeSpr == nullptr)
             return;
         for (int i = 0; i < _activeSprCount; i++) {
@@ -270,13 +470,48 @@ namespace Engine {
 
             setSpritePosAndScale(*spr);
         }
+
+        if (_compactionEnabled && !_compactStalled &&
+                _tileZones.getFragmentation() >= kCompactFragmentationPercent)
+            _compactStalled = _tileZones.compact(kOamCompactTiles) == 0;
+    }
+
+    void OAMManager::flush() {
+        for (int oamId = 0; oamId < SPRITE_COUNT; oamId++) {
+            if (_pendingTiles[oamId] == nullptr)
+                continue;
+            OAMEntry* oamEntry = &_oamEntries[oamId];
+            u32 entryBytes = oamEntry->tileWidth * oamEntry->tileHeight * 64;
+            dmaCopy(_pendingTiles[oamId], (u8*) _tileRam + oamEntry->tileStart * 64, entryBytes);
+            vblankQueue.charge(entryBytes);
+            _pendingTiles[oamId] = nullptr;
+        }
+
+        // One copy covering every dirty entry
+        int first = -1, last = -1;
+        for (int word = 0; word < SPRITE_COUNT / 32; word++) {
+            u32 dirty = _oamDirty[word];
+            if (dirty == 0)
+                continue;
+            if (first == -1)
+                first = word * 32 + __builtin_ctz(dirty);
+            last = word * 32 + 31 - __builtin_clz(dirty);
+            _oamDirty[word] = 0;
+        }
+        if (first == -1)
+            return;
+        u32 bytes = (last - first + 1) * 8;
+        DC_FlushRange(shadowEntry(first), bytes);
+        dmaCopy(shadowEntry(first), (u8*) _oamRam + first * 8, bytes);
+        vblankQueue.charge(bytes);
     }
 
     void OAMManager::setOAMState(Engine::Sprite &spr) {
         for (int i = 0; i < spr._memory.oamEntryCount; i++) {
             u8 oamId = spr._memory.oamEntries[i];
             OAMEntry* oamEntry = &_oamEntries[oamId];
-            auto* oamStart = (u16*) ((u8*) _oamRam + oamId * 8);
+            u16* oamStart = shadowEntry(oamId);
+            markOamDirty(oamId);
             oamStart[0] = 1 << 13; // set 256 color mode
             oamStart[1] = 0;
             oamStart[2] = oamEntry->tileStart + (0 << 10);  // set start tile and priority 0
@@ -337,44 +572,71 @@ namespace Engine {
         spr._texture->getSizeTiles(tileWidth, tileHeight);
         u8 oamW = (tileWidth + 7) / 8;
         u8 oamH = (tileHeight + 7) / 8;
+        bool useScale = (spr._scale_x != (1 << 8)) || (spr._scale_y != (1 << 8));
+
+        // Whole sprite first, affine entries are drawn double size
+        int boxScale = useScale ? 2 : 1;
+        s32 left = spr._x >> 8, top = spr._y >> 8;
+        s32 right = ((spr._x + (oamW - 1) * 64 * spr._scale_x) >> 8) + 64 * boxScale;
+        s32 bottom = ((spr._y + (oamH - 1) * 64 * spr._scale_y) >> 8) + 64 * boxScale;
+        if (left >= SCREEN_WIDTH || right <= 0 || top >= SCREEN_HEIGHT || bottom <= 0) {
+            for (int i = 0; i < spr._memory.oamEntryCount; i++)
+                cullOAMEntry(spr._memory.oamEntries[i]);
+            return;
+        }
+
+        if (useScale) {
+            u8 scaleIdx = spr._memory.oamScaleIdx;
+            if (scaleIdx == 0xff || _oamScaleEntries[scaleIdx].scaleX != spr._scale_x ||
+                    _oamScaleEntries[scaleIdx].scaleY != spr._scale_y) {
+                if (scaleIdx != 0xff)
+                    freeOamScaleEntry(spr);
+                allocateOamScaleEntry(spr);
+            }
+        } else {
+            if (spr._memory.oamScaleIdx != 0xff) {
+                freeOamScaleEntry(spr);
+            }
+        }
+        bool affine = spr._memory.oamScaleIdx != 0xff;
+
         for (int oamY = 0; oamY < oamH; oamY++) {
             for (int oamX = 0; oamX < oamW; oamX++) {
                 int oamId = spr._memory.oamEntries[oamY * oamW + oamX];
-                auto* oamStart = (u16*) ((u8*) _oamRam + oamId * 8);
-                bool useScale = (spr._scale_x != (1 << 8)) || (spr._scale_y != (1 << 8));
-                if (useScale) {
-                    if (spr._memory.oamScaleIdx == 0xff) {
-                        allocateOamScaleEntry(spr);
-                    }
-                } else {
-                    if (spr._memory.oamScaleIdx != 0xff) {
-                        freeOamScaleEntry(spr);
-                    }
+                OAMEntry* oamEntry = &_oamEntries[oamId];
+                s32 posX = spr._x + oamX * 64 * spr._scale_x;
+                s32 posY = spr._y + oamY * 64 * spr._scale_y;
+
+                s32 entryX = posX >> 8, entryY = posY >> 8;
+                s32 entryW = oamEntry->tileWidth * 8, entryH = oamEntry->tileHeight * 8;
+                if (affine) {
+                    entryW *= 2;
+                    entryH *= 2;
                 }
+                if (entryX >= SCREEN_WIDTH || entryX + entryW <= 0 ||
+                        entryY >= SCREEN_HEIGHT || entryY + entryH <= 0) {
+                    cullOAMEntry(oamId);
+                    continue;
+                }
+                oamEntry->culled = false;
+
+                u16* oamStart = shadowEntry(oamId);
+                u16 prevAttr0 = oamStart[0], prevAttr1 = oamStart[1], prevAttr2 = oamStart[2];
 
                 oamStart[1] &= ~(0b1111 << 9);
-                if (spr._memory.oamScaleIdx != 0xff) {
+                if (affine) {
                     oamStart[0] |= 1 << 8;  // set scale and rotation flag
                     oamStart[0] |= 1 << 9;  // set scale and rotation flag
                     oamStart[1] |= spr._memory.oamScaleIdx << 9;
-                    auto* oamScaleA = (u16*)((u8*)_oamRam + spr._memory.oamScaleIdx * 0x20 + 0x6);
-                    auto* oamScaleB = (u16*)((u8*)_oamRam + spr._memory.oamScaleIdx * 0x20 + 0xE);
-                    auto* oamScaleC = (u16*)((u8*)_oamRam + spr._memory.oamScaleIdx * 0x20 + 0x16);
-                    auto* oamScaleD = (u16*)((u8*)_oamRam + spr._memory.oamScaleIdx * 0x20 + 0x1E);
-                    *oamScaleA = (1 << 16) / spr._scale_x;
-                    *oamScaleB = 0;
-                    *oamScaleC = 0;
-                    *oamScaleD = (1 << 16) / spr._scale_y;
                 } else {
                     oamStart[0] &= ~(1 << 8);
                     oamStart[0] &= ~(1 << 9);
                 }
                 oamStart[0] &= ~0xFF;
-                s32 posX = spr._x + oamX * 64 * spr._scale_x;
+                // Entries poking out of the left or top wrap around
                 posX %= (512 << 8);
                 if (posX < 0)
                     posX = (512 << 8) + posX;
-                s32 posY = spr._y + oamY * 64 * spr._scale_y;
                 posY %= (256 << 8);
                 if (posY < 0)
                     posY = (256 << 8) + posY;
@@ -383,24 +645,66 @@ namespace Engine {
                 oamStart[1] |= posX >> 8;
                 oamStart[2] &= ~(3 << 10);
                 oamStart[2] |= (spr._layer & 0b11) << 10;
-                // TODO: Disable oam if out of screen
+                if (oamStart[0] != prevAttr0 || oamStart[1] != prevAttr1 || oamStart[2] != prevAttr2)
+                    markOamDirty(oamId);
             }
         }
     }
 
+    void OAMManager::cullOAMEntry(int oamId) {
+        _culledCount++;
+        if (_oamEntries[oamId].culled)
+            return;
+        _oamEntries[oamId].culled = true;
+        u16* oamStart = shadowEntry(oamId);
+        oamStart[0] &= ~(1 << 8);
+        oamStart[0] |= 1 << 9;  // Not displayed
+        markOamDirty(oamId);
+    }
+
     void OAMManager::allocateOamScaleEntry(Engine::Sprite &spr) {
+        // Share a matrix with any sprite using the same scale, or take back
+        // an unused one that still holds it
+        int freeIdx = -1;
         for (int i = 0; i < 32; i++) {
-            if (!_oamScaleEntryUsed[i]) {
+            OAMScaleEntry* entry = &_oamScaleEntries[i];
+            if (entry->scaleX == spr._scale_x && entry->scaleY == spr._scale_y) {
+                entry->refCount++;
                 spr._memory.oamScaleIdx = i;
-                _oamScaleEntryUsed[i] = true;
                 return;
             }
+            if (entry->refCount == 0 && freeIdx == -1)
+                freeIdx = i;
         }
+        if (freeIdx == -1)
+            return;  // All matrices in use, sprite is drawn unscaled
+
+        OAMScaleEntry* entry = &_oamScaleEntries[freeIdx];
+        entry->refCount = 1;
+        entry->scaleX = spr._scale_x;
+        entry->scaleY = spr._scale_y;
+        spr._memory.oamScaleIdx = freeIdx;
+
+        // Reciprocals only computed when a matrix gets a new scale
+        u16* oamScale = shadowEntry(freeIdx * 4);
+        oamScale[3] = (1 << 16) / spr._scale_x;
+        oamScale[7] = 0;
+        oamScale[11] = 0;
+        oamScale[15] = (1 << 16) / spr._scale_y;
+        for (int i = 0; i < 4; i++)
+            markOamDirty(freeIdx * 4 + i);
+    }
+
+    int OAMManager::getScaleEntriesUsed() const {
+        int used = 0;
+        for (auto& entry : _oamScaleEntries)
+            used += entry.refCount > 0;
+        return used;
     }
 
     void OAMManager::freeOamScaleEntry(Engine::Sprite &spr) {
-        _oamScaleEntryUsed[spr._memory.oamScaleIdx] = false;
-       spr._memory.oamScaleIdx = 0xff;
+        _oamScaleEntries[spr._memory.oamScaleIdx].refCount--;
+        spr._memory.oamScaleIdx = 0xff;
     }
 
     OAMManager OAMManagerSub(SPRITE_PALETTE_SUB, SPRITE_GFX_SUB, OAM_SUB);
@@ -0,0 +1,76 @@
+#include "Engine/Profiler.hpp"
+
+#ifdef DEBUG_PROFILER
+namespace Engine {
+    namespace {
+        const char* kPhaseNames[PROFILE_PHASE_COUNT] = {
+            "game", "3d_draw", "gl_flush", "audio", "vblank_wait", "oam", "oam_flush", "textures", "vblank_jobs", "input"
+        };
+
+        // Sorts ascending in place, at most kProfilerFrames values
+        void sortValues(s32* values, int count) {
+            for (int i = 1; i < count; i++) {
+                s32 value = values[i];
+                int j = i - 1;
+                for (; j >= 0 && values[j] > value; j--)
+                    values[j + 1] = values[j];
+                values[j + 1] = value;
+            }
+        }
+
+        s32 ticksToUs(s32 ticks) {
+            return (s32)(((s64) ticks * 1000000) / BUS_CLOCK);
+        }
+
+        void dumpStats(const char* name, s32* values, int count) {
+            char buffer[100];
+            s64 sum = 0;
+            for (int i = 0; i < count; i++)
+                sum += values[i];
+            sortValues(values, count);
+            int p99 = (count * 99 + 99) / 100 - 1;
+            sprintf(buffer, "PROF %-12s min %6ld avg %6ld p99 %6ld us", name,
+                    (long) ticksToUs(values[0]), (long) ticksToUs((s32)(sum / count)),
+                    (long) ticksToUs(values[p99]));
+            nocashMessage(buffer);
+        }
+    }
+
+    void Profiler::endFrame() {
+        u32 end = now();
+        // Everything between the end of the last tick and the start of this one
+        u32 tickTicks = 0;
+        for (int i = PROFILE_GAME + 1; i < PROFILE_PHASE_COUNT; i++)
+            tickTicks += _current.phaseTicks[i];
+        _current.phaseTicks[PROFILE_GAME] = (end - _frameEnd) - tickTicks;
+        _current.vblankLeft = kVBlankTicks - (s32)(end - _vblankStart);
+        _frameEnd = end;
+
+        _frames[_frameIdx] = _current;
+        _frameIdx = (_frameIdx + 1) % kProfilerFrames;
+        if (_frameCount < kProfilerFrames)
+            _frameCount++;
+        _current = ProfilerFrame();
+    }
+
+    void Profiler::dump() {
+        char buffer[100];
+        if (_frameCount == 0)
+            return;
+        s32 values[kProfilerFrames];
+        sprintf(buffer, "PROF last %d frames", _frameCount);
+        nocashMessage(buffer);
+        for (int phase = 0; phase < PROFILE_PHASE_COUNT; phase++) {
+            for (int i = 0; i < _frameCount; i++)
+                values[i] = (s32) _frames[i].phaseTicks[phase];
+            dumpStats(kPhaseNames[phase], values, _frameCount);
+        }
+        for (int i = 0; i < _frameCount; i++)
+            values[i] = _frames[i].vblankLeft;
+        dumpStats("vblank_left", values, _frameCount);
+        nocashMessage("----------------------------------");
+    }
+
+    Profiler profiler;
+}
+#endif
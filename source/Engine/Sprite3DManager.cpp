@@ -3,7 +3,9 @@
 //
 
 #include "Sprite3DManager.hpp"
+#include "OAMManager.hpp"
 #include "Texture.hpp"
+#include "VBlankQueue.hpp"
 #include "DEBUG_FLAGS.hpp"
 
 int getOnesInBin(int x) {
@@ -21,6 +23,8 @@ namespace Engine {
             return -1;
         if (res._memory.allocated != NoAlloc)
             return -2;
+        if (res._texture->_compressed && !_compressedTextures)
+            nocashMessage("Error: 4x4 compressed sprite waits on setCompressedTextures");
 
         auto** activeSpriteNew = new Sprite*[_activeSprCount + 1];
         memcpy(activeSpriteNew, _activeSpr, sizeof(Sprite**) * _activeSprCount);
@@ -33,6 +37,7 @@ namespace Engine {
         res._memory.allocated = Allocated3D;
         res._memory.loadedFrame = -1;
         res._memory.loadedIntoMemory = false;
+        res._memory.uploadQueued = false;
         return 0;
     }
 
@@ -51,7 +56,12 @@ namespace Engine {
         if (sprIdx == -1)
             return;
 
-        freeSpriteTexture(spr);
+        if (spr._memory.uploadQueued) {
+            vblankQueue.cancel(&spr);
+            spr._memory.uploadQueued = false;
+        }
+        if (spr._memory.loadedIntoMemory)
+            freeSpriteTexture(spr);
 
         auto** activeSpriteNew = new Sprite*[_activeSprCount - 1];
         memcpy(activeSpriteNew, _activeSpr, sizeof(Sprite**) * sprIdx);
@@ -66,40 +76,62 @@ namespace Engine {
     }
 
     void Sprite3DManager::loadSpriteTexture(Engine::Sprite &spr) {
+        spr._texture->findEmptyQuads();
         spr._texture->_loaded3DCount += 1;
-        if (spr._texture->_loaded3DCount > 1) { // Already loaded to texture
+        if (spr._texture->_loaded3DCount > 1 || // Already loaded to texture
+                spr._texture->_atlasPage >= 0 ||
+                rebindTexture(*spr._texture)) {
             spr._memory.loadedIntoMemory = true;
             return;
         }
+        if (_vacatedCount != 0) {
+            // Space just vacated by compaction is still drawn from, wait
+            spr._texture->_loaded3DCount -= 1;
+            return;
+        }
 
         spr._texture->_color8bit = spr._texture->_colorCount >= 16;
-        u16 length, alignment, tileBytes;
-        if (spr._texture->_color8bit) {
-            length = 16;
+        u16 length = texturePaletteLength(*spr._texture), alignment, tileBytes;
+        u8 format;
+        if (spr._texture->_compressed) {
+            // Block palette from the start of its slots, texel words here
+            // and index words at half their offset in slot 1
+            alignment = 1;
+            tileBytes = 16;
+            format = 5;
+        } else if (spr._texture->_color8bit) {
             alignment = 16;
             tileBytes = 64;
+            format = 4;
         } else {
-            length = 1;
             alignment = 1;
             tileBytes = 32;
+            format = 3;
         }
 
-        int res = paletteFreeZones.reserve(length, spr._texture->_paletteIdx, alignment);
+        int res = reservePalette(length, spr._texture->_paletteIdx, alignment);
         if (res != 0) {
-            // no palette found
+            // no palette found, try again later
+            spr._texture->_loaded3DCount -= 1;
             return;
         }
 
-        u16* paletteBase = &VRAM_E[16 * spr._texture->_paletteIdx + 1];
-        dmaCopyHalfWordsAsynch(3, spr._texture->_colors, paletteBase,
-                               spr._texture->_colorCount * 2);
+        _paletteBytesUsed += length * 32;
+
+        if (spr._texture->_compressed)
+            dmaCopyHalfWordsAsynch(3, spr._texture->_colors, &VRAM_E[16 * spr._texture->_paletteIdx],
+                                   spr._texture->_blockColorCount * 2);
+        else
+            dmaCopyHalfWordsAsynch(3, spr._texture->_colors, &VRAM_E[16 * spr._texture->_paletteIdx + 1],
+                                   spr._texture->_colorCount * 2);
 
         u8 tileWidth, tileHeight;
         spr._texture->getSizeTiles(tileWidth, tileHeight);
 
         int allocX = getOnesInBin(tileWidth);
         int allocY = getOnesInBin(tileHeight);
-        spr._texture->_tileStart = new u16[allocX * allocY];
+        spr._texture->_quads = new Texture3DQuad[allocX * allocY];
+        spr._texture->_quadCount = 0;
 
         int tileIdx = 0;
 
@@ -107,46 +139,46 @@ namespace Engine {
         int tileHeight_ = tileHeight;
         while (tileHeight_ > 0) {
             u8 subTileHeight = 1;
-            while (subTileHeight << 1 <= tileHeight_)
+            u8 allocYFmt = 0;
+            while (subTileHeight << 1 <= tileHeight_) {
                 subTileHeight <<= 1;
+                allocYFmt += 1;
+            }
 
             int tileWidth_ = tileWidth;
             int tilePosX = 0;
             while (tileWidth_ > 0) {
                 u8 subTileWidth = 1;
-                while (subTileWidth << 1 <= tileWidth_)
+                u8 allocXFmt = 0;
+                while (subTileWidth << 1 <= tileWidth_) {
                     subTileWidth <<= 1;
+                    allocXFmt += 1;
+                }
+
+                Texture3DQuad& quad = spr._texture->_quads[tileIdx];
+                quad.x = tilePosX;
+                quad.y = tilePosY;
+                quad.width = subTileWidth;
+                quad.height = subTileHeight;
+                quad.texFormat = (allocXFmt << 20) + (allocYFmt << 23) + (format << 26);
+                if (!spr._texture->_compressed)  // 4x4 blocks have their own transparent texels
+                    quad.texFormat += 1 << 29;
+                quad.frameBytes = subTileWidth * subTileHeight * tileBytes;
 
-                u16 neededTiles = subTileWidth * subTileHeight * spr._texture->_frameCount * tileBytes;
-                if (tileFreeZones.reserve(neededTiles, spr._texture->_tileStart[tileIdx], 1) == 1) {
+                u32 neededTiles = quad.frameBytes * spr._texture->_frameCount;
+                if (reserveTiles(neededTiles, quad.tileStart, 1, spr._texture->_compressed) == 1) {
+                    // Give back what's reserved so far, try again later
+                    freeTextureVram(spr._texture->_quads, spr._texture->_quadCount,
+                                    spr._texture->_frameCount, spr._texture->_paletteIdx,
+                                    length, nullptr);
+                    spr._texture->_quads = nullptr;
+                    spr._texture->_quadCount = 0;
+                    spr._texture->_loaded3DCount -= 1;
                     return;
                 }
+                _tileBytesUsed += neededTiles;
+                spr._texture->_quadCount++;
 
-                for (int frame = 0; frame < spr._texture->_frameCount; frame++) {
-                    for (int y = tilePosY * 8, y2 = 0; y < (tilePosY + subTileHeight) * 8; y++, y2++) {
-                        for (int x = tilePosX * 8, x2 = 0; x < (tilePosX + subTileWidth) * 8; x++, x2++) {
-                            int tileX = x / 8;
-                            int tileY = y / 8;
-                            u8 *tileRamStart = (u8 *) VRAM_B + spr._texture->_tileStart[tileIdx] +
-                                               frame * subTileWidth * subTileHeight * tileBytes;
-
-                            u16 framePos = frame * tileWidth * tileHeight;
-                            u32 tileOffset = framePos + tileY * tileWidth + tileX;
-                            tileOffset *= 64;
-                            if (spr._texture->_color8bit) {
-                                tileOffset += (y % 8) * 8 + (x % 8);
-                                u16* dst = (u16*)(tileRamStart + y2 * subTileWidth * 8 + x2);
-                                *dst &= ~(0xFF << (8 * (x2 & 1)));
-                                *dst |= (spr._texture->_tiles[tileOffset] & 0xFF) << (8 * (x2 & 1));
-                            } else {
-                                tileOffset += (y % 8) * 8 + (x % 8);
-                                u16* dst = (u16*)(tileRamStart + (y2 * subTileWidth * 8 + x2) / 2);
-                                *dst &= ~(0xF << (4 * (x2 & 3)));
-                                *dst |= (spr._texture->_tiles[tileOffset] & 0xFF) << (4 * (x2 & 3));
-                            }
-                        }
-                    }
-                }
                 tileIdx++;
                 tileWidth_ -= subTileWidth;
                 tilePosX += subTileWidth;
@@ -155,46 +187,509 @@ namespace Engine {
             tilePosY += subTileHeight;
         }
 
+        // Frames follow over the next v-blanks, see streamTexture
+        spr._texture->_residentFrames = new u8[(spr._texture->_frameCount + 7) / 8]();
+        spr._texture->_residentCount = 0;
+        spr._texture->_streamAnim = spr._cAnimation;
+        queueStream(*spr._texture);
+
+        _cacheStats.misses++;
         spr._memory.loadedIntoMemory = true;
     }
 
+    u16 Sprite3DManager::texturePaletteLength(const Engine::Texture &texture) {
+        if (texture._compressed)
+            return (texture._blockColorCount + 15) / 16;
+        return texture._colorCount >= 16 ? 16 : 1;
+    }
+
+    u32 Sprite3DManager::textureFrameBytes(const Engine::Texture &texture) {
+        u8 tileWidth, tileHeight;
+        texture.getSizeTiles(tileWidth, tileHeight);
+        if (texture._compressed)  // Texel and index words
+            return tileWidth * tileHeight * 24;
+        return tileWidth * tileHeight * (texture._colorCount >= 16 ? 64 : 32);
+    }
+
+    bool Sprite3DManager::nextStreamRange(const Engine::Texture &texture, u8 &start, u8 &end) const {
+        if (texture._residentFrames == nullptr || texture._residentCount >= texture._frameCount)
+            return false;
+
+        // Frames the sprite is showing first, then the rest in order
+        int first = -1;
+        if (texture._streamAnim >= 0 && texture._streamAnim < texture._animationCount) {
+            const CSPRAnimation& anim = texture._animations[texture._streamAnim];
+            for (int i = 0; i < anim.frameCount && first < 0; i++) {
+                if (!texture.frameResident(anim.frames[i].frame))
+                    first = anim.frames[i].frame;
+            }
+        }
+        for (int frame = 0; frame < texture._frameCount && first < 0; frame++) {
+            if (!texture.frameResident(frame))
+                first = frame;
+        }
+
+        // Following frames while they fit the chunk, one frame at least
+        u32 frameBytes = textureFrameBytes(texture);
+        start = first;
+        end = first + 1;
+        while (end < texture._frameCount && !texture.frameResident(end) &&
+                (end + 1 - start) * frameBytes <= _streamChunk)
+            end++;
+        return true;
+    }
+
+    void Sprite3DManager::queueStream(Engine::Texture &texture) {
+        u8 start, end;
+        if (texture._streamQueued || !nextStreamRange(texture, start, end))
+            return;
+        texture._streamQueued = true;
+        vblankQueue.push(streamTextureJob, &texture, (end - start) * textureFrameBytes(texture));
+    }
+
+    void Sprite3DManager::cancelStream(Engine::Texture &texture) {
+        if (!texture._streamQueued)
+            return;
+        vblankQueue.cancel(&texture);
+        texture._streamQueued = false;
+    }
+
+    void Sprite3DManager::streamTextureJob(void* target, const s32*) {
+        auto* texture = (Texture*) target;
+        texture->_streamQueued = false;
+        u8 start, end;
+        if (!main3dSpr.nextStreamRange(*texture, start, end))
+            return;
+        // Index words and textures past slot 0 are in slot 1
+        bool slot1 = main3dSpr._compressedTextures;
+        vramSetBankB(VRAM_B_LCD);
+        if (slot1)
+            vramSetBankD(VRAM_D_LCD);
+        main3dSpr.streamTexture(*texture, start, end);
+        vramSetBankB(VRAM_B_TEXTURE_SLOT0);
+        if (slot1)
+            vramSetBankD(VRAM_D_TEXTURE_SLOT1);
+        // Runs again this v-blank if the budget allows
+        main3dSpr.queueStream(*texture);
+    }
+
+    void Sprite3DManager::streamTexture(Engine::Texture &texture, u8 start, u8 end) {
+        const u8* texSrc = texture._texData;
+        for (int quadIdx = 0; quadIdx < texture._quadCount; quadIdx++) {
+            Texture3DQuad& quad = texture._quads[quadIdx];
+            if (texSrc != nullptr) {
+                // Pre-swizzled, every frame of the sub-texture back to back
+                u32 rangeBytes = quad.frameBytes * (end - start);
+                const u8* rangeSrc = texSrc + start * quad.frameBytes;
+                u8* tileRamStart = textureVram(quad.tileStart + start * quad.frameBytes);
+                DC_FlushRange(rangeSrc, rangeBytes);
+                dmaCopy(rangeSrc, tileRamStart, rangeBytes);
+                if (texture._compressed) {
+                    // Index words after all the texels, half the size and
+                    // at half the offset in slot 1
+                    const u8* indexSrc = texture._texData + texture._texDataSize / 3 * 2 +
+                                         (rangeSrc - texture._texData) / 2;
+                    DC_FlushRange(indexSrc, rangeBytes / 2);
+                    dmaCopy(indexSrc, (u8*) VRAM_D + (quad.tileStart + start * quad.frameBytes) / 2,
+                            rangeBytes / 2);
+                }
+                texSrc += quad.frameBytes * texture._frameCount;
+            }
+            else if (texture._color8bit)
+                packQuadFrames<PIXELS_8BPP>(texture, quad, start, end);
+            else
+                packQuadFrames<PIXELS_4BPP>(texture, quad, start, end);
+        }
+
+        for (int frame = start; frame < end; frame++)
+            texture._residentFrames[frame / 8] |= 1 << (frame % 8);
+        texture._residentCount += end - start;
+        _cacheStats.streamChunks++;
+    }
+
+    template <PixelFormat Format>
+    void Sprite3DManager::packQuadFrames(const Texture& texture, const Texture3DQuad& quad, u8 start, u8 end) {
+        u8 tileWidth, tileHeight;
+        texture.getSizeTiles(tileWidth, tileHeight);
+        // A tile row is 8 texels, 2 words at 8bpp and 1 at 4bpp
+        const u32 tileRowWords = Format == PIXELS_8BPP ? 2 : 1;
+        for (int frame = start; frame < end; frame++) {
+            auto* dst = (u32*) textureVram(quad.tileStart + frame * quad.frameBytes);
+            const u8* frameTiles = texture._tiles + frame * tileWidth * tileHeight * 64;
+            for (int y = 0; y < quad.height * 8; y++) {
+                const u8* src = frameTiles + ((quad.y + y / 8) * tileWidth + quad.x) * 64 + (y % 8) * 8;
+                for (int tileX = 0; tileX < quad.width; tileX++, src += 64, dst += tileRowWords)
+                    packPixels<Format>(src, dst, 8);
+            }
+        }
+    }
+
+    bool Sprite3DManager::spriteReady(Engine::Sprite &spr) {
+        Texture& texture = *spr._texture;
+        if (texture._residentCount >= texture._frameCount)
+            return true;
+        bool ready = true;
+        if (spr._cAnimation >= 0) {
+            const CSPRAnimation& anim = texture._animations[spr._cAnimation];
+            for (int i = 0; i < anim.frameCount && ready; i++)
+                ready = texture.frameResident(anim.frames[i].frame);
+        } else
+            ready = texture.frameResident(spr._cFrame);
+        if (!ready)  // Stream what it's waiting for next
+            texture._streamAnim = spr._cAnimation;
+        return ready;
+    }
+
 
     void Sprite3DManager::freeSpriteTexture(Engine::Sprite &spr) {
         spr._texture->_loaded3DCount -= 1;
         if (spr._texture->_loaded3DCount > 0) // Texture used by another sprite
             return;
+        if (spr._texture->_atlasPage >= 0)  // The page stays until the texture is freed
+            return;
+        cancelStream(*spr._texture);
+        if (!_textureCacheEnabled) {
+            freeTextureVram(spr._texture->_quads, spr._texture->_quadCount, spr._texture->_frameCount,
+                            spr._texture->_paletteIdx, texturePaletteLength(*spr._texture),
+                            spr._texture->_residentFrames);
+            spr._texture->_quads = nullptr;
+            spr._texture->_quadCount = 0;
+            spr._texture->_residentFrames = nullptr;
+            return;
+        }
+        parkTexture(*spr._texture);
+    }
 
-        _paletteUsed[spr._texture->_paletteIdx] = false;
+    int Sprite3DManager::findResident(const Engine::Texture &texture) const {
+        int adopt = -1;
+        for (int i = 0; i < kResidentTextureSlots; i++) {
+            const ResidentTexture& entry = _resident[i];
+            if (!entry.used)
+                continue;
+            if (entry.owner == &texture)
+                return i;
+            if (entry.owner == nullptr && texture._pathHash != 0 && entry.pathHash == texture._pathHash &&
+                    entry.width == texture._width && entry.height == texture._height &&
+                    entry.frameCount == texture._frameCount && entry.colorCount == texture._colorCount)
+                adopt = i;
+        }
+        return adopt;
+    }
 
-        u8 tileWidth, tileHeight;
-        u8 tileBytes = spr._texture->_color8bit ? 64 : 32;
-        spr._texture->getSizeTiles(tileWidth, tileHeight);
+    bool Sprite3DManager::rebindTexture(Engine::Texture &texture) {
+        int idx = findResident(texture);
+        if (idx < 0)
+            return false;
+        ResidentTexture& entry = _resident[idx];
+        if (entry.owner == nullptr) {
+            // Loaded again from the same file, same data as what's in VRAM
+            texture._quads = entry.quads;
+            texture._quadCount = entry.quadCount;
+            texture._paletteIdx = entry.paletteIdx;
+            texture._color8bit = entry.color8bit;
+            texture._residentFrames = entry.residentFrames;
+            texture._residentCount = entry.residentCount;
+        }
+        entry = ResidentTexture();
+        _cacheStats.hits++;
+        _cacheStats.resident--;
+        _cacheStats.savedBytes += texture._residentCount * textureFrameBytes(texture) +
+                                  (texture._colorCount + texture._blockColorCount) * 2;
+        queueStream(texture);  // Parked before all its frames were in
+        return true;
+    }
 
-        int tileIdx = 0;
-        while (tileHeight > 0) {
-            u8 subTileHeight = 1;
-            while (subTileHeight << 1 <= tileHeight)
-                subTileHeight <<= 1;
-            int tileWidth_ = tileWidth;
-            while (tileWidth_ > 0) {
-                u8 subTileWidth = 1;
-                while (subTileWidth << 1 <= tileWidth_)
-                    subTileWidth <<= 1;
-                u16 neededTiles = subTileWidth * subTileHeight * spr._texture->_frameCount * tileBytes;
-                tileFreeZones.free(neededTiles, spr._texture->_tileStart[tileIdx]);
-                tileIdx++;
-                tileWidth_ -= subTileWidth;
+    void Sprite3DManager::parkTexture(Engine::Texture &texture) {
+        int slot = -1;
+        while (slot < 0) {
+            for (int i = 0; i < kResidentTextureSlots && slot < 0; i++) {
+                if (!_resident[i].used)
+                    slot = i;
+            }
+            if (slot < 0)
+                evictTexture();
+        }
+
+        ResidentTexture& entry = _resident[slot];
+        entry.used = true;
+        entry.owner = &texture;
+        entry.pathHash = texture._pathHash;
+        entry.width = texture._width;
+        entry.height = texture._height;
+        entry.frameCount = texture._frameCount;
+        entry.colorCount = texture._colorCount;
+        entry.quads = texture._quads;
+        entry.quadCount = texture._quadCount;
+        entry.paletteIdx = texture._paletteIdx;
+        entry.paletteLength = texturePaletteLength(texture);
+        entry.color8bit = texture._color8bit;
+        entry.residentFrames = texture._residentFrames;
+        entry.residentCount = texture._residentCount;
+        entry.lastUsed = ++_residentClock;
+        _cacheStats.resident++;
+    }
+
+    void Sprite3DManager::orphanTexture(Engine::Texture &texture) {
+        cancelStream(texture);
+        int idx = findResident(texture);
+        if (idx >= 0 && _resident[idx].owner == &texture) {
+            _resident[idx].owner = nullptr;
+            if (_resident[idx].pathHash == 0)  // Nothing can adopt it
+                evictResident(idx);
+        } else {
+            freeTextureVram(texture._quads, texture._quadCount, texture._frameCount,
+                            texture._paletteIdx, texturePaletteLength(texture), texture._residentFrames);
+        }
+        texture._quads = nullptr;
+        texture._quadCount = 0;
+        texture._residentFrames = nullptr;
+    }
+
+    bool Sprite3DManager::evictTexture() {
+        int oldest = -1;
+        for (int i = 0; i < kResidentTextureSlots; i++) {
+            if (_resident[i].used && (oldest < 0 || _resident[i].lastUsed < _resident[oldest].lastUsed))
+                oldest = i;
+        }
+        if (oldest < 0)
+            return false;
+        evictResident(oldest);
+        return true;
+    }
+
+    void Sprite3DManager::evictResident(int idx) {
+        ResidentTexture& entry = _resident[idx];
+        freeTextureVram(entry.quads, entry.quadCount, entry.frameCount,
+                        entry.paletteIdx, entry.paletteLength, entry.residentFrames);
+        if (entry.owner != nullptr) {
+            entry.owner->_quads = nullptr;
+            entry.owner->_quadCount = 0;
+            entry.owner->_residentFrames = nullptr;
+        }
+        entry = ResidentTexture();
+        _cacheStats.evictions++;
+        _cacheStats.resident--;
+    }
+
+    void Sprite3DManager::freeTextureVram(Engine::Texture3DQuad *quads, u8 quadCount, u8 frameCount,
+                                          u16 paletteIdx, u16 paletteLength, u8* residentFrames) {
+        paletteFreeZones.free(paletteLength, paletteIdx);
+        _paletteBytesUsed -= paletteLength * 32;
+
+        for (int i = 0; i < quadCount; i++) {
+            u32 neededTiles = quads[i].frameBytes * frameCount;
+            freeTiles(neededTiles, quads[i].tileStart);
+            _tileBytesUsed -= neededTiles;
+        }
+        delete[] quads;
+        delete[] residentFrames;
+    }
+
+    int Sprite3DManager::reserveTiles(u32 length, u32 &start, u32 alignment, bool slot0) {
+        slot0 |= !_compressedTextures;
+        while (!tileFreeZones.fits(length, alignment)) {
+            if (!slot0 && slot1FreeZones.fits(length, alignment))
+                return slot1FreeZones.reserve(length, start, alignment);
+            if (!evictTexture())
+                break;
+        }
+        if (_compactionEnabled && !tileFreeZones.fits(length, alignment) &&
+                tileFreeZones.getFreeLength() >= length + alignment - 1) {
+            // Enough free space once it's merged, try again after that
+            _compactTarget = length + alignment - 1;
+            _compactStalled = false;
+            queueCompaction();
+            return 1;
+        }
+        return tileFreeZones.reserve(length, start, alignment);
+    }
+
+    void Sprite3DManager::freeTiles(u32 length, u32 start) {
+        _compactStalled = false;
+        if (start >= kTextureSlotBytes)
+            slot1FreeZones.free(length, start);
+        else
+            tileFreeZones.free(length, start);
+    }
+
+    bool Sprite3DManager::compactionWanted() const {
+        if (!_compactionEnabled || _compactStalled)
+            return false;
+        if (_compactTarget != 0)
+            return true;
+        // Only fragmented, wait for a v-blank with nothing else to upload
+        if (vblankQueue.getStats().depth != 0)
+            return false;
+        if (tileFreeZones.getFragmentation() >= kCompactFragmentationPercent)
+            return true;
+        return _compressedTextures && slot1FreeZones.getFragmentation() >= kCompactFragmentationPercent;
+    }
+
+    void Sprite3DManager::queueCompaction() {
+        if (_compactQueued)
+            return;
+        _compactQueued = true;
+        vblankQueue.push(compactTilesJob, this, kTextureCompactChunk);
+    }
+
+    void Sprite3DManager::compactTilesJob(void* target, const s32*) {
+        auto* manager = (Sprite3DManager*) target;
+        manager->_compactQueued = false;
+        if (!manager->_compactionEnabled)
+            return;
+        bool slot1 = manager->_compressedTextures;
+        vramSetBankB(VRAM_B_LCD);
+        if (slot1)
+            vramSetBankD(VRAM_D_LCD);
+        u32 moved = manager->tileFreeZones.compact(kTextureCompactChunk);
+        if (slot1)
+            moved += manager->slot1FreeZones.compact(kTextureCompactChunk - moved);
+        vramSetBankB(VRAM_B_TEXTURE_SLOT0);
+        if (slot1)
+            vramSetBankD(VRAM_D_TEXTURE_SLOT1);
+
+        manager->_cacheStats.compactedBytes += moved;
+        manager->_compactStalled = moved == 0;
+        if (moved == 0 || manager->tileFreeZones.getLargestFree() >= manager->_compactTarget)
+            manager->_compactTarget = 0;
+    }
+
+    bool Sprite3DManager::relocateTilesCallback(void* context, u32 start, u32 newStart, u32 length) {
+        return ((Sprite3DManager*) context)->relocateTiles(start, newStart, length);
+    }
+
+    bool Sprite3DManager::relocateTiles(u32 start, u32 newStart, u32 length) {
+        // The frame rendered after this v-blank still reads the old copy,
+        // nothing may land on it until the next one
+        if (newStart + length > start || _vacatedCount == kTextureCompactMoves)
+            return false;
+        for (int i = 0; i < _vacatedCount; i++) {
+            if (newStart < _vacatedStart[i] + _vacatedLength[i] && _vacatedStart[i] < newStart + length)
+                return false;
+        }
+
+        // Tiles belong to a shown texture, a parked one or an atlas page
+        u32* tileStart = nullptr;
+        u32 texFormat = 0;
+        for (int i = 0; i < _activeSprCount && tileStart == nullptr; i++) {
+            Texture& texture = *_activeSpr[i]->_texture;
+            for (int quadIdx = 0; quadIdx < texture._quadCount; quadIdx++) {
+                if (texture._quads[quadIdx].tileStart == start) {
+                    tileStart = &texture._quads[quadIdx].tileStart;
+                    texFormat = texture._quads[quadIdx].texFormat;
+                    break;
+                }
+            }
+        }
+        for (int i = 0; i < kResidentTextureSlots && tileStart == nullptr; i++) {
+            ResidentTexture& entry = _resident[i];
+            for (int quadIdx = 0; entry.used && quadIdx < entry.quadCount; quadIdx++) {
+                if (entry.quads[quadIdx].tileStart == start) {
+                    tileStart = &entry.quads[quadIdx].tileStart;
+                    texFormat = entry.quads[quadIdx].texFormat;
+                    break;
+                }
+            }
+        }
+        for (int i = 0; i < kAtlasMaxPages && tileStart == nullptr; i++) {
+            if (_atlasPages[i].used && _atlasPages[i].tileStart == start)
+                tileStart = &_atlasPages[i].tileStart;
+        }
+        if (tileStart == nullptr)
+            return false;
+
+        dmaCopy(textureVram(start), textureVram(newStart), length);
+        if (((texFormat >> 26) & 7) == 5)  // Index words follow at half the offset
+            dmaCopy((u8*) VRAM_D + start / 2, (u8*) VRAM_D + newStart / 2, length / 2);
+        *tileStart = newStart;
+        _vacatedStart[_vacatedCount] = start;
+        _vacatedLength[_vacatedCount] = length;
+        _vacatedCount++;
+        return true;
+    }
+
+    int Sprite3DManager::reservePalette(u16 length, u16 &start, u16 alignment) {
+        while (!paletteFreeZones.fits(length, alignment) && evictTexture());
+        u32 start_;
+        int res = paletteFreeZones.reserve(length, start_, alignment);
+        if (res == 0)
+            start = start_;
+        return res;
+    }
+
+    bool Sprite3DManager::textureInSlot1(const Engine::Texture &texture) {
+        for (int i = 0; i < texture._quadCount; i++) {
+            if (texture._quads[i].tileStart >= kTextureSlotBytes)
+                return true;
+        }
+        return false;
+    }
+
+    void Sprite3DManager::flushTextureCache() {
+        while (evictTexture());
+    }
+
+    void Sprite3DManager::setTextureCacheEnabled(bool enabled) {
+        _textureCacheEnabled = enabled;
+        if (!enabled)
+            flushTextureCache();
+    }
+
+    bool Sprite3DManager::setCompressedTextures(bool enabled) {
+        if (enabled == _compressedTextures)
+            return true;
+        if (enabled && OAMManagerSub.getActiveCount() != 0) {
+            nocashMessage("Error: sub screen sprites still use VRAM_D");
+            return false;
+        }
+        if (!enabled) {
+            // Sprites in slot 1 load again in slot 0. Parked 4x4 textures
+            // would lose their index words.
+            for (int i = 0; i < _activeSprCount; i++) {
+                Sprite* spr = _activeSpr[i];
+                if (!spr->_memory.loadedIntoMemory || !textureInSlot1(*spr->_texture))
+                    continue;
+                freeSpriteTexture(*spr);
+                spr->_memory.loadedIntoMemory = false;
             }
-            tileHeight -= subTileHeight;
+            flushTextureCache();
         }
+        _compressedTextures = enabled;
+        OAMManagerSub.setTilesLent(enabled);
+        vramSetBankD(enabled ? VRAM_D_TEXTURE_SLOT1 : VRAM_D_SUB_SPRITE);
+        return true;
+    }
 
-        delete[] spr._texture->_tileStart;
-        spr._texture->_tileStart = nullptr;
+    void Sprite3DManager::resetCacheStats() {
+        u16 resident = _cacheStats.resident;
+        _cacheStats = TextureCacheStats();
+        _cacheStats.resident = resident;
+    }
+
+    void Sprite3DManager::resetZoneStats() {
+        tileFreeZones.resetStats();
+        slot1FreeZones.resetStats();
+        paletteFreeZones.resetStats();
+    }
+
+    void Sprite3DManager::dumpZoneStats() const {
+        tileFreeZones.dumpStats();
+        if (_compressedTextures)
+            slot1FreeZones.dumpStats();
+        paletteFreeZones.dumpStats();
+    }
+
+    void Sprite3DManager::resetGeometryStats() {
+        _geometryStats = GeometryStats();
+        _geometryWarned = false;
     }
 
     void Sprite3DManager::draw() {
+        _geometryStats.quads = 0;
         if (_activeSpr == nullptr)
             return;
+
+        _drawCount = 0;
         for (int i = 0; i < _activeSprCount; i++) {
             Sprite* spr = _activeSpr[i];
 
@@ -203,105 +698,539 @@ namespace Engine {
             if (!spr->_memory.loadedIntoMemory)
                 continue;
 
-            glColor( RGB15(31,31,31) );
-            glPolyFmt( POLY_ALPHA(31) | POLY_CULL_NONE);
+            if (spr->_texture->_atlasPage >= 0)
+                addAtlasQuad(*spr, i);
+            else if (spriteReady(*spr)) {
+                for (int quadIdx = 0; quadIdx < spr->_texture->_quadCount; quadIdx++) {
+                    // Nothing to see, don't spend a polygon on it
+                    if (_skipEmptyQuads && spr->_texture->quadEmpty(quadIdx, spr->_cFrame)) {
+                        _geometryStats.emptySkipped++;
+                        continue;
+                    }
+                    addQuad(*spr, i, spr->_texture->_quads[quadIdx]);
+                }
+            }
+        }
+        applyQuadBudget();
 
-            u8 tileWidth, tileHeight;
-            u8 tileFormat = spr->_texture->_color8bit ? 4 : 3;
-            u8 tileBytes = spr->_texture->_color8bit ? 64 : 32;
-            spr->_texture->getSizeTiles(tileWidth, tileHeight);
-
-            int tileIdx = 0;
-            int tilePosY = 0;
-            while (tileHeight > 0) {
-                u8 subTileHeight = 1;
-                u8 allocYFmt = 0;
-                while (subTileHeight << 1 <= tileHeight) {
-                    subTileHeight <<= 1;
-                    allocYFmt += 1;
+        // Group quads with the same texture state, groups in order of first
+        // use and quads in insertion order inside a group. Chains of
+        // indices, so nothing moves around.
+        u16 groupHead[kDrawGroupSlots], groupTail[kDrawGroupSlots];
+        u16 groupOrder[kDrawGroupSlots];
+        int groupCount = 0;
+        for (int i = 0; i < kDrawGroupSlots; i++)
+            groupHead[i] = kDrawListEnd;
+        for (int i = 0; i < _drawCount; i++) {
+            const DrawQuad& quad = _drawList[i];
+            u32 hashSlot = (quad.texFormat ^ (quad.palFormat * 0x9E3779B1)) % kDrawGroupSlots;
+            u32 slot = hashSlot;
+            int probe = 0;
+            for (; probe < kDrawGroupSlots; probe++) {
+                u16 head = groupHead[slot];
+                if (head == kDrawListEnd) {
+                    groupHead[slot] = i;
+                    groupOrder[groupCount++] = slot;
+                    break;
+                }
+                if (_drawList[head].texFormat == quad.texFormat && _drawList[head].palFormat == quad.palFormat) {
+                    _drawNext[groupTail[slot]] = i;
+                    break;
                 }
+                slot = (slot + 1) % kDrawGroupSlots;
+            }
+            if (probe == kDrawGroupSlots) {
+                // Every slot taken, any group works as each quad sets its own state
+                slot = hashSlot;
+                _drawNext[groupTail[slot]] = i;
+            }
+            groupTail[slot] = i;
+            _drawNext[i] = kDrawListEnd;
+        }
 
-                int tileWidth_ = tileWidth;
-                int tilePosX = 0;
-                while (tileWidth_ > 0) {
-                    u8 subTileWidth = 1;
-                    u8 allocXFmt = 0;
-                    while (subTileWidth << 1 <= tileWidth_) {
-                        subTileWidth <<= 1;
-                        allocXFmt += 1;
-                    }
+        if (_drawCount == 0)
+            return;
 
-                    s32 x = ((spr->_x - (1 << 4)) >> 8) + 1;
-                    x += (tilePosX * 8 * spr->_scale_x) >> 8;
-                    s32 x2 = x + ((subTileWidth * 8 * spr->_scale_x) >> 8);
-                    s32 w = subTileWidth * 8;
-                    s32 y = (((spr->_y - (1 << 4)) >> 8)) + 1;
-                    y += (tilePosY * 8 * spr->_scale_y) >> 8;
-                    s32 y2 = y + ((subTileHeight * 8 * spr->_scale_y) >> 8);
-                    s32 h = subTileHeight * 8;
-
-                    if (x > 256 || x2 < 0 || y > 192 || y2 < 0) {
-                        tileIdx++;
-                        tileWidth_ -= subTileWidth;
-                        tilePosX += subTileWidth;
-                        continue;
-                    }
+        _gxList.reset();
+        _gxList.command(GX_COLOR, RGB15(31,31,31));
+        _gxList.command(GX_POLYGON_ATTR, POLY_ALPHA(31) | POLY_CULL_NONE);
+        _gxList.command(GX_MTX_MODE, GL_MODELVIEW);
+        _gxList.command(GX_MTX_IDENTITY);
+        // Texture parameters can change between polygons of the same batch
+        _gxList.command(GX_BEGIN_VTXS, GL_QUADS);
+        _texStateSet = false;
+        for (int group = 0; group < groupCount; group++) {
+            for (u16 i = groupHead[groupOrder[group]]; i != kDrawListEnd; i = _drawNext[i]) {
+                DrawQuad& quad = _drawList[i];
+                setTexState(quad.texFormat, quad.palFormat);
+                _gxList.command(GX_TEXCOORD, (quad.v << (4 + 16)) + (quad.u << 4));
+                _gxList.command(GX_VTX_16, quad.x + (quad.y << 16), quad.z);
+                _gxList.command(GX_TEXCOORD, ((quad.v + quad.h) << (4 + 16)) + (quad.u << 4));
+                _gxList.command(GX_VTX_XY, quad.x + (quad.y2 << 16));
+                _gxList.command(GX_TEXCOORD, ((quad.v + quad.h) << (4 + 16)) + ((quad.u + quad.w) << 4));
+                _gxList.command(GX_VTX_XY, quad.x2 + (quad.y2 << 16));
+                _gxList.command(GX_TEXCOORD, (quad.v << (4 + 16)) + ((quad.u + quad.w) << 4));
+                _gxList.command(GX_VTX_XY, quad.x2 + (quad.y << 16));
+            }
+        }
+        _gxList.command(GX_END_VTXS);
+        _geometryStats.quads = _drawCount;
+        if (_drawCount > _geometryStats.maxQuads)
+            _geometryStats.maxQuads = _drawCount;
+        // Runs while the CPU goes on with the frame, waitDraw before
+        // anything else writes to the geometry engine
+        _gxList.submit();
+    }
 
-                    MATRIX_CONTROL = GL_MODELVIEW;
-                    MATRIX_IDENTITY = 0;
-                    GFX_TEX_FORMAT = (allocXFmt << 20) + (allocYFmt << 23) + (tileFormat << 26) + (1 << 29) +
-                                     (spr->_texture->_tileStart[tileIdx] + spr->_cFrame * subTileWidth * subTileHeight * tileBytes) / 8;
-                    if (tileFormat == 4)
-                        GFX_PAL_FORMAT = spr->_texture->_paletteIdx;
-                    else
-                        GFX_PAL_FORMAT = spr->_texture->_paletteIdx * 2;
-                    GFX_BEGIN = GL_QUADS;
-                    GFX_TEX_COORD = 0;
-                    GFX_VERTEX16 = x + (y << 16);
-                    GFX_VERTEX16 = spr->_layer + spr->_texture->_topDownOffset;
-                    GFX_TEX_COORD = h << (4 + 16);
-                    GFX_VERTEX_XY = x + (y2 << 16);
-                    GFX_TEX_COORD = (h << (4 + 16)) + (w << 4);
-                    GFX_VERTEX_XY = x2 + (y2 << 16);
-                    GFX_TEX_COORD = (w << 4);
-                    GFX_VERTEX_XY = x2 + (y << 16);
-                    GFX_END = 0;
-
-                    tileIdx++;
-                    tileWidth_ -= subTileWidth;
-                    tilePosX += subTileWidth;
-                }
-                tileHeight -= subTileHeight;
-                tilePosY += subTileHeight;
+    DrawQuad* Sprite3DManager::newDrawQuad() {
+        if (_drawCount == kDrawListEnd)
+            return nullptr;
+        if (_drawCount == _drawCapacity) {
+            _drawCapacity = _drawCapacity == 0 ? 32 : _drawCapacity * 2;
+            auto* drawListNew = new DrawQuad[_drawCapacity];
+            memcpy(drawListNew, _drawList, sizeof(DrawQuad) * _drawCount);
+            delete[] _drawList;
+            delete[] _drawNext;
+            _drawList = drawListNew;
+            _drawNext = new u16[_drawCapacity];
+        }
+        return &_drawList[_drawCount++];
+    }
+
+    void Sprite3DManager::applyQuadBudget() {
+        // Against what the hardware takes when the budget is over it
+        u16 limit = _quadBudget < kMaxQuads ? _quadBudget : kMaxQuads;
+        bool warn = _drawCount * 100 >= limit * kGeometryWarnPercent;
+        if (warn && !_geometryWarned) {
+            char buffer[100];
+            sprintf(buffer, "3D geometry %d/%d quads", _drawCount, limit);
+            nocashMessage(buffer);
+            _geometryStats.warnings++;
+        }
+        _geometryWarned = warn;
+        if (_drawCount <= _quadBudget)
+            return;
+
+        // Lowest priority that has to lose sprites, every one below goes
+        u16 perPriority[256] = {0};
+        for (int i = 0; i < _drawCount; i++)
+            perPriority[_drawList[i].priority + 128]++;
+        int cutPriority = 255;
+        int kept = 0;
+        while (kept + perPriority[cutPriority] <= _quadBudget)
+            kept += perPriority[cutPriority--];
+        kept += perPriority[cutPriority];
+        cutPriority -= 128;
+
+        // At the cut, whole sprites from the last one drawn, so none shows
+        // with pieces missing. A sprite's quads are next to each other.
+        u16 lastSprite = kDrawListEnd;
+        for (int i = _drawCount - 1; i >= 0; i--) {
+            DrawQuad& quad = _drawList[i];
+            if (quad.priority < cutPriority || (quad.priority == cutPriority &&
+                    (kept > _quadBudget || quad.sprite == lastSprite))) {
+                if (quad.sprite != lastSprite)
+                    _geometryStats.droppedSprites++;
+                if (quad.priority == cutPriority)
+                    kept--;
+                lastSprite = quad.sprite;
+                quad.sprite = kDrawListEnd;
             }
         }
+
+        int count = 0;
+        for (int i = 0; i < _drawCount; i++) {
+            if (_drawList[i].sprite != kDrawListEnd)
+                _drawList[count++] = _drawList[i];
+        }
+        _geometryStats.dropped += _drawCount - count;
+        _drawCount = count;
     }
 
-    void Sprite3DManager::updateTextures() {
-        bool setBank = false;
-        if (_activeSpr == nullptr)
+    void Sprite3DManager::addQuad(Engine::Sprite &spr, u16 sprIdx, const Engine::Texture3DQuad &texQuad) {
+        s32 x = ((spr._x - (1 << 4)) >> 8) + 1;
+        x += (texQuad.x * 8 * spr._scale_x) >> 8;
+        s32 x2 = x + ((texQuad.width * 8 * spr._scale_x) >> 8);
+        s32 y = ((spr._y - (1 << 4)) >> 8) + 1;
+        y += (texQuad.y * 8 * spr._scale_y) >> 8;
+        s32 y2 = y + ((texQuad.height * 8 * spr._scale_y) >> 8);
+        if (x > 256 || x2 < 0 || y > 192 || y2 < 0)
             return;
-        for (int i = 0; i < _activeSprCount; i++) {
+
+        DrawQuad* quad = newDrawQuad();
+        if (quad == nullptr)
+            return;
+        // Palette base is in 16 byte steps for both formats
+        quad->texFormat = texQuad.texFormat + (texQuad.tileStart + spr._cFrame * texQuad.frameBytes) / 8;
+        quad->palFormat = spr._texture->_paletteIdx * 2;
+        quad->x = x;
+        quad->y = y;
+        quad->x2 = x2;
+        quad->y2 = y2;
+        quad->z = spr._layer + spr._texture->_topDownOffset;
+        quad->u = 0;
+        quad->v = 0;
+        quad->w = texQuad.width * 8;
+        quad->h = texQuad.height * 8;
+        quad->sprite = sprIdx;
+        quad->priority = spr._drawPriority;
+    }
+
+    void Sprite3DManager::addAtlasQuad(Engine::Sprite &spr, u16 sprIdx) {
+        AtlasPage& page = _atlasPages[spr._texture->_atlasPage];
+        if (!page.uploaded)
+            return;
+
+        s32 w = spr._texture->_width;
+        s32 h = spr._texture->_height;
+        s32 x = ((spr._x - (1 << 4)) >> 8) + 1;
+        s32 x2 = x + ((w * spr._scale_x) >> 8);
+        s32 y = ((spr._y - (1 << 4)) >> 8) + 1;
+        s32 y2 = y + ((h * spr._scale_y) >> 8);
+        if (x > 256 || x2 < 0 || y > 192 || y2 < 0)
+            return;
+
+        DrawQuad* quad = newDrawQuad();
+        if (quad == nullptr)
+            return;
+        quad->texFormat = (page.widthFmt << 20) + (page.heightFmt << 23) +
+                          ((page.color8bit ? 4 : 3) << 26) + (1 << 29) + page.tileStart / 8;
+        quad->palFormat = page.paletteIdx * 2;
+        quad->x = x;
+        quad->y = y;
+        quad->x2 = x2;
+        quad->y2 = y2;
+        quad->z = spr._layer + spr._texture->_topDownOffset;
+        quad->u = spr._texture->_atlasCoords[spr._cFrame * 2];
+        quad->v = spr._texture->_atlasCoords[spr._cFrame * 2 + 1];
+        quad->w = w;
+        quad->h = h;
+        quad->sprite = sprIdx;
+        quad->priority = spr._drawPriority;
+    }
+
+    void Sprite3DManager::loadSpriteTextureJob(void* target, const s32*) {
+        auto* spr = (Sprite*) target;
+        spr->_memory.uploadQueued = false;
+        vramSetBankB(VRAM_B_LCD);
+        vramSetBankE(VRAM_E_LCD);
+        main3dSpr.loadSpriteTexture(*spr);
+        vramSetBankB(VRAM_B_TEXTURE_SLOT0);
+        vramSetBankE(VRAM_E_TEX_PALETTE);
+    }
+
+    void Sprite3DManager::updateTextures() {
+        // The frame drawn with the moved textures' old places is out
+        _vacatedCount = 0;
+        for (int i = 0; _activeSpr != nullptr && i < _activeSprCount; i++) {
             Sprite* spr = _activeSpr[i];
 
-            if (!spr->_memory.loadedIntoMemory) {
+            if (!spr->_memory.loadedIntoMemory && !spr->_memory.uploadQueued &&
+                    (!spr->_texture->_compressed || _compressedTextures)) {
 #ifdef DEBUG_3D
                 char buffer[100];
-                sprintf(buffer, "Loading sprite %d out of %d", i + 1, activeSpriteCount);
+                sprintf(buffer, "Queueing sprite %d out of %d", i + 1, _activeSprCount);
                 nocashMessage(buffer);
 #endif
-                if (!setBank) {
-                    vramSetBankB(VRAM_B_LCD);
-                    vramSetBankE(VRAM_E_LCD);
-                    setBank = true;
+                // Shared and parked textures are already in VRAM, the
+                // frames of new ones stream in with jobs of their own
+                u32 cost = 0;
+                if (spr->_texture->_loaded3DCount == 0 && spr->_texture->_atlasPage < 0 &&
+                        findResident(*spr->_texture) < 0)
+                    cost = (spr->_texture->_colorCount + spr->_texture->_blockColorCount) * 2;
+                spr->_memory.uploadQueued = true;
+                vblankQueue.push(loadSpriteTextureJob, spr, cost);
+            }
+        }
+        // After the loads, which can't use what it vacates this v-blank
+        if (compactionWanted())
+            queueCompaction();
+    }
+
+    void Sprite3DManager::setTexState(u32 texFormat, u32 palFormat) {
+        if (!_texStateSet || texFormat != _texFormat)
+            _gxList.command(GX_TEXIMAGE_PARAM, texFormat);
+        if (!_texStateSet || palFormat != _palFormat)
+            _gxList.command(GX_PLTT_BASE, palFormat);
+        _texFormat = texFormat;
+        _palFormat = palFormat;
+        _texStateSet = true;
+    }
+
+    void Sprite3DManager::packAtlas(Engine::Texture **textures, int textureCount) {
+        if (!_atlasEnabled || textureCount == 0)
+            return;
+        // Only textures that aren't in VRAM yet and that are small enough
+        bool* packed = new bool[textureCount];
+        for (int i = 0; i < textureCount; i++) {
+            Texture* tex = textures[i];
+            packed[i] = !tex->getLoaded() || tex->_atlasPage >= 0 || tex->_loaded3DCount > 0 || tex->_compressed ||
+                        tex->_width > kAtlasMaxTextureSize || tex->_height > kAtlasMaxTextureSize ||
+                        (u32) tex->_width * tex->_height * tex->_frameCount > kAtlasMaxTextureTexels;
+        }
+        while (packAtlasPage(textures, textureCount, packed) == 0);
+        delete[] packed;
+    }
+
+    // Places textures (in order) on shelves of the given width, each frame
+    // on its own spot. Textures whose colors or frames don't fit are
+    // skipped. Returns the texel area of the page rounded to powers of two.
+    u32 Sprite3DManager::shelfPack(Engine::Texture **textures, const int *order, int orderCount, u16 width, u16 maxHeight,
+                  u16 *colors, u16 &colorCount, u8 **coords, bool *placed, u16 &usedWidth, u16 &usedHeight) {
+        u16 cursorX = 0, shelfY = 0, shelfHeight = 0;
+        usedWidth = 0;
+        for (int i = 0; i < orderCount; i++) {
+            Texture* tex = textures[order[i]];
+            placed[i] = false;
+
+            u16 newColors = 0;
+            for (int c = 0; c < tex->_colorCount; c++) {
+                int pageColor = 0;
+                while (pageColor < colorCount && colors[pageColor] != tex->_colors[c])
+                    pageColor++;
+                if (pageColor == colorCount)
+                    newColors++;
+            }
+            if (colorCount + newColors > 255)
+                continue;
+
+            u16 cursorX_ = cursorX, shelfY_ = shelfY, shelfHeight_ = shelfHeight, usedWidth_ = usedWidth;
+            bool fits = tex->_width <= width;
+            for (int frame = 0; frame < tex->_frameCount && fits; frame++) {
+                if (cursorX_ + tex->_width > width) {
+                    shelfY_ += shelfHeight_;
+                    cursorX_ = 0;
+                    shelfHeight_ = 0;
+                }
+                if (shelfY_ + tex->_height > maxHeight) {
+                    fits = false;
+                    break;
                 }
-                loadSpriteTexture(*spr);
+                coords[i][frame * 2] = cursorX_;
+                coords[i][frame * 2 + 1] = shelfY_;
+                cursorX_ += tex->_width;
+                if (cursorX_ > usedWidth_)
+                    usedWidth_ = cursorX_;
+                if (tex->_height > shelfHeight_)
+                    shelfHeight_ = tex->_height;
+            }
+            if (!fits)
+                continue;
+
+            cursorX = cursorX_;
+            shelfY = shelfY_;
+            shelfHeight = shelfHeight_;
+            usedWidth = usedWidth_;
+            for (int c = 0; c < tex->_colorCount; c++) {
+                int pageColor = 0;
+                while (pageColor < colorCount && colors[pageColor] != tex->_colors[c])
+                    pageColor++;
+                if (pageColor == colorCount)
+                    colors[colorCount++] = tex->_colors[c];
             }
+            placed[i] = true;
         }
-        if (setBank) {
-            vramSetBankB(VRAM_B_TEXTURE_SLOT0);
-            vramSetBankE(VRAM_E_TEX_PALETTE);
+        usedHeight = shelfY + shelfHeight;
+
+        u32 pageWidth = 8, pageHeight = 8;
+        while (pageWidth < usedWidth)
+            pageWidth <<= 1;
+        while (pageHeight < usedHeight)
+            pageHeight <<= 1;
+        return pageWidth * pageHeight;
+    }
+
+    int Sprite3DManager::packAtlasPage(Engine::Texture **textures, int textureCount, bool *packed) {
+        int pageIdx = 0;
+        for (; pageIdx < kAtlasMaxPages; pageIdx++) {
+            if (!_atlasPages[pageIdx].used)
+                break;
         }
+        if (pageIdx == kAtlasMaxPages)
+            return 1;
+        AtlasPage& page = _atlasPages[pageIdx];
+        page = AtlasPage();
+
+        // Tallest first so the shelves waste less space
+        int* order = new int[textureCount];
+        int orderCount = 0;
+        for (int i = 0; i < textureCount; i++) {
+            if (packed[i])
+                continue;
+            int j = orderCount++;
+            while (j > 0 && textures[order[j - 1]]->_height < textures[i]->_height) {
+                order[j] = order[j - 1];
+                j--;
+            }
+            order[j] = i;
+        }
+
+        auto** coords = new u8*[orderCount];
+        for (int i = 0; i < orderCount; i++)
+            coords[i] = new u8[textures[order[i]]->_frameCount * 2];
+        bool* placed = new bool[orderCount];
+        u16 colors[255];
+
+        // Narrow pages round up to less VRAM, pick the width that fits the
+        // most textures in the smallest page
+        u16 bestWidth = 0;
+        int bestCount = 0;
+        u32 bestArea = 0;
+        for (u16 width = 32; width <= kAtlasPageWidth; width <<= 1) {
+            u16 maxHeight = kAtlasPageMaxBytes / width;
+            if (maxHeight > 256)
+                maxHeight = 256;
+            u16 colorCount = 0, usedWidth, usedHeight;
+            u32 area = shelfPack(textures, order, orderCount, width, maxHeight,
+                                 colors, colorCount, coords, placed, usedWidth, usedHeight);
+            int count = 0;
+            for (int i = 0; i < orderCount; i++)
+                count += placed[i];
+            if (count > bestCount || (count == bestCount && count > 0 && area < bestArea)) {
+                bestWidth = width;
+                bestCount = count;
+                bestArea = area;
+            }
+        }
+
+        u16 usedWidth = 0, usedHeight = 0;
+        if (bestCount > 0) {
+            u16 maxHeight = kAtlasPageMaxBytes / bestWidth;
+            if (maxHeight > 256)
+                maxHeight = 256;
+            shelfPack(textures, order, orderCount, bestWidth, maxHeight,
+                      page.colors, page.colorCount, coords, placed, usedWidth, usedHeight);
+            for (int i = 0; i < orderCount; i++) {
+                if (!placed[i])
+                    continue;
+                Texture* tex = textures[order[i]];
+                tex->_atlasCoords = coords[i];
+                coords[i] = nullptr;
+                tex->_atlasPage = pageIdx;
+                packed[order[i]] = true;
+                page.textureCount++;
+            }
+        }
+        for (int i = 0; i < orderCount; i++)
+            delete[] coords[i];
+        delete[] coords;
+        delete[] placed;
+        delete[] order;
+
+        if (page.textureCount == 0)
+            return 1;
+
+        u16 width = 8, height = 8;
+        while (width < usedWidth) {
+            width <<= 1;
+            page.widthFmt++;
+        }
+        while (height < usedHeight) {
+            height <<= 1;
+            page.heightFmt++;
+        }
+        page.color8bit = page.colorCount >= 16;
+        page.texelBytes = page.color8bit ? width * height : width * height / 2;
+        // Only the colors in use, a 256 color palette can start on any 16 color slot
+        page.paletteLength = (page.colorCount + 1 + 15) / 16;
+
+        bool reserved = reserveTiles(page.texelBytes, page.tileStart, 8, true) == 0;
+        if (reserved && reservePalette(page.paletteLength, page.paletteIdx, 1) != 0) {
+            freeTiles(page.texelBytes, page.tileStart);
+            reserved = false;
+        }
+        if (!reserved) {
+            // Out of VRAM, the textures will be loaded on their own
+            for (int i = 0; i < textureCount; i++) {
+                if (textures[i]->_atlasPage != pageIdx)
+                    continue;
+                delete[] textures[i]->_atlasCoords;
+                textures[i]->_atlasCoords = nullptr;
+                textures[i]->_atlasPage = -1;
+            }
+            return 1;
+        }
+        _tileBytesUsed += page.texelBytes;
+        _paletteBytesUsed += page.paletteLength * 32;
+
+        page.texels = new u8[page.texelBytes];
+        memset(page.texels, 0, page.texelBytes);
+        for (int i = 0; i < textureCount; i++) {
+            Texture* tex = textures[i];
+            if (tex->_atlasPage != pageIdx)
+                continue;
+
+            u8 remap[256] = {0};
+            for (int c = 0; c < tex->_colorCount; c++) {
+                int pageColor = 0;
+                while (page.colors[pageColor] != tex->_colors[c])
+                    pageColor++;
+                remap[c + 1] = pageColor + 1;
+            }
+
+            bool unpacked = tex->_tiles == nullptr;
+            tex->unpackTiles();
+            u8 tileWidth, tileHeight;
+            tex->getSizeTiles(tileWidth, tileHeight);
+            for (int frame = 0; frame < tex->_frameCount; frame++) {
+                u16 frameX = tex->_atlasCoords[frame * 2];
+                u16 frameY = tex->_atlasCoords[frame * 2 + 1];
+                for (int y = 0; y < tex->_height; y++) {
+                    for (int x = 0; x < tex->_width; x++) {
+                        u32 tileOffset = (frame * tileWidth * tileHeight + (y / 8) * tileWidth + x / 8) * 64 +
+                                         (y % 8) * 8 + (x % 8);
+                        u8 texel = remap[tex->_tiles[tileOffset]];
+                        u32 dst = (frameY + y) * width + frameX + x;
+                        if (page.color8bit)
+                            page.texels[dst] = texel;
+                        else
+                            page.texels[dst / 2] |= texel << (4 * (dst & 1));
+                    }
+                }
+            }
+            if (unpacked) {
+                // Version 5 textures only kept their 3D data
+                delete[] tex->_tiles;
+                tex->_tiles = nullptr;
+            }
+        }
+
+        page.used = true;
+        vblankQueue.push(loadAtlasPageJob, &page, page.texelBytes + page.colorCount * 2);
+        return 0;
+    }
+
+    void Sprite3DManager::loadAtlasPageJob(void* target, const s32*) {
+        auto* page = (AtlasPage*) target;
+        vramSetBankB(VRAM_B_LCD);
+        vramSetBankE(VRAM_E_LCD);
+        DC_FlushRange(page->texels, page->texelBytes);
+        dmaCopy(page->texels, (u8*) VRAM_B + page->tileStart, page->texelBytes);
+        DC_FlushRange(page->colors, page->colorCount * 2);
+        dmaCopyHalfWords(3, page->colors, &VRAM_E[16 * page->paletteIdx + 1], page->colorCount * 2);
+        vramSetBankB(VRAM_B_TEXTURE_SLOT0);
+        vramSetBankE(VRAM_E_TEX_PALETTE);
+        delete[] page->texels;
+        page->texels = nullptr;
+        page->uploaded = true;
+    }
+
+    void Sprite3DManager::releaseAtlas(Engine::Texture &texture) {
+        AtlasPage& page = _atlasPages[texture._atlasPage];
+        delete[] texture._atlasCoords;
+        texture._atlasCoords = nullptr;
+        texture._atlasPage = -1;
+        if (--page.textureCount > 0)
+            return;
+
+        if (!page.uploaded)
+            vblankQueue.cancel(&page);
+        delete[] page.texels;
+        freeTiles(page.texelBytes, page.tileStart);
+        paletteFreeZones.free(page.paletteLength, page.paletteIdx);
+        _tileBytesUsed -= page.texelBytes;
+        _paletteBytesUsed -= page.paletteLength * 32;
+        page = AtlasPage();
     }
 
     Sprite3DManager main3dSpr;
@@ -1,4 +1,5 @@
 #include "Engine/Texture.hpp"
+#include "Engine/Sprite3DManager.hpp"
 #include "Formats/utils.hpp"
 
 namespace Engine {
@@ -25,6 +26,10 @@ namespace Engine {
             return false;
         }
 
+        // FNV-1a, so the 3D VRAM cache knows the file when it comes back
+        _pathHash = 2166136261u;
+        for (const char* c = path; *c != 0; c++)
+            _pathHash = (_pathHash ^ (u8) *c) * 16777619u;
         return true;
     }
 
@@ -51,7 +56,7 @@ namespace Engine {
         }
 
         fread(&version, 4, 1, f);
-        if (version != 4) {
+        if (version != 4 && version != 5) {
             return 3;
         }
 
@@ -66,8 +71,40 @@ namespace Engine {
 
         fread(&_frameCount, 1, 1, f);
         u16 tileCount = tileWidth * tileHeight;
-        _tiles = new u8[64 * tileCount * _frameCount];
-        fread(_tiles, 8 * 8 * tileCount * _frameCount, 1, f);
+        if (version == 4) {
+            _tiles = new u8[64 * tileCount * _frameCount];
+            fread(_tiles, 8 * 8 * tileCount * _frameCount, 1, f);
+        } else {
+            u8 texFormat;
+            fread(&texFormat, 1, 1, f);
+            bool color8bit = texFormat & 1;
+            _compressed = texFormat & 2;
+            fread(&_texDataSize, 4, 1, f);
+            // 4x4 compressed: 16 bytes of texels and 8 of index words per tile
+            u32 tileBytes = _compressed ? 24 : (color8bit ? 64 : 32);
+            int error = 0;
+            // Sprite3DManager picks the depth from the color count
+            if (!_compressed && color8bit != (_colorCount >= 16))
+                error = 5;
+            else if (_texDataSize != tileCount * _frameCount * tileBytes)
+                error = 6;
+            if (error != 0) {
+                // Not loaded yet, free_() wouldn't release the palette
+                delete[] _colors;
+                _colors = nullptr;
+                _compressed = false;
+                _texDataSize = 0;
+                return error;
+            }
+            _texData = new u8[_texDataSize];
+            fread(_texData, _texDataSize, 1, f);
+            if (_compressed) {
+                fread(&_blockColorCount, 2, 1, f);
+                delete[] _colors;
+                _colors = new u16[_blockColorCount];
+                fread(_colors, 2, _blockColorCount, f);
+            }
+        }
 
         fread(&_animationCount, 1, 1, f);
         _animations = new CSPRAnimation[_animationCount];
@@ -97,10 +134,22 @@ namespace Engine {
         if (!_loaded)
             return;
         _loaded = false;
+        if (_atlasPage >= 0)
+            main3dSpr.releaseAtlas(*this);
+        if (_quads != nullptr)  // Parked, the VRAM cache takes it over
+            main3dSpr.orphanTexture(*this);
+        _pathHash = 0;
         delete[] _colors;
         _colors = nullptr;
         delete[] _tiles;
         _tiles = nullptr;
+        delete[] _emptyQuads;
+        _emptyQuads = nullptr;
+        delete[] _texData;
+        _texData = nullptr;
+        _texDataSize = 0;
+        _compressed = false;
+        _blockColorCount = 0;
         if (_animations != nullptr) {
             for (int i = 0; i < _animationCount; i++) {
                 delete[] _animations[i].name;
@@ -112,4 +161,126 @@ namespace Engine {
         }
         _animations = nullptr;
     }
-}
\ No newline at end of file
+
+    void Texture::unpackTiles() {
+        if (_tiles != nullptr || _texData == nullptr || _compressed)
+            return;
+        u8 tileWidth, tileHeight;
+        getSizeTiles(tileWidth, tileHeight);
+        bool color8bit = _colorCount >= 16;
+        _tiles = new u8[64 * tileWidth * tileHeight * _frameCount];
+
+        // Walk the sub-textures in the order jsonToCspr.py wrote them
+        const u8* src = _texData;
+        int tilePosY = 0;
+        int tileHeight_ = tileHeight;
+        while (tileHeight_ > 0) {
+            u8 subTileHeight = 1;
+            while (subTileHeight << 1 <= tileHeight_)
+                subTileHeight <<= 1;
+
+            int tileWidth_ = tileWidth;
+            int tilePosX = 0;
+            while (tileWidth_ > 0) {
+                u8 subTileWidth = 1;
+                while (subTileWidth << 1 <= tileWidth_)
+                    subTileWidth <<= 1;
+
+                int texelWidth = subTileWidth * 8;
+                for (int frame = 0; frame < _frameCount; frame++) {
+                    for (int y = 0; y < subTileHeight * 8; y++) {
+                        for (int x = 0; x < texelWidth; x++) {
+                            int texel = y * texelWidth + x;
+                            u8 pixel;
+                            if (color8bit)
+                                pixel = src[texel];
+                            else
+                                pixel = (src[texel / 2] >> (4 * (texel & 1))) & 0xF;
+                            int tileX = tilePosX + x / 8, tileY = tilePosY + y / 8;
+                            u32 tileOffset = (frame * tileWidth * tileHeight + tileY * tileWidth + tileX) * 64;
+                            _tiles[tileOffset + (y % 8) * 8 + (x % 8)] = pixel;
+                        }
+                    }
+                    src += subTileWidth * subTileHeight * (color8bit ? 64 : 32);
+                }
+                tileWidth_ -= subTileWidth;
+                tilePosX += subTileWidth;
+            }
+            tileHeight_ -= subTileHeight;
+            tilePosY += subTileHeight;
+        }
+    }
+
+    void Texture::dropTexData() {
+        if (_tiles == nullptr || _compressed)
+            return;
+        delete[] _texData;
+        _texData = nullptr;
+        _texDataSize = 0;
+    }
+
+    void Texture::findEmptyQuads() {
+        if (_emptyQuads != nullptr)
+            return;
+        u8 tileWidth, tileHeight;
+        getSizeTiles(tileWidth, tileHeight);
+        int quadCount = __builtin_popcount(tileWidth) * __builtin_popcount(tileHeight);
+        _emptyQuads = new u8[(quadCount * _frameCount + 7) / 8]();
+        bool color8bit = _colorCount >= 16;
+
+        // Same walk as unpackTiles, transparent texels are all 0 bits and
+        // transparent 4x4 blocks all texel 3 in a mode with transparency
+        const u8* src = _texData;
+        const u8* indexSrc = _compressed ? _texData + _texDataSize / 3 * 2 : nullptr;
+        int quadIdx = 0;
+        int tilePosY = 0;
+        int tileHeight_ = tileHeight;
+        while (tileHeight_ > 0) {
+            u8 subTileHeight = 1;
+            while (subTileHeight << 1 <= tileHeight_)
+                subTileHeight <<= 1;
+
+            int tileWidth_ = tileWidth;
+            int tilePosX = 0;
+            while (tileWidth_ > 0) {
+                u8 subTileWidth = 1;
+                while (subTileWidth << 1 <= tileWidth_)
+                    subTileWidth <<= 1;
+
+                for (int frame = 0; frame < _frameCount; frame++) {
+                    bool empty = true;
+                    if (_compressed) {
+                        u32 blocks = subTileWidth * subTileHeight * 4;
+                        for (u32 i = 0; i < blocks && empty; i++)
+                            empty = ((const u32*) src)[i] == 0xFFFFFFFF && (((const u16*) indexSrc)[i] >> 14) < 2;
+                        src += blocks * 4;
+                        indexSrc += blocks * 2;
+                    } else if (src != nullptr) {
+                        u32 bytes = subTileWidth * subTileHeight * (color8bit ? 64 : 32);
+                        for (u32 i = 0; i < bytes && empty; i++)
+                            empty = src[i] == 0;
+                        src += bytes;
+                    } else if (_tiles != nullptr) {
+                        for (int tileY = tilePosY; tileY < tilePosY + subTileHeight && empty; tileY++) {
+                            for (int tileX = tilePosX; tileX < tilePosX + subTileWidth && empty; tileX++) {
+                                const u8* tile = &_tiles[(frame * tileWidth * tileHeight + tileY * tileWidth + tileX) * 64];
+                                for (int i = 0; i < 64 && empty; i++)
+                                    empty = tile[i] == 0;
+                            }
+                        }
+                    } else
+                        empty = false;
+                    if (empty) {
+                        u32 bit = quadIdx * _frameCount + frame;
+                        _emptyQuads[bit / 8] |= 1 << (bit % 8);
+                    }
+                }
+                quadIdx++;
+                tileWidth_ -= subTileWidth;
+                tilePosX += subTileWidth;
+            }
+            tileHeight_ -= subTileHeight;
+            tilePosY += subTileHeight;
+        }
+    }
+}
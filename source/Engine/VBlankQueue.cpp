@@ -0,0 +1,113 @@
+#include "Engine/VBlankQueue.hpp"
+#include <cstdio>
+
+namespace Engine {
+    // A job that keeps losing to non deferrable work still runs after this
+    // many v-blanks, even if it breaks the budget
+    const u32 kVBlankMaxWait = 8;
+
+    int VBlankQueue::push(VBlankJobFunc func, void* target, u32 cost,
+                          s32 arg0, s32 arg1, s32 arg2, s32 arg3) {
+        _stats.queued++;
+        if (_count >= kVBlankQueueCapacity) {
+            _stats.overflows++;
+            s32 args[kVBlankJobArgs] = {arg0, arg1, arg2, arg3};
+            func(target, args);
+            return 1;
+        }
+
+        VBlankJob& job = _jobs[(_head + _count) % kVBlankQueueCapacity];
+        job.func = func;
+        job.target = target;
+        job.args[0] = arg0;
+        job.args[1] = arg1;
+        job.args[2] = arg2;
+        job.args[3] = arg3;
+        job.cost = cost;
+        job.queuedFrame = _frame;
+        _count++;
+
+        _stats.depth = _count;
+        if (_count > _stats.maxDepth)
+            _stats.maxDepth = _count;
+        return 0;
+    }
+
+    void VBlankQueue::cancel(const void* target) {
+        u16 kept = 0;
+        for (int i = 0; i < _count; i++) {
+            VBlankJob& job = _jobs[(_head + i) % kVBlankQueueCapacity];
+            if (job.target == target)
+                continue;
+            if (kept != i)
+                _jobs[(_head + kept) % kVBlankQueueCapacity] = job;
+            kept++;
+        }
+        _count = kept;
+        _stats.depth = _count;
+    }
+
+    void VBlankQueue::runJob(VBlankJob& job) {
+        job.func(job.target, job.args);
+        _frameCost += job.cost;
+        _stats.run++;
+    }
+
+    void VBlankQueue::popFront() {
+        _head = (_head + 1) % kVBlankQueueCapacity;
+        _count--;
+    }
+
+    void VBlankQueue::drain() {
+        while (_count > 0) {
+            VBlankJob& job = _jobs[_head];
+            bool fits = _frameCost == 0 || _frameCost + job.cost <= _budget;
+            if (!fits && _frame - job.queuedFrame < kVBlankMaxWait)
+                break;
+            // Pop before running, the job may queue more work
+            VBlankJob current = job;
+            popFront();
+            runJob(current);
+        }
+
+        _stats.deferred += _count;
+        _stats.depth = _count;
+        if (_frameCost > _budget)
+            _stats.overruns++;
+        _stats.lastFrameCost = _frameCost;
+        if (_frameCost > _stats.maxFrameCost)
+            _stats.maxFrameCost = _frameCost;
+        _frameCost = 0;
+        _frame++;
+    }
+
+    void VBlankQueue::flush() {
+        while (_count > 0) {
+            VBlankJob current = _jobs[_head];
+            popFront();
+            current.func(current.target, current.args);
+            _stats.run++;
+        }
+        _stats.depth = 0;
+    }
+
+    void VBlankQueue::resetStats() {
+        _stats = VBlankQueueStats();
+        _stats.depth = _count;
+    }
+
+    void VBlankQueue::dumpStats() const {
+        char buffer[120];
+        sprintf(buffer, "VBLANK depth %d max %d queued %lu run %lu deferred %lu",
+                _stats.depth, _stats.maxDepth, (unsigned long) _stats.queued,
+                (unsigned long) _stats.run, (unsigned long) _stats.deferred);
+        nocashMessage(buffer);
+        sprintf(buffer, "VBLANK overruns %lu overflows %lu cost last %lu max %lu budget %lu",
+                (unsigned long) _stats.overruns, (unsigned long) _stats.overflows,
+                (unsigned long) _stats.lastFrameCost, (unsigned long) _stats.maxFrameCost,
+                (unsigned long) _budget);
+        nocashMessage(buffer);
+    }
+
+    VBlankQueue vblankQueue;
+}
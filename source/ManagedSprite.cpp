@@ -21,6 +21,8 @@ void ManagedSprite::load(ROOMSprite *sprData, u8 textureCount,
     _spr.setShown(true);
 
     _interactAction = sprData->interactAction;
+    if (_interactAction == 0)  // Decoration, the first to go when 3D runs out of quads
+        _spr._drawPriority = -1;
     if (_interactAction == 1)
         _cutsceneId = sprData->cutsceneId;
     else if (_interactAction == 2) {
@@ -9,7 +9,6 @@
 
 void Camera::updatePosition(bool roomChange) {
     const int offsetX = 0, offsetY = -20;
-    int xTilePrev = (_prevX >> 8) / 8, yTilePrev = (_prevY >> 8) / 8;
     if (!_manual) {
         _pos._wx = globalPlayer->_playerSpr._wx - ((256 / 2 - 9) << 8) + (offsetX << 8);
         _pos._wy = globalPlayer->_playerSpr._wy - ((192 / 2 - 14) << 8) + (offsetY << 8);
@@ -42,20 +41,15 @@ void Camera::updatePosition(bool roomChange) {
     Engine::bg3Pb = 0;
     Engine::bg3Pc = 0;
     Engine::bg3Pd = (1 << 16) / _pos._w_scale_y;
-    int xTilePost = (_pos._wx >> 8) / 8, yTilePost = (_pos._wy >> 8) / 8;
-    if ((xTilePrev != xTilePost || yTilePrev != yTilePost) && !roomChange) {
-        int incrementX = xTilePost > xTilePrev ? 1 : -1;
-        int incrementY = yTilePost > yTilePrev ? 1 : -1;
-        for (int xTile = xTilePrev; xTile != xTilePost; xTile += incrementX) {
-            globalRoom->_bg.loadBgRectMain(xTile + incrementX + 32, yTilePost - 1, 1, 26);
-            globalRoom->_bg.loadBgRectMain(xTile + incrementX - 1, yTilePost - 1, 1, 26);
-        }
-        for (int yTile = yTilePrev; yTile != yTilePost; yTile += incrementY) {
-            globalRoom->_bg.loadBgRectMain(xTilePost - 1, yTile + incrementY + 24, 34, 1);
-            globalRoom->_bg.loadBgRectMain(xTilePost - 1, yTile + incrementY - 1, 34, 1);
-        }
-    } else if (roomChange) {
-        globalRoom->_bg.loadBgRectMain(xTilePost - 1, yTilePost - 1, 34, 26);
+    if (roomChange) {
+        // Screen is faded out on room change, no need to wait for v-blank
+        globalRoom->_bg.loadWindowMain(_pos._wx >> 8, _pos._wy >> 8);
+    } else {
+        // Following the player, its speed is what the camera moved by. Pans
+        // and walks in cutscenes know theirs ahead.
+        s32 vx = _pos._wx - _prevX, vy = _pos._wy - _prevY;
+        globalRoom->_nav.getVelocity(_manual ? &_pos : &globalPlayer->_playerSpr, vx, vy);
+        globalRoom->_bg.scrollWindowMain(_pos._wx >> 8, _pos._wy >> 8, vx, vy);
     }
     _prevX = _pos._wx, _prevY = _pos._wy;
 }
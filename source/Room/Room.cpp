@@ -5,6 +5,8 @@
 #include "Room/Room.hpp"
 #include "Engine/Engine.hpp"
 #include "Engine/Audio.hpp"
+#include "Engine/OAMManager.hpp"
+#include "Engine/Sprite3DManager.hpp"
 #include "Save.hpp"
 #include "Cutscene/Cutscene.hpp"
 #include "Room/Player.hpp"
@@ -177,6 +179,7 @@ int Room::loadRoom(FILE *f) {
 
         _textures[i]->loadPath(path);
     }
+    Engine::main3dSpr.packAtlas(_textures, _textureCount);
 
     fread(&_spriteCount, 1, 1, f);
     _roomData.roomSprites.roomSprites = new ROOMSprite[_spriteCount];
@@ -222,6 +225,15 @@ int Room::loadRoom(FILE *f) {
 }
 
 void Room::free_() {
+#ifdef DEBUG_ZONE_STATS
+    char buffer[100];
+    sprintf(buffer, "ZONES room %d", _roomId);
+    nocashMessage(buffer);
+    Engine::main3dSpr.dumpZoneStats();
+    Engine::OAMManagerSub.dumpZoneStats();
+    Engine::main3dSpr.resetZoneStats();
+    Engine::OAMManagerSub.resetZoneStats();
+#endif
     _bg.free_();
     delete[] _roomData.roomExits.roomExits;
     _roomData.roomExits.roomExits = nullptr;
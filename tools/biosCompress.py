@@ -0,0 +1,161 @@
+"""LZ77 and RLE streams the ARM9 BIOS decompressors unpack
+(swiDecompressLZSSWram/Vram, swiDecompressRLEWram/Vram).
+
+Every stream starts with a 32-bit header: the type in the low byte, the
+decompressed size in the upper 24 bits.
+  0x10 LZ77: a flag byte for every 8 blocks, most significant bit first.
+       A set bit is a 2-byte back reference, length - 3 in the top nibble
+       and distance - 1 in the other 12 bits. A clear bit is a literal.
+  0x30 RLE: a flag byte per run. Bit 7 set, the next byte repeats
+       (flag & 0x7F) + 3 times. Clear, (flag & 0x7F) + 1 literals follow.
+  0x00 stored as is, not a BIOS type, for data neither one shrinks.
+Streams are padded to 4 bytes, the BIOS reads its source a word at a
+time.
+
+Pure python, no PIL/numpy needed.
+"""
+import struct
+
+LZ77 = 0x10
+RLE = 0x30
+STORED = 0x00
+
+LZ_MIN_LENGTH = 3
+LZ_MAX_LENGTH = 18
+LZ_WINDOW = 4096
+# Candidates checked per position, longer chains find little more
+LZ_MAX_CHAIN = 64
+
+
+def _header(kind, size):
+    if size >= 1 << 24:
+        raise ValueError("BIOS streams hold at most 16MB")
+    return struct.pack("<I", kind | (size << 8))
+
+
+def _pad(data):
+    return data + bytes(-len(data) % 4)
+
+
+def compress_lz77(data, vram_safe=True):
+    """vram_safe keeps every distance at 2 or more. The VRAM decompressors
+    write 16 bits at a time and can't copy the byte they just wrote."""
+    data = bytes(data)
+    min_distance = 2 if vram_safe else 1
+    out = bytearray(_header(LZ77, len(data)))
+    chains = {}
+    pos = 0
+    while pos < len(data):
+        flag_pos = len(out)
+        out.append(0)
+        for bit in range(8):
+            if pos >= len(data):
+                break
+            best_length, best_distance = 0, 0
+            key = data[pos:pos + LZ_MIN_LENGTH]
+            if len(key) == LZ_MIN_LENGTH:
+                for candidate in reversed(chains.get(key, [])[-LZ_MAX_CHAIN:]):
+                    distance = pos - candidate
+                    if distance > LZ_WINDOW:
+                        break
+                    if distance < min_distance:
+                        continue
+                    length = 0
+                    limit = min(LZ_MAX_LENGTH, len(data) - pos)
+                    while length < limit and data[candidate + length] == data[pos + length]:
+                        length += 1
+                    if length > best_length:
+                        best_length, best_distance = length, distance
+                        if length == LZ_MAX_LENGTH:
+                            break
+            if best_length >= LZ_MIN_LENGTH:
+                out[flag_pos] |= 0x80 >> bit
+                out.append(((best_length - 3) << 4) | ((best_distance - 1) >> 8))
+                out.append((best_distance - 1) & 0xFF)
+                step = best_length
+            else:
+                out.append(data[pos])
+                step = 1
+            for i in range(pos, pos + step):
+                chains.setdefault(data[i:i + LZ_MIN_LENGTH], []).append(i)
+            pos += step
+    return _pad(bytes(out))
+
+
+def compress_rle(data):
+    data = bytes(data)
+    out = bytearray(_header(RLE, len(data)))
+    literals = bytearray()
+
+    def flush_literals():
+        while literals:
+            chunk = literals[:128]
+            out.append(len(chunk) - 1)
+            out.extend(chunk)
+            del literals[:128]
+
+    pos = 0
+    while pos < len(data):
+        run = 1
+        while run < 130 and pos + run < len(data) and data[pos + run] == data[pos]:
+            run += 1
+        if run >= 3:
+            flush_literals()
+            out.append(0x80 | (run - 3))
+            out.append(data[pos])
+            pos += run
+        else:
+            literals.append(data[pos])
+            pos += 1
+    flush_literals()
+    return _pad(bytes(out))
+
+
+def store(data):
+    return _pad(_header(STORED, len(data)) + bytes(data))
+
+
+def pack(data):
+    """Smallest of the three"""
+    return min((compress_lz77(data), compress_rle(data), store(data)), key=len)
+
+
+def decompress(stream):
+    header, = struct.unpack_from("<I", stream)
+    kind, size = header & 0xFF, header >> 8
+    src = 4
+    out = bytearray()
+    if kind == STORED:
+        out = bytearray(stream[src:src + size])
+    elif kind == LZ77:
+        while len(out) < size:
+            flags = stream[src]
+            src += 1
+            for bit in range(8):
+                if len(out) >= size:
+                    break
+                if flags & (0x80 >> bit):
+                    length = (stream[src] >> 4) + 3
+                    distance = (((stream[src] & 0xF) << 8) | stream[src + 1]) + 1
+                    src += 2
+                    for _ in range(length):
+                        out.append(out[-distance])
+                else:
+                    out.append(stream[src])
+                    src += 1
+    elif kind == RLE:
+        while len(out) < size:
+            flag = stream[src]
+            src += 1
+            if flag & 0x80:
+                out.extend(bytes([stream[src]]) * ((flag & 0x7F) + 3))
+                src += 1
+            else:
+                length = (flag & 0x7F) + 1
+                out.extend(stream[src:src + length])
+                src += length
+    else:
+        raise ValueError(f"unknown stream type {kind:#x}")
+    if len(out) != size:
+        raise ValueError("stream overruns its size")
+    return bytes(out)
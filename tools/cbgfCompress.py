@@ -0,0 +1,78 @@
+#!/usr/bin/python3
+"""Rewrites version 1 CBGF backgrounds as version 3: the same file with
+its tiles and map each stored as a BIOS LZ77/RLE stream (biosCompress),
+whichever is smaller.
+
+  python3 cbgfCompress.py <in.cbgf|dir> <out.cbgf|dir>
+
+Every stream is decoded again and compared before it is written.
+"""
+import os
+import struct
+import sys
+
+import binary
+import biosCompress
+
+
+def write_packed(wtr, data):
+    stream = biosCompress.pack(data)
+    if biosCompress.decompress(stream) != bytes(data):
+        raise ValueError("stream doesn't decode back to its data")
+    wtr.write_uint32(len(stream))
+    wtr.write(stream)
+
+
+def convert(input_file, output_file):
+    with open(input_file, "rb") as f:
+        data = f.read()
+    if data[:4] != b"CBGF":
+        raise ValueError(f"{input_file} isn't a CBGF")
+    version, file_format, color_count = struct.unpack_from("<IBB", data, 8)
+    if version != 1:
+        raise ValueError(f"{input_file} is version {version}, only 1 converts")
+    pos = 14 + 2 * color_count
+    tile_count, = struct.unpack_from("<H", data, pos)
+    tiles_size = tile_count * (64 if file_format & 1 else 32)
+    tiles = data[pos + 2:pos + 2 + tiles_size]
+    pos += 2 + tiles_size
+    width, height = struct.unpack_from("<HH", data, pos)
+    tile_map = data[pos + 4:pos + 4 + width * height * 2]
+
+    wtr = binary.BinaryWriter(open(output_file, "wb"))
+    wtr.write(b"CBGF")
+    file_size_pos = wtr.tell()
+    wtr.write_uint32(0)
+    wtr.write_uint32(3)  # Version
+    wtr.write_uint8(file_format)
+    wtr.write_uint8(color_count)
+    wtr.write(data[14:14 + 2 * color_count])
+    wtr.write_uint16(tile_count)
+    write_packed(wtr, tiles)
+    wtr.write_uint16(width)
+    wtr.write_uint16(height)
+    write_packed(wtr, tile_map)
+
+    size = wtr.tell()
+    wtr.seek(file_size_pos)
+    wtr.write_uint32(size)
+    wtr.close()
+    print(f"{input_file}: {len(data)} -> {size} bytes ({100 * size / len(data):.1f}%)")
+
+
+def main():
+    if len(sys.argv) != 3:
+        print(__doc__)
+        sys.exit(1)
+    src, dst = sys.argv[1], sys.argv[2]
+    if not os.path.isdir(src):
+        convert(src, dst)
+        return
+    os.makedirs(dst, exist_ok=True)
+    for file in sorted(os.listdir(src)):
+        if file.endswith(".cbgf"):
+            convert(os.path.join(src, file), os.path.join(dst, file))
+
+
+if __name__ == '__main__':
+    main()
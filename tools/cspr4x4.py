@@ -0,0 +1,385 @@
+"""DS 4x4 block compressed textures (GFX_TEX_FORMAT format 5).
+
+Every 4x4 block is a 32-bit word of 2-bit texels in slot 0, plus a 16-bit
+word in slot 1 (at half the texel word's offset) holding the block's
+palette offset, in 2 color steps, and its mode:
+  0: 3 colors, texel 3 transparent
+  1: 2 colors, texel 2 their average, texel 3 transparent
+  2: 4 colors
+  3: 2 colors, texels 2 and 3 blend them 5:3 and 3:5
+
+Pure python so the round trip can be checked without PIL/numpy:
+  python3 cspr4x4.py --synthetic <w> <h> <frames> <out.cspr>
+writes a generated sprite sheet, its .rgba reference (RGBA8, frames
+stacked vertically) for `undertale_host tex4x4`, and prints the report.
+"""
+import math
+import os
+import sys
+
+import binary
+
+TRANSPARENT = None
+# Squared error (in 5 bit steps) a block may trade for each palette color
+# it doesn't need, 0 keeps the closest fit whatever it costs
+DEFAULT_SIZE_WEIGHT = 4.0
+
+
+def power_of_two_blocks(size):
+    # Same split as Sprite3DManager: largest power of two first
+    blocks = []
+    pos = 0
+    while size > 0:
+        sub_size = 1
+        while sub_size << 1 <= size:
+            sub_size <<= 1
+        blocks.append((pos, sub_size))
+        pos += sub_size
+        size -= sub_size
+    return blocks
+
+
+def mode_colors(mode, pal):
+    """The 4 texel colors of a block, None for transparent."""
+    c0, c1 = pal[0], pal[1]
+    if mode == 0:
+        return [c0, c1, pal[2], TRANSPARENT]
+    if mode == 1:
+        return [c0, c1, tuple((a + b) // 2 for a, b in zip(c0, c1)), TRANSPARENT]
+    if mode == 2:
+        return [c0, c1, pal[2], pal[3]]
+    return [c0, c1,
+            tuple((a * 5 + b * 3) // 8 for a, b in zip(c0, c1)),
+            tuple((a * 3 + b * 5) // 8 for a, b in zip(c0, c1))]
+
+
+def color_error(a, b):
+    return sum((x - y) * (x - y) for x, y in zip(a, b))
+
+
+def fit_texels(pixels, colors):
+    """Closest texel per pixel, transparent pixels only map to None."""
+    texels = []
+    error = 0
+    for pixel in pixels:
+        if pixel is TRANSPARENT:
+            texels.append(colors.index(TRANSPARENT))
+            continue
+        best, best_error = 0, None
+        for i, color in enumerate(colors):
+            if color is TRANSPARENT:
+                continue
+            e = color_error(pixel, color)
+            if best_error is None or e < best_error:
+                best, best_error = i, e
+        texels.append(best)
+        error += best_error
+    return texels, error
+
+
+def cluster(counts, k):
+    """k colors for the weighted colors in counts, k-means from far apart seeds."""
+    colors = sorted(counts, key=lambda c: -counts[c])
+    centers = [colors[0]]
+    while len(centers) < k:
+        centers.append(max(colors, key=lambda c: min(color_error(c, m) for m in centers)))
+    for _ in range(8):
+        sums = [[0, 0, 0, 0] for _ in centers]
+        for color, count in counts.items():
+            i = min(range(k), key=lambda j: color_error(color, centers[j]))
+            for ch in range(3):
+                sums[i][ch] += color[ch] * count
+            sums[i][3] += count
+        moved = [tuple((s[ch] + s[3] // 2) // s[3] for ch in range(3)) if s[3] else centers[i]
+                 for i, s in enumerate(sums)]
+        if moved == centers:
+            break
+        centers = moved
+    return centers
+
+
+def endpoint_candidates(counts):
+    colors = list(counts)
+    pairs = [(a, b) for i, a in enumerate(colors) for b in colors[i + 1:]]
+    low = tuple(min(c[ch] for c in colors) for ch in range(3))
+    high = tuple(max(c[ch] for c in colors) for ch in range(3))
+    pairs.append((low, high))
+    return pairs
+
+
+def encode_block(pixels, size_weight):
+    """Mode, palette entries and texels of 16 pixels (row by row)."""
+    counts = {}
+    for pixel in pixels:
+        if pixel is not TRANSPARENT:
+            counts[pixel] = counts.get(pixel, 0) + 1
+    transparent = TRANSPARENT in pixels
+    uniq = sorted(counts, key=lambda c: -counts[c])
+
+    if not uniq:
+        return 1, None, [3] * 16, 0
+    if len(uniq) <= 2:
+        pal = [uniq[0], uniq[-1]]
+        texels, error = fit_texels(pixels, mode_colors(1, pal))
+        return 1, pal, texels, error
+
+    candidates = []
+    if transparent:
+        pal = uniq if len(uniq) == 3 else cluster(counts, 3)
+        candidates.append((0, pal + [pal[0]]))
+        pair_mode = 1
+    else:
+        pal = uniq if len(uniq) == 4 else (uniq + [uniq[0]] if len(uniq) == 3 else cluster(counts, 4))
+        candidates.append((2, pal))
+        pair_mode = 3
+    for c0, c1 in endpoint_candidates(counts):
+        candidates.append((pair_mode, [c0, c1]))
+
+    best = None
+    for mode, pal in candidates:
+        texels, error = fit_texels(pixels, mode_colors(mode, pal))
+        # Palette entries are what the format saves on, 2 colors beat 4 when close
+        cost = error + size_weight * len(pal)
+        if best is None or cost < best[0]:
+            best = (cost, mode, pal, texels, error)
+    return best[1], best[2], best[3], best[4]
+
+
+class BlockPalette:
+    """Shared palette, blocks with the same colors point at the same spot."""
+
+    def __init__(self):
+        self.colors = []
+        self.offsets = {}  # Tuple of 2 or 4 colors -> offset in 2 color steps
+
+    def add(self, pal):
+        key = tuple(pal)
+        if key in self.offsets:
+            return self.offsets[key]
+        offset = len(self.colors) // 2
+        self.colors += pal
+        # Groups can also start in the colors before, 2 color steps only
+        for i in range(max(0, len(self.colors) - 6) & ~1, len(self.colors) - 1, 2):
+            self.offsets.setdefault(tuple(self.colors[i:i + 2]), i // 2)
+            if i + 4 <= len(self.colors):
+                self.offsets.setdefault(tuple(self.colors[i:i + 4]), i // 2)
+        return offset
+
+
+def encode_texture(pixels, width, height, palette, size_weight, stats):
+    """Texel words and index words of one width x height (multiples of 4) image."""
+    texel_data = bytearray()
+    index_data = bytearray()
+    for block_y in range(0, height, 4):
+        for block_x in range(0, width, 4):
+            block = [pixels[(block_y + y) * width + block_x + x] for y in range(4) for x in range(4)]
+            mode, pal, texels, error = encode_block(block, size_weight)
+            offset = 0 if pal is None else palette.add(pal)
+            if offset >= 1 << 14:
+                raise ValueError("4x4 palette over 32768 colors")
+            word = 0
+            for i, texel in enumerate(texels):
+                word |= texel << (2 * i)
+            texel_data += word.to_bytes(4, "little")
+            index_data += (offset | (mode << 14)).to_bytes(2, "little")
+            stats["modes"][mode] += 1
+    return bytes(texel_data), bytes(index_data)
+
+
+def decode_texture(texel_data, index_data, palette_colors, width, height):
+    """Reference decoder, same as host/source/texture4x4.cpp."""
+    pixels = [TRANSPARENT] * (width * height)
+    block = 0
+    for block_y in range(0, height, 4):
+        for block_x in range(0, width, 4):
+            word = int.from_bytes(texel_data[block * 4:block * 4 + 4], "little")
+            index = int.from_bytes(index_data[block * 2:block * 2 + 2], "little")
+            offset, mode = (index & 0x3FFF) * 2, index >> 14
+            pal = palette_colors[offset:offset + 4]
+            pal += [(0, 0, 0)] * (4 - len(pal))
+            colors = mode_colors(mode, pal)
+            for i in range(16):
+                pixels[(block_y + i // 4) * width + block_x + i % 4] = colors[(word >> (2 * i)) & 3]
+            block += 1
+    return pixels
+
+
+def expand(c):
+    return (c << 3) | (c >> 2)
+
+
+def psnr(source, decoded):
+    """Over the opaque source pixels, RGB555 expanded to 8 bits."""
+    error, count = 0, 0
+    for a, b in zip(source, decoded):
+        if a is TRANSPARENT:
+            continue
+        if b is TRANSPARENT:
+            b = (0, 0, 0)
+        error += sum((expand(x) - expand(y)) ** 2 for x, y in zip(a, b))
+        count += 3
+    if count == 0 or error == 0:
+        return math.inf
+    return 10 * math.log10(255 * 255 * count / error)
+
+
+def encode_sprite(frames, width, height, size_weight=DEFAULT_SIZE_WEIGHT):
+    """CSPR version 5 texture data for frames of width x height RGB555 pixels.
+
+    Sub-textures as in jsonToCspr.swizzle_tiles, every frame back to back:
+    the texel words of all of them, then their index words in the same
+    order so the runtime copies them to slot 1 at half the offset.
+    Returns the texture data, palette colors and a report dict.
+    """
+    tile_w, tile_h = (width + 7) // 8, (height + 7) // 8
+    pad_w = tile_w * 8
+    stats = {"modes": [0, 0, 0, 0]}
+    palette = BlockPalette()
+    texel_data, index_data = bytearray(), bytearray()
+    padded = []
+    for frame in frames:
+        image = [TRANSPARENT] * (pad_w * tile_h * 8)
+        for y in range(height):
+            image[y * pad_w:y * pad_w + width] = frame[y * width:(y + 1) * width]
+        padded.append(image)
+    decoded_frames = [[TRANSPARENT] * len(image) for image in padded]
+
+    quads = []
+    for pos_y, sub_h in power_of_two_blocks(tile_h):
+        for pos_x, sub_w in power_of_two_blocks(tile_w):
+            quads.append((pos_x * 8, pos_y * 8, sub_w * 8, sub_h * 8))
+    for x0, y0, w, h in quads:
+        for f, image in enumerate(padded):
+            sub = [image[(y0 + y) * pad_w + x0 + x] for y in range(h) for x in range(w)]
+            texels, indices = encode_texture(sub, w, h, palette, size_weight, stats)
+            texel_data += texels
+            index_data += indices
+            decoded = decode_texture(texels, indices, palette.colors, w, h)
+            for y in range(h):
+                for x in range(w):
+                    decoded_frames[f][(y0 + y) * pad_w + x0 + x] = decoded[y * w + x]
+
+    source_all, decoded_all = [], []
+    for f, image in enumerate(padded):
+        source_all += image
+        decoded_all += decoded_frames[f]
+
+    colors = {p for frame in frames for p in frame if p is not TRANSPARENT}
+    if len(colors) <= 255:
+        uncompressed = tile_w * tile_h * len(frames) * (64 if len(colors) >= 16 else 32) + len(colors) * 2
+    else:  # Direct color
+        uncompressed = tile_w * tile_h * len(frames) * 128
+    report = {
+        "texel_bytes": len(texel_data),
+        "index_bytes": len(index_data),
+        "palette_bytes": len(palette.colors) * 2,
+        "colors": len(colors),
+        "uncompressed_bytes": uncompressed,
+        "psnr": psnr(source_all, decoded_all),
+        "modes": stats["modes"],
+    }
+    return bytes(texel_data + index_data), palette.colors, report
+
+
+def format_report(report):
+    total = report["texel_bytes"] + report["index_bytes"] + report["palette_bytes"]
+    uncompressed = report["uncompressed_bytes"]
+    kind = "paletted" if report["colors"] <= 255 else "direct color"
+    quality = "lossless" if math.isinf(report["psnr"]) else f"PSNR {report['psnr']:.2f} dB"
+    modes = "/".join(str(m) for m in report["modes"])
+    return (f"4x4: {report['texel_bytes']} B texels + {report['index_bytes']} B index + "
+            f"{report['palette_bytes']} B palette = {total} B vs {uncompressed} B {kind} "
+            f"({total / uncompressed:.0%}), {quality}, modes 0/1/2/3 {modes}")
+
+
+def write_cspr(output_file, width, height, top_down_offset, frames, animations,
+               size_weight=DEFAULT_SIZE_WEIGHT):
+    """Writes a compressed CSPR (texFormat 2, see CSPR.hpp), returns the report."""
+    tex_data, palette, report = encode_sprite(frames, width, height, size_weight)
+
+    wtr = binary.BinaryWriter(open(output_file, "wb"))
+    wtr.write(b"CSPR")
+    file_size_pos = wtr.tell()
+    wtr.write_uint32(0)
+    wtr.write_uint32(5)  # Version
+    wtr.write_uint16(width)
+    wtr.write_uint16(height)
+    wtr.write_uint16(top_down_offset)
+
+    wtr.write_uint8(0)  # No paletted colors, the blocks have their own
+
+    wtr.write_uint8(len(frames))
+    wtr.write_uint8(2)  # 4x4 compressed
+    wtr.write_uint32(len(tex_data))
+    wtr.write(tex_data)
+    wtr.write_uint16(len(palette))
+    for r, g, b in palette:
+        wtr.write_uint16(r + (g << 5) + (b << 10))
+
+    wtr.write_uint8(len(animations))
+    for animation in animations:
+        wtr.write_string(animation["name"], encoding="ascii")
+        anim_frames = animation["frames"]
+        wtr.write_uint8(len(anim_frames))
+        for frame in anim_frames:
+            wtr.write_uint8(frame["frame"])
+            wtr.write_uint16(frame["duration"])
+            wtr.write_int8(frame.get("draw_off_x", 0))
+            wtr.write_int8(frame.get("draw_off_y", 0))
+
+    size = wtr.tell()
+    wtr.seek(file_size_pos)
+    wtr.write_uint32(size)
+    wtr.close()
+    return report
+
+
+def synthetic_frames(width, height, frame_count):
+    """Shaded ellipse with flat pixel art bands, moving frame to frame."""
+    frames = []
+    for f in range(frame_count):
+        frame = []
+        for y in range(height):
+            for x in range(width):
+                dx = (x - width / 2 + 0.5) / (width / 2)
+                dy = (y - height / 2 + 0.5) / (height / 2)
+                if dx * dx + dy * dy > 1:
+                    frame.append(TRANSPARENT)
+                elif (y + f * 2) // 6 % 3 == 0:
+                    # Flat bands, 3 colors, like outlines and clothes
+                    frame.append(((x // 8 + f) % 3 * 12, 4, 31 - (x // 8) % 3 * 10))
+                else:
+                    light = 1 - (dx * dx + dy * dy) * 0.7
+                    frame.append((int(31 * light * (x + 1) / width),
+                                  int(31 * light * (y + 1) / height),
+                                  int(31 * light * (f + 1) / frame_count)))
+        frames.append(frame)
+    return frames
+
+
+def write_reference(path, frames, width, height):
+    with open(path, "wb") as f:
+        for frame in frames:
+            for pixel in frame:
+                if pixel is TRANSPARENT:
+                    f.write(bytes(4))
+                else:
+                    f.write(bytes([expand(c) for c in pixel] + [255]))
+
+
+def main(argv):
+    if len(argv) == 5 and argv[0] == "--synthetic":
+        width, height, frame_count = int(argv[1]), int(argv[2]), int(argv[3])
+        output_file = argv[4]
+        frames = synthetic_frames(width, height, frame_count)
+        animations = [{"name": "gfx", "frames": [{"frame": i, "duration": 1} for i in range(frame_count)]}]
+        report = write_cspr(output_file, width, height, height, frames, animations)
+        write_reference(os.path.splitext(output_file)[0] + ".rgba", frames, width, height)
+        print(f"{output_file}: {format_report(report)}")
+        return 0
+    print("usage: cspr4x4.py --synthetic <width> <height> <frames> <out.cspr>", file=sys.stderr)
+    return 1
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv[1:]))
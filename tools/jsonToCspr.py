@@ -1,12 +1,33 @@
 import pathlib
 
 import binary
+import cspr4x4
+from cspr4x4 import power_of_two_blocks
 import numpy as np
 from PIL import Image
 import json
 import os
 
 
+def swizzle_tiles(tiles, tile_w, tile_h, frame_count, color_8bit):
+    """Lay 8x8 tiles out as the 3D sub-textures Sprite3DManager uploads.
+
+    Sub-blocks go row by row, each one holds every frame back to back as
+    a linear texture, 1 byte per texel or 2 texels per byte (low nibble first).
+    """
+    tiles = tiles.reshape(frame_count, tile_h, tile_w, 8, 8)
+    out = bytearray()
+    for pos_y, sub_h in power_of_two_blocks(tile_h):
+        for pos_x, sub_w in power_of_two_blocks(tile_w):
+            for frame in range(frame_count):
+                block = tiles[frame, pos_y:pos_y + sub_h, pos_x:pos_x + sub_w]
+                texels = block.transpose(0, 2, 1, 3).reshape(-1).astype(np.uint8)
+                if not color_8bit:
+                    texels = texels[0::2] | (texels[1::2] << 4)
+                out += texels.tobytes()
+    return bytes(out)
+
+
 def convert(input_file, output_file):
     print(f"Converting {input_file} to {output_file}")
     with open(input_file, "r") as f:
@@ -15,6 +36,17 @@ def convert(input_file, output_file):
     image = Image.open(os.path.splitext(input_file)[0] + ".png")
 
     np_array = np.array(image)
+
+    # "compress": true, or {"size_weight": n} to trade quality for size.
+    # Big, mostly opaque sheets as 4x4 blocks, 3D only
+    compress = data.get("compress", False)
+    if compress:
+        size_weight = cspr4x4.DEFAULT_SIZE_WEIGHT
+        if isinstance(compress, dict):
+            size_weight = compress.get("size_weight", size_weight)
+        convert_compressed(data, np_array, output_file, size_weight)
+        return
+
     np_array_palette = np.zeros((np_array.shape[0], np_array.shape[1]), dtype=np.uint8)
 
     palette = [np.array([0, 255, 0])]  # r 0 g 255 b 0 - transparent
@@ -67,7 +99,7 @@ def convert(input_file, output_file):
     wtr.write(b"CSPR")
     file_size_pos = wtr.tell()
     wtr.write_uint32(0)
-    wtr.write_uint32(4)  # Version
+    wtr.write_uint32(5)  # Version
     wtr.write_uint16(width)
     wtr.write_uint16(height)
     wtr.write_uint16(top_down_offset)
@@ -75,8 +107,14 @@ def convert(input_file, output_file):
     wtr.write_uint8(len(palette))
     wtr.write(palette.tobytes())
 
+    # Textures with less than 16 colors (+ transparent) are 4bpp in 3D
+    color_8bit = len(palette) >= 16
+    tex_data = swizzle_tiles(tiles, tile_w, tile_h, frame_count, color_8bit)
+
     wtr.write_uint8(frame_count)
-    wtr.write(tiles.tobytes())
+    wtr.write_uint8(1 if color_8bit else 0)
+    wtr.write_uint32(len(tex_data))
+    wtr.write(tex_data)
 
     animations = data.get("animations", [])
     wtr.write_uint8(len(animations))
@@ -96,6 +134,21 @@ def convert(input_file, output_file):
     wtr.close()
 
 
+def convert_compressed(data, np_array, output_file, size_weight):
+    width, height = data["size"]
+    top_down_offset = data.get("top_down_offset", height)
+    frames = []
+    for frame in range(data["frameCount"]):
+        pixels = []
+        for row in np_array[frame * height:(frame + 1) * height, :width]:
+            for r, g, b, a in row:
+                pixels.append(cspr4x4.TRANSPARENT if a == 0 else (int(r) >> 3, int(g) >> 3, int(b) >> 3))
+        frames.append(pixels)
+    report = cspr4x4.write_cspr(output_file, width, height, top_down_offset, frames,
+                                data.get("animations", []), size_weight)
+    print(f"  {cspr4x4.format_report(report)}")
+
+
 def compile_sprites():
     for root, _, files in os.walk("spr"):
         for file in files:
@@ -5,9 +5,15 @@ import pathlib
 from PIL import Image
 import numpy as np
 import binary
+from cbgfCompress import write_packed
 
 
 FORCE_8BIT = True
+# Backgrounds wider or taller than the 64x64 hardware map are written as
+# version 2, cut in REGION_SIZE square regions the game streams in. Others
+# are version 3, tiles and map LZ77/RLE compressed.
+STREAM_CELLS = 64
+REGION_SIZE = 16
 
 
 def convert(input_file, output_file):
@@ -58,6 +64,7 @@ def convert(input_file, output_file):
         return tile_
 
     tiles = []
+    tile_ids = {}
 
     tile_map = np.zeros(((np_array.shape[0] + 7) // 8, (np_array.shape[1] + 7) // 8),
                         dtype=np.dtype(np.uint16).newbyteorder("<"))
@@ -66,12 +73,12 @@ def convert(input_file, output_file):
         for tile_col in range((np_array.shape[1] + 7) // 8):
             tile = get_tile(tile_col, tile_row)
 
-            for i, t in enumerate(tiles):
-                if all((t == tile).flatten()):
-                    break
-            else:
+            key = tile.tobytes()
+            i = tile_ids.get(key)
+            if i is None:
                 tiles.append(tile)
                 i = len(tiles) - 1
+                tile_ids[key] = i
 
             tile_map[tile_row][tile_col] = i
 
@@ -83,21 +90,25 @@ def convert(input_file, output_file):
     wtr.write(b"CBGF")
     file_size_pos = wtr.tell()
     wtr.write_uint32(0)
-    wtr.write_uint32(1)  # Version
+    streamed = tile_map.shape[0] > STREAM_CELLS or tile_map.shape[1] > STREAM_CELLS
+    wtr.write_uint32(2 if streamed else 3)  # Version
     wtr.write_uint8(1 if color8bit else 0)
 
     # begin palette
     wtr.write_uint8(len(palette))
     wtr.write(palette.tobytes())
 
-    # begin tiles
-    wtr.write_uint16(len(tiles))
-    wtr.write(tiles.tobytes())
+    if streamed:
+        write_regions(wtr, tiles, tile_map)
+    else:
+        # begin tiles
+        wtr.write_uint16(len(tiles))
+        write_packed(wtr, tiles.tobytes())
 
-    # begin map
-    wtr.write_uint16(tile_map.shape[1])
-    wtr.write_uint16(tile_map.shape[0])
-    wtr.write(tile_map.tobytes())
+        # begin map
+        wtr.write_uint16(tile_map.shape[1])
+        wtr.write_uint16(tile_map.shape[0])
+        write_packed(wtr, tile_map.tobytes())
 
     size = wtr.tell()
     wtr.seek(file_size_pos)
@@ -105,6 +116,44 @@ def convert(input_file, output_file):
     wtr.close()
 
 
+def write_regions(wtr, tiles, tile_map):
+    # Each region lists the tiles it uses (background tile id and pixels),
+    # then its map indexes that list. Cells past the background are 0.
+    height, width = tile_map.shape
+    regions_w = (width + REGION_SIZE - 1) // REGION_SIZE
+    regions_h = (height + REGION_SIZE - 1) // REGION_SIZE
+    wtr.write_uint16(len(tiles))
+    wtr.write_uint16(width)
+    wtr.write_uint16(height)
+    wtr.write_uint8(REGION_SIZE)
+    table_pos = wtr.tell()
+    wtr.write(bytes(4 * regions_w * regions_h))
+
+    offsets = []
+    for region_y in range(regions_h):
+        for region_x in range(regions_w):
+            offsets.append(wtr.tell())
+            cells = tile_map[region_y * REGION_SIZE:(region_y + 1) * REGION_SIZE,
+                             region_x * REGION_SIZE:(region_x + 1) * REGION_SIZE]
+            ids = list(dict.fromkeys(cells.flatten().tolist()))
+            local = {tile_id: i for i, tile_id in enumerate(ids)}
+            region_map = np.zeros((REGION_SIZE, REGION_SIZE), dtype=np.dtype(np.uint16).newbyteorder("<"))
+            for y in range(cells.shape[0]):
+                for x in range(cells.shape[1]):
+                    region_map[y][x] = local[int(cells[y][x])]
+
+            wtr.write_uint16(len(ids))
+            wtr.write(np.array(ids, dtype=np.dtype(np.uint16).newbyteorder("<")).tobytes())
+            wtr.write(tiles[ids].tobytes())
+            wtr.write(region_map.tobytes())
+
+    end_pos = wtr.tell()
+    wtr.seek(table_pos)
+    for offset in offsets:
+        wtr.write_uint32(offset)
+    wtr.seek(end_pos)
+
+
 def compile_backgrounds():
     for root, _, files in os.walk("bg"):
         for file in files: